@@ -1,11 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
-#include <ctime>
+#include <stddef.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
 
+#if defined(__SSSE3__) || defined(__AVX__)
+#include <tmmintrin.h>		// pshufb for the bmp bgr -> rgb swap
+#endif
+
 #ifdef WIN32
 #include <windows.h>
 #pragma warning(disable:4996)
@@ -15,6 +25,11 @@
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include "glut.h"
+#ifdef HEADLESS
+#include "headless.cpp"		// draw offscreen with egl instead of in a glut window (benchmarking)
+#endif
+#include "timestep.cpp"		// fixed-timestep animation and the frame cap
+#include "glslprogram.cpp"
 
 
 //	This is a sample OpenGL / GLUT program
@@ -98,6 +113,15 @@ enum Projections
 	PERSP
 };
 
+// which texture minification filter:
+
+enum TextureFilters
+{
+	BILINEAR,			// no mipmaps
+	TRILINEAR,			// blend between the two nearest mipmaps
+	ANISOTROPIC			// trilinear, plus more samples along the direction the texture is squashed
+};
+
 // which button:
 
 enum ButtonVals
@@ -126,6 +150,8 @@ const GLfloat FOGEND = { 4. };
 int				ActiveButton;							// current button that is down
 int				TextureOn;								// != 0 means to draw the axes
 int				DebugOn;								// != 0 means to print debugging info
+float			MaxAnisotropy;							// 1. means anisotropic filtering is not available
+int				WhichFilter;							// BILINEAR, TRILINEAR, or ANISOTROPIC
 int				DepthBufferOn;							// != 0 means to use the z-buffer
 int				DepthFightingOn;						// != 0 means to force the creation of z-fighting
 int				MainWindow;								// window id for main graphics window
@@ -138,11 +164,9 @@ int				Xmouse, Ymouse;							// mouse values
 float			Xrot, Yrot;								// rotation angles in degrees
 bool			Light0On, Light1On = true;				// keeps track of light statuses
 bool			Frozen;									// current freeze status of animations
-float			PigPosX, PigPosZ;						// Pig Head position
 bool			Day = false;							// Keeps track if it is Day or Night, starts in Night
 GLuint			BoxList;								// Block Object
 GLuint			PlaneList;								// Flat Ground Object
-GLuint			SlabList;								// Slab Object
 GLuint			DoorList;								// Door Object
 GLuint			WindowList;								// Window Object
 GLuint			TorchList;								// Torch Object
@@ -150,14 +174,17 @@ GLuint			PigList;								// Pig Body Object
 GLuint			PigLegList;								// Pig Leg Object
 GLuint			PigFaceList;							// Pig Head/Face Object
 GLuint			PigNoseList;							// Pig Nose Object
-GLuint			dark_oak_planks;						// Dark Oak Texture
 GLuint			grass;									// Grass Texture
-GLuint			stonebrick;								// Stone Brick Texture
 GLuint			door;									// Door Texture
 GLuint			pigface;								// Pig Face Texture
 GLuint			pigbody;								// Pig Body Texture
 GLuint			pignose;								// Pig Nose Texture
 GLuint			moon;									// Moon Texture
+GLuint			BlockTextureArray;						// Block Textures, one layer per block texture
+GLSLProgram*	BlockShader;							// Lights and textures the blocks
+GLint			BlockLight0OnLoc, BlockLight1OnLoc;		// its uniform locations, found once after linking
+GLint			BlockModulateLoc, BlockClusteredLoc;
+GLint			BlockTexturesLoc;
 int				WhichDirection = 0;						// Keeps track of the direction of the eye
 
 
@@ -166,31 +193,69 @@ int				WhichDirection = 0;						// Keeps track of the direction of the eye
 float			eyex = -1., eyey = 3.5, eyez = 10., lookx = -1., looky = 3.4, lookz = 0., upx = 0., upy = 1., upz = 0.;
 
 
+// a bmp file to decode, see DecodeBmps( ):
+
+struct bmpload
+{
+	char*			filename;
+	unsigned char*	texture;			// NULL if the file could not be decoded
+	int				width, height;
+};
+
+
 // function prototypes:
 
 void	Animate();
+void	BeginShadows();
+void	BeginZone(int);
+void	BinLights(float, float);
+void	BindShadows(struct shadowuniforms*);
+void	BindSunShadows(struct sunshadowuniforms*);
+void	ClearLights();
 void	Display();
 void	DoDebugMenu(int);
+void	DoFilterMenu(int);
 void	DoLightsMenu(int);
 void	DoMainMenu(int);
+void	DoPigsMenu(int);
+void	DoShadowsMenu(int);
 void	DoTimeMenu(int);
+void	DrawChunks();
+void	DrawPig(int);
+void	DrawPigs(int, int);
+void	DrawProfile(float, float);
+void	DrawShadowCasters(int);
 void	DoRasterString(float, float, float, char*);
 void	DoStrokeString(float, float, float, float, char*);
 float	ElapsedSeconds();
+void	EndProfileFrame();
+void	EndZone();
 void	InitGraphics();
 void	InitLists();
+void	InitClusters();
 void	InitMenus();
+void	InitPigs();
+void	InitProfiler();
+void	InitShadows();
+void	InitSunShadows();
 void	Keyboard(unsigned char, int, int);
 void	MouseButton(int, int, int, int);
 void	MouseMotion(int, int);
+void	RenderSunShadows();
+int		RenderShadowCube(float, float, float);
 void	Reset();
+void	ResetProfiler();
 void	Resize(int, int);
+void	SetTextureFilter();
 void	Visibility(int);
 
 unsigned char* BmpToTexture(char*, int*, int*);
+void			BgrToRgb(const unsigned char*, unsigned char*, int);
+int				DecodeBmps(struct bmpload*, int);
+double			MillisecondsSince(std::chrono::steady_clock::time_point);
 void			HsvRgb(float[3], float[3]);
-int				ReadInt(FILE*);
-short			ReadShort(FILE*);
+int				ReadInt(const unsigned char*);
+short			ReadShort(const unsigned char*);
 
 void			Cross(float[3], float[3], float[3]);
 float			Dot(float[3], float[3]);
@@ -260,9 +325,12 @@ void SetPointLight(int ilight, float x, float y, float z, float r, float g, floa
 
 
 // OsuSphere.cpp provided by Mike Bailey for this assignment
+//
+// the points and triangles of a sphere only depend on (slices, stacks), so each
+// tessellation is built once into a vertex buffer of unit-radius points and an
+// index buffer of triangles -- the radius becomes a scale applied at draw time
 
-int		NumLngs, NumLats;
-struct point* Pts;
+#define MAXSPHEREMESHES		8
 
 struct point
 {
@@ -271,60 +339,66 @@ struct point
 	float s, t;		// texture coords
 };
 
-inline
-struct point*
-	PtsPointer(int lat, int lng)
+struct spheremesh
 {
-	if (lat < 0)	lat += (NumLats - 1);
-	if (lng < 0)	lng += (NumLngs - 0);
-	if (lat > NumLats - 1)	lat -= (NumLats - 1);
-	if (lng > NumLngs - 1)	lng -= (NumLngs - 0);
-	return &Pts[NumLngs * lat + lng];
-}
+	int				numLngs, numLats;	// tessellation this mesh was built with
+	int				numPts;				// # of points in the vertex buffer
+	int				numIndices;			// # of indices in the index buffer
+	GLuint			vbo;				// interleaved points
+	GLuint			ibo;				// triangle indices
+};
 
-inline
-void
-DrawPoint(struct point* p)
-{
-	glNormal3fv(&p->nx);
-	glTexCoord2fv(&p->s);
-	glVertex3fv(&p->x);
-}
+struct spheremesh	SphereMeshes[MAXSPHEREMESHES];
+int					NumSphereMeshes;
 
-void
-OsuSphere(float radius, int slices, int stacks)
-{
-	// set the globals:
 
-	NumLngs = slices;
-	NumLats = stacks;
-	if (NumLngs < 3)
-		NumLngs = 3;
-	if (NumLats < 3)
-		NumLats = 3;
+// find the cached mesh for this tessellation, building it the first time it is asked for:
+
+struct spheremesh*
+GetSphereMesh(int slices, int stacks)
+{
+	int numLngs = slices;
+	int numLats = stacks;
+	if (numLngs < 3)
+		numLngs = 3;
+	if (numLats < 3)
+		numLats = 3;
+
+	for (int i = 0; i < NumSphereMeshes; i++)
+	{
+		if (SphereMeshes[i].numLngs == numLngs && SphereMeshes[i].numLats == numLats)
+			return &SphereMeshes[i];
+	}
 
-	// allocate the point data structure:
+	if (NumSphereMeshes >= MAXSPHEREMESHES)
+	{
+		fprintf(stderr, "Too many sphere tessellations -- cannot cache %d x %d\n", numLngs, numLats);
+		return NULL;
+	}
 
-	Pts = new struct point[NumLngs * NumLats];
+	struct spheremesh* m = &SphereMeshes[NumSphereMeshes++];
+	m->numLngs = numLngs;
+	m->numLats = numLats;
+	m->numPts = numLngs * numLats;
 
-	// fill the Pts structure:
+	// fill the points, ilat=0 is the south pole and ilat=numLats-1 is the north pole:
 
-	for (int ilat = 0; ilat < NumLats; ilat++)
+	struct point* pts = new struct point[m->numPts];
+	for (int ilat = 0; ilat < numLats; ilat++)
 	{
-		float lat = -M_PI / 2. + M_PI * (float)ilat / (float)(NumLats - 1);	// ilat=0/lat=0. is the south pole
-											// ilat=NumLats-1, lat=+M_PI/2. is the north pole
+		float lat = -M_PI / 2. + M_PI * (float)ilat / (float)(numLats - 1);
 		float xz = cosf(lat);
 		float  y = sinf(lat);
-		for (int ilng = 0; ilng < NumLngs; ilng++)				// ilng=0, lng=-M_PI and
-											// ilng=NumLngs-1, lng=+M_PI are the same meridian
+		for (int ilng = 0; ilng < numLngs; ilng++)				// ilng=0, lng=-M_PI and
+											// ilng=numLngs-1, lng=+M_PI are the same meridian
 		{
-			float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(NumLngs - 1);
+			float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(numLngs - 1);
 			float x = xz * cosf(lng);
 			float z = -xz * sinf(lng);
-			struct point* p = PtsPointer(ilat, ilng);
-			p->x = radius * x;
-			p->y = radius * y;
-			p->z = radius * z;
+			struct point* p = &pts[numLngs * ilat + ilng];
+			p->x = x;
+			p->y = y;
+			p->z = z;
 			p->nx = x;
 			p->ny = y;
 			p->nz = z;
@@ -333,731 +407,3072 @@ OsuSphere(float radius, int slices, int stacks)
 		}
 	}
 
-	struct point top, bot;		// top, bottom points
+	// two triangles between each pair of neighboring latitudes, wound the same
+	// way the old triangle strips were:
+
+	m->numIndices = 6 * (numLats - 1) * (numLngs - 1);
+	GLuint* indices = new GLuint[m->numIndices];
+	GLuint* ip = indices;
+	for (int ilat = 1; ilat < numLats; ilat++)
+	{
+		for (int ilng = 0; ilng < numLngs - 1; ilng++)
+		{
+			GLuint a0 = numLngs * ilat + ilng;			// this latitude
+			GLuint b0 = numLngs * (ilat - 1) + ilng;	// the one below it
+			*ip++ = a0;		*ip++ = b0;		*ip++ = a0 + 1;
+			*ip++ = a0 + 1;	*ip++ = b0;		*ip++ = b0 + 1;
+		}
+	}
+
+	glGenBuffers(1, &m->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, m->vbo);
+	glBufferData(GL_ARRAY_BUFFER, m->numPts * sizeof(struct point), pts, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glGenBuffers(1, &m->ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, m->numIndices * sizeof(GLuint), indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	delete[] indices;
+	delete[] pts;
+
+	return m;
+}
+
+// point the vertex arrays at a buffer of points -- base is NULL when a vbo is bound:
+
+inline
+void
+SetPointPointers(char* base)
+{
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(struct point), base + offsetof(struct point, x));
+	glNormalPointer(GL_FLOAT, sizeof(struct point), base + offsetof(struct point, nx));
+	glTexCoordPointer(2, GL_FLOAT, sizeof(struct point), base + offsetof(struct point, s));
+}
+
+inline
+void
+UnsetPointPointers()
+{
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+}
+
+void
+OsuSphere(float radius, int slices, int stacks)
+{
+	struct spheremesh* m = GetSphereMesh(slices, stacks);
+	if (m == NULL)
+		return;
+
+	glPushMatrix();
+	glScalef(radius, radius, radius);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
+	glBindBuffer(GL_ARRAY_BUFFER, m->vbo);
+	SetPointPointers(NULL);
+	glDrawElements(GL_TRIANGLES, m->numIndices, GL_UNSIGNED_INT, (void*)0);
+	UnsetPointPointers();
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glPopMatrix();
+}
+
+
+// view-frustum culling:
+//
+// the 6 planes of the viewing volume are pulled out of projection * modelview
+// once per frame, so they are in the same coordinates the scene is drawn in.
+// anything whose bounding box is completely outside one of the planes is
+// skipped before it gets to the driver
+
+struct plane
+{
+	float	a, b, c, d;				// a*x + b*y + c*z + d >= 0 means inside
+};
 
-	top.x = 0.;		top.y = radius;	top.z = 0.;
-	top.nx = 0.;		top.ny = 1.;		top.nz = 0.;
-	top.s = 0.;		top.t = 1.;
+struct plane	FrustumPlanes[6];
+int				NumDrawn;				// # of objects drawn this frame
+int				NumCulled;				// # of objects culled this frame
+bool			ShowCullCounts;			// true means put the drawn/culled counts on the screen
 
-	bot.x = 0.;		bot.y = -radius;	bot.z = 0.;
-	bot.nx = 0.;		bot.ny = -1.;		bot.nz = 0.;
-	bot.s = 0.;		bot.t = 0.;
 
-	// connect the north pole to the latitude NumLats-2:
+// call this right after the projection and viewing transformations are set:
+
+void
+ExtractFrustum()
+{
+	float p[16], mv[16], m[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, p);
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
 
+	// m = p * mv, both column-major:
 
-	glBegin(GL_TRIANGLE_STRIP);
-	for (int ilng = 0; ilng < NumLngs; ilng++)
+	for (int col = 0; col < 4; col++)
 	{
-		glTexCoord2f(bot.s, bot.t);
-		float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(NumLngs - 1);
-		top.s = (lng + M_PI) / (2. * M_PI);
-		DrawPoint(&top);
-		struct point* p = PtsPointer(NumLats - 2, ilng);	// ilat=NumLats-1 is the north pole
-		DrawPoint(p);
+		for (int row = 0; row < 4; row++)
+		{
+			m[4 * col + row] = 0.;
+			for (int k = 0; k < 4; k++)
+				m[4 * col + row] += p[4 * k + row] * mv[4 * col + k];
+		}
 	}
-	glEnd();
 
-	// connect the south pole to the latitude 1:
+	// left, right, bottom, top, near, far are row 3 plus or minus rows 0, 1, 2:
 
-	glBegin(GL_TRIANGLE_STRIP);
-	for (int ilng = NumLngs - 1; ilng >= 0; ilng--)
+	for (int i = 0; i < 6; i++)
 	{
-		glTexCoord2f(bot.s, bot.t);
-		float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(NumLngs - 1);
-		bot.s = (lng + M_PI) / (2. * M_PI);
-		DrawPoint(&bot);
-		struct point* p = PtsPointer(1, ilng);					// ilat=0 is the south pole
-		DrawPoint(p);
+		int row = i / 2;
+		float sign = (i % 2 == 0) ? 1.f : -1.f;
+		FrustumPlanes[i].a = m[3] + sign * m[row];
+		FrustumPlanes[i].b = m[7] + sign * m[4 + row];
+		FrustumPlanes[i].c = m[11] + sign * m[8 + row];
+		FrustumPlanes[i].d = m[15] + sign * m[12 + row];
 	}
-	glEnd();
 
-	// connect the horizontal strips:
+	NumDrawn = 0;
+	NumCulled = 0;
+}
+
+
+// returns false if the box is completely outside the frustum.
+// for each plane, only the corner of the box that is farthest along the
+// plane's normal needs to be tested:
 
-	for (int ilat = 2; ilat < NumLats - 1; ilat++)
+bool
+BoxVisible(float xmin, float ymin, float zmin, float xmax, float ymax, float zmax)
+{
+	for (int i = 0; i < 6; i++)
 	{
-		struct point* p;
-		glBegin(GL_TRIANGLE_STRIP);
-		for (int ilng = 0; ilng < NumLngs; ilng++)
+		struct plane* pl = &FrustumPlanes[i];
+		float x = (pl->a >= 0.) ? xmax : xmin;
+		float y = (pl->b >= 0.) ? ymax : ymin;
+		float z = (pl->c >= 0.) ? zmax : zmin;
+		if (pl->a * x + pl->b * y + pl->c * z + pl->d < 0.)
 		{
-			p = PtsPointer(ilat, ilng);
-			DrawPoint(p);
-			p = PtsPointer(ilat - 1, ilng);
-			DrawPoint(p);
+			NumCulled++;
+			return false;
 		}
-		glEnd();
 	}
-	// clean-up:
-	delete[] Pts;
-	Pts = NULL;
+	NumDrawn++;
+	return true;
 }
 
 
-// main program:
+// the display profiler:
+//
+// Display( ) is split into zones, each one timed on the cpu (how long its
+// commands take to submit) and on the gpu (a GL_TIME_ELAPSED query around the
+// same commands). a frame's queries are read PROFILEFRAMES-1 frames later, when
+// the gpu is long done with them, so reading them never stalls the pipeline.
+// the hud shows each zone averaged over the last PROFILEHISTORY frames
 
-int
-main(int argc, char* argv[])
+#define PROFILEFRAMES		4			// frames of queries in flight
+#define PROFILEHISTORY		60			// frames in the rolling averages
+
+enum Zones
 {
-	// turn on the glut package:
-	// (do this before checking argc and argv since it might
-	// pull some command line arguments out)
+	ZONE_CLEAR,
+	ZONE_SHADOWS,
+	ZONE_BINNING,
+	ZONE_SKY,
+	ZONE_TERRAIN,
+	ZONE_BLOCKS,
+	ZONE_PIG,
+	ZONE_WINDOWS,
+	ZONE_LIGHTS,
+	ZONE_TEXT,
+	NUMZONES
+};
 
-	glutInit(&argc, argv);
+const char* ZoneNames[NUMZONES] = { "clear", "shadows", "binning", "sky", "terrain", "blocks", "pig", "windows", "lights", "text" };
 
-	// setup all the graphics stuff:
+bool			ShowProfile;							// true means time the zones and put them on the screen
+bool			HasTimerQuery;							// false means there are only cpu times
+GLuint			ZoneQueries[PROFILEFRAMES][NUMZONES];
+bool			ZoneIssued[PROFILEFRAMES][NUMZONES];	// true if that frame used the query
+int				ProfileFrame;							// # of frames since the profile was turned on
+int				CurrentZone = -1;						// -1 means not in a zone
+std::chrono::steady_clock::time_point	ZoneStart;
+float			ZoneCpuMs[NUMZONES][PROFILEHISTORY];
+float			ZoneGpuMs[NUMZONES][PROFILEHISTORY];
 
-	InitGraphics();
 
-	// create the display structures that will not change:
+// call this once the opengl context exists:
 
-	InitLists();
+void
+InitProfiler()
+{
+	HasTimerQuery = strstr((char*)glGetString(GL_EXTENSIONS), "GL_ARB_timer_query") != NULL;
+	if (HasTimerQuery)
+		glGenQueries(PROFILEFRAMES * NUMZONES, &ZoneQueries[0][0]);
+	else
+		fprintf(stderr, "No GL_ARB_timer_query -- the profiler will only show cpu times\n");
+}
 
-	// init all the global variables used by Display( ):
-	// this will also post a redisplay
 
-	Reset();
+// start the averages over (whenever the profile gets turned on):
 
-	// setup all the user interface stuff:
+void
+ResetProfiler()
+{
+	ProfileFrame = 0;
+	CurrentZone = -1;
+	memset(ZoneIssued, 0, sizeof(ZoneIssued));
+	memset(ZoneCpuMs, 0, sizeof(ZoneCpuMs));
+	memset(ZoneGpuMs, 0, sizeof(ZoneGpuMs));
+}
 
-	InitMenus();
 
-	// draw the scene once and wait for some interaction:
-	// (this will never return)
+// zones cannot nest -- a GL_TIME_ELAPSED query cannot be started inside another one:
 
-	glutSetWindow(MainWindow);
-	glutMainLoop();
+void
+BeginZone(int zone)
+{
+	if (!ShowProfile)
+		return;
 
-	// glutMainLoop( ) never returns
-	// this line is here to make the compiler happy:
+	CurrentZone = zone;
+	if (HasTimerQuery)
+	{
+		int slot = ProfileFrame % PROFILEFRAMES;
+		glBeginQuery(GL_TIME_ELAPSED, ZoneQueries[slot][zone]);
+		ZoneIssued[slot][zone] = true;
+	}
+	ZoneStart = std::chrono::steady_clock::now();
+}
 
-	return 0;
+
+void
+EndZone()
+{
+	if (!ShowProfile || CurrentZone < 0)
+		return;
+
+	ZoneCpuMs[CurrentZone][ProfileFrame % PROFILEHISTORY] = MillisecondsSince(ZoneStart);
+	if (HasTimerQuery)
+		glEndQuery(GL_TIME_ELAPSED);
+	CurrentZone = -1;
 }
 
 
-// this is where one would put code that is to be called
-// everytime the glut main loop has nothing to do
-//
-// this is typically where animation parameters are set
-//
-// do not call Display( ) from here -- let glutMainLoop( ) do it
+// call this after the last zone of the frame:
+// it collects the gpu times of the oldest frame in flight, since the next frame reuses its queries
 
 void
-Animate()
+EndProfileFrame()
 {
-	srand(time(0));
-	const int MS_IN_THE_ANIMATION_CYCLE = 10000;	// milliseconds in the animation loop
-	int ms = glutGet(GLUT_ELAPSED_TIME);			// milliseconds since the program started
-	ms %= MS_IN_THE_ANIMATION_CYCLE;				// milliseconds in the range 0 to MS_IN_THE_ANIMATION_CYCLE-1
-	Time = (float)ms / (float)MS_IN_THE_ANIMATION_CYCLE;        // [ 0., 1. )
-	float timer = 0.5 + 0.5 * sin(2. * M_PI * Time);
-
-	int randNum = rand() % 2;
-	if (randNum >= 0.7)
-		PigPosX = timer;
-	else if (randNum <= 0.2)
-		PigPosZ = timer;
-	else if (randNum > 0.5 && randNum < 0.7)
-		PigPosZ = timer;
-	else if (randNum <= 0.5 && randNum < 0.2)
-		PigPosX = timer;
+	if (!ShowProfile)
+		return;
 
-	glFlush();
-	glutSetWindow(MainWindow);
-	glutPostRedisplay();
+	ProfileFrame++;
+	if (!HasTimerQuery)
+		return;
+
+	int slot = ProfileFrame % PROFILEFRAMES;
+	int frame = ProfileFrame - PROFILEFRAMES;		// the frame that used this slot
+	for (int z = 0; z < NUMZONES; z++)
+	{
+		if (ZoneIssued[slot][z])
+		{
+			GLuint64 ns;
+			glGetQueryObjectui64v(ZoneQueries[slot][z], GL_QUERY_RESULT, &ns);
+			ZoneGpuMs[z][frame % PROFILEHISTORY] = (float)ns / 1000000.f;
+			ZoneIssued[slot][z] = false;
+		}
+	}
 }
 
 
-// draw the complete scene:
+// put the averages on the screen, one line per zone going down from (x,y) in percent units:
 
 void
-Display()
+DrawProfile(float x, float y)
 {
-	if (DebugOn != 0)
+	int cpuFrames = ProfileFrame < PROFILEHISTORY ? ProfileFrame : PROFILEHISTORY;
+	int gpuFrames = ProfileFrame - PROFILEFRAMES + 1;
+	if (gpuFrames < 0)
+		gpuFrames = 0;
+	if (gpuFrames > PROFILEHISTORY)
+		gpuFrames = PROFILEHISTORY;
+
+	char line[64];
+	float cpuTotal = 0., gpuTotal = 0.;
+	for (int z = 0; z < NUMZONES; z++)
 	{
-		fprintf(stderr, "Display\n");
+		float cpu = 0., gpu = 0.;
+		for (int i = 0; i < PROFILEHISTORY; i++)
+		{
+			cpu += ZoneCpuMs[z][i];
+			gpu += ZoneGpuMs[z][i];
+		}
+		cpu = cpuFrames > 0 ? cpu / (float)cpuFrames : 0.;
+		gpu = gpuFrames > 0 ? gpu / (float)gpuFrames : 0.;
+		cpuTotal += cpu;
+		gpuTotal += gpu;
+
+		if (HasTimerQuery)
+			sprintf(line, "%s:  cpu %.2f  gpu %.2f ms", ZoneNames[z], cpu, gpu);
+		else
+			sprintf(line, "%s:  cpu %.2f ms", ZoneNames[z], cpu);
+		DoRasterString(x, y - 4. * (float)z, 0., line);
 	}
 
+	if (HasTimerQuery)
+		sprintf(line, "frame:  cpu %.2f  gpu %.2f ms", cpuTotal, gpuTotal);
+	else
+		sprintf(line, "frame:  cpu %.2f ms", cpuTotal);
+	DoRasterString(x, y - 4. * (float)NUMZONES, 0., line);
+}
 
-	// set which window we want to do the graphics into:
 
-	glutSetWindow(MainWindow);
+// clustered forward lighting:
+//
+// fixed-function opengl stops at 8 lights, and every enabled light costs every
+// vertex of every lit object. instead, the lights for a frame go into Lights[ ],
+// BinLights( ) sorts them into a grid of clusters -- CLUSTERSX x CLUSTERSY tiles
+// of the viewport times CLUSTERSZ slices of depth -- and the lighting shader only
+// loops over the lights in the cluster its fragment falls in. the light list, the
+// cluster grid, and the list of light indices all go to the shader as float
+// textures. the shaders have these same numbers in them, so change both together
+
+#define MAXLIGHTS			1024		// lights in one frame
+#define CLUSTERSX			16			// tiles across the viewport
+#define CLUSTERSY			16			// tiles up the viewport
+#define CLUSTERSZ			24			// depth slices, spaced exponentially from the near to the far plane
+#define LIGHTINDEXWIDTH		1024		// the light index texture is LIGHTINDEXWIDTH x LIGHTINDEXHEIGHT
+#define LIGHTINDEXHEIGHT	256
+#define MAXLIGHTINDICES		( LIGHTINDEXWIDTH * LIGHTINDEXHEIGHT )
+#define LIGHTROWS			4			// texels per light in the light texture, one in each row
+#define LIGHTSUNIT			1			// texture units the light data is bound to
+#define CLUSTERSUNIT		2
+#define LIGHTINDEXUNIT		3
+
+const float LIGHTCUTOFF = { 1.f / 256.f };		// a light ends where it adds less than this to a color component
+const float NOCUTOFF = { 1.e+30f };				// the radius of a light that never falls off
+
+// a light in eye coordinates, the same way glLightfv( ) would have stored it:
+
+struct light
+{
+	float	x, y, z;				// position
+	float	radius;					// how far the light reaches, NOCUTOFF if it never falls off
+	float	r, g, b;				// diffuse and specular color
+	float	spotCos;				// cos of the spot cutoff angle, -1. for a point light
+	float	xdir, ydir, zdir;		// spot direction
+	float	spotExponent;
+	float	consatten, quadatten;
+	int		group;					// LightGroup when it was added, 0 is no group
+	int		shadow;					// its shadow cube map from RenderShadowCube( ), 0 is none
+};
 
-	// erase the background:
+struct light	Lights[MAXLIGHTS];
+int				NumLights;
+int				LightGroup;								// the group AddLight( ) puts new lights in
+int				NumLightIndices;						// # of light indices the last BinLights( ) used
+bool			HasClusters;							// false means there are no float textures -- fixed-function only
+bool			ClusteredOn;							// true means light with the clustered shader
+GLuint			LightsTex;								// MAXLIGHTS x LIGHTROWS rgba
+GLuint			ClustersTex;							// (CLUSTERSX*CLUSTERSY) x CLUSTERSZ luminance (offset) + alpha (count)
+GLuint			LightIndexTex;							// LIGHTINDEXWIDTH x LIGHTINDEXHEIGHT luminance
+float			ClusterNear, ClusterFar;				// the depths the slices go between
+int				ClusterRange[MAXLIGHTS][6];				// x0, x1, y0, y1, z0, z1 clusters each light touches
+float			LightData[LIGHTROWS][MAXLIGHTS][4];
+float			ClusterData[CLUSTERSZ][CLUSTERSX * CLUSTERSY][2];
+float			LightIndices[MAXLIGHTINDICES];
+
+// where a lighting shader keeps the uniforms BindClusters( ) sets, looked up once after it links:
+
+struct clusteruniforms
+{
+	GLint	lights, clusters, lightIndices;
+	GLint	viewport;
+	GLint	clusterNear, clusterLogRatio;
+	GLint	skipGroup;
+};
 
-	glDrawBuffer(GL_BACK);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+struct clusteruniforms	BlockClusterUniforms;
 
-	glEnable(GL_DEPTH_TEST);
 
+// call this once the opengl context exists:
 
-	// specify shading to be flat:
+void
+InitClusters()
+{
+	HasClusters = strstr((char*)glGetString(GL_EXTENSIONS), "GL_ARB_texture_float") != NULL;
+	if (!HasClusters)
+	{
+		fprintf(stderr, "No GL_ARB_texture_float -- the lights will be fixed-function only\n");
+		return;
+	}
 
-	glShadeModel(GL_SMOOTH);
+	GLuint* texs[3] = { &LightsTex, &ClustersTex, &LightIndexTex };
+	GLint internal[3] = { GL_RGBA32F_ARB, GL_LUMINANCE_ALPHA32F_ARB, GL_LUMINANCE32F_ARB };
+	GLenum format[3] = { GL_RGBA, GL_LUMINANCE_ALPHA, GL_LUMINANCE };
+	int widths[3] = { MAXLIGHTS, CLUSTERSX * CLUSTERSY, LIGHTINDEXWIDTH };
+	int heights[3] = { LIGHTROWS, CLUSTERSZ, LIGHTINDEXHEIGHT };
+	for (int i = 0; i < 3; i++)
+	{
+		glGenTextures(1, texs[i]);
+		glBindTexture(GL_TEXTURE_2D, *texs[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, internal[i], widths[i], heights[i], 0, format[i], GL_FLOAT, NULL);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
 
 
-	// set the viewport to a square centered in the window:
+// start a new frame's list of lights:
 
-	GLsizei vx = glutGet(GLUT_WINDOW_WIDTH);
-	GLsizei vy = glutGet(GLUT_WINDOW_HEIGHT);
-	GLsizei v = vx < vy ? vx : vy;			// minimum dimension
-	GLint xl = (vx - v) / 2;
-	GLint yb = (vy - v) / 2;
-	glViewport(xl, yb, v, v);
+void
+ClearLights()
+{
+	NumLights = 0;
+}
 
 
-	// set the viewing volume:
-	// remember that the Z clipping  values are actually
-	// given as DISTANCES IN FRONT OF THE EYE
-	// USE gluOrtho2D( ) IF YOU ARE DOING 2D !
+// these take the same arguments as SetPointLight( ) and SetSpotLight( ), and like
+// glLightfv( ), the position and direction go through the current modelview matrix.
+// a shader can leave out one group of lights (uSkipGroup), the way an object can be
+// drawn with some of the GL_LIGHTs disabled -- set LightGroup before adding them:
 
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
+struct light*
+AddLight(float x, float y, float z, float r, float g, float b, float consatten, float quadatten)
+{
+	if (NumLights >= MAXLIGHTS)
+	{
+		fprintf(stderr, "Too many lights -- only %d fit in a frame\n", MAXLIGHTS);
+		return NULL;
+	}
 
-	if (WhichProjection == ORTHO)
-		glOrtho(-55., 55., -55., 55., 0.1, 1000.);
+	float mv[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+	struct light* l = &Lights[NumLights++];
+	l->x = mv[0] * x + mv[4] * y + mv[8] * z + mv[12];
+	l->y = mv[1] * x + mv[5] * y + mv[9] * z + mv[13];
+	l->z = mv[2] * x + mv[6] * y + mv[10] * z + mv[14];
+	l->r = r;
+	l->g = g;
+	l->b = b;
+	l->consatten = consatten;
+	l->quadatten = quadatten;
+	l->spotCos = -1.;
+	l->xdir = l->ydir = l->zdir = 0.;
+	l->spotExponent = 0.;
+	l->group = LightGroup;
+	l->shadow = 0;
+
+	// solve consatten + quadatten*d^2 = brightest/LIGHTCUTOFF for the distance d:
+
+	float brightest = r > g ? r : g;
+	if (b > brightest)
+		brightest = b;
+	if (quadatten > 0.)
+	{
+		float d2 = (brightest / LIGHTCUTOFF - consatten) / quadatten;
+		l->radius = d2 > 0. ? sqrtf(d2) : 0.;
+	}
 	else
-		gluPerspective(10., 1., 0.1, 1000.);
+		l->radius = NOCUTOFF;
+	return l;
+}
 
+struct light*
+AddPointLight(float x, float y, float z, float r, float g, float b, float consatten, float quadatten)
+{
+	return AddLight(x, y, z, r, g, b, consatten, quadatten);
+}
 
-	// place the objects into the scene:
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
+void
+AddSpotLight(float x, float y, float z, float xdir, float ydir, float zdir, float r, float g, float b)
+{
+	struct light* l = AddLight(x, y, z, r, g, b, 1., 0.);
+	if (l == NULL)
+		return;
 
-	// set the eye position, look-at position, and up-vector:
-	gluLookAt(eyex, eyey, eyez, lookx, looky, lookz, upx, upy, upz);
+	float mv[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+	float dir[3], eyeDir[3];
+	dir[0] = mv[0] * xdir + mv[4] * ydir + mv[8] * zdir;
+	dir[1] = mv[1] * xdir + mv[5] * ydir + mv[9] * zdir;
+	dir[2] = mv[2] * xdir + mv[6] * ydir + mv[10] * zdir;
+	Unit(dir, eyeDir);
+	l->xdir = eyeDir[0];
+	l->ydir = eyeDir[1];
+	l->zdir = eyeDir[2];
+	l->spotCos = cosf(45. * M_PI / 180.);		// GL_SPOT_CUTOFF and GL_SPOT_EXPONENT from SetSpotLight( )
+	l->spotExponent = 1.;
+}
 
 
+// which depth slice an eye-space depth (a positive distance in front of the eye) is in:
 
-	// rotate the scene:
+inline
+int
+ClusterSlice(float depth)
+{
+	if (depth <= ClusterNear)
+		return 0;
+	int slice = (int)(logf(depth / ClusterNear) / logf(ClusterFar / ClusterNear) * (float)CLUSTERSZ);
+	return slice < CLUSTERSZ ? slice : CLUSTERSZ - 1;
+}
 
-	glRotatef((GLfloat)Yrot, 0., 1., 0.);
-	glRotatef((GLfloat)Xrot, 1., 0., 0.);
+inline
+int
+ClusterTile(float ndc, int numTiles)
+{
+	int tile = (int)floorf((ndc + 1.f) / 2.f * (float)numTiles);
+	if (tile < 0)
+		return 0;
+	return tile < numTiles ? tile : numTiles - 1;
+}
 
 
-	// uniformly scale the scene:
+// sort this frame's lights into the clusters and send everything to the textures.
+// call it after the projection matrix is set, with the near and far planes it used:
 
-	if (Scale < MINSCALE)
-		Scale = MINSCALE;
-	glScalef((GLfloat)Scale, (GLfloat)Scale, (GLfloat)Scale);
+void
+BinLights(float zNear, float zFar)
+{
+	if (!HasClusters)
+		return;
 
+	ClusterNear = zNear;
+	ClusterFar = zFar;
+	float p[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, p);
 
-	// Turn the lights on
+	// find the block of clusters each light's sphere of influence touches.
+	// the screen tiles come from projecting the corners of the box around the
+	// sphere, with the part of the box behind the near plane cut off:
 
-	if (Light0On)
-		glEnable(GL_LIGHT0);
-	else
-		glDisable(GL_LIGHT0);
+	static int counts[CLUSTERSZ][CLUSTERSX * CLUSTERSY];
+	static int next[CLUSTERSZ][CLUSTERSX * CLUSTERSY];
+	memset(counts, 0, sizeof(counts));
+	for (int i = 0; i < NumLights; i++)
+	{
+		struct light* l = &Lights[i];
+		int* range = ClusterRange[i];
+		float front = -l->z - l->radius;
+		float back = -l->z + l->radius;
+		if (back < zNear || front > zFar)
+		{
+			range[4] = 1;			// an empty range of slices
+			range[5] = 0;
+			continue;
+		}
+		range[4] = ClusterSlice(front);
+		range[5] = ClusterSlice(back);
 
-	if (Light1On)
-		glEnable(GL_LIGHT1);
-	else
-		glDisable(GL_LIGHT1);
+		if (l->radius == NOCUTOFF)
+		{
+			range[0] = range[2] = 0;
+			range[1] = CLUSTERSX - 1;
+			range[3] = CLUSTERSY - 1;
+		}
+		else
+		{
+			float xmin = 1.e+30f, ymin = 1.e+30f, xmax = -1.e+30f, ymax = -1.e+30f;
+			for (int c = 0; c < 8; c++)
+			{
+				float x = l->x + ((c & 1) ? l->radius : -l->radius);
+				float y = l->y + ((c & 2) ? l->radius : -l->radius);
+				float z = l->z + ((c & 4) ? l->radius : -l->radius);
+				if (z > -zNear)
+					z = -zNear;
+				float w = p[3] * x + p[7] * y + p[11] * z + p[15];
+				float xndc = (p[0] * x + p[4] * y + p[8] * z + p[12]) / w;
+				float yndc = (p[1] * x + p[5] * y + p[9] * z + p[13]) / w;
+				if (xndc < xmin)	xmin = xndc;
+				if (xndc > xmax)	xmax = xndc;
+				if (yndc < ymin)	ymin = yndc;
+				if (yndc > ymax)	ymax = yndc;
+			}
+			if (xmax < -1. || xmin > 1. || ymax < -1. || ymin > 1.)
+			{
+				range[4] = 1;		// not on the screen at all
+				range[5] = 0;
+				continue;
+			}
+			range[0] = ClusterTile(xmin, CLUSTERSX);
+			range[1] = ClusterTile(xmax, CLUSTERSX);
+			range[2] = ClusterTile(ymin, CLUSTERSY);
+			range[3] = ClusterTile(ymax, CLUSTERSY);
+		}
 
+		for (int z = range[4]; z <= range[5]; z++)
+			for (int y = range[2]; y <= range[3]; y++)
+				for (int x = range[0]; x <= range[1]; x++)
+					counts[z][x + CLUSTERSX * y]++;
+	}
 
-	// since we are using glScalef( ), be sure normals get unitized:
+	// each cluster's lights are one run of the index list:
 
-	glEnable(GL_NORMALIZE);
+	NumLightIndices = 0;
+	for (int z = 0; z < CLUSTERSZ; z++)
+	{
+		for (int t = 0; t < CLUSTERSX * CLUSTERSY; t++)
+		{
+			if (NumLightIndices + counts[z][t] > MAXLIGHTINDICES)
+				counts[z][t] = MAXLIGHTINDICES - NumLightIndices;
+			ClusterData[z][t][0] = (float)NumLightIndices;
+			ClusterData[z][t][1] = 0.;
+			next[z][t] = NumLightIndices;
+			NumLightIndices += counts[z][t];
+		}
+	}
+	if (NumLightIndices == MAXLIGHTINDICES)
+		fprintf(stderr, "The light index list is full -- some clusters are missing lights\n");
 
-	
-	// Draw Sky
+	for (int i = 0; i < NumLights; i++)
+	{
+		int* range = ClusterRange[i];
+		for (int z = range[4]; z <= range[5]; z++)
+		{
+			for (int y = range[2]; y <= range[3]; y++)
+			{
+				for (int x = range[0]; x <= range[1]; x++)
+				{
+					int t = x + CLUSTERSX * y;
+					if (ClusterData[z][t][1] >= (float)counts[z][t])
+						continue;
+					LightIndices[next[z][t]++] = (float)i;
+					ClusterData[z][t][1] += 1.;
+				}
+			}
+		}
+
+		struct light* l = &Lights[i];
+		float* d = LightData[0][i];
+		d[0] = l->x;	d[1] = l->y;	d[2] = l->z;	d[3] = l->radius;
+		d = LightData[1][i];
+		d[0] = l->r;	d[1] = l->g;	d[2] = l->b;	d[3] = l->spotCos;
+		d = LightData[2][i];
+		d[0] = l->xdir;	d[1] = l->ydir;	d[2] = l->zdir;	d[3] = l->spotExponent;
+		d = LightData[3][i];
+		d[0] = l->consatten;	d[1] = l->quadatten;	d[2] = (float)l->group;	d[3] = (float)l->shadow;
+	}
+
+	// only send the part of each texture that is in use:
+
+	if (NumLights > 0)
+	{
+		glBindTexture(GL_TEXTURE_2D, LightsTex);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, MAXLIGHTS);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, NumLights, LIGHTROWS, GL_RGBA, GL_FLOAT, LightData);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	}
+
+	glBindTexture(GL_TEXTURE_2D, ClustersTex);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTERSX * CLUSTERSY, CLUSTERSZ, GL_LUMINANCE_ALPHA, GL_FLOAT, ClusterData);
+
+	int rows = (NumLightIndices + LIGHTINDEXWIDTH - 1) / LIGHTINDEXWIDTH;
+	if (rows > 0)
+	{
+		glBindTexture(GL_TEXTURE_2D, LightIndexTex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, LIGHTINDEXWIDTH, rows, GL_LUMINANCE, GL_FLOAT, LightIndices);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+
+// GLSLProgram keeps its program handle to itself, so ask gl which one Use( ) makes current:
+
+GLuint
+ProgramHandle(GLSLProgram* shader)
+{
+	GLint program;
+	shader->Use();
+	glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+	shader->Use(0);
+	return (GLuint)program;
+}
+
+
+// GLSLProgram looks a uniform up by name every time it is set, so ask gl for them
+// once instead -- BindClusters( ) runs every frame:
+
+void
+LookUpClusterUniforms(GLuint program, struct clusteruniforms* u)
+{
+	u->lights = glGetUniformLocation(program, "uLights");
+	u->clusters = glGetUniformLocation(program, "uClusters");
+	u->lightIndices = glGetUniformLocation(program, "uLightIndices");
+	u->viewport = glGetUniformLocation(program, "uViewport");
+	u->clusterNear = glGetUniformLocation(program, "uClusterNear");
+	u->clusterLogRatio = glGetUniformLocation(program, "uClusterLogRatio");
+	u->skipGroup = glGetUniformLocation(program, "uSkipGroup");
+}
+
+
+// hand the cluster textures to the lighting shader that is in use, whose uniforms are in u.
+// the viewport is the square one Display( ) sets up, so one size is enough:
+
+void
+BindClusters(struct clusteruniforms* u)
+{
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	glActiveTexture(GL_TEXTURE0 + LIGHTSUNIT);
+	glBindTexture(GL_TEXTURE_2D, LightsTex);
+	glActiveTexture(GL_TEXTURE0 + CLUSTERSUNIT);
+	glBindTexture(GL_TEXTURE_2D, ClustersTex);
+	glActiveTexture(GL_TEXTURE0 + LIGHTINDEXUNIT);
+	glBindTexture(GL_TEXTURE_2D, LightIndexTex);
+	glActiveTexture(GL_TEXTURE0);
+
+	glUniform1i(u->lights, LIGHTSUNIT);
+	glUniform1i(u->clusters, CLUSTERSUNIT);
+	glUniform1i(u->lightIndices, LIGHTINDEXUNIT);
+	glUniform3f(u->viewport, (float)viewport[0], (float)viewport[1], (float)viewport[2]);
+	glUniform1f(u->clusterNear, ClusterNear);
+	glUniform1f(u->clusterLogRatio, logf(ClusterFar / ClusterNear));
+	glUniform1f(u->skipGroup, 0.f);
+}
+
+
+// shadows:
+//
+// a point light's shadows go in a cube map -- six 90-degree views out of the light,
+// each texel holding the distance from the light to the nearest caster (divided by
+// SHADOWFAR so that it fits in [0.,1.]). the lighting shaders compare a fragment's
+// own distance from the light to what the cube map has in that direction, 9 times
+// around it to soften the edge (percentage-closer filtering). the casters are drawn
+// by DrawShadowCasters( ) with the same vbos and display lists the main pass uses,
+// but with no textures, no lighting, and only the faces they fall in.
+// each light's cube map is sized by how close the light is to the eye
+
+#define MAXSHADOWCUBES		2
+#define SHADOWCUBEUNIT		7			// texture units of the cube maps, SHADOWCUBEUNIT+0, +1, ...
+#define EYETOWORLDMATRIX	7			// texture matrix the shaders get EyeToWorld[ ] from
+#define SHADOWMAXSIZE		1024		// texels along each side of a cube face
+#define SHADOWMINSIZE		256
+
+const float SHADOWNEAR = { 0.05f };
+const float SHADOWFAR = { 100.f };			// the shaders have this number in them too
+const float SHADOWSIZEREACH = { 12.f };		// a light closer to the eye than this gets SHADOWMAXSIZE, half the size every time that doubles
+
+// the look and up directions of the 6 cube faces, in GL_TEXTURE_CUBE_MAP_POSITIVE_X order:
+
+const float CubeFaces[6][2][3] =
+{
+	{ {  1.,  0.,  0. }, { 0., -1.,  0. } },
+	{ { -1.,  0.,  0. }, { 0., -1.,  0. } },
+	{ {  0.,  1.,  0. }, { 0.,  0.,  1. } },
+	{ {  0., -1.,  0. }, { 0.,  0., -1. } },
+	{ {  0.,  0.,  1. }, { 0., -1.,  0. } },
+	{ {  0.,  0., -1. }, { 0., -1.,  0. } },
+};
+
+struct shadowcube
+{
+	int		size;				// texels along each side of a face, 0 until it is first used
+	GLuint	tex;				// GL_R32F cube map of distances
+	GLuint	depth;				// depth renderbuffer the 6 faces share
+	GLuint	fbo;
+	float	x, y, z;			// where the light is, in world coordinates
+};
+
+struct shadowcube	ShadowCubes[MAXSHADOWCUBES];
+int					NumShadowCubes;			// # of cube maps drawn this frame
+bool				HasShadows;				// false means no framebuffer objects or no GL_R32F
+GLSLProgram*		ShadowCubeShader;		// writes the distance to the light
+float				EyeToWorld[16];			// undoes the viewing transformation, see BeginShadows( )
+
+// where a lighting shader keeps the uniforms BindShadows( ) sets, looked up once after it links:
+
+struct shadowuniforms
+{
+	GLint	shadowCubes[MAXSHADOWCUBES];
+	GLint	cubeLights[MAXSHADOWCUBES];
+	GLint	cubeTexels[MAXSHADOWCUBES];
+	GLint	shadowsOn;
+};
+
+struct shadowuniforms	BlockShadowUniforms;
+
+
+// 4x4 matrices are column-major, the way glGetFloatv( ) hands them back:
+
+void
+MulMatrix(float a[16], float b[16], float ab[16])
+{
+	for (int c = 0; c < 4; c++)
+		for (int r = 0; r < 4; r++)
+			ab[4 * c + r] = a[r] * b[4 * c] + a[4 + r] * b[4 * c + 1] + a[8 + r] * b[4 * c + 2] + a[12 + r] * b[4 * c + 3];
+}
+
+void
+TransformPoint(float m[16], float x, float y, float z, float xyz[3])
+{
+	float w = m[3] * x + m[7] * y + m[11] * z + m[15];
+	xyz[0] = (m[0] * x + m[4] * y + m[8] * z + m[12]) / w;
+	xyz[1] = (m[1] * x + m[5] * y + m[9] * z + m[13]) / w;
+	xyz[2] = (m[2] * x + m[6] * y + m[10] * z + m[14]) / w;
+}
+
+// cofactors over the determinant, false if m cannot be inverted:
+
+bool
+InvertMatrix(float m[16], float inv[16])
+{
+	float t[16];
+	t[0] = m[5] * m[10] * m[15] - m[5] * m[11] * m[14] - m[9] * m[6] * m[15] + m[9] * m[7] * m[14] + m[13] * m[6] * m[11] - m[13] * m[7] * m[10];
+	t[4] = -m[4] * m[10] * m[15] + m[4] * m[11] * m[14] + m[8] * m[6] * m[15] - m[8] * m[7] * m[14] - m[12] * m[6] * m[11] + m[12] * m[7] * m[10];
+	t[8] = m[4] * m[9] * m[15] - m[4] * m[11] * m[13] - m[8] * m[5] * m[15] + m[8] * m[7] * m[13] + m[12] * m[5] * m[11] - m[12] * m[7] * m[9];
+	t[12] = -m[4] * m[9] * m[14] + m[4] * m[10] * m[13] + m[8] * m[5] * m[14] - m[8] * m[6] * m[13] - m[12] * m[5] * m[10] + m[12] * m[6] * m[9];
+	t[1] = -m[1] * m[10] * m[15] + m[1] * m[11] * m[14] + m[9] * m[2] * m[15] - m[9] * m[3] * m[14] - m[13] * m[2] * m[11] + m[13] * m[3] * m[10];
+	t[5] = m[0] * m[10] * m[15] - m[0] * m[11] * m[14] - m[8] * m[2] * m[15] + m[8] * m[3] * m[14] + m[12] * m[2] * m[11] - m[12] * m[3] * m[10];
+	t[9] = -m[0] * m[9] * m[15] + m[0] * m[11] * m[13] + m[8] * m[1] * m[15] - m[8] * m[3] * m[13] - m[12] * m[1] * m[11] + m[12] * m[3] * m[9];
+	t[13] = m[0] * m[9] * m[14] - m[0] * m[10] * m[13] - m[8] * m[1] * m[14] + m[8] * m[2] * m[13] + m[12] * m[1] * m[10] - m[12] * m[2] * m[9];
+	t[2] = m[1] * m[6] * m[15] - m[1] * m[7] * m[14] - m[5] * m[2] * m[15] + m[5] * m[3] * m[14] + m[13] * m[2] * m[7] - m[13] * m[3] * m[6];
+	t[6] = -m[0] * m[6] * m[15] + m[0] * m[7] * m[14] + m[4] * m[2] * m[15] - m[4] * m[3] * m[14] - m[12] * m[2] * m[7] + m[12] * m[3] * m[6];
+	t[10] = m[0] * m[5] * m[15] - m[0] * m[7] * m[13] - m[4] * m[1] * m[15] + m[4] * m[3] * m[13] + m[12] * m[1] * m[7] - m[12] * m[3] * m[5];
+	t[14] = -m[0] * m[5] * m[14] + m[0] * m[6] * m[13] + m[4] * m[1] * m[14] - m[4] * m[2] * m[13] - m[12] * m[1] * m[6] + m[12] * m[2] * m[5];
+	t[3] = -m[1] * m[6] * m[11] + m[1] * m[7] * m[10] + m[5] * m[2] * m[11] - m[5] * m[3] * m[10] - m[9] * m[2] * m[7] + m[9] * m[3] * m[6];
+	t[7] = m[0] * m[6] * m[11] - m[0] * m[7] * m[10] - m[4] * m[2] * m[11] + m[4] * m[3] * m[10] + m[8] * m[2] * m[7] - m[8] * m[3] * m[6];
+	t[11] = -m[0] * m[5] * m[11] + m[0] * m[7] * m[9] + m[4] * m[1] * m[11] - m[4] * m[3] * m[9] - m[8] * m[1] * m[7] + m[8] * m[3] * m[5];
+	t[15] = m[0] * m[5] * m[10] - m[0] * m[6] * m[9] - m[4] * m[1] * m[10] + m[4] * m[2] * m[9] + m[8] * m[1] * m[6] - m[8] * m[2] * m[5];
+
+	float det = m[0] * t[0] + m[1] * t[4] + m[2] * t[8] + m[3] * t[12];
+	if (det == 0.)
+		return false;
+	for (int i = 0; i < 16; i++)
+		inv[i] = t[i] / det;
+	return true;
+}
+
+
+// call this once the opengl context exists:
+
+void
+InitShadows()
+{
+	char* extensions = (char*)glGetString(GL_EXTENSIONS);
+	HasShadows = strstr(extensions, "GL_ARB_framebuffer_object") != NULL &&
+		strstr(extensions, "GL_ARB_texture_rg") != NULL;
+	if (!HasShadows)
+	{
+		fprintf(stderr, "No GL_ARB_framebuffer_object or GL_ARB_texture_rg -- there will be no shadows\n");
+		return;
+	}
+
+	ShadowCubeShader = new GLSLProgram();
+	bool valid = ShadowCubeShader->Create("shadowcube.vert", "shadowcube.frag");
+	if (!valid) {
+		fprintf(stderr, "Shadow cube shader cannot be created -- there will be no shadows\n");
+		HasShadows = false;
+	}
+	else
+		fprintf(stderr, "Shadow cube shader created.\n");
+	ShadowCubeShader->SetVerbose(false);
+}
+
+
+// (re)build a cube map and its framebuffer at a new size.
+// returns false, and turns the shadows off, if the framebuffer cannot be drawn into:
+
+bool
+SizeShadowCube(struct shadowcube* sc, int size)
+{
+	if (sc->size == 0)
+	{
+		glGenTextures(1, &sc->tex);
+		glGenRenderbuffers(1, &sc->depth);
+		glGenFramebuffers(1, &sc->fbo);
+	}
+	sc->size = size;
+
+	glBindTexture(GL_TEXTURE_CUBE_MAP, sc->tex);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	for (int f = 0; f < 6; f++)
+		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, 0, GL_R32F, size, size, 0, GL_RED, GL_FLOAT, NULL);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, sc->depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size, size);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	// the faces all have the same size and format, so checking with one of them is enough:
+
+	GLint oldFbo;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &oldFbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, sc->fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, sc->depth);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X, sc->tex, 0);
+	bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	glBindFramebuffer(GL_FRAMEBUFFER, oldFbo);
+	if (!complete)
+	{
+		fprintf(stderr, "Shadow cube framebuffer (%d x %d GL_R32F) is not complete -- there will be no shadows\n", size, size);
+		HasShadows = false;
+	}
+	return complete;
+}
+
+
+// call this right after the viewing transformation is set, before any shadows are drawn:
+// the shadow maps are all in world coordinates, and the shaders get from eye
+// coordinates back to world coordinates with the inverse of the viewing transformation
+
+void
+BeginShadows()
+{
+	float mv[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+	InvertMatrix(mv, EyeToWorld);
+	NumShadowCubes = 0;
+}
+
+
+// draw the shadow cube map for a point light at (x,y,z), which, like AddLight( ),
+// goes through the current modelview matrix.
+// returns the cube map's slot for light->shadow, 0 if there is no cube map for it:
+
+int
+RenderShadowCube(float x, float y, float z)
+{
+	if (!HasShadows || NumShadowCubes >= MAXSHADOWCUBES)
+		return 0;
+
+	float mv[16], toWorld[16], eye[3];
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+	MulMatrix(EyeToWorld, mv, toWorld);
+	struct shadowcube* sc = &ShadowCubes[NumShadowCubes++];
+	float light[3];
+	TransformPoint(toWorld, x, y, z, light);
+	sc->x = light[0];
+	sc->y = light[1];
+	sc->z = light[2];
+
+	TransformPoint(EyeToWorld, 0., 0., 0., eye);
+	float dx = eye[0] - sc->x;
+	float dy = eye[1] - sc->y;
+	float dz = eye[2] - sc->z;
+	float distance = sqrtf(dx * dx + dy * dy + dz * dz);
+	int size = SHADOWMAXSIZE;
+	for (float reach = SHADOWSIZEREACH; distance > reach && size > SHADOWMINSIZE; reach *= 2.)
+		size /= 2;
+	if (size != sc->size && !SizeShadowCube(sc, size))
+	{
+		NumShadowCubes--;
+		return 0;
+	}
+
+	// draw into the cube map, and put everything back the way it was afterwards
+	// (the window might be drawing into a framebuffer object too):
+
+	GLint oldFbo, oldViewport[4];
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &oldFbo);
+	glGetIntegerv(GL_VIEWPORT, oldViewport);
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	gluPerspective(90., 1., SHADOWNEAR, SHADOWFAR);
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+
+	glBindFramebuffer(GL_FRAMEBUFFER, sc->fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, sc->depth);
+	glViewport(0, 0, sc->size, sc->size);
+	glClearColor(1., 1., 1., 1.);		// nothing in the way, as far as SHADOWFAR
+	ShadowCubeShader->Use();
+	for (int f = 0; f < 6; f++)
+	{
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, sc->tex, 0);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glLoadIdentity();
+		gluLookAt(sc->x, sc->y, sc->z,
+			sc->x + CubeFaces[f][0][0], sc->y + CubeFaces[f][0][1], sc->z + CubeFaces[f][0][2],
+			CubeFaces[f][1][0], CubeFaces[f][1][1], CubeFaces[f][1][2]);
+		DrawShadowCasters(f);
+	}
+	ShadowCubeShader->Use(0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, oldFbo);
+	glViewport(oldViewport[0], oldViewport[1], oldViewport[2], oldViewport[3]);
+	glClearColor(BACKCOLOR[0], BACKCOLOR[1], BACKCOLOR[2], BACKCOLOR[3]);
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPopMatrix();
+
+	return NumShadowCubes;
+}
+
+
+void
+LookUpShadowUniforms(GLuint program, struct shadowuniforms* u)
+{
+	char name[32];
+	for (int i = 0; i < MAXSHADOWCUBES; i++)
+	{
+		sprintf(name, "uShadowCube%d", i);
+		u->shadowCubes[i] = glGetUniformLocation(program, name);
+		sprintf(name, "uCubeLight%d", i);
+		u->cubeLights[i] = glGetUniformLocation(program, name);
+		sprintf(name, "uCubeTexel%d", i);
+		u->cubeTexels[i] = glGetUniformLocation(program, name);
+	}
+	u->shadowsOn = glGetUniformLocation(program, "uShadowsOn");
+}
+
+
+// hand the shadow maps to the lighting shader that is in use, whose uniforms are in u:
+
+void
+BindShadows(struct shadowuniforms* u)
+{
+	glActiveTexture(GL_TEXTURE0 + EYETOWORLDMATRIX);
+	glMatrixMode(GL_TEXTURE);
+	glLoadMatrixf(EyeToWorld);
+	glMatrixMode(GL_MODELVIEW);
+
+	for (int i = 0; i < MAXSHADOWCUBES; i++)
+	{
+		struct shadowcube* sc = &ShadowCubes[i];
+		glActiveTexture(GL_TEXTURE0 + SHADOWCUBEUNIT + i);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, sc->tex);
+
+		glUniform1i(u->shadowCubes[i], SHADOWCUBEUNIT + i);
+		glUniform3f(u->cubeLights[i], sc->x, sc->y, sc->z);
+		glUniform1f(u->cubeTexels[i], sc->size > 0 ? 2.f / (float)sc->size : 0.f);
+	}
+	glActiveTexture(GL_TEXTURE0);
+	glUniform1i(u->shadowsOn, (ShadowsOn != 0 && HasShadows) ? 1 : 0);
+}
+
+
+// the sun's (and at night the moon's) shadows are cascaded: the view frustum, out to
+// SUNSHADOWDISTANCE, is cut into CASCADES slices, and each slice gets its own
+// orthographic depth map looking down the sun's direction, so the slices near the
+// eye get many more texels per block than the far ones. the shaders pick the slice
+// from the eye depth, and GL_COMPARE_R_TO_TEXTURE with GL_LINEAR gives 2x2
+// percentage-closer filtering for each of the 4 lookups they do around a point.
+// the depth pass is fixed-function with no color buffer at all
+
+#define CASCADES			3			// the shaders have uSunShadow0 .. uSunShadow2 and a vec3 of where they end
+#define SUNSHADOWUNIT		4			// texture units (and texture matrices) of the cascades, SUNSHADOWUNIT+0, +1, ...
+#define SUNSHADOWSIZE		1024
+
+const float SUNDIRECTION[] = { 0.99619f, 0.08716f, 0.f };	// towards the sun, which is turned up 5 degrees
+const float SUNSHADOWDISTANCE = { 120.f };		// no sun shadows farther from the eye than this
+const float CASCADELOG = { 0.75f };				// 1. is logarithmically spaced cascades, 0. is evenly spaced
+const float SUNCASTERREACH = { 200.f };			// how far towards the sun a caster can be from the slice it shadows
+const float SUNSHADOWDIMDAY = { 0.5f };			// what the shadows multiply the color by
+const float SUNSHADOWDIMNIGHT = { 0.75f };
+
+GLuint			SunShadowTex[CASCADES];
+GLuint			SunShadowFbo[CASCADES];
+float			CascadeEnds[CASCADES];					// eye depth each cascade reaches out to
+float			SunShadowMatrices[CASCADES][16];		// eye coordinates to shadow map s, t, and depth
+GLSLProgram*	ShadowedShader;							// GL_REPLACE texturing with the sun's shadows on it
+GLint			ShadowedTexUnitLoc;
+
+// where a shader keeps the uniforms BindSunShadows( ) sets, looked up once after it links:
+
+struct sunshadowuniforms
+{
+	GLint	sunShadows[CASCADES];
+	GLint	cascadeEnds;
+	GLint	sunTexel, shadowDim;
+};
+
+struct sunshadowuniforms	BlockSunUniforms, ShadowedSunUniforms;
+
+
+void
+LookUpSunShadowUniforms(GLuint program, struct sunshadowuniforms* u)
+{
+	char name[32];
+	for (int i = 0; i < CASCADES; i++)
+	{
+		sprintf(name, "uSunShadow%d", i);
+		u->sunShadows[i] = glGetUniformLocation(program, name);
+	}
+	u->cascadeEnds = glGetUniformLocation(program, "uCascadeEnds");
+	u->sunTexel = glGetUniformLocation(program, "uSunTexel");
+	u->shadowDim = glGetUniformLocation(program, "uShadowDim");
+}
+
+
+void
+InitSunShadows()
+{
+	if (!HasShadows)
+		return;
+
+	glGenTextures(CASCADES, SunShadowTex);
+	glGenFramebuffers(CASCADES, SunShadowFbo);
+	GLint oldFbo;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &oldFbo);
+	float white[] = { 1., 1., 1., 1. };
+	for (int i = 0; i < CASCADES; i++)
+	{
+		glBindTexture(GL_TEXTURE_2D, SunShadowTex[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, SUNSHADOWSIZE, SUNSHADOWSIZE, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, white);		// off the map is lit
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, SunShadowFbo[i]);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, SunShadowTex[i], 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			fprintf(stderr, "Sun shadow framebuffer %d is not complete -- there will be no shadows\n", i);
+			HasShadows = false;
+		}
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, oldFbo);
+
+	ShadowedShader = new GLSLProgram();
+	bool valid = ShadowedShader->Create("shadowed.vert", "shadowed.frag");
+	if (!valid) {
+		fprintf(stderr, "Shadowed shader cannot be created -- there will be no shadows\n");
+		HasShadows = false;
+	}
+	else
+		fprintf(stderr, "Shadowed shader created.\n");
+	ShadowedShader->SetVerbose(false);
+	if (valid)
+	{
+		GLuint program = ProgramHandle(ShadowedShader);
+		ShadowedTexUnitLoc = glGetUniformLocation(program, "uTexUnit");
+		LookUpSunShadowUniforms(program, &ShadowedSunUniforms);
+	}
+}
+
+
+// draw the cascades for the current projection and viewing transformation.
+// call BeginShadows( ) first:
+
+void
+RenderSunShadows()
+{
+	if (!HasShadows)
+		return;
+
+	// the view frustum's 4 edges, from the near plane to the far plane, in eye coordinates
+	// (this works for glOrtho( ) as well as gluPerspective( )):
+
+	float proj[16], clipToEye[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, proj);
+	InvertMatrix(proj, clipToEye);
+	float nearCorners[4][3], farCorners[4][3];
+	for (int k = 0; k < 4; k++)
+	{
+		float x = (k & 1) ? 1.f : -1.f;
+		float y = (k & 2) ? 1.f : -1.f;
+		TransformPoint(clipToEye, x, y, -1., nearCorners[k]);
+		TransformPoint(clipToEye, x, y, 1., farCorners[k]);
+	}
+	float zNear = -nearCorners[0][2];
+	float zFar = -farCorners[0][2];
+	float reach = SUNSHADOWDISTANCE < zFar ? SUNSHADOWDISTANCE : zFar;
+
+	GLint oldFbo, oldViewport[4];
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &oldFbo);
+	glGetIntegerv(GL_VIEWPORT, oldViewport);
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+
+	// the sun's view, from the world origin -- each cascade just moves its glOrtho( ) box:
+
+	float lightView[16], lightProj[16];
+	glLoadIdentity();
+	gluLookAt(0., 0., 0., -SUNDIRECTION[0], -SUNDIRECTION[1], -SUNDIRECTION[2], 0., 1., 0.);
+	glGetFloatv(GL_MODELVIEW_MATRIX, lightView);
+
+	// last frame's cascades are still bound for the shaders, take them off before drawing into them:
+
+	for (int i = 0; i < CASCADES; i++)
+	{
+		glActiveTexture(GL_TEXTURE0 + SUNSHADOWUNIT + i);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+	glActiveTexture(GL_TEXTURE0);
+
+	glViewport(0, 0, SUNSHADOWSIZE, SUNSHADOWSIZE);
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(2., 4.);
+	float start = zNear;
+	for (int i = 0; i < CASCADES; i++)
+	{
+		float f = (float)(i + 1) / (float)CASCADES;
+		float end = CASCADELOG * zNear * powf(reach / zNear, f) + (1. - CASCADELOG) * (zNear + (reach - zNear) * f);
+
+		// a sphere around the slice of the frustum from start to end, so the cascade is
+		// the same size however the eye turns:
+
+		float corners[8][3];
+		float center[3] = { 0., 0., 0. };
+		for (int k = 0; k < 8; k++)
+		{
+			float t = ((k < 4 ? start : end) - zNear) / (zFar - zNear);
+			float* n = nearCorners[k % 4];
+			float* fc = farCorners[k % 4];
+			TransformPoint(EyeToWorld, n[0] + t * (fc[0] - n[0]), n[1] + t * (fc[1] - n[1]), n[2] + t * (fc[2] - n[2]), corners[k]);
+			center[0] += corners[k][0] / 8.;
+			center[1] += corners[k][1] / 8.;
+			center[2] += corners[k][2] / 8.;
+		}
+		float radius = 0.;
+		for (int k = 0; k < 8; k++)
+		{
+			float dx = corners[k][0] - center[0];
+			float dy = corners[k][1] - center[1];
+			float dz = corners[k][2] - center[2];
+			float r = sqrtf(dx * dx + dy * dy + dz * dz);
+			if (r > radius)
+				radius = r;
+		}
+
+		// snap the center to whole texels, so the shadow edges do not crawl as the eye moves:
+
+		float c[3];
+		TransformPoint(lightView, center[0], center[1], center[2], c);
+		float texel = 2.f * radius / (float)SUNSHADOWSIZE;
+		c[0] = texel * floorf(c[0] / texel);
+		c[1] = texel * floorf(c[1] / texel);
+
+		glMatrixMode(GL_PROJECTION);
+		glLoadIdentity();
+		glOrtho(c[0] - radius, c[0] + radius, c[1] - radius, c[1] + radius, -c[2] - radius - SUNCASTERREACH, -c[2] + radius);
+		glGetFloatv(GL_PROJECTION_MATRIX, lightProj);
+		glMatrixMode(GL_MODELVIEW);
+		glLoadMatrixf(lightView);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, SunShadowFbo[i]);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		DrawShadowCasters(-1);
+
+		// eye coordinates -> world -> the sun's clip coordinates -> [0.,1.]:
+
+		float bias[16] = { 0.5, 0., 0., 0.,   0., 0.5, 0., 0.,   0., 0., 0.5, 0.,   0.5, 0.5, 0.5, 1. };
+		float biasProj[16], biasProjView[16];
+		MulMatrix(bias, lightProj, biasProj);
+		MulMatrix(biasProj, lightView, biasProjView);
+		MulMatrix(biasProjView, EyeToWorld, SunShadowMatrices[i]);
+		CascadeEnds[i] = end;
+		start = end;
+	}
+	glDisable(GL_POLYGON_OFFSET_FILL);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, oldFbo);
+	glViewport(oldViewport[0], oldViewport[1], oldViewport[2], oldViewport[3]);
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPopMatrix();
+}
+
+
+// hand the cascades to the shader that is in use, whose uniforms are in u. their
+// matrices go in the texture matrices of their units, as the shaders read them there:
+
+void
+BindSunShadows(struct sunshadowuniforms* u)
+{
+	for (int i = 0; i < CASCADES; i++)
+	{
+		glActiveTexture(GL_TEXTURE0 + SUNSHADOWUNIT + i);
+		glBindTexture(GL_TEXTURE_2D, SunShadowTex[i]);
+		glMatrixMode(GL_TEXTURE);
+		glLoadMatrixf(SunShadowMatrices[i]);
+		glUniform1i(u->sunShadows[i], SUNSHADOWUNIT + i);
+	}
+	glMatrixMode(GL_MODELVIEW);
+	glActiveTexture(GL_TEXTURE0);
+
+	glUniform3fv(u->cascadeEnds, 1, CascadeEnds);
+	glUniform1f(u->sunTexel, 1.f / (float)SUNSHADOWSIZE);
+	glUniform1f(u->shadowDim, Day ? SUNSHADOWDIMDAY : SUNSHADOWDIMNIGHT);
+}
+
+
+// the torch field -- a TORCHFIELDSIZE x TORCHFIELDSIZE grid of torches stuck in the
+// ground around the house. they are only real lights with clustered lighting:
+
+#define TORCHFIELDSIZE		16
+
+const float TORCHFIELDSPACING = { 4.f };
+const float TORCHQUADATTEN = { 1.f };		// the wall torches never fall off, these do
+
+bool			TorchFieldOn;			// true means draw (and light) the torch field
+
+
+// where field torch (i,j) goes, false if that spot is inside the house:
+
+bool
+FieldTorch(int i, int j, float* x, float* z)
+{
+	*x = -31. + TORCHFIELDSPACING * (float)i;
+	*z = -35. + TORCHFIELDSPACING * (float)j;
+	return !(*x > -9. && *x < 7. && *z > -11. && *z < 3.);
+}
+
+
+// the voxel world:
+//
+// the world is a grid of CHUNKSIZE^3 chunks of block ids. a full block is
+// VOXELWIDTH on each side and is stored as two half-height voxels stacked on
+// top of each other, so that a slab is just a single voxel and the stepped
+// roof needs no special cases. each chunk is meshed once into a vbo and is
+// only meshed again after one of its blocks (or a block touching it) changes
+
+#define CHUNKSIZE		16			// voxels along each side of a chunk
+#define WORLDCHUNKSX	4			// # of chunks across the world
+#define WORLDCHUNKSY	2
+#define WORLDCHUNKSZ	4
+#define WORLDORIGINX	32			// voxel index of world voxel x = 0
+#define WORLDORIGINY	0
+#define WORLDORIGINZ	32
+
+const float VOXELWIDTH = { 2.f };	// x and z size of a voxel
+const float VOXELHEIGHT = { 1.f };	// y size of a voxel -- half a block
+
+enum BlockIds
+{
+	AIR,
+	STONEBRICK,
+	DARK_OAK_PLANKS,
+	DOOR,
+	WINDOW,
+	NUMBLOCKIDS
+};
+
+enum BlockTextures
+{
+	TEX_STONEBRICK,
+	TEX_DARK_OAK_PLANKS,
+	NUMBLOCKTEXTURES
+};
+
+// the block textures are all packed into the layers of one texture array,
+// so a whole chunk is drawn with a single bind and a single draw call:
+
+const char* BlockTextureFiles[NUMBLOCKTEXTURES] =
+{
+	"stonebrick.bmp",
+	"acacia.bmp"
+};
+
+struct blockinfo
+{
+	const char*	name;
+	int			texture;			// layer in BlockTextureArray, -1 means the block is not meshed
+	bool		opaque;				// true means it hides the faces of its neighbors
+};
+
+// doors and windows are drawn by their own display lists, they are only
+// in the world so that the walls know where the openings are:
+
+struct blockinfo BlockInfo[NUMBLOCKIDS] =
+{
+	{ "air",				-1,						false },
+	{ "stonebrick",			TEX_STONEBRICK,			true },
+	{ "dark_oak_planks",	TEX_DARK_OAK_PLANKS,	true },
+	{ "door",				-1,						false },
+	{ "window",				-1,						false },
+};
+
+struct chunk
+{
+	unsigned char	blocks[CHUNKSIZE * CHUNKSIZE * CHUNKSIZE];	// block ids, x fastest, then z, then y
+	int				cx, cy, cz;									// which chunk this is
+	bool			dirty;										// true means the blocks changed since the last meshing
+	GLuint			vbo;										// meshed points
+	GLuint			ibo;										// meshed triangle indices
+	int				numIndices;									// # of indices in the chunk's one draw call
+	float			xmin, ymin, zmin;							// bounding box of the meshed points
+	float			xmax, ymax, zmax;
+};
+
+struct chunk*	Chunks;					// WORLDCHUNKSX * WORLDCHUNKSY * WORLDCHUNKSZ chunks
+// a meshed point -- like struct point, but the third texture coordinate
+// is the layer of the texture array:
+
+struct voxelpoint
+{
+	float x, y, z;		// coordinates
+	float nx, ny, nz;	// surface normal
+	float s, t, p;		// texture coords and texture layer
+};
+
+struct voxelpoint*	MeshPts;			// scratch space for meshing one chunk
+GLuint*				MeshIndices;
+
+// the 6 faces of a voxel, as unit-cube corners in counter-clockwise order
+// with the texture coordinates the old BoxList used for that face:
+
+struct voxelface
+{
+	int		dx, dy, dz;					// direction to the neighbor this face looks at
+	int		corners[4][3];
+};
+
+struct voxelface VoxelFaces[6] =
+{
+	{  0,  0,  1,	{ { 0, 0, 1 }, { 1, 0, 1 }, { 1, 1, 1 }, { 0, 1, 1 } } },	// front
+	{  1,  0,  0,	{ { 1, 0, 1 }, { 1, 0, 0 }, { 1, 1, 0 }, { 1, 1, 1 } } },	// right
+	{  0,  0, -1,	{ { 1, 0, 0 }, { 0, 0, 0 }, { 0, 1, 0 }, { 1, 1, 0 } } },	// back
+	{ -1,  0,  0,	{ { 0, 0, 0 }, { 0, 0, 1 }, { 0, 1, 1 }, { 0, 1, 0 } } },	// left
+	{  0,  1,  0,	{ { 0, 1, 0 }, { 0, 1, 1 }, { 1, 1, 1 }, { 1, 1, 0 } } },	// top
+	{  0, -1,  0,	{ { 1, 0, 0 }, { 1, 0, 1 }, { 0, 0, 1 }, { 0, 0, 0 } } },	// bottom
+};
+
+
+inline
+struct chunk*
+ChunkPointer(int cx, int cy, int cz)
+{
+	return &Chunks[cx + WORLDCHUNKSX * (cz + WORLDCHUNKSZ * cy)];
+}
+
+
+inline
+void
+SetVoxelPointPointers(char* base)
+{
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(struct voxelpoint), base + offsetof(struct voxelpoint, x));
+	glNormalPointer(GL_FLOAT, sizeof(struct voxelpoint), base + offsetof(struct voxelpoint, nx));
+	glTexCoordPointer(3, GL_FLOAT, sizeof(struct voxelpoint), base + offsetof(struct voxelpoint, s));
+}
+
+
+// x, y, z are world voxel coordinates (voxel 0,0,0 is at the world origin):
+
+int
+GetBlock(int x, int y, int z)
+{
+	x += WORLDORIGINX;
+	y += WORLDORIGINY;
+	z += WORLDORIGINZ;
+	if (x < 0 || x >= CHUNKSIZE * WORLDCHUNKSX ||
+		y < 0 || y >= CHUNKSIZE * WORLDCHUNKSY ||
+		z < 0 || z >= CHUNKSIZE * WORLDCHUNKSZ)
+		return AIR;
+
+	struct chunk* c = ChunkPointer(x / CHUNKSIZE, y / CHUNKSIZE, z / CHUNKSIZE);
+	return c->blocks[(x % CHUNKSIZE) + CHUNKSIZE * ((z % CHUNKSIZE) + CHUNKSIZE * (y % CHUNKSIZE))];
+}
+
+void
+SetBlock(int x, int y, int z, int id)
+{
+	x += WORLDORIGINX;
+	y += WORLDORIGINY;
+	z += WORLDORIGINZ;
+	if (x < 0 || x >= CHUNKSIZE * WORLDCHUNKSX ||
+		y < 0 || y >= CHUNKSIZE * WORLDCHUNKSY ||
+		z < 0 || z >= CHUNKSIZE * WORLDCHUNKSZ)
+	{
+		fprintf(stderr, "SetBlock: voxel (%d,%d,%d) is outside the world\n",
+			x - WORLDORIGINX, y - WORLDORIGINY, z - WORLDORIGINZ);
+		return;
+	}
+
+	struct chunk* c = ChunkPointer(x / CHUNKSIZE, y / CHUNKSIZE, z / CHUNKSIZE);
+	unsigned char* b = &c->blocks[(x % CHUNKSIZE) + CHUNKSIZE * ((z % CHUNKSIZE) + CHUNKSIZE * (y % CHUNKSIZE))];
+	if (*b != id)
+	{
+		*b = (unsigned char)id;
+		c->dirty = true;
+
+		// a voxel on the edge of a chunk can hide or uncover a face in the next chunk over:
+
+		int lx = x % CHUNKSIZE;
+		int ly = y % CHUNKSIZE;
+		int lz = z % CHUNKSIZE;
+		if (lx == 0 && c->cx > 0)
+			ChunkPointer(c->cx - 1, c->cy, c->cz)->dirty = true;
+		if (lx == CHUNKSIZE - 1 && c->cx < WORLDCHUNKSX - 1)
+			ChunkPointer(c->cx + 1, c->cy, c->cz)->dirty = true;
+		if (ly == 0 && c->cy > 0)
+			ChunkPointer(c->cx, c->cy - 1, c->cz)->dirty = true;
+		if (ly == CHUNKSIZE - 1 && c->cy < WORLDCHUNKSY - 1)
+			ChunkPointer(c->cx, c->cy + 1, c->cz)->dirty = true;
+		if (lz == 0 && c->cz > 0)
+			ChunkPointer(c->cx, c->cy, c->cz - 1)->dirty = true;
+		if (lz == CHUNKSIZE - 1 && c->cz < WORLDCHUNKSZ - 1)
+			ChunkPointer(c->cx, c->cy, c->cz + 1)->dirty = true;
+	}
+}
+
+
+// a full block is two voxels tall, y is in voxels (half blocks):
+
+void
+SetFullBlock(int x, int y, int z, int id)
+{
+	SetBlock(x, y, z, id);
+	SetBlock(x, y + 1, z, id);
+}
+
+
+// allocate the chunks and the meshing scratch space:
+
+void
+InitWorld()
+{
+	Chunks = new struct chunk[WORLDCHUNKSX * WORLDCHUNKSY * WORLDCHUNKSZ];
+	for (int cy = 0; cy < WORLDCHUNKSY; cy++)
+	{
+		for (int cz = 0; cz < WORLDCHUNKSZ; cz++)
+		{
+			for (int cx = 0; cx < WORLDCHUNKSX; cx++)
+			{
+				struct chunk* c = ChunkPointer(cx, cy, cz);
+				memset(c->blocks, AIR, sizeof(c->blocks));
+				c->cx = cx;
+				c->cy = cy;
+				c->cz = cz;
+				c->dirty = true;
+				glGenBuffers(1, &c->vbo);
+				glGenBuffers(1, &c->ibo);
+				c->numIndices = 0;
+			}
+		}
+	}
+
+	// worst case is every voxel in the chunk showing all 6 faces with nothing to merge:
+
+	const int maxFaces = 6 * CHUNKSIZE * CHUNKSIZE * CHUNKSIZE;
+	MeshPts = new struct voxelpoint[4 * maxFaces];
+	MeshIndices = new GLuint[6 * maxFaces];
+}
+
+
+// the house, in voxels -- stone brick first floor, dark oak second floor and gables,
+// and a stone brick slab roof that steps up half a block per row:
+
+void
+BuildHouse()
+{
+	for (int y = 0; y < 6; y += 2)
+	{
+		int id = (y == 0) ? STONEBRICK : DARK_OAK_PLANKS;
+		for (int x = -4; x <= 2; x++)
+		{
+			SetFullBlock(x, y, 0, id);
+			SetFullBlock(x, y, -5, id);
+		}
+		for (int z = -4; z <= -1; z++)
+		{
+			SetFullBlock(-4, y, z, id);
+			SetFullBlock(2, y, z, id);
+		}
+	}
+
+	SetFullBlock(-1, 0, 0, DOOR);
+	SetFullBlock(-1, 2, 0, DOOR);
+	SetFullBlock(-3, 2, 0, WINDOW);
+	SetFullBlock(1, 2, 0, WINDOW);
+
+	for (int z = 0; z >= -5; z -= 5)
+	{
+		SetBlock(2, 6, z, DARK_OAK_PLANKS);
+		for (int x = -3; x <= 1; x++)
+			SetFullBlock(x, 6, z, DARK_OAK_PLANKS);
+		SetBlock(-4, 6, z, DARK_OAK_PLANKS);
+
+		SetBlock(0, 8, z, DARK_OAK_PLANKS);
+		SetFullBlock(-1, 8, z, DARK_OAK_PLANKS);
+		SetBlock(-2, 8, z, DARK_OAK_PLANKS);
+	}
+
+	for (int z = -6; z <= 1; z++)
+	{
+		for (int step = 0; step <= 8; step++)
+		{
+			int rise = (step <= 4) ? step : 8 - step;
+			SetBlock(3 - step, 6 + rise, z, STONEBRICK);
+		}
+	}
+}
+
+
+// turn the blocks of one chunk into triangles.
+// a face is only kept if the voxel it looks at is not opaque (this also
+// checks the neighboring chunks, through GetBlock). the faces that are left
+// are merged greedily, one slice of the chunk at a time: each visible face
+// is grown as far as it can go along u, then that whole row is grown as far
+// as it can go along v, and the rectangle becomes a single quad. only faces
+// with the same texture layer are merged. the
+// texture coordinates are in world space, so a merged quad repeats the
+// texture once per block just like the separate faces would have
+
+void
+MeshChunk(struct chunk* c)
+{
+	int mask[CHUNKSIZE * CHUNKSIZE];		// texture layer + 1 of the faces that still need to be drawn, 0 means none
+	int numPts = 0;
+	int numIndices = 0;
+
+	for (int f = 0; f < 6; f++)
+	{
+		struct voxelface* vf = &VoxelFaces[f];
+
+		// a is the axis the face looks along, u and v are the two axes in its plane:
+
+		int a = (vf->dx != 0) ? 0 : ((vf->dy != 0) ? 1 : 2);
+		int u = (a + 1) % 3;
+		int v = (a + 2) % 3;
+
+		for (int slice = 0; slice < CHUNKSIZE; slice++)
+		{
+			int l[3];							// voxel coordinates within the chunk
+			l[a] = slice;
+			for (int j = 0; j < CHUNKSIZE; j++)
+			{
+				for (int i = 0; i < CHUNKSIZE; i++)
+				{
+					l[u] = i;
+					l[v] = j;
+					int layer = BlockInfo[c->blocks[l[0] + CHUNKSIZE * (l[2] + CHUNKSIZE * l[1])]].texture;
+					if (layer >= 0)
+					{
+						int x = c->cx * CHUNKSIZE + l[0] - WORLDORIGINX;
+						int y = c->cy * CHUNKSIZE + l[1] - WORLDORIGINY;
+						int z = c->cz * CHUNKSIZE + l[2] - WORLDORIGINZ;
+						if (BlockInfo[GetBlock(x + vf->dx, y + vf->dy, z + vf->dz)].opaque)
+							layer = -1;
+					}
+					mask[i + CHUNKSIZE * j] = layer + 1;
+				}
+			}
+
+			for (int j = 0; j < CHUNKSIZE; j++)
+			{
+				for (int i = 0; i < CHUNKSIZE; )
+				{
+					int m = mask[i + CHUNKSIZE * j];
+					if (m == 0)
+					{
+						i++;
+						continue;
+					}
+
+					int w = 1;
+					while (i + w < CHUNKSIZE && mask[i + w + CHUNKSIZE * j] == m)
+						w++;
+
+					int h = 1;
+					for (; j + h < CHUNKSIZE; h++)
+					{
+						bool full = true;
+						for (int k = 0; k < w; k++)
+						{
+							if (mask[i + k + CHUNKSIZE * (j + h)] != m)
+							{
+								full = false;
+								break;
+							}
+						}
+						if (!full)
+							break;
+					}
+
+					for (int jj = 0; jj < h; jj++)
+					{
+						for (int ii = 0; ii < w; ii++)
+							mask[i + ii + CHUNKSIZE * (j + jj)] = 0;
+					}
+
+					// stretch the unit face's corners over the w x h rectangle:
+
+					for (int k = 0; k < 4; k++)
+					{
+						int corner[3];
+						corner[a] = slice + vf->corners[k][a];
+						corner[u] = i + w * vf->corners[k][u];
+						corner[v] = j + h * vf->corners[k][v];
+
+						struct voxelpoint* p = &MeshPts[numPts + k];
+						p->x = VOXELWIDTH * (float)(c->cx * CHUNKSIZE + corner[0] - WORLDORIGINX);
+						p->y = VOXELHEIGHT * (float)(c->cy * CHUNKSIZE + corner[1] - WORLDORIGINY);
+						p->z = VOXELWIDTH * (float)(c->cz * CHUNKSIZE + corner[2] - WORLDORIGINZ);
+						p->nx = (float)vf->dx;
+						p->ny = (float)vf->dy;
+						p->nz = (float)vf->dz;
+
+						// one copy of the texture per full block, in world coordinates
+						// so neighboring faces line up:
+
+						if (vf->dy != 0)
+						{
+							p->s = p->z / VOXELWIDTH;
+							p->t = vf->dy * p->x / VOXELWIDTH;
+						}
+						else
+						{
+							p->s = (vf->dx * -p->z + vf->dz * p->x) / VOXELWIDTH;
+							p->t = p->y / (2.f * VOXELHEIGHT);
+						}
+						p->p = (float)(m - 1);
+					}
+					MeshIndices[numIndices++] = numPts;
+					MeshIndices[numIndices++] = numPts + 1;
+					MeshIndices[numIndices++] = numPts + 2;
+					MeshIndices[numIndices++] = numPts;
+					MeshIndices[numIndices++] = numPts + 2;
+					MeshIndices[numIndices++] = numPts + 3;
+					numPts += 4;
+
+					i += w;
+				}
+			}
+		}
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, c->vbo);
+	glBufferData(GL_ARRAY_BUFFER, numPts * sizeof(struct voxelpoint), MeshPts, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, c->ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices * sizeof(GLuint), MeshIndices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	c->xmin = c->ymin = c->zmin =  1.e+30f;
+	c->xmax = c->ymax = c->zmax = -1.e+30f;
+	for (int i = 0; i < numPts; i++)
+	{
+		struct voxelpoint* p = &MeshPts[i];
+		if (p->x < c->xmin)	c->xmin = p->x;
+		if (p->y < c->ymin)	c->ymin = p->y;
+		if (p->z < c->zmin)	c->zmin = p->z;
+		if (p->x > c->xmax)	c->xmax = p->x;
+		if (p->y > c->ymax)	c->ymax = p->y;
+		if (p->z > c->zmax)	c->zmax = p->z;
+	}
+
+	c->numIndices = numIndices;
+	c->dirty = false;
+	if (DebugOn != 0)
+		fprintf(stderr, "Meshed chunk (%d,%d,%d): %d triangles\n", c->cx, c->cy, c->cz, numIndices / 3);
+}
+
+
+// draw every chunk that is in the view, re-meshing the ones whose blocks have changed.
+// uModulate is GL_MODULATE at night and GL_REPLACE during the day:
+
+void
+DrawWorld()
+{
+	BlockShader->Use();
+	glUniform1i(BlockLight0OnLoc, (Light0On && !ClusteredOn) ? 1 : 0);
+	glUniform1i(BlockLight1OnLoc, (Light1On && !ClusteredOn) ? 1 : 0);
+	glUniform1i(BlockModulateLoc, Day ? 0 : 1);
+	glUniform1i(BlockClusteredLoc, ClusteredOn ? 1 : 0);
+	glUniform1i(BlockTexturesLoc, 0);
+	BindClusters(&BlockClusterUniforms);		// even when it is off, so its samplers are not on unit 0 with the texture array
+	BindShadows(&BlockShadowUniforms);			// the same goes for the shadow maps
+	BindSunShadows(&BlockSunUniforms);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, BlockTextureArray);
+	DrawChunks();
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	BlockShader->Use(0);
+}
+
+
+// the chunk loop of DrawWorld( ), which the shadow passes use too:
+
+void
+DrawChunks()
+{
+	for (int i = 0; i < WORLDCHUNKSX * WORLDCHUNKSY * WORLDCHUNKSZ; i++)
+	{
+		struct chunk* c = &Chunks[i];
+		if (c->dirty)
+			MeshChunk(c);
+		if (c->numIndices == 0)
+			continue;
+		if (!BoxVisible(c->xmin, c->ymin, c->zmin, c->xmax, c->ymax, c->zmax))
+			continue;
+
+		glBindBuffer(GL_ARRAY_BUFFER, c->vbo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, c->ibo);
+		SetVoxelPointPointers(NULL);
+		glDrawElements(GL_TRIANGLES, c->numIndices, GL_UNSIGNED_INT, (void*)0);
+		UnsetPointPointers();
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+// the mobs: position, velocity, heading, and animation phase for any number of them, in
+// structure-of-arrays form so the update walks straight through memory one field at a
+// time. the update has no branches and no calls, only selects, so the compiler can
+// vectorize it, and it runs in chunks of MOBCHUNK on a pool of threads that is started
+// once, since starting threads every frame would cost more than updating a few thousand pigs
+
+#define MOBCHUNK			1024		// mobs per chunk the threads take, a multiple of any simd width
+
+const float MOBSTEERRATE = { 0.5f };		// how many times a second each mob picks a new way to turn
+const float MOBSTILLRATE = { 0.1f };		// phase per second of standing still (the old 10 second animation cycle)
+const float MOBWALKRATE = { 0.35f };		// phase per second of walking
+
+// where the mobs can go: the pen they stay in, and the house they walk around:
+
+const float PENX0 = { -42.f },  PENX1 = { 54.f },  PENZ0 = { -43.f },  PENZ1 = { 53.f };
+const float HOUSEX0 = { -10.f }, HOUSEX1 = { 8.5f }, HOUSEZ0 = { -12.f }, HOUSEZ1 = { 4.f };
+
+struct mobs
+{
+	int		count, capacity;
+	float*	x;					// the center of it on the ground
+	float*	z;
+	float*	vx;					// units per second
+	float*	vz;
+	float*	heading;			// degrees about y, 0. faces -x the way the pig by the house does
+	float*	phase;				// [0.,1.)
+	float*	turnRate;			// the most it turns, radians per second, 0. means it never turns
+	float*	seed;				// staggers when each one picks a new way to turn
+	float*	prevX;				// x, z, and heading at the step before the last one, for drawing in between
+	float*	prevZ;
+	float*	prevHeading;
+};
+
+struct mobs				Pigs;
+
+std::thread*			MobThreads;
+int						NumMobThreads;				// the main thread counts as one
+std::mutex				MobMutex;
+std::condition_variable	MobWake, MobDone;
+int						MobGeneration;				// bumped for every parallel update
+int						MobWorking;					// workers that have not finished this generation
+int						MobActive;					// threads that take chunks this generation
+bool					MobQuit;					// true means the workers return instead of working
+struct mobs*			MobJob;
+float					MobDt, MobTime;
+std::atomic<int>		MobNextChunk;
+
+
+void
+InitMobs(struct mobs* m, int capacity)
+{
+	m->count = 0;
+	m->capacity = capacity;
+	m->x = new float[capacity];
+	m->z = new float[capacity];
+	m->vx = new float[capacity];
+	m->vz = new float[capacity];
+	m->heading = new float[capacity];
+	m->phase = new float[capacity];
+	m->turnRate = new float[capacity];
+	m->seed = new float[capacity];
+	m->prevX = new float[capacity];
+	m->prevZ = new float[capacity];
+	m->prevHeading = new float[capacity];
+}
+
+
+// a pseudo-random number in [0.,1.) from 2 integers, the same every run
+// (rand( ) is neither repeatable across threads nor safe to call from them):
+
+inline
+float
+MobHash(unsigned int a, unsigned int b)
+{
+	unsigned int h = a * 2654435761u ^ b * 40503u;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	return (float)(int)(h & 0xffffff) / (float)0x1000000;
+}
+
+
+// returns its index, or -1 if there is no room:
+
+int
+AddMob(struct mobs* m, float x, float z, float heading, float speed, float turnRate)
+{
+	if (m->count >= m->capacity)
+		return -1;
+
+	int i = m->count++;
+	float h = heading * (float)M_PI / 180.f;
+	m->x[i] = x;
+	m->z[i] = z;
+	m->vx[i] = -speed * cosf(h);
+	m->vz[i] = speed * sinf(h);
+	m->heading[i] = heading;
+	m->phase[i] = MobHash(i, 1);
+	m->turnRate[i] = turnRate;
+	m->seed[i] = MobHash(i, 2);
+	m->prevX[i] = x;
+	m->prevZ[i] = z;
+	m->prevHeading[i] = heading;
+	return i;
+}
+
+
+// remember where the mobs are, before the last step of a frame moves them:
+
+void
+SaveMobs(struct mobs* m)
+{
+	memcpy(m->prevX, m->x, m->count * sizeof(float));
+	memcpy(m->prevZ, m->z, m->count * sizeof(float));
+	memcpy(m->prevHeading, m->heading, m->count * sizeof(float));
+}
+
+
+// move mobs first to last-1 along by dt seconds. each one turns at a rate it picks
+// again every 1/MOBSTEERRATE seconds, and turns back at the pen's edges and the house's walls.
+// the velocity turns by the same angle as the heading, with sin and cos from their
+// series since the angles are small, and the wrap-arounds truncate to int instead of
+// calling floorf( ), so the loop has no calls or branches in it. the |s and &s are on
+// purpose, || and && would be branches. the arrays come in as __restrict arguments since
+// gcc only believes __restrict there, and without it every store could change every array.
+// gcc vectorizes it with -O3 -fno-trapping-math -- with trapping math it pushes the
+// floating-point math into the two sides of each ?: and then cannot make it a select:
+
+void
+MoveMobs(int first, int last, float dt, float time,
+	float* __restrict x, float* __restrict z, float* __restrict vx, float* __restrict vz,
+	float* __restrict heading, float* __restrict phase, const float* __restrict turnRate, const float* __restrict seed)
+{
+	for (int i = first; i < last; i++)
+	{
+		unsigned int tick = (unsigned int)(int)(time * MOBSTEERRATE + seed[i]);
+		float turn = turnRate[i] * (2.f * MobHash(tick, i) - 1.f);
+
+		float a = turn * dt;
+		float a2 = a * a;
+		float c = 1.f - a2 * (1.f / 2.f);
+		float s = a - a * a2 * (1.f / 6.f);
+		float vx1 = c * vx[i] + s * vz[i];		// heading goes the same way glRotatef( ) about y does
+		float vz1 = -s * vx[i] + c * vz[i];
+		float h1 = heading[i] + a * (180.f / (float)M_PI);
+
+		float nx = x[i] + vx1 * dt;
+		float nz = z[i] + vz1 * dt;
+		bool outX = (nx < PENX0) | (nx > PENX1);
+		bool outZ = (nz < PENZ0) | (nz > PENZ1);
+		bool inHouse = (nx > HOUSEX0) & (nx < HOUSEX1) & (nz > HOUSEZ0) & (nz < HOUSEZ1);
+		bool wasInX = (x[i] > HOUSEX0) & (x[i] < HOUSEX1);		// then it came in through a z wall
+		bool flipX = outX | (inHouse & !wasInX);
+		bool flipZ = outZ | (inHouse & wasInX);
+
+		// a flip turns that part of the velocity around and stays put on that axis this step.
+		// the flips are +-1. multipliers, picking between 2 results would be a branch:
+
+		float sx = flipX ? -1.f : 1.f;
+		float sz = flipZ ? -1.f : 1.f;
+		vx[i] = sx * vx1;
+		vz[i] = sz * vz1;
+		x[i] += 0.5f * (1.f + sx) * vx1 * dt;
+		z[i] += 0.5f * (1.f + sz) * vz1 * dt;
+		h1 = sz * (sx * h1 + 90.f * (1.f - sx));			// 180.-h1 for a flip in x, -h1 for a flip in z
+		h1 = h1 - 360.f * (float)(int)(h1 * (1.f / 360.f)) + 360.f;		// (-360.,360.) + 360.
+		heading[i] = h1 - 360.f * (float)(int)(h1 * (1.f / 360.f));
+
+		float rate = (vx1 * vx1 + vz1 * vz1 > 0.f) ? MOBWALKRATE : MOBSTILLRATE;
+		float p = phase[i] + dt * rate;
+		phase[i] = p - (float)(int)p;
+	}
+}
+
+
+void
+UpdateMobRange(struct mobs* m, int first, int last, float dt, float time)
+{
+	MoveMobs(first, last, dt, time, m->x, m->z, m->vx, m->vz, m->heading, m->phase, m->turnRate, m->seed);
+}
+
+
+// the chunks of the current generation, taken until there are none left:
+
+void
+UpdateMobChunks()
+{
+	int numChunks = (MobJob->count + MOBCHUNK - 1) / MOBCHUNK;
+	for (int c = MobNextChunk++; c < numChunks; c = MobNextChunk++)
+	{
+		int last = (c + 1) * MOBCHUNK;
+		if (last > MobJob->count)
+			last = MobJob->count;
+		UpdateMobRange(MobJob, c * MOBCHUNK, last, MobDt, MobTime);
+	}
+}
+
+
+// one thread of the pool -- sleep until UpdateMobs( ) has a new generation, help with it, repeat:
+
+void
+MobWorker(int id)
+{
+	int generation = 0;
+	for ( ; ; )
+	{
+		{
+			std::unique_lock<std::mutex> lock(MobMutex);
+			while (MobGeneration == generation)
+				MobWake.wait(lock);
+			generation = MobGeneration;
+			if (MobQuit)
+				return;
+		}
+
+		if (id < MobActive)
+			UpdateMobChunks();
+
+		std::unique_lock<std::mutex> lock(MobMutex);
+		if (--MobWorking == 0)
+			MobDone.notify_one();
+	}
+}
+
+
+// exit( ) calls this before it destroys the mutex and the condition variables,
+// which cannot be destroyed while the workers are still waiting on them:
+
+void
+StopMobThreads()
+{
+	{
+		std::unique_lock<std::mutex> lock(MobMutex);
+		MobQuit = true;
+		MobGeneration++;
+	}
+	MobWake.notify_all();
+	for (int i = 1; i < NumMobThreads; i++)
+		MobThreads[i].join();
+}
+
+
+void
+InitMobThreads()
+{
+	NumMobThreads = (int)std::thread::hardware_concurrency();
+	if (NumMobThreads < 1)
+		NumMobThreads = 1;
+
+	MobThreads = new std::thread[NumMobThreads];		// [0] is the main thread and is never started
+	for (int i = 1; i < NumMobThreads; i++)
+		MobThreads[i] = std::thread(MobWorker, i);
+	atexit(StopMobThreads);
+}
+
+
+// update every mob on numThreads threads, this one included.
+// fewer than 2 chunks are not worth waking anyone up for:
+
+void
+UpdateMobs(struct mobs* m, float dt, float time, int numThreads)
+{
+	if (numThreads > NumMobThreads)
+		numThreads = NumMobThreads;
+	if (numThreads <= 1 || m->count <= MOBCHUNK)
+	{
+		UpdateMobRange(m, 0, m->count, dt, time);
+		return;
+	}
+
+	MobJob = m;
+	MobDt = dt;
+	MobTime = time;
+	MobNextChunk = 0;
+	{
+		std::unique_lock<std::mutex> lock(MobMutex);
+		MobActive = numThreads;
+		MobWorking = NumMobThreads - 1;
+		MobGeneration++;
+	}
+	MobWake.notify_all();
+
+	UpdateMobChunks();
+
+	std::unique_lock<std::mutex> lock(MobMutex);
+	while (MobWorking > 0)
+		MobDone.wait(lock);
+}
+
+
+// FinalProject -mobbench [file.json]: time UpdateMobs( ) for 1 to 100,000 pigs on 1 thread
+// up to all of them, and write the time per pig and the speed-up over 1 thread as json
+// (to stdout without a file). this needs no window, so it runs before any graphics start:
+
+void
+BenchMobs(const char* json)
+{
+	const int counts[] = { 1, 10, 100, 1000, 10000, 100000 };
+	const int numCounts = sizeof(counts) / sizeof(counts[0]);
+	const float dt = 1.f / 60.f;
+
+	int threads[32];
+	int numThreadCounts = 0;
+	for (int t = 1; t < NumMobThreads && numThreadCounts < 31; t *= 2)
+		threads[numThreadCounts++] = t;
+	threads[numThreadCounts++] = NumMobThreads;
+
+	FILE* fp = stdout;
+	if (json != NULL)
+	{
+		fp = fopen(json, "w");
+		if (fp == NULL)
+		{
+			fprintf(stderr, "Cannot create benchmark file '%s'\n", json);
+			exit(1);
+		}
+	}
+	fprintf(fp, "{\n");
+	fprintf(fp, "\t\"cores\": %d,\n", NumMobThreads);
+	fprintf(fp, "\t\"chunk\": %d,\n", MOBCHUNK);
+	fprintf(fp, "\t\"runs\": [\n");
+
+	struct mobs bench;
+	InitMobs(&bench, counts[numCounts - 1]);
+	for (int c = 0; c < numCounts; c++)
+	{
+		// the same number of pig updates for every count, so each one takes about as long:
+
+		int steps = 4000000 / counts[c];
+		if (steps > 100000)
+			steps = 100000;
+
+		double oneThreadNs = 0.;
+		for (int t = 0; t < numThreadCounts; t++)
+		{
+			bench.count = 0;
+			for (int i = 0; i < counts[c]; i++)
+				AddMob(&bench, PENX0 + (PENX1 - PENX0) * MobHash(i, 3), PENZ0 + (PENZ1 - PENZ0) * MobHash(i, 4),
+					360.f * MobHash(i, 5), 1.f, 1.f);
+
+			UpdateMobs(&bench, dt, 0., threads[t]);			// wake the threads and the caches up first
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (int s = 0; s < steps; s++)
+				UpdateMobs(&bench, dt, (float)s * dt, threads[t]);
+			double ns = 1.e+6 * MillisecondsSince(start) / ((double)steps * (double)counts[c]);
+			if (t == 0)
+				oneThreadNs = ns;
+
+			fprintf(stderr, "%6d pigs, %2d threads: %8.3f ns per pig, %5.2fx\n", counts[c], threads[t], ns, oneThreadNs / ns);
+			fprintf(fp, "\t\t{ \"pigs\": %d, \"threads\": %d, \"steps\": %d, \"ns_per_pig\": %.4f, \"speedup\": %.3f }%s\n",
+				counts[c], threads[t], steps, ns, oneThreadNs / ns,
+				(c == numCounts - 1 && t == numThreadCounts - 1) ? "" : ",");
+		}
+	}
+	fprintf(fp, "\t]\n");
+	fprintf(fp, "}\n");
+	if (fp != stdout)
+		fclose(fp);
+}
+
+
+// the pigs: the one by the house, which stays put, and a field of them that wander around it
+
+#define PIGFIELDSIZE		32			// the field is PIGFIELDSIZE x PIGFIELDSIZE pigs
+#define MAXPIGS				( PIGFIELDSIZE * PIGFIELDSIZE + 1 )
+
+const float PIGFIELDSPACING = { 3.f };
+const float PIGSPEED = { 1.f };				// units per second
+const float PIGTURNRATE = { 1.f };			// radians per second
+const float PIGPIVOTX = { 0.5f };			// where the pig turns about, before DrawPig( ) puts it at its mob's x and z
+const float PIGPIVOTZ = { 5.375f };
+
+bool		PigFieldOn;						// true means the field of pigs is there as well as the one by the house
+
+
+// where field pig (i,j) starts, as an offset from the pig by the house.
+// false means that spot is in the house or on top of that pig:
+
+bool
+FieldPig(int i, int j, float* dx, float* dz)
+{
+	*dx = PIGFIELDSPACING * ((float)i - (float)PIGFIELDSIZE / 2.f);
+	*dz = PIGFIELDSPACING * ((float)j - (float)PIGFIELDSIZE / 2.f) + 1.5f;
+	float x = 7.5f + *dx, z = 5.4f + *dz;
+	if (x > HOUSEX0 && x < HOUSEX1 && z > HOUSEZ0 && z < HOUSEZ1)
+		return false;
+	return fabsf(*dx) > 2.f || fabsf(*dz) > 2.f;
+}
+
+
+// start the pigs over, with or without the field:
+
+void
+SpawnPigs()
+{
+	Pigs.count = 0;
+	AddMob(&Pigs, 7. + PIGPIVOTX, PIGPIVOTZ, 0., 0., 0.);
+	for (int i = 0; PigFieldOn && i < PIGFIELDSIZE; i++)
+	{
+		for (int j = 0; j < PIGFIELDSIZE; j++)
+		{
+			float dx, dz;
+			if (FieldPig(i, j, &dx, &dz))
+				AddMob(&Pigs, 7. + PIGPIVOTX + dx, PIGPIVOTZ + dz, 360.f * MobHash(i, j), PIGSPEED, PIGTURNRATE);
+		}
+	}
+}
+
+
+// how far pig i's face is tipped, from its animation phase:
+
+inline
+float
+PigTip(int i)
+{
+	return 0.5f + 0.5f * sinf(2.f * (float)M_PI * Pigs.phase[i]);
+}
+
+
+// where pig i is drawn, StepAlpha of the way from its step before last to its last step.
+// the heading goes the short way around, so one going from 359. to 1. does not spin backwards:
+
+void
+PigPlace(int i, float* x, float* z, float* heading)
+{
+	*x = Pigs.prevX[i] + StepAlpha * (Pigs.x[i] - Pigs.prevX[i]);
+	*z = Pigs.prevZ[i] + StepAlpha * (Pigs.z[i] - Pigs.prevZ[i]);
+	float dh = Pigs.heading[i] - Pigs.prevHeading[i];
+	dh -= 360.f * floorf(dh / 360.f + 0.5f);
+	*heading = Pigs.prevHeading[i] + StepAlpha * dh;
+}
+
+
+// pig i, turned to its heading, with its face tipped by its animation phase.
+// the box is a little bigger than the pig turned any way, since its face tips a few degrees as it moves:
+
+void
+DrawPig(int i)
+{
+	float x, z, heading;
+	PigPlace(i, &x, &z, &heading);
+	if (BoxVisible(x - 1.65, -0.3, z - 1.65, x + 1.65, 1.5, z + 1.65)) {
+		glPushMatrix();
+
+
+		glTranslatef(x, 0., z);
+		glRotatef(heading, 0., 1., 0.);
+		glTranslatef(-PIGPIVOTX, 0., -PIGPIVOTZ);
+		glBindTexture(GL_TEXTURE_2D, pigbody);
+		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+
+		glPushMatrix();
+		glTranslatef(0., 0.25, 5.);
+		glCallList(PigList);
+		glPopMatrix();
+
+		glPushMatrix();
+		glTranslatef(0.1, 0., 5.);
+		glCallList(PigLegList);
+		glTranslatef(0., 0., 0.5);
+		glCallList(PigLegList);
+		glTranslatef(0.75, 0., 0.);
+		glCallList(PigLegList);
+		glTranslatef(0., 0., -0.5);
+		glCallList(PigLegList);
+		glPopMatrix();
+
+
+		glRotatef(PigTip(i) * 2, 1., 0., 0.);
+		glRotatef(PigTip(i) * 4, 0., 0., 1.);
+
+
+		glBindTexture(GL_TEXTURE_2D, pigface);
+		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+
+		glPushMatrix();
+		glTranslatef(-0.75, 0.25, 4.875);
+		glCallList(PigFaceList);
+		glPopMatrix();
+
+		glBindTexture(GL_TEXTURE_2D, pignose);
+		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+
+		glPushMatrix();
+		glTranslatef(-0.90, 0.25, 5.125);
+		glScalef(0.5, 0.35, 0.525);
+		glCallList(PigFaceList);
+		glPopMatrix();
+
+		glPopMatrix();
+	}
+}
+
+
+// instanced pigs: every pig is 6 boxes on 2 meshes, the body and its 4 legs on the unit
+// box with the body's texture coordinates, and the face and the nose on the unit box with
+// the face's. each box is one instance -- its transformation and its layer of
+// PigTextureArray -- so all of the pigs in the view, however many there are, take one
+// glDrawElementsInstancedARB( ) per mesh. the instances are rebuilt every time the pigs are
+// drawn, since the faces tip every frame and each pass culls to its own frustum
+
+#define PIGBODYBOXES		5			// body + 4 legs
+#define PIGFACEBOXES		2			// face + nose
+
+// the unit box's corners, and the corners of each of its 6 quads:
+
+const float PigCorners[8][3] =
+{
+	{ 0., 0., 1. }, { 1., 0., 1. }, { 1., 1., 1. }, { 0., 1., 1. },
+	{ 0., 0., 0. }, { 1., 0., 0. }, { 1., 1., 0. }, { 0., 1., 0. },
+};
+const int PigQuads[6][4] =
+{
+	{ 0, 1, 2, 3 }, { 2, 1, 5, 6 }, { 7, 6, 5, 4 }, { 3, 7, 4, 0 }, { 3, 2, 6, 7 }, { 4, 5, 1, 0 },
+};
+const float PigNormals[6][3] =
+{
+	{ 0., 0., 1. }, { 1., 0., 0. }, { 0., 0., -1. }, { -1., 0., 0. }, { 0., 1., 0. }, { 0., -1., 0. },
+};
+
+// the same texture coordinates PigList/PigLegList and PigFaceList use:
+
+const float PigBodySTs[6][4][2] =
+{
+	{ { 0., 1. }, { 0., 0. }, { 1., 0. }, { 1., 1. } },
+	{ { 1., 1. }, { 0., 1. }, { 0., 0. }, { 1., 0. } },
+	{ { 1., 0. }, { 1., 1. }, { 0., 1. }, { 0., 0. } },
+	{ { 1., 0. }, { 1., 1. }, { 0., 1. }, { 0., 0. } },
+	{ { 1., 0. }, { 1., 1. }, { 0., 1. }, { 0., 0. } },
+	{ { 1., 0. }, { 1., 1. }, { 0., 1. }, { 0., 0. } },
+};
+const float PigFaceSTs[6][4][2] =
+{
+	{ { 0., .3 }, { 0., 0. }, { .3, 0. }, { .3, .3 } },
+	{ { .5, .5 }, { 0., .5 }, { 0., 0. }, { .5, 0. } },
+	{ { .5, 0. }, { .5, .5 }, { 0., .5 }, { 0., 0. } },
+	{ { 1., 1. }, { 0., 1. }, { 0., 0. }, { 1., 0. } },
+	{ { .5, 0. }, { .5, .5 }, { 0., .5 }, { 0., 0. } },
+	{ { .5, 0. }, { .5, .5 }, { 0., .5 }, { 0., 0. } },
+};
+
+// one box of one pig:
+
+struct piginstance
+{
+	float	row0[4], row1[4], row2[4];		// the top 3 rows of its transformation, the 4th is always 0 0 0 1
+	float	layer;							// 0. is pigbody, 1. is pigface, 2. is pignose
+};
+
+bool				HasInstancing;						// false means draw the pigs one at a time with the display lists
+GLuint				PigTextureArray;					// pigbody, pigface, and pignose as 3 layers
+GLuint				PigMeshVbo, PigMeshIbo;				// the body box, then the face box, 24 points each
+GLuint				PigInstanceVbo;
+GLSLProgram*		PigShader;
+GLint				PigRowAttribs[3], PigLayerAttrib;
+GLint				PigTexUnitLoc, PigDistanceLoc, PigShadowsOnLoc;		// uniform locations, found once after linking
+struct sunshadowuniforms	PigSunUniforms;
+struct piginstance	PigBodyInstances[MAXPIGS * PIGBODYBOXES];
+struct piginstance	PigFaceInstances[MAXPIGS * PIGFACEBOXES];
+int					NumPigsDrawn;						// how many pigs the last DrawPigs( ) drew
+
+
+// the same as glTranslatef( ), glRotatef( ) about x, y, or z, and glScalef( ), but on a matrix of our own:
+
+void
+TranslateMatrix(float m[16], float x, float y, float z)
+{
+	for (int r = 0; r < 4; r++)
+		m[12 + r] += m[r] * x + m[4 + r] * y + m[8 + r] * z;
+}
+
+void
+RotateMatrix(float m[16], float degrees, int axis)
+{
+	float c = cosf(degrees * (float)M_PI / 180.f);
+	float s = sinf(degrees * (float)M_PI / 180.f);
+	int a = (axis == 0) ? 4 : (axis == 1) ? 8 : 0;		// x rotates columns 1 and 2, y 2 and 0, z 0 and 1
+	int b = (axis == 0) ? 8 : (axis == 1) ? 0 : 4;
+	for (int r = 0; r < 4; r++)
+	{
+		float ca = m[a + r], cb = m[b + r];
+		m[a + r] = c * ca + s * cb;
+		m[b + r] = -s * ca + c * cb;
+	}
+}
+
+void
+ScaleMatrix(float m[16], float x, float y, float z)
+{
+	for (int r = 0; r < 4; r++)
+	{
+		m[r] *= x;
+		m[4 + r] *= y;
+		m[8 + r] *= z;
+	}
+}
+
+
+void
+SetPigInstance(struct piginstance* p, float m[16], float layer)
+{
+	for (int c = 0; c < 4; c++)
+	{
+		p->row0[c] = m[4 * c + 0];
+		p->row1[c] = m[4 * c + 1];
+		p->row2[c] = m[4 * c + 2];
+	}
+	p->layer = layer;
+}
+
+
+void
+InitPigs()
+{
+	InitMobs(&Pigs, MAXPIGS);
+	SpawnPigs();
+
+	char* extensions = (char*)glGetString(GL_EXTENSIONS);
+	HasInstancing = strstr(extensions, "GL_ARB_draw_instanced") != NULL &&
+		strstr(extensions, "GL_ARB_instanced_arrays") != NULL &&
+		strstr(extensions, "GL_EXT_texture_array") != NULL;
+	if (!HasInstancing)
+	{
+		fprintf(stderr, "No GL_ARB_draw_instanced or GL_ARB_instanced_arrays -- the pigs will be drawn one at a time\n");
+		return;
+	}
+
+	// the 2 boxes, 4 points per quad so each quad gets its own texture coordinates:
+
+	struct point points[2 * 24];
+	GLuint indices[36];
+	for (int m = 0; m < 2; m++)
+	{
+		for (int q = 0; q < 6; q++)
+		{
+			for (int k = 0; k < 4; k++)
+			{
+				struct point* p = &points[24 * m + 4 * q + k];
+				const float* corner = PigCorners[PigQuads[q][k]];
+				const float* st = (m == 0) ? PigBodySTs[q][k] : PigFaceSTs[q][k];
+				p->x = corner[0];
+				p->y = corner[1];
+				p->z = corner[2];
+				p->nx = PigNormals[q][0];
+				p->ny = PigNormals[q][1];
+				p->nz = PigNormals[q][2];
+				p->s = st[0];
+				p->t = st[1];
+			}
+			if (m == 0)
+			{
+				GLuint i[6] = { 0, 1, 2, 0, 2, 3 };
+				for (int k = 0; k < 6; k++)
+					indices[6 * q + k] = 4 * q + i[k];
+			}
+		}
+	}
+	glGenBuffers(1, &PigMeshVbo);
+	glBindBuffer(GL_ARRAY_BUFFER, PigMeshVbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(points), points, GL_STATIC_DRAW);
+	glGenBuffers(1, &PigMeshIbo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, PigMeshIbo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+	glGenBuffers(1, &PigInstanceVbo);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	PigShader = new GLSLProgram();
+	bool valid = PigShader->Create("pigs.vert", "pigs.frag");
+	if (!valid) {
+		fprintf(stderr, "Pig shader cannot be created -- the pigs will be drawn one at a time\n");
+		HasInstancing = false;
+		return;
+	}
+	fprintf(stderr, "Pig shader created.\n");
+	PigShader->SetVerbose(false);
+
+	// GLSLProgram only knows uniforms, so ask gl where the instance attributes went.
+	// the uniforms are looked up once here too, instead of by name every frame:
+
+	GLuint program = ProgramHandle(PigShader);
+	PigRowAttribs[0] = glGetAttribLocation(program, "aRow0");
+	PigRowAttribs[1] = glGetAttribLocation(program, "aRow1");
+	PigRowAttribs[2] = glGetAttribLocation(program, "aRow2");
+	PigLayerAttrib = glGetAttribLocation(program, "aLayer");
+	PigTexUnitLoc = glGetUniformLocation(program, "uTexUnit");
+	PigDistanceLoc = glGetUniformLocation(program, "uDistance");
+	PigShadowsOnLoc = glGetUniformLocation(program, "uShadowsOn");
+	LookUpSunShadowUniforms(program, &PigSunUniforms);
+}
+
+
+// draw one of the 2 meshes once per instance:
+
+void
+DrawPigMesh(int mesh, struct piginstance* instances, int numInstances)
+{
+	if (numInstances == 0)
+		return;
+
+	glBindBuffer(GL_ARRAY_BUFFER, PigInstanceVbo);
+	glBufferData(GL_ARRAY_BUFFER, numInstances * sizeof(struct piginstance), instances, GL_STREAM_DRAW);
+	for (int k = 0; k < 3; k++)
+	{
+		glEnableVertexAttribArray(PigRowAttribs[k]);
+		glVertexAttribPointer(PigRowAttribs[k], 4, GL_FLOAT, GL_FALSE, sizeof(struct piginstance),
+			(void*)(offsetof(struct piginstance, row0) + 4 * k * sizeof(float)));
+		glVertexAttribDivisorARB(PigRowAttribs[k], 1);
+	}
+	glEnableVertexAttribArray(PigLayerAttrib);
+	glVertexAttribPointer(PigLayerAttrib, 1, GL_FLOAT, GL_FALSE, sizeof(struct piginstance), (void*)offsetof(struct piginstance, layer));
+	glVertexAttribDivisorARB(PigLayerAttrib, 1);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, PigMeshIbo);
+	glBindBuffer(GL_ARRAY_BUFFER, PigMeshVbo);
+	SetPointPointers((char*)NULL + 24 * mesh * sizeof(struct point));
+	glDrawElementsInstancedARB(GL_TRIANGLES, 36, GL_UNSIGNED_INT, (void*)0, numInstances);
+	UnsetPointPointers();
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	// the divisors stay with the attribute numbers, which other shaders use too:
+
+	for (int k = 0; k < 3; k++)
+	{
+		glVertexAttribDivisorARB(PigRowAttribs[k], 0);
+		glDisableVertexAttribArray(PigRowAttribs[k]);
+	}
+	glVertexAttribDivisorARB(PigLayerAttrib, 0);
+	glDisableVertexAttribArray(PigLayerAttrib);
+}
+
+
+// every pig in the frustum, in 2 draws.
+// distances != 0 is for the shadow cube maps, which want the distance to the light instead of a color,
+// and shadows != 0 puts the sun's shadows on them (never while the cascades are being drawn):
+
+void
+DrawPigs(int distances, int shadows)
+{
+	if (!HasInstancing)
+	{
+		for (int i = 0; i < Pigs.count; i++)
+			DrawPig(i);
+		return;
+	}
+
+	int numBodies = 0, numFaces = 0;
+	NumPigsDrawn = 0;
+	for (int i = 0; i < Pigs.count; i++)
+	{
+		// the same box DrawPig( ) culls with:
+
+		float x, z, heading;
+		PigPlace(i, &x, &z, &heading);
+		if (!BoxVisible(x - 1.65, -0.3, z - 1.65, x + 1.65, 1.5, z + 1.65))
+			continue;
+		NumPigsDrawn++;
+
+		float pig[16] = { 1., 0., 0., 0.,   0., 1., 0., 0.,   0., 0., 1., 0.,   x, 0., z, 1. };
+		RotateMatrix(pig, heading, 1);
+		TranslateMatrix(pig, -PIGPIVOTX, 0., -PIGPIVOTZ);
+		float m[16];
+		memcpy(m, pig, sizeof(m));
+		TranslateMatrix(m, 0., 0.25, 5.);
+		ScaleMatrix(m, 1., 0.5, 0.75);
+		SetPigInstance(&PigBodyInstances[numBodies++], m, 0.);
+
+		float legs[4][2] = { { 0.1f, 5.f }, { 0.1f, 5.5f }, { 0.85f, 5.5f }, { 0.85f, 5.f } };
+		for (int k = 0; k < 4; k++)
+		{
+			memcpy(m, pig, sizeof(m));
+			TranslateMatrix(m, legs[k][0], 0., legs[k][1]);
+			ScaleMatrix(m, 0.25, 0.25, 0.25);
+			SetPigInstance(&PigBodyInstances[numBodies++], m, 0.);
+		}
+
+		float head[16];
+		memcpy(head, pig, sizeof(head));
+		RotateMatrix(head, PigTip(i) * 2, 0);
+		RotateMatrix(head, PigTip(i) * 4, 2);
+		memcpy(m, head, sizeof(m));
+		TranslateMatrix(m, -0.75, 0.25, 4.875);
+		SetPigInstance(&PigFaceInstances[numFaces++], m, 1.);
+		memcpy(m, head, sizeof(m));
+		TranslateMatrix(m, -0.90, 0.25, 5.125);
+		ScaleMatrix(m, 0.5, 0.35, 0.525);
+		SetPigInstance(&PigFaceInstances[numFaces++], m, 2.);
+	}
+	if (NumPigsDrawn == 0)
+		return;
+
+	// the shadow passes have their own shaders in use, so put theirs back afterwards:
+
+	GLint oldProgram;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &oldProgram);
+	PigShader->Use();
+	glUniform1i(PigTexUnitLoc, 0);
+	glUniform1i(PigDistanceLoc, distances ? 1 : 0);
+	glUniform1i(PigShadowsOnLoc, shadows ? 1 : 0);
+	if (shadows)
+		BindSunShadows(&PigSunUniforms);
+	else
+	{
+		// the cascade samplers still have to be on units of their own:
+
+		for (int i = 0; i < CASCADES; i++)
+			glUniform1i(PigSunUniforms.sunShadows[i], SUNSHADOWUNIT + i);
+	}
+	glBindTexture(GL_TEXTURE_2D_ARRAY, PigTextureArray);
+
+	DrawPigMesh(0, PigBodyInstances, numBodies);
+	DrawPigMesh(1, PigFaceInstances, numFaces);
+
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glUseProgram(oldProgram);
+}
+
+
+// everything that casts shadows, for the shadow passes: the blocks, the door, and the pigs.
+// the ground is flat so it cannot shadow anything, and the torches are where the lights are.
+// face is the cube map face (-1 for the sun), the frustum culling does the rest:
+
+void
+DrawShadowCasters(int face)
+{
+	ExtractFrustum();
+	if (BoxVisible(-2., 0., 0., -1.85, 4., 2.))
+		glCallList(DoorList);
+	DrawPigs(face >= 0, 0);
+	DrawChunks();
+}
+
+
+// upload n decoded bmps into the layers of one texture array. every layer has to be
+// the same size, so any texture that is smaller than the biggest one gets scaled up to match.
+// the bmps' pixels are left for the caller to delete:
+
+GLuint
+MakeTextureArray(struct bmpload* bmps, int n, GLint wrap)
+{
+	int width = 1, height = 1;
+	for (int t = 0; t < n; t++)
+	{
+		if (bmps[t].texture == NULL)
+		{
+			fprintf(stderr, "Cannot load texture array layer '%s'\n", bmps[t].filename);
+			continue;
+		}
+		if (bmps[t].width > width)
+			width = bmps[t].width;
+		if (bmps[t].height > height)
+			height = bmps[t].height;
+	}
 
-	if (!Day) {
-		glColor3f(0.06, 0.06, 0.12);
-		OsuSphere(400., 10., 10.);
+	GLuint tex;
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, tex);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, wrap);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrap);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB, width, height, n, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+
+	for (int t = 0; t < n; t++)
+	{
+		if (bmps[t].texture == NULL)
+			continue;
+
+		unsigned char* layer = bmps[t].texture;
+		if (bmps[t].width != width || bmps[t].height != height)
+		{
+			layer = new unsigned char[3 * width * height];
+			gluScaleImage(GL_RGB, bmps[t].width, bmps[t].height, GL_UNSIGNED_BYTE, bmps[t].texture,
+				width, height, GL_UNSIGNED_BYTE, layer);
+		}
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, t, width, height, 1, GL_RGB, GL_UNSIGNED_BYTE, layer);
+
+		if (layer != bmps[t].texture)
+			delete[] layer;
 	}
-	else {
-		glColor3f(0.33, 0.62, 0.98);
-		OsuSphere(400., 10., 10.);
+	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	return tex;
+}
+
+
+// main program:
+
+int
+main(int argc, char* argv[])
+{
+	// turn on the glut package:
+	// (do this before checking argc and argv since it might
+	// pull some command line arguments out)
+
+	glutInit(&argc, argv);
+
+	// the pigs' update threads, which the benchmark needs and the graphics do not:
+
+	InitMobThreads();
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-mobbench") == 0)
+		{
+			BenchMobs(i + 1 < argc ? argv[i + 1] : NULL);
+			return 0;
+		}
 	}
 
-	glEnable(GL_TEXTURE_2D);
+	// setup all the graphics stuff:
 
+	InitGraphics();
 
-	// Draw Moon/Sun
+	// create the display structures that will not change:
 
-	glPushMatrix();
-	if (!Day) {
-		glBindTexture(GL_TEXTURE_2D, moon);
-		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-		glMatrixMode(GL_TEXTURE_2D);
+	InitLists();
+
+	// init all the global variables used by Display( ):
+	// this will also post a redisplay
+
+	Reset();
+
+	// setup all the user interface stuff:
+
+	InitMenus();
+
+	// draw the scene once and wait for some interaction:
+	// (this will never return)
+
+	glutSetWindow(MainWindow);
+	glutMainLoop();
+
+	// glutMainLoop( ) never returns
+	// this line is here to make the compiler happy:
+
+	return 0;
+}
+
+
+// this is where one would put code that is to be called
+// everytime the glut main loop has nothing to do
+//
+// this is typically where animation parameters are set
+//
+// do not call Display( ) from here -- let glutMainLoop( ) do it
+
+void
+Animate()
+{
+	const int MS_IN_THE_ANIMATION_CYCLE = 10000;	// milliseconds in the animation loop
+	int ms = glutGet(GLUT_ELAPSED_TIME);			// milliseconds since the program started
+
+	// the pigs move a step at a time, and DrawPigs( ) puts them in between their last 2 steps:
+
+	int steps = CountSteps();
+	for (int i = 0; i < steps; i++)
+	{
+		if (i == steps - 1)
+			SaveMobs(&Pigs);
+		UpdateMobs(&Pigs, STEPMS / 1000.f, SteppedMs / 1000.f, NumMobThreads);
+		SteppedMs += STEPMS;
 	}
-	else {
-		glDisable(GL_TEXTURE_2D);
-		glColor3f(1., 0.9, 0.65);
+	CapFrameRate();
+
+	ms %= MS_IN_THE_ANIMATION_CYCLE;				// milliseconds in the range 0 to MS_IN_THE_ANIMATION_CYCLE-1
+	Time = (float)ms / (float)MS_IN_THE_ANIMATION_CYCLE;        // [ 0., 1. )
+
+	glFlush();
+	glutSetWindow(MainWindow);
+	glutPostRedisplay();
+}
+
+
+// draw the complete scene:
+
+void
+Display()
+{
+	if (DebugOn != 0)
+	{
+		fprintf(stderr, "Display\n");
 	}
-	glRotatef(5, 0., 0., 1.);
-	glTranslatef(300., 0., 0.);
-	glScalef(2., 2., 2.);
-	glCallList(BoxList);
-	glPopMatrix();
 
-	glEnable(GL_TEXTURE_2D);
 
+	// set which window we want to do the graphics into:
 
-	// Draw grass on ground
+	glutSetWindow(MainWindow);
 
-	glEnable(GL_LIGHTING);
+	BeginZone(ZONE_CLEAR);
 
-	glBindTexture(GL_TEXTURE_2D, grass);
+	// erase the background:
+
+	glDrawBuffer(GL_BACK);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	glEnable(GL_DEPTH_TEST);
+
+
+	// specify shading to be flat:
 
-	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-	glMatrixMode(GL_TEXTURE_2D);
 	glShadeModel(GL_SMOOTH);
-	glCallList(PlaneList);
 
-	glDisable(GL_LIGHTING);
 
+	// set the viewport to a square centered in the window:
 
-	// Draw door
+	GLsizei vx = glutGet(GLUT_WINDOW_WIDTH);
+	GLsizei vy = glutGet(GLUT_WINDOW_HEIGHT);
+	GLsizei v = vx < vy ? vx : vy;			// minimum dimension
+	GLint xl = (vx - v) / 2;
+	GLint yb = (vy - v) / 2;
+	glViewport(xl, yb, v, v);
 
-	glBindTexture(GL_TEXTURE_2D, door);
-	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-	glCallList(DoorList);
 
+	// set the viewing volume:
+	// remember that the Z clipping  values are actually
+	// given as DISTANCES IN FRONT OF THE EYE
+	// USE gluOrtho2D( ) IF YOU ARE DOING 2D !
 
-	// Draw stone brick walls
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
 
-	glEnable(GL_LIGHTING);
-	glBindTexture(GL_TEXTURE_2D, stonebrick);
-	if (!Day)
-		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	if (WhichProjection == ORTHO)
+		glOrtho(-55., 55., -55., 55., 0.1, 1000.);
 	else
-		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-	glMatrixMode(GL_TEXTURE_2D);
-	glShadeModel(GL_SMOOTH);
-	glPushMatrix();
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-8, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-
-
-	glCallList(BoxList);
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-
-	glCallList(BoxList);
-	glTranslatef(0, 0, 2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, 2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, 2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, 2);
-	glCallList(BoxList);
-	glPopMatrix();
-	glDisable(GL_LIGHTING);
+		gluPerspective(10., 1., 0.1, 1000.);
+
 
+	// place the objects into the scene:
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
 
-	// Draw dark oak plank walls
+	// set the eye position, look-at position, and up-vector:
+	gluLookAt(eyex, eyey, eyez, lookx, looky, lookz, upx, upy, upz);
 
-	glEnable(GL_LIGHTING);
-	glBindTexture(GL_TEXTURE_2D, dark_oak_planks);
-	if (!Day)
-		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+
+
+	// rotate the scene:
+
+	glRotatef((GLfloat)Yrot, 0., 1., 0.);
+	glRotatef((GLfloat)Xrot, 1., 0., 0.);
+
+
+	// uniformly scale the scene:
+
+	if (Scale < MINSCALE)
+		Scale = MINSCALE;
+	glScalef((GLfloat)Scale, (GLfloat)Scale, (GLfloat)Scale);
+
+
+	// the shadow maps are drawn from these coordinates too, before the frustum
+	// below is built (the shadow passes build their own). the torches only
+	// get shadows with clustered lighting, which is what does them per fragment:
+
+	EndZone();
+
+	BeginZone(ZONE_SHADOWS);
+
+	int shadow0 = 0, shadow1 = 0;
+	if (ShadowsOn && HasShadows)
+	{
+		BeginShadows();
+		RenderSunShadows();
+		if (ClusteredOn && Light0On)
+			shadow0 = RenderShadowCube(-3., 3., 4.);
+		if (ClusteredOn && Light1On)
+			shadow1 = RenderShadowCube(1., 3., 4.);
+	}
+
+	EndZone();
+
+	BeginZone(ZONE_BINNING);
+
+
+	// everything below is drawn in these coordinates, so build the view frustum from them:
+
+	ExtractFrustum();
+
+
+	// Turn the lights on
+
+	if (Light0On)
+		glEnable(GL_LIGHT0);
 	else
-		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-	glMatrixMode(GL_TEXTURE_2D);
-	glShadeModel(GL_SMOOTH);
+		glDisable(GL_LIGHT0);
+
+	if (Light1On)
+		glEnable(GL_LIGHT1);
+	else
+		glDisable(GL_LIGHT1);
+
+
+	// since we are using glScalef( ), be sure normals get unitized:
+
+	glEnable(GL_NORMALIZE);
+
+
+	// with clustered lighting the torches go into the light list instead of
+	// GL_LIGHT0 and GL_LIGHT1, at the same places SetPointLight( ) puts them below:
+
+	if (ClusteredOn)
+	{
+		ClearLights();
+		struct light* l;
+		if (Light0On && (l = AddPointLight(-3., 3., 4., 1., 1., 0.75, 1., 0.)) != NULL)
+			l->shadow = shadow0;
+		if (Light1On && (l = AddPointLight(1., 3., 4., 1., 1., 0.75, 1., 0.)) != NULL)
+			l->shadow = shadow1;
+		if (TorchFieldOn)
+		{
+			for (int i = 0; i < TORCHFIELDSIZE; i++)
+			{
+				for (int j = 0; j < TORCHFIELDSIZE; j++)
+				{
+					float x, z;
+					if (FieldTorch(i, j, &x, &z))
+						AddPointLight(x, 1., z, 1., 1., 0.75, 1., TORCHQUADATTEN);
+				}
+			}
+		}
+		BinLights(0.1, 1000.);
+	}
+
+	EndZone();
+
+	
+	// Draw Sky
+
+	BeginZone(ZONE_SKY);
+
+	if (BoxVisible(-400., -400., -400., 400., 400., 400.)) {
+		if (!Day) {
+			glColor3f(0.06, 0.06, 0.12);
+			OsuSphere(400., 10., 10.);
+		}
+		else {
+			glColor3f(0.33, 0.62, 0.98);
+			OsuSphere(400., 10., 10.);
+		}
+	}
+
+	glEnable(GL_TEXTURE_2D);
+
+
+	// Draw Moon/Sun
 
 	glPushMatrix();
-	glTranslatef(0, 2, 0);
-	glCallList(BoxList);
-	glTranslatef(-4, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-4, 0, 0);
-	glCallList(BoxList);
-
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-
-	glTranslatef(0, 0, 2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, 2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, 2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, 2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, 2);
-	glCallList(BoxList);
-
-
-	glTranslatef(-2, 2, 0);
-	glCallList(BoxList);
-
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, -2);
-	glCallList(BoxList);
-
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-
-	glTranslatef(0, 0, 2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, 2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, 2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, 2);
-	glCallList(BoxList);
-	glTranslatef(0, 0, 2);
-	glCallList(BoxList);
-
-	glTranslatef(0, 2, 0);
-	glCallList(SlabList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(SlabList);
-
-	glTranslatef(4, 2, 0);
-	glCallList(SlabList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(SlabList);
-
-	glTranslatef(4, -2, -10);
-	glCallList(SlabList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(-2, 0, 0);
-	glCallList(SlabList);
-
-	glTranslatef(4, 2, 0);
-	glCallList(SlabList);
-	glTranslatef(2, 0, 0);
-	glCallList(BoxList);
-	glTranslatef(2, 0, 0);
-	glCallList(SlabList);
+	if (!Day) {
+		glBindTexture(GL_TEXTURE_2D, moon);
+		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+	}
+	else {
+		glDisable(GL_TEXTURE_2D);
+		glColor3f(1., 0.9, 0.65);
+	}
+	glRotatef(5, 0., 0., 1.);
+	glTranslatef(300., 0., 0.);
+	glScalef(2., 2., 2.);
+	if (BoxVisible(298., 26., 0., 303., 31., 4.))		// the 4x4x4 box, turned 5 degrees
+		glCallList(BoxList);
 	glPopMatrix();
-	glDisable(GL_LIGHTING);
 
+	glEnable(GL_TEXTURE_2D);
+
+	EndZone();
+
+
+	// Draw grass on ground
 
-	// Draw stone brick roof
+	BeginZone(ZONE_TERRAIN);
 
 	glEnable(GL_LIGHTING);
-	glBindTexture(GL_TEXTURE_2D, stonebrick);
-	if (!Day)
-		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
-	else
-		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-	glMatrixMode(GL_TEXTURE_2D);
+
+	glBindTexture(GL_TEXTURE_2D, grass);
+
+	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
 	glShadeModel(GL_SMOOTH);
+	if (ShadowsOn && HasShadows)
+	{
+		ShadowedShader->Use();
+		glUniform1i(ShadowedTexUnitLoc, 0);
+		BindSunShadows(&ShadowedSunUniforms);
+	}
+	if (BoxVisible(-200., 0., -200., 202., 0., 200.))
+		glCallList(PlaneList);
 
-	glPushMatrix();
-	glTranslatef(6, 6, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-
-	glTranslatef(-2, 1, 0);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-
-	glTranslatef(-2, 1, 0);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-
-	glTranslatef(-2, 1, 0);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-
-	glTranslatef(-2, 1, 0);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-
-	glTranslatef(-2, -1, 0);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-
-	glTranslatef(-2, -1, 0);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-
-	glTranslatef(-2, -1, 0);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, 2);
-	glCallList(SlabList);
-
-	glTranslatef(-2, -1, 0);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glTranslatef(0, 0, -2);
-	glCallList(SlabList);
-	glPopMatrix();
 	glDisable(GL_LIGHTING);
 
-	// Draw Pig
-	glPushMatrix();
+	EndZone();
 
 
-	glTranslatef(7., 0., 0.);
-	glBindTexture(GL_TEXTURE_2D, pigbody);
-	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+	// Draw door (with the ground's shadowed shader still in use, if it is)
 
-	glPushMatrix();
-	glTranslatef(0., 0.25, 5.);
-	glCallList(PigList);
-	glPopMatrix();
+	BeginZone(ZONE_BLOCKS);
 
-	glPushMatrix();
-	glTranslatef(0.1, 0., 5.);
-	glCallList(PigLegList);
-	glTranslatef(0., 0., 0.5);
-	glCallList(PigLegList);
-	glTranslatef(0.75, 0., 0.);
-	glCallList(PigLegList);
-	glTranslatef(0., 0., -0.5);
-	glCallList(PigLegList);
-	glPopMatrix();
+	glBindTexture(GL_TEXTURE_2D, door);
+	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+	if (BoxVisible(-2., 0., 0., -1.85, 4., 2.))
+		glCallList(DoorList);
+	if (ShadowsOn && HasShadows)
+		ShadowedShader->Use(0);
 
 
-	glRotatef(PigPosX*2, 1., 0., 0.);
-	glRotatef(PigPosZ*4, 0., 0., 1.);
+	// Draw the blocks of the world -- stone brick and dark oak walls and the stone brick roof
 
+	DrawWorld();
 
-	glBindTexture(GL_TEXTURE_2D, pigface);
-	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+	EndZone();
 
-	glPushMatrix();
-	glTranslatef(-0.75, 0.25, 4.875);
-	glCallList(PigFaceList);
-	glPopMatrix();
+	// Draw Pig
 
-	glBindTexture(GL_TEXTURE_2D, pignose);
-	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+	BeginZone(ZONE_PIG);
 
-	glPushMatrix();
-	glTranslatef(-0.90, 0.25, 5.125);
-	glScalef(0.5, 0.35, 0.525);
-	glCallList(PigFaceList);
-	glPopMatrix();
+	// the instanced pigs put the sun's shadows on themselves:
+
+	if (ShadowsOn && HasShadows && !HasInstancing)
+	{
+		ShadowedShader->Use();
+		glUniform1i(ShadowedTexUnitLoc, 0);
+		BindSunShadows(&ShadowedSunUniforms);
+	}
+	DrawPigs(0, ShadowsOn && HasShadows);
+	if (ShadowsOn && HasShadows && !HasInstancing)
+		ShadowedShader->Use(0);
 
 	glDisable(GL_TEXTURE_2D);
 
-	glPopMatrix();
+	EndZone();
 
 
 	// Draw windows
 
+	BeginZone(ZONE_WINDOWS);
+
 	glPushMatrix();
-	glCallList(WindowList);
+	if (BoxVisible(2.1, 2.1, 1., 3.9, 3.9, 1.))
+		glCallList(WindowList);
 	glTranslatef(-8., 0., 0.);
-	glCallList(WindowList);
+	if (BoxVisible(-5.9, 2.1, 1., -4.1, 3.9, 1.))
+		glCallList(WindowList);
 	glPopMatrix();
 
+	EndZone();
+
 
 	// Draw torches
 
+	BeginZone(ZONE_LIGHTS);
+
 	glPushMatrix();
 
 	glEnable(GL_LIGHTING);
@@ -1070,7 +3485,8 @@ Display()
 
 	glTranslatef(-3., 3., 2.2);
 	glRotatef(25., 1., 0., 0.);
-	glCallList(TorchList);
+	if (BoxVisible(-3.15, 2.4, 1.8, -2.85, 3.6, 2.6))
+		glCallList(TorchList);
 	glPopMatrix();
 
 	glEnable(GL_LIGHTING);
@@ -1085,12 +3501,34 @@ Display()
 
 	glTranslatef(1., 3., 2.2);
 	glRotatef(25., 1., 0., 0.);
-	glCallList(TorchList);
+	if (BoxVisible(0.85, 2.4, 1.8, 1.15, 3.6, 2.6))
+		glCallList(TorchList);
 	glPopMatrix();
 
+	if (TorchFieldOn)
+	{
+		for (int i = 0; i < TORCHFIELDSIZE; i++)
+		{
+			for (int j = 0; j < TORCHFIELDSIZE; j++)
+			{
+				float x, z;
+				if (!FieldTorch(i, j, &x, &z) || !BoxVisible(x - 0.1, 0., z - 0.1, x + 0.1, 1.1, z + 0.1))
+					continue;
+				glPushMatrix();
+				glTranslatef(x, 0.5, z);
+				glCallList(TorchList);
+				glPopMatrix();
+			}
+		}
+	}
+
+	EndZone();
+
 
 	// draw some gratuitous text that just rotates on top of the scene:
 
+	BeginZone(ZONE_TEXT);
+
 	glDisable(GL_DEPTH_TEST);
 	glColor3f(0., 1., 1.);
 	DoRasterString(0., 1., 0., (char*)"");
@@ -1119,7 +3557,25 @@ Display()
 	glColor3f(1., 1., 1.);
 	DoRasterString(2., 2., 0., (char*)"Minecraft - C++");
 
+	if (ShowCullCounts) {
+		char counts[64];
+		sprintf(counts, "Drawn: %d  Culled: %d", NumDrawn, NumCulled);
+		DoRasterString(60., 2., 0., counts);
+		if (ClusteredOn) {
+			sprintf(counts, "Lights: %d  Indices: %d", NumLights, NumLightIndices);
+			DoRasterString(60., 6., 0., counts);
+		}
+		if (HasInstancing) {
+			sprintf(counts, "Pigs: %d in 2 draws", NumPigsDrawn);
+			DoRasterString(60., 10., 0., counts);
+		}
+	}
+
+	if (ShowProfile)
+		DrawProfile(2., 90.);
 
+	EndZone();
+	EndProfileFrame();
 
 
 	// swap the double-buffered framebuffers:
@@ -1141,6 +3597,31 @@ DoLightsMenu(int id)
 		Light0On = !Light0On;
 	else if (id == 1)
 		Light1On = !Light1On;
+	else if (id == 2)
+		TorchFieldOn = !TorchFieldOn;
+	else if (id == 3)
+		ClusteredOn = HasClusters && !ClusteredOn;
+
+	glutSetWindow(MainWindow);
+	glutPostRedisplay();
+}
+
+
+void
+DoPigsMenu(int id)
+{
+	PigFieldOn = id;
+	SpawnPigs();
+
+	glutSetWindow(MainWindow);
+	glutPostRedisplay();
+}
+
+
+void
+DoShadowsMenu(int id)
+{
+	ShadowsOn = id;
 
 	glutSetWindow(MainWindow);
 	glutPostRedisplay();
@@ -1169,6 +3650,18 @@ DoDebugMenu(int id)
 	glutPostRedisplay();
 }
 
+
+void
+DoFilterMenu(int id)
+{
+	WhichFilter = id;
+	SetTextureFilter();
+
+	glutSetWindow(MainWindow);
+	glutPostRedisplay();
+}
+
+
 // main menu callback:
 
 void
@@ -1257,18 +3750,36 @@ InitMenus()
 	int lightsmenu = glutCreateMenu(DoLightsMenu);
 	glutAddMenuEntry("Left Torch - On/Off", 0);
 	glutAddMenuEntry("Right Torch - On/Off", 1);
+	glutAddMenuEntry("Torch Field - On/Off", 2);
+	glutAddMenuEntry("Clustered Lighting - On/Off", 3);
+
+	int shadowsmenu = glutCreateMenu(DoShadowsMenu);
+	glutAddMenuEntry("Off", 0);
+	glutAddMenuEntry("On", 1);
+
+	int pigsmenu = glutCreateMenu(DoPigsMenu);
+	glutAddMenuEntry("One Pig", 0);
+	glutAddMenuEntry("Pig Field", 1);
 
 	int timemenu = glutCreateMenu(DoTimeMenu);
 	glutAddMenuEntry("Daytime", 0);
 	glutAddMenuEntry("Nighttime", 1);
 
+	int filtermenu = glutCreateMenu(DoFilterMenu);
+	glutAddMenuEntry("Bilinear", BILINEAR);
+	glutAddMenuEntry("Trilinear (Mipmaps)", TRILINEAR);
+	glutAddMenuEntry("Anisotropic", ANISOTROPIC);
+
 	int debugmenu = glutCreateMenu(DoDebugMenu);
 	glutAddMenuEntry("Off", 0);
 	glutAddMenuEntry("On", 1);
 
 	int mainmenu = glutCreateMenu(DoMainMenu);
 	glutAddSubMenu("Torches", lightsmenu);
+	glutAddSubMenu("Shadows", shadowsmenu);
+	glutAddSubMenu("Pigs", pigsmenu);
 	glutAddSubMenu("Time of Day", timemenu);
+	glutAddSubMenu("Texture Filtering", filtermenu);
 	glutAddSubMenu("Debug", debugmenu);
 	glutAddMenuEntry("Reset", RESET);
 	glutAddMenuEntry("Quit", QUIT);
@@ -1327,84 +3838,93 @@ InitGraphics()
 	// TimerFunc -- trigger something to happen a certain time from now
 	// IdleFunc -- what to do when nothing else is going on
 
-	int width1, height1, width2, height2, width3, height3, width4, height4, 
-		width5, height5, width6, height6, width7, height7, width8, height8;
-
-	unsigned char * TextureArray1 = BmpToTexture("acacia.bmp", &width1, &height1);
-	unsigned char* TextureArray2 = BmpToTexture("grass.bmp", &width2, &height2);
-	unsigned char* TextureArray3 = BmpToTexture("stonebrick.bmp", &width3, &height3);
-	unsigned char* TextureArray4 = BmpToTexture("door.bmp", &width4, &height4);
-	unsigned char* TextureArray5 = BmpToTexture("pigbody.bmp", &width5, &height5);
-	unsigned char* TextureArray6 = BmpToTexture("pigface.bmp", &width6, &height6);
-	unsigned char* TextureArray7 = BmpToTexture("pignose.bmp", &width7, &height7);
-	unsigned char* TextureArray8 = BmpToTexture("moon.bmp", &width8, &height8);
+	// decode all of the bmp files at once on a pool of threads,
+	// only the uploads below need to happen on this (the gl) thread:
 
+	const int numSceneBmps = 6;
+	struct bmpload bmps[numSceneBmps + NUMBLOCKTEXTURES] =
+	{
+		{ (char*)"grass.bmp", NULL, 0, 0 },
+		{ (char*)"door.bmp", NULL, 0, 0 },
+		{ (char*)"pigbody.bmp", NULL, 0, 0 },
+		{ (char*)"pigface.bmp", NULL, 0, 0 },
+		{ (char*)"pignose.bmp", NULL, 0, 0 },
+		{ (char*)"moon.bmp", NULL, 0, 0 },
+	};
+	for (int t = 0; t < NUMBLOCKTEXTURES; t++)
+		bmps[numSceneBmps + t].filename = (char*)BlockTextureFiles[t];
+
+	std::chrono::steady_clock::time_point decodeStart = std::chrono::steady_clock::now();
+	int numDecodeThreads = DecodeBmps(bmps, numSceneBmps + NUMBLOCKTEXTURES);
+	double decodeMs = MillisecondsSince(decodeStart);
+
+	// each texture gets its mipmaps built by the driver when its image is loaded:
+
+	std::chrono::steady_clock::time_point uploadStart = std::chrono::steady_clock::now();
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 	
-	glGenTextures(1, &dark_oak_planks);
 	glGenTextures(1, &grass);
-	glGenTextures(1, &stonebrick);
 	glGenTextures(1, &door);
 	glGenTextures(1, &pigbody);
 	glGenTextures(1, &pigface);
 	glGenTextures(1, &pignose);
 	glGenTextures(1, &moon);
 
-	glBindTexture(GL_TEXTURE_2D, dark_oak_planks);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, 3, width1, height1, 0, GL_RGB, GL_UNSIGNED_BYTE, TextureArray1);
-
 	glBindTexture(GL_TEXTURE_2D, grass);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, 3, width2, height2, 0, GL_RGB, GL_UNSIGNED_BYTE, TextureArray2);
-
-	glBindTexture(GL_TEXTURE_2D, stonebrick);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, 3, width3, height3, 0, GL_RGB, GL_UNSIGNED_BYTE, TextureArray3);
+	glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
+	glTexImage2D(GL_TEXTURE_2D, 0, 3, bmps[0].width, bmps[0].height, 0, GL_RGB, GL_UNSIGNED_BYTE, bmps[0].texture);
 
 	glBindTexture(GL_TEXTURE_2D, door);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, 3, width4, height4, 0, GL_RGB, GL_UNSIGNED_BYTE, TextureArray4);
+	glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
+	glTexImage2D(GL_TEXTURE_2D, 0, 3, bmps[1].width, bmps[1].height, 0, GL_RGB, GL_UNSIGNED_BYTE, bmps[1].texture);
 
 	glBindTexture(GL_TEXTURE_2D, pigbody);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, 3, width5, height5, 0, GL_RGB, GL_UNSIGNED_BYTE, TextureArray5);
+	glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
+	glTexImage2D(GL_TEXTURE_2D, 0, 3, bmps[2].width, bmps[2].height, 0, GL_RGB, GL_UNSIGNED_BYTE, bmps[2].texture);
 
 	glBindTexture(GL_TEXTURE_2D, pigface);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, 3, width6, height6, 0, GL_RGB, GL_UNSIGNED_BYTE, TextureArray6);
+	glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
+	glTexImage2D(GL_TEXTURE_2D, 0, 3, bmps[3].width, bmps[3].height, 0, GL_RGB, GL_UNSIGNED_BYTE, bmps[3].texture);
 	
 	glBindTexture(GL_TEXTURE_2D, pignose);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, 3, width7, height7, 0, GL_RGB, GL_UNSIGNED_BYTE, TextureArray7);
+	glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
+	glTexImage2D(GL_TEXTURE_2D, 0, 3, bmps[4].width, bmps[4].height, 0, GL_RGB, GL_UNSIGNED_BYTE, bmps[4].texture);
 
 	glBindTexture(GL_TEXTURE_2D, moon);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, 3, width8, height8, 0, GL_RGB, GL_UNSIGNED_BYTE, TextureArray8);
+	glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
+	glTexImage2D(GL_TEXTURE_2D, 0, 3, bmps[5].width, bmps[5].height, 0, GL_RGB, GL_UNSIGNED_BYTE, bmps[5].texture);
+
+	// see how much anisotropic filtering this card can do:
+
+	MaxAnisotropy = 1.;
+	if (strstr((char*)glGetString(GL_EXTENSIONS), "GL_EXT_texture_filter_anisotropic") != NULL)
+		glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &MaxAnisotropy);
+	glFinish();
+	double uploadMs = MillisecondsSince(uploadStart);
 
 	glutSetWindow(MainWindow);
 	glutDisplayFunc(Display);
@@ -1441,6 +3961,47 @@ InitGraphics()
 	fprintf(stderr, "Status: Using GLEW %s\n", glewGetString(GLEW_VERSION));
 #endif
 
+	// the texture arrays and shaders use opengl calls that glew loads, so they come after it.
+	// the pigs' array is only for the instanced pigs, but it costs little to have:
+
+	uploadStart = std::chrono::steady_clock::now();
+	BlockTextureArray = MakeTextureArray(&bmps[numSceneBmps], NUMBLOCKTEXTURES, GL_REPEAT);
+	PigTextureArray = MakeTextureArray(&bmps[2], 3, GL_CLAMP_TO_EDGE);
+	for (int i = 0; i < numSceneBmps + NUMBLOCKTEXTURES; i++)
+		delete[] bmps[i].texture;
+	glFinish();
+	uploadMs += MillisecondsSince(uploadStart);
+	fprintf(stderr, "Textures: decoded %d bmp files in %.2f ms on %d threads, uploaded them in %.2f ms\n",
+		numSceneBmps + NUMBLOCKTEXTURES, decodeMs, numDecodeThreads, uploadMs);
+
+	BlockShader = new GLSLProgram();
+	bool valid = BlockShader->Create("blocks.vert", "blocks.frag");
+	if (!valid) {
+		fprintf(stderr, "Block shader cannot be created.\n");
+		DoMainMenu(QUIT);
+	}
+	else
+		fprintf(stderr, "Block shader created.\n");
+	BlockShader->SetVerbose(false);
+
+	GLuint program = ProgramHandle(BlockShader);
+	BlockLight0OnLoc = glGetUniformLocation(program, "uLight0On");
+	BlockLight1OnLoc = glGetUniformLocation(program, "uLight1On");
+	BlockModulateLoc = glGetUniformLocation(program, "uModulate");
+	BlockClusteredLoc = glGetUniformLocation(program, "uClustered");
+	BlockTexturesLoc = glGetUniformLocation(program, "uBlockTextures");
+	LookUpClusterUniforms(program, &BlockClusterUniforms);
+	LookUpShadowUniforms(program, &BlockShadowUniforms);
+	LookUpSunShadowUniforms(program, &BlockSunUniforms);
+
+	// the timer queries are from glew too, and so are the clustered lights' float textures,
+	// the shadows' framebuffer objects, and the pigs' instancing:
+
+	InitProfiler();
+	InitClusters();
+	InitShadows();
+	InitSunShadows();
+	InitPigs();
 }
 
 
@@ -1454,6 +4015,11 @@ InitLists()
 {
 	glutSetWindow(MainWindow);
 
+	// create the voxel world and put the house in it:
+	// (the chunks get meshed the first time they are drawn)
+	InitWorld();
+	BuildHouse();
+
 	// create the grass:
 	PlaneList = glGenLists(1);
 	glNewList(PlaneList, GL_COMPILE);
@@ -1581,93 +4147,6 @@ InitLists()
 	glEndList();
 
 
-	// create the Slab Blocks:
-	SlabList = glGenLists(1);
-	glNewList(SlabList, GL_COMPILE);
-	GLdouble c1[] = { 2, 1, 2 };
-	GLdouble d1[] = { 0., 1, 2 };
-	GLdouble g1[] = { 2, 1, 0. };
-	GLdouble h1[] = { 0., 1, 0. };
-
-	// Front
-	glBegin(GL_QUADS);
-	glNormal3d(0, 0, 1);
-	glTexCoord2f(0, 0);
-	glVertex3dv(a);
-	glTexCoord2f(1, 0);
-	glVertex3dv(b);
-	glTexCoord2f(1, 0.5);
-	glVertex3dv(c1);
-	glTexCoord2f(0, 0.5);
-	glVertex3dv(d1);
-	glEnd();
-
-	// Right
-	glBegin(GL_QUADS);
-	glNormal3d(1, 0, 0);
-	glTexCoord2f(0, 0.5);
-	glVertex3dv(c1);
-	glTexCoord2f(0, 0);
-	glVertex3dv(b);
-	glTexCoord2f(1, 0);
-	glVertex3dv(f);
-	glTexCoord2f(1, 0.5);
-	glVertex3dv(g1);
-	glEnd();
-
-	// Back
-	glBegin(GL_QUADS);
-	glNormal3d(0, 0, -1);
-	glTexCoord2f(1, 0.5);
-	glVertex3dv(h1);
-	glTexCoord2f(0, 0.5);
-	glVertex3dv(g1);
-	glTexCoord2f(0, 0);
-	glVertex3dv(f);
-	glTexCoord2f(1, 0);
-	glVertex3dv(e);
-	glEnd();
-
-	// Left
-	glBegin(GL_QUADS);
-	glNormal3d(-1, 0, 0);
-	glTexCoord2f(1, 0.5);
-	glVertex3dv(d1);
-	glTexCoord2f(0, 0.5);
-	glVertex3dv(h1);
-	glTexCoord2f(0, 0);
-	glVertex3dv(e);
-	glTexCoord2f(1, 0);
-	glVertex3dv(a);
-	glEnd();
-
-	// Top
-	glBegin(GL_QUADS);
-	glNormal3d(0, 1, 0);
-	glTexCoord2f(1, 0);
-	glVertex3dv(d1);
-	glTexCoord2f(1, 1);
-	glVertex3dv(c1);
-	glTexCoord2f(0, 1);
-	glVertex3dv(g1);
-	glTexCoord2f(0, 0);
-	glVertex3dv(h1);
-	glEnd();
-
-	// Bottom
-	glBegin(GL_QUADS);
-	glNormal3d(0, -1, 0);
-	glTexCoord2f(0, 1);
-	glVertex3dv(e);
-	glTexCoord2f(0, 0);
-	glVertex3dv(f);
-	glTexCoord2f(1, 0);
-	glVertex3dv(b);
-	glTexCoord2f(1, 1);
-	glVertex3dv(a);
-	glEnd();
-	glEndList();
-
 	// create the Window:
 	WindowList = glGenLists(1);
 	glNewList(WindowList, GL_COMPILE);
@@ -2021,7 +4500,10 @@ Keyboard(unsigned char c, int x, int y)
 		if (Frozen)
 			glutIdleFunc(NULL);
 		else
+		{
+			LastStepMs = -1;
 			glutIdleFunc(Animate);
+		}
 		break;
 
 	case 'w':
@@ -2133,6 +4615,37 @@ Keyboard(unsigned char c, int x, int y)
 		Day = !Day;
 		break;
 
+	case '4':
+		TorchFieldOn = !TorchFieldOn;
+		break;
+
+	case '5':
+		PigFieldOn = !PigFieldOn;
+		SpawnPigs();
+		break;
+
+	case 'l':
+	case 'L':
+		ClusteredOn = HasClusters && !ClusteredOn;
+		break;
+
+	case 'h':
+	case 'H':
+		ShadowsOn = !ShadowsOn;
+		break;
+
+	case 'c':
+	case 'C':
+		ShowCullCounts = !ShowCullCounts;
+		break;
+
+	case 't':
+	case 'T':
+		ShowProfile = !ShowProfile;
+		if (ShowProfile)
+			ResetProfiler();
+		break;
+
 	case 'q':
 	case 'Q':
 	case ESCAPE:
@@ -2141,6 +4654,7 @@ Keyboard(unsigned char c, int x, int y)
 
 	default:
 		fprintf(stderr, "Don't know what to do with keyboard hit: '%c' (0x%0x)\n", c, c);
+		return;			// nothing changed, so there is nothing to redraw
 	}
 
 	// force a call to Display( ):
@@ -2206,8 +4720,14 @@ MouseButton(int button, int state, int x, int y)
 		ActiveButton &= ~b;		// clear the proper bit
 	}
 
-	glutSetWindow(MainWindow);
-	glutPostRedisplay();
+	// pressing or letting go of a button only changes what the next moves do,
+	// but the wheel changes the scale right away:
+
+	if (button == SCROLL_WHEEL_UP || button == SCROLL_WHEEL_DOWN)
+	{
+		glutSetWindow(MainWindow);
+		glutPostRedisplay();
+	}
 
 }
 
@@ -2217,7 +4737,7 @@ MouseButton(int button, int state, int x, int y)
 void
 MouseMotion(int x, int y)
 {
-	if (true)
+	if (DebugOn != 0)
 		fprintf(stderr, "MouseMotion: %d, %d\n", x, y);
 
 
@@ -2244,8 +4764,16 @@ MouseMotion(int x, int y)
 	Xmouse = x;			// new current position
 	Ymouse = y;
 
-	glutSetWindow(MainWindow);
-	glutPostRedisplay();
+	// glut calls this for every move, with or without a button down, and most of
+	// them change nothing on the screen. only the ones that turned or scaled the
+	// scene ask for a redraw, and however many of those come in before the next
+	// Display( ), glut still draws just once for them:
+
+	if ((dx != 0 || dy != 0) && (ActiveButton & (LEFT | MIDDLE)) != 0)
+	{
+		glutSetWindow(MainWindow);
+		glutPostRedisplay();
+	}
 }
 
 
@@ -2266,10 +4794,35 @@ Reset()
 	WhichProjection = PERSP;
 	Xrot = Yrot = 0.;
 	Light0On = Light1On = true;
+	TorchFieldOn = false;
+	PigFieldOn = false;
+	SpawnPigs();
+	ClusteredOn = HasClusters;
+	WhichFilter = TRILINEAR;
+	SetTextureFilter();
 	glFlush();
 }
 
 
+// set the minification filter of every texture from WhichFilter:
+
+void
+SetTextureFilter()
+{
+	GLuint textures[] = { grass, door, pigbody, pigface, pignose, moon, BlockTextureArray, PigTextureArray };
+	const int numTextures = sizeof(textures) / sizeof(textures[0]);
+	for (int i = 0; i < numTextures; i++)
+	{
+		GLenum target = (textures[i] == BlockTextureArray || textures[i] == PigTextureArray) ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+		glBindTexture(target, textures[i]);
+		glTexParameteri(target, GL_TEXTURE_MIN_FILTER, (WhichFilter == BILINEAR) ? GL_LINEAR : GL_LINEAR_MIPMAP_LINEAR);
+		if (MaxAnisotropy > 1.)
+			glTexParameterf(target, GL_TEXTURE_MAX_ANISOTROPY_EXT, (WhichFilter == ANISOTROPIC) ? MaxAnisotropy : 1.f);
+		glBindTexture(target, 0);
+	}
+}
+
+
 // called when user resizes the window:
 
 void
@@ -2376,7 +4929,9 @@ struct bmfh
 	short bfReserved1;
 	short bfReserved2;
 	int bfOffBytes;		// # bytes to get to the start of the per-pixel data
-} FileHeader;
+};
+
+#define BMFH_SIZE		14	// bytes the file header takes up in the file (sizeof(struct bmfh) is padded)
 
 // bmp info header:
 struct bmih
@@ -2392,11 +4947,39 @@ struct bmih
 	int biYPixelsPerMeter;
 	int biClrUsed;		// # colors in the palette
 	int biClrImportant;
-} InfoHeader;
+};
+
 
+// turn one row of bgr pixels into rgb.
+// with ssse3, 5 pixels at a time are swapped with a single byte shuffle:
+// 16 bytes are loaded and stored, but only the first 15 are kept, the 16th
+// gets overwritten by the next group. the shuffle is only compiled in when the
+// compiler targets ssse3 (-mssse3 or -mavx with g++, /arch:AVX with msvc) --
+// without that it is all the plain loop
+
+void
+BgrToRgb(const unsigned char* bgr, unsigned char* rgb, int numPixels)
+{
+	int s = 0;
+#if defined(__SSSE3__) || defined(__AVX__)
+	const __m128i swap = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+	for (; s + 6 <= numPixels; s += 5)
+	{
+		__m128i pixels = _mm_loadu_si128((const __m128i*)(bgr + 3 * s));
+		_mm_storeu_si128((__m128i*)(rgb + 3 * s), _mm_shuffle_epi8(pixels, swap));
+	}
+#endif
+	for (; s < numPixels; s++)
+	{
+		rgb[3 * s + 0] = bgr[3 * s + 2];		// r
+		rgb[3 * s + 1] = bgr[3 * s + 1];		// g
+		rgb[3 * s + 2] = bgr[3 * s + 0];		// b
+	}
+}
 
 
 // read a BMP file into a Texture:
+// the whole file is read with one fread( ) and then decoded from memory
 
 unsigned char*
 BmpToTexture(char* filename, int* width, int* height)
@@ -2418,7 +5001,32 @@ BmpToTexture(char* filename, int* width, int* height)
 	}
 #endif
 
-	FileHeader.bfType = ReadShort(fp);
+	fseek(fp, 0, SEEK_END);
+	long fileSize = ftell(fp);
+	rewind(fp);
+	if (fileSize < BMFH_SIZE + 40)
+	{
+		fprintf(stderr, "Bmp file '%s' is too short to be a bmp\n", filename);
+		fclose(fp);
+		return NULL;
+	}
+
+	unsigned char* file = new unsigned char[fileSize];
+	size_t numRead = fread(file, 1, fileSize, fp);
+	fclose(fp);
+	if (numRead != (size_t)fileSize)
+	{
+		fprintf(stderr, "Cannot read Bmp file '%s'\n", filename);
+		delete[] file;
+		return NULL;
+	}
+
+	// the headers are local so that more than one file can be loaded at a time:
+
+	struct bmfh FileHeader;
+	struct bmih InfoHeader;
+
+	FileHeader.bfType = ReadShort(&file[0]);
 
 
 	// if bfType is not BMP_MAGIC_NUMBER, the file is not a bmp:
@@ -2428,84 +5036,85 @@ BmpToTexture(char* filename, int* width, int* height)
 	if (FileHeader.bfType != BMP_MAGIC_NUMBER)
 	{
 		fprintf(stderr, "Wrong type of file: 0x%0x\n", FileHeader.bfType);
-		fclose(fp);
+		delete[] file;
 		return NULL;
 	}
 
 
-	FileHeader.bfSize = ReadInt(fp);
+	FileHeader.bfSize = ReadInt(&file[2]);
 	if (VERBOSE)	fprintf(stderr, "FileHeader.bfSize = %d\n", FileHeader.bfSize);
 
-	FileHeader.bfReserved1 = ReadShort(fp);
-	FileHeader.bfReserved2 = ReadShort(fp);
+	FileHeader.bfReserved1 = ReadShort(&file[6]);
+	FileHeader.bfReserved2 = ReadShort(&file[8]);
 
-	FileHeader.bfOffBytes = ReadInt(fp);
+	FileHeader.bfOffBytes = ReadInt(&file[10]);
 	if (VERBOSE)	fprintf(stderr, "FileHeader.bfOffBytes = %d\n", FileHeader.bfOffBytes);
 
 
-	InfoHeader.biSize = ReadInt(fp);
+	InfoHeader.biSize = ReadInt(&file[14]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biSize = %d\n", InfoHeader.biSize);
-	InfoHeader.biWidth = ReadInt(fp);
+	InfoHeader.biWidth = ReadInt(&file[18]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biWidth = %d\n", InfoHeader.biWidth);
-	InfoHeader.biHeight = ReadInt(fp);
+	InfoHeader.biHeight = ReadInt(&file[22]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biHeight = %d\n", InfoHeader.biHeight);
 
 	const int nums = InfoHeader.biWidth;
 	const int numt = InfoHeader.biHeight;
 
-	InfoHeader.biPlanes = ReadShort(fp);
+	InfoHeader.biPlanes = ReadShort(&file[26]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biPlanes = %d\n", InfoHeader.biPlanes);
 
-	InfoHeader.biBitCount = ReadShort(fp);
+	InfoHeader.biBitCount = ReadShort(&file[28]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biBitCount = %d\n", InfoHeader.biBitCount);
 
-	InfoHeader.biCompression = ReadInt(fp);
+	InfoHeader.biCompression = ReadInt(&file[30]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biCompression = %d\n", InfoHeader.biCompression);
 
-	InfoHeader.biSizeImage = ReadInt(fp);
+	InfoHeader.biSizeImage = ReadInt(&file[34]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biSizeImage = %d\n", InfoHeader.biSizeImage);
 
-	InfoHeader.biXPixelsPerMeter = ReadInt(fp);
-	InfoHeader.biYPixelsPerMeter = ReadInt(fp);
+	InfoHeader.biXPixelsPerMeter = ReadInt(&file[38]);
+	InfoHeader.biYPixelsPerMeter = ReadInt(&file[42]);
 
-	InfoHeader.biClrUsed = ReadInt(fp);
+	InfoHeader.biClrUsed = ReadInt(&file[46]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biClrUsed = %d\n", InfoHeader.biClrUsed);
 
-	InfoHeader.biClrImportant = ReadInt(fp);
+	InfoHeader.biClrImportant = ReadInt(&file[50]);
 
 
 	// fprintf( stderr, "Image size found: %d x %d\n", ImageWidth, ImageHeight );
 
 
-	// pixels will be stored bottom-to-top, left-to-right:
-	unsigned char* texture = new unsigned char[3 * nums * numt];
-	if (texture == NULL)
+	// this function does not support compression:
+
+	if (InfoHeader.biCompression != 0)
 	{
-		fprintf(stderr, "Cannot allocate the texture array!\n");
+		fprintf(stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression);
+		delete[] file;
 		return NULL;
 	}
 
-	// extra padding bytes:
+
+	// each row is padded out to a multiple of 4 bytes:
 
 	int requiredRowSizeInBytes = 4 * ((InfoHeader.biBitCount * InfoHeader.biWidth + 31) / 32);
 	if (VERBOSE)	fprintf(stderr, "requiredRowSizeInBytes = %d\n", requiredRowSizeInBytes);
 
-	int myRowSizeInBytes = (InfoHeader.biBitCount * InfoHeader.biWidth + 7) / 8;
-	if (VERBOSE)	fprintf(stderr, "myRowSizeInBytes = %d\n", myRowSizeInBytes);
-
-	int oldNumExtra = 4 * (((3 * InfoHeader.biWidth) + 3) / 4) - 3 * InfoHeader.biWidth;
-	if (VERBOSE)	fprintf(stderr, "Old NumExtra padding = %d\n", oldNumExtra);
-
-	int numExtra = requiredRowSizeInBytes - myRowSizeInBytes;
-	if (VERBOSE)	fprintf(stderr, "New NumExtra padding = %d\n", numExtra);
-
+	if (nums <= 0 || numt <= 0 || FileHeader.bfOffBytes < 0 ||
+		(long)FileHeader.bfOffBytes + (long)requiredRowSizeInBytes * numt > fileSize)
+	{
+		fprintf(stderr, "Bmp file '%s' is too short for a %d x %d image\n", filename, nums, numt);
+		delete[] file;
+		return NULL;
+	}
 
-	// this function does not support compression:
 
-	if (InfoHeader.biCompression != 0)
+	// pixels will be stored bottom-to-top, left-to-right:
+	unsigned char* texture = new unsigned char[3 * nums * numt];
+	if (texture == NULL)
 	{
-		fprintf(stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression);
-		fclose(fp);
+		fprintf(stderr, "Cannot allocate the texture array!\n");
+		delete[] file;
 		return NULL;
 	}
 
@@ -2513,93 +5122,100 @@ BmpToTexture(char* filename, int* width, int* height)
 	// we can handle 24 bits of direct color:
 	if (InfoHeader.biBitCount == 24)
 	{
-		rewind(fp);
-		fseek(fp, FileHeader.bfOffBytes, SEEK_SET);
-		int t;
-		unsigned char* tp;
-		for (t = 0, tp = texture; t < numt; t++)
+		for (int t = 0; t < numt; t++)
 		{
-			for (int s = 0; s < nums; s++, tp += 3)
-			{
-				*(tp + 2) = fgetc(fp);		// b
-				*(tp + 1) = fgetc(fp);		// g
-				*(tp + 0) = fgetc(fp);		// r
-			}
-
-			for (int e = 0; e < numExtra; e++)
-			{
-				fgetc(fp);
-			}
+			const unsigned char* row = &file[FileHeader.bfOffBytes + requiredRowSizeInBytes * t];
+			BgrToRgb(row, &texture[3 * nums * t], nums);
 		}
 	}
 
 	// we can also handle 8 bits of indirect color:
+	// (the color table is stored as b, g, r, a)
 	if (InfoHeader.biBitCount == 8 && InfoHeader.biClrUsed == 256)
 	{
-		struct rgba32
-		{
-			unsigned char r, g, b, a;
-		};
-		struct rgba32* colorTable = new struct rgba32[InfoHeader.biClrUsed];
-
-		rewind(fp);
-		fseek(fp, sizeof(struct bmfh) + InfoHeader.biSize - 2, SEEK_SET);
-		for (int c = 0; c < InfoHeader.biClrUsed; c++)
+		const unsigned char* colorTable = &file[BMFH_SIZE + InfoHeader.biSize];
+		if (colorTable + 4 * InfoHeader.biClrUsed > file + fileSize)
 		{
-			colorTable[c].r = fgetc(fp);
-			colorTable[c].g = fgetc(fp);
-			colorTable[c].b = fgetc(fp);
-			colorTable[c].a = fgetc(fp);
-			if (VERBOSE)	fprintf(stderr, "%4d:\t0x%02x\t0x%02x\t0x%02x\t0x%02x\n",
-				c, colorTable[c].r, colorTable[c].g, colorTable[c].b, colorTable[c].a);
+			fprintf(stderr, "Bmp file '%s' is too short for its color table\n", filename);
+			delete[] texture;
+			delete[] file;
+			return NULL;
 		}
 
-		rewind(fp);
-		fseek(fp, FileHeader.bfOffBytes, SEEK_SET);
-		int t;
-		unsigned char* tp;
-		for (t = 0, tp = texture; t < numt; t++)
+		for (int t = 0; t < numt; t++)
 		{
+			const unsigned char* row = &file[FileHeader.bfOffBytes + requiredRowSizeInBytes * t];
+			unsigned char* tp = &texture[3 * nums * t];
 			for (int s = 0; s < nums; s++, tp += 3)
 			{
-				int index = fgetc(fp);
-				*(tp + 0) = colorTable[index].r;	// r
-				*(tp + 1) = colorTable[index].g;	// g
-				*(tp + 2) = colorTable[index].b;	// b
-			}
-
-			for (int e = 0; e < numExtra; e++)
-			{
-				fgetc(fp);
+				const unsigned char* color = &colorTable[4 * row[s]];
+				*(tp + 0) = color[2];	// r
+				*(tp + 1) = color[1];	// g
+				*(tp + 2) = color[0];	// b
 			}
 		}
-
-		delete[] colorTable;
 	}
 
-	fclose(fp);
+	delete[] file;
 
 	*width = nums;
 	*height = numt;
 	return texture;
 }
 
+
+// one thread of DecodeBmps( ) -- keep taking the next file no one has started on:
+
+void
+DecodeBmpsWorker(struct bmpload* bmps, int numBmps, std::atomic<int>* next)
+{
+	for (int b = (*next)++; b < numBmps; b = (*next)++)
+		bmps[b].texture = BmpToTexture(bmps[b].filename, &bmps[b].width, &bmps[b].height);
+}
+
+
+// decode a list of bmp files on a pool of threads, so the total time is about
+// the time of the biggest file, not the sum of them all. BmpToTexture( ) makes
+// no gl calls and keeps no global state, so it is safe to run this way.
+// returns the number of threads used:
+
+int
+DecodeBmps(struct bmpload* bmps, int numBmps)
+{
+	int numThreads = (int)std::thread::hardware_concurrency();
+	if (numThreads < 1)
+		numThreads = 1;
+	if (numThreads > numBmps)
+		numThreads = numBmps;
+
+	std::atomic<int> next(0);
+	std::thread* threads = new std::thread[numThreads];
+	for (int i = 0; i < numThreads; i++)
+		threads[i] = std::thread(DecodeBmpsWorker, bmps, numBmps, &next);
+	for (int i = 0; i < numThreads; i++)
+		threads[i].join();
+	delete[] threads;
+
+	return numThreads;
+}
+
+
+double
+MillisecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
 int
-ReadInt(FILE* fp)
+ReadInt(const unsigned char* p)
 {
-	const unsigned char b0 = fgetc(fp);
-	const unsigned char b1 = fgetc(fp);
-	const unsigned char b2 = fgetc(fp);
-	const unsigned char b3 = fgetc(fp);
-	return (b3 << 24) | (b2 << 16) | (b1 << 8) | b0;
+	return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
 }
 
 short
-ReadShort(FILE* fp)
+ReadShort(const unsigned char* p)
 {
-	const unsigned char b0 = fgetc(fp);
-	const unsigned char b1 = fgetc(fp);
-	return (b1 << 8) | b0;
+	return (p[1] << 8) | p[0];
 }
 
 
@@ -5,6 +5,10 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 
+#if defined(__SSSE3__) || defined(__AVX__)
+#include <tmmintrin.h>		// pshufb for the bmp bgr -> rgb swap
+#endif
+
 #ifdef WIN32
 #include <windows.h>
 #pragma warning(disable:4996)
@@ -14,6 +18,9 @@
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include "glut.h"
+#ifdef HEADLESS
+#include "headless.cpp"		// draw offscreen with egl instead of in a glut window (benchmarking)
+#endif
 
 
 //	This is a sample OpenGL / GLUT program
@@ -210,9 +217,10 @@ void	Visibility(int);
 
 void			Axes(float);
 unsigned char* BmpToTexture(char*, int*, int*);
+void			BgrToRgb(const unsigned char*, unsigned char*, int);
 void			HsvRgb(float[3], float[3]);
-int				ReadInt(FILE*);
-short			ReadShort(FILE*);
+int				ReadInt(const unsigned char*);
+short			ReadShort(const unsigned char*);
 
 void			Cross(float[3], float[3], float[3]);
 float			Dot(float[3], float[3]);
@@ -790,6 +798,7 @@ Keyboard(unsigned char c, int x, int y)
 
 	default:
 		fprintf(stderr, "Don't know what to do with keyboard hit: '%c' (0x%0x)\n", c, c);
+		return;			// nothing changed, so there is nothing to redraw
 	}
 
 	// force a call to Display( ):
@@ -854,8 +863,14 @@ MouseButton(int button, int state, int x, int y)
 		ActiveButton &= ~b;		// clear the proper bit
 	}
 
-	glutSetWindow(MainWindow);
-	glutPostRedisplay();
+	// pressing or letting go of a button only changes what the next moves do,
+	// but the wheel changes the scale right away:
+
+	if (button == SCROLL_WHEEL_UP || button == SCROLL_WHEEL_DOWN)
+	{
+		glutSetWindow(MainWindow);
+		glutPostRedisplay();
+	}
 
 }
 
@@ -890,8 +905,16 @@ MouseMotion(int x, int y)
 	Xmouse = x;			// new current position
 	Ymouse = y;
 
-	glutSetWindow(MainWindow);
-	glutPostRedisplay();
+	// glut calls this for every move, with or without a button down, and most of
+	// them change nothing on the screen. only the ones that turned or scaled the
+	// scene ask for a redraw, and however many of those come in before the next
+	// Display( ), glut still draws just once for them:
+
+	if ((dx != 0 || dy != 0) && (ActiveButton & (LEFT | MIDDLE)) != 0)
+	{
+		glutSetWindow(MainWindow);
+		glutPostRedisplay();
+	}
 }
 
 
@@ -1089,7 +1112,9 @@ struct bmfh
 	short bfReserved1;
 	short bfReserved2;
 	int bfOffBytes;		// # bytes to get to the start of the per-pixel data
-} FileHeader;
+};
+
+#define BMFH_SIZE		14	// bytes the file header takes up in the file (sizeof(struct bmfh) is padded)
 
 // bmp info header:
 struct bmih
@@ -1105,9 +1130,39 @@ struct bmih
 	int biYPixelsPerMeter;
 	int biClrUsed;		// # colors in the palette
 	int biClrImportant;
-} InfoHeader;
+};
+
+
+// turn one row of bgr pixels into rgb.
+// with ssse3, 5 pixels at a time are swapped with a single byte shuffle:
+// 16 bytes are loaded and stored, but only the first 15 are kept, the 16th
+// gets overwritten by the next group. the shuffle is only compiled in when the
+// compiler targets ssse3 (-mssse3 or -mavx with g++, /arch:AVX with msvc) --
+// without that it is all the plain loop
+
+void
+BgrToRgb(const unsigned char* bgr, unsigned char* rgb, int numPixels)
+{
+	int s = 0;
+#if defined(__SSSE3__) || defined(__AVX__)
+	const __m128i swap = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+	for (; s + 6 <= numPixels; s += 5)
+	{
+		__m128i pixels = _mm_loadu_si128((const __m128i*)(bgr + 3 * s));
+		_mm_storeu_si128((__m128i*)(rgb + 3 * s), _mm_shuffle_epi8(pixels, swap));
+	}
+#endif
+	for (; s < numPixels; s++)
+	{
+		rgb[3 * s + 0] = bgr[3 * s + 2];		// r
+		rgb[3 * s + 1] = bgr[3 * s + 1];		// g
+		rgb[3 * s + 2] = bgr[3 * s + 0];		// b
+	}
+}
+
 
 // read a BMP file into a Texture:
+// the whole file is read with one fread( ) and then decoded from memory
 
 unsigned char*
 BmpToTexture(char* filename, int* width, int* height)
@@ -1121,7 +1176,7 @@ BmpToTexture(char* filename, int* width, int* height)
 		return NULL;
 	}
 #else
-	FILE* fp = fopen(filename, "rb");
+	fp = fopen(filename, "rb");
 	if (fp == NULL)
 	{
 		fprintf(stderr, "Cannot open Bmp file '%s'\n", filename);
@@ -1129,7 +1184,33 @@ BmpToTexture(char* filename, int* width, int* height)
 	}
 #endif
 
-	FileHeader.bfType = ReadShort(fp);
+	fseek(fp, 0, SEEK_END);
+	long fileSize = ftell(fp);
+	rewind(fp);
+	if (fileSize < BMFH_SIZE + 40)
+	{
+		fprintf(stderr, "Bmp file '%s' is too short to be a bmp\n", filename);
+		fclose(fp);
+		return NULL;
+	}
+
+	unsigned char* file = new unsigned char[fileSize];
+	size_t numRead = fread(file, 1, fileSize, fp);
+	fclose(fp);
+	if (numRead != (size_t)fileSize)
+	{
+		fprintf(stderr, "Cannot read Bmp file '%s'\n", filename);
+		delete[] file;
+		return NULL;
+	}
+
+	// the headers are local so that more than one file can be loaded at a time:
+
+	struct bmfh FileHeader;
+	struct bmih InfoHeader;
+
+	FileHeader.bfType = ReadShort(&file[0]);
+
 
 	// if bfType is not BMP_MAGIC_NUMBER, the file is not a bmp:
 
@@ -1138,150 +1219,127 @@ BmpToTexture(char* filename, int* width, int* height)
 	if (FileHeader.bfType != BMP_MAGIC_NUMBER)
 	{
 		fprintf(stderr, "Wrong type of file: 0x%0x\n", FileHeader.bfType);
-		fclose(fp);
+		delete[] file;
 		return NULL;
 	}
 
-	FileHeader.bfSize = ReadInt(fp);
+
+	FileHeader.bfSize = ReadInt(&file[2]);
 	if (VERBOSE)	fprintf(stderr, "FileHeader.bfSize = %d\n", FileHeader.bfSize);
 
-	FileHeader.bfReserved1 = ReadShort(fp);
-	FileHeader.bfReserved2 = ReadShort(fp);
+	FileHeader.bfReserved1 = ReadShort(&file[6]);
+	FileHeader.bfReserved2 = ReadShort(&file[8]);
 
-	FileHeader.bfOffBytes = ReadInt(fp);
+	FileHeader.bfOffBytes = ReadInt(&file[10]);
 	if (VERBOSE)	fprintf(stderr, "FileHeader.bfOffBytes = %d\n", FileHeader.bfOffBytes);
 
-	InfoHeader.biSize = ReadInt(fp);
+
+	InfoHeader.biSize = ReadInt(&file[14]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biSize = %d\n", InfoHeader.biSize);
-	InfoHeader.biWidth = ReadInt(fp);
+	InfoHeader.biWidth = ReadInt(&file[18]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biWidth = %d\n", InfoHeader.biWidth);
-	InfoHeader.biHeight = ReadInt(fp);
+	InfoHeader.biHeight = ReadInt(&file[22]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biHeight = %d\n", InfoHeader.biHeight);
 
 	const int nums = InfoHeader.biWidth;
 	const int numt = InfoHeader.biHeight;
 
-	InfoHeader.biPlanes = ReadShort(fp);
+	InfoHeader.biPlanes = ReadShort(&file[26]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biPlanes = %d\n", InfoHeader.biPlanes);
 
-	InfoHeader.biBitCount = ReadShort(fp);
+	InfoHeader.biBitCount = ReadShort(&file[28]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biBitCount = %d\n", InfoHeader.biBitCount);
 
-	InfoHeader.biCompression = ReadInt(fp);
+	InfoHeader.biCompression = ReadInt(&file[30]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biCompression = %d\n", InfoHeader.biCompression);
 
-	InfoHeader.biSizeImage = ReadInt(fp);
+	InfoHeader.biSizeImage = ReadInt(&file[34]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biSizeImage = %d\n", InfoHeader.biSizeImage);
 
-	InfoHeader.biXPixelsPerMeter = ReadInt(fp);
-	InfoHeader.biYPixelsPerMeter = ReadInt(fp);
+	InfoHeader.biXPixelsPerMeter = ReadInt(&file[38]);
+	InfoHeader.biYPixelsPerMeter = ReadInt(&file[42]);
 
-	InfoHeader.biClrUsed = ReadInt(fp);
+	InfoHeader.biClrUsed = ReadInt(&file[46]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biClrUsed = %d\n", InfoHeader.biClrUsed);
 
-	InfoHeader.biClrImportant = ReadInt(fp);
+	InfoHeader.biClrImportant = ReadInt(&file[50]);
+
 
 	// fprintf( stderr, "Image size found: %d x %d\n", ImageWidth, ImageHeight );
 
-	// pixels will be stored bottom-to-top, left-to-right:
-	unsigned char* texture = new unsigned char[3 * nums * numt];
-	if (texture == NULL)
+
+	// this function does not support compression:
+
+	if (InfoHeader.biCompression != 0)
 	{
-		fprintf(stderr, "Cannot allocate the texture array!\n");
+		fprintf(stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression);
+		delete[] file;
 		return NULL;
 	}
 
-	// extra padding bytes:
+
+	// each row is padded out to a multiple of 4 bytes:
 
 	int requiredRowSizeInBytes = 4 * ((InfoHeader.biBitCount * InfoHeader.biWidth + 31) / 32);
 	if (VERBOSE)	fprintf(stderr, "requiredRowSizeInBytes = %d\n", requiredRowSizeInBytes);
 
-	int myRowSizeInBytes = (InfoHeader.biBitCount * InfoHeader.biWidth + 7) / 8;
-	if (VERBOSE)	fprintf(stderr, "myRowSizeInBytes = %d\n", myRowSizeInBytes);
-
-	int oldNumExtra = 4 * (((3 * InfoHeader.biWidth) + 3) / 4) - 3 * InfoHeader.biWidth;
-	if (VERBOSE)	fprintf(stderr, "Old NumExtra padding = %d\n", oldNumExtra);
-
-	int numExtra = requiredRowSizeInBytes - myRowSizeInBytes;
-	if (VERBOSE)	fprintf(stderr, "New NumExtra padding = %d\n", numExtra);
+	if (nums <= 0 || numt <= 0 || FileHeader.bfOffBytes < 0 ||
+		(long)FileHeader.bfOffBytes + (long)requiredRowSizeInBytes * numt > fileSize)
+	{
+		fprintf(stderr, "Bmp file '%s' is too short for a %d x %d image\n", filename, nums, numt);
+		delete[] file;
+		return NULL;
+	}
 
-	// this function does not support compression:
 
-	if (InfoHeader.biCompression != 0)
+	// pixels will be stored bottom-to-top, left-to-right:
+	unsigned char* texture = new unsigned char[3 * nums * numt];
+	if (texture == NULL)
 	{
-		fprintf(stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression);
-		fclose(fp);
+		fprintf(stderr, "Cannot allocate the texture array!\n");
+		delete[] file;
 		return NULL;
 	}
 
+
 	// we can handle 24 bits of direct color:
 	if (InfoHeader.biBitCount == 24)
 	{
-		rewind(fp);
-		fseek(fp, FileHeader.bfOffBytes, SEEK_SET);
-		int t;
-		unsigned char* tp;
-		for (t = 0, tp = texture; t < numt; t++)
+		for (int t = 0; t < numt; t++)
 		{
-			for (int s = 0; s < nums; s++, tp += 3)
-			{
-				*(tp + 2) = fgetc(fp);		// b
-				*(tp + 1) = fgetc(fp);		// g
-				*(tp + 0) = fgetc(fp);		// r
-			}
-
-			for (int e = 0; e < numExtra; e++)
-			{
-				fgetc(fp);
-			}
+			const unsigned char* row = &file[FileHeader.bfOffBytes + requiredRowSizeInBytes * t];
+			BgrToRgb(row, &texture[3 * nums * t], nums);
 		}
 	}
 
 	// we can also handle 8 bits of indirect color:
+	// (the color table is stored as b, g, r, a)
 	if (InfoHeader.biBitCount == 8 && InfoHeader.biClrUsed == 256)
 	{
-		struct rgba32
-		{
-			unsigned char r, g, b, a;
-		};
-		struct rgba32* colorTable = new struct rgba32[InfoHeader.biClrUsed];
-
-		rewind(fp);
-		fseek(fp, sizeof(struct bmfh) + InfoHeader.biSize - 2, SEEK_SET);
-		for (int c = 0; c < InfoHeader.biClrUsed; c++)
+		const unsigned char* colorTable = &file[BMFH_SIZE + InfoHeader.biSize];
+		if (colorTable + 4 * InfoHeader.biClrUsed > file + fileSize)
 		{
-			colorTable[c].r = fgetc(fp);
-			colorTable[c].g = fgetc(fp);
-			colorTable[c].b = fgetc(fp);
-			colorTable[c].a = fgetc(fp);
-			if (VERBOSE)	fprintf(stderr, "%4d:\t0x%02x\t0x%02x\t0x%02x\t0x%02x\n",
-				c, colorTable[c].r, colorTable[c].g, colorTable[c].b, colorTable[c].a);
+			fprintf(stderr, "Bmp file '%s' is too short for its color table\n", filename);
+			delete[] texture;
+			delete[] file;
+			return NULL;
 		}
 
-		rewind(fp);
-		fseek(fp, FileHeader.bfOffBytes, SEEK_SET);
-		int t;
-		unsigned char* tp;
-		for (t = 0, tp = texture; t < numt; t++)
+		for (int t = 0; t < numt; t++)
 		{
+			const unsigned char* row = &file[FileHeader.bfOffBytes + requiredRowSizeInBytes * t];
+			unsigned char* tp = &texture[3 * nums * t];
 			for (int s = 0; s < nums; s++, tp += 3)
 			{
-				int index = fgetc(fp);
-				*(tp + 0) = colorTable[index].r;	// r
-				*(tp + 1) = colorTable[index].g;	// g
-				*(tp + 2) = colorTable[index].b;	// b
-			}
-
-			for (int e = 0; e < numExtra; e++)
-			{
-				fgetc(fp);
+				const unsigned char* color = &colorTable[4 * row[s]];
+				*(tp + 0) = color[2];	// r
+				*(tp + 1) = color[1];	// g
+				*(tp + 2) = color[0];	// b
 			}
 		}
-
-		delete[] colorTable;
 	}
 
-	fclose(fp);
+	delete[] file;
 
 	*width = nums;
 	*height = numt;
@@ -1289,21 +1347,15 @@ BmpToTexture(char* filename, int* width, int* height)
 }
 
 int
-ReadInt(FILE* fp)
+ReadInt(const unsigned char* p)
 {
-	const unsigned char b0 = fgetc(fp);
-	const unsigned char b1 = fgetc(fp);
-	const unsigned char b2 = fgetc(fp);
-	const unsigned char b3 = fgetc(fp);
-	return (b3 << 24) | (b2 << 16) | (b1 << 8) | b0;
+	return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
 }
 
 short
-ReadShort(FILE* fp)
+ReadShort(const unsigned char* p)
 {
-	const unsigned char b0 = fgetc(fp);
-	const unsigned char b1 = fgetc(fp);
-	return (b1 << 8) | b0;
+	return (p[1] << 8) | p[0];
 }
 
 
@@ -1,10 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
 
+#if defined(__SSSE3__) || defined(__AVX__)
+#include <tmmintrin.h>		// pshufb for the bmp bgr -> rgb swap
+#endif
+
 #ifdef WIN32
 #include <windows.h>
 #pragma warning(disable:4996)
@@ -14,6 +23,10 @@
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include "glut.h"
+#ifdef HEADLESS
+#include "headless.cpp"		// draw offscreen with egl instead of in a glut window (benchmarking)
+#endif
+#include "timestep.cpp"		// fixed-timestep animation and the frame cap
 
 
 //	This is a sample OpenGL / GLUT program
@@ -164,6 +177,11 @@ const GLfloat FOGDENSITY = { 0.30f };
 const GLfloat FOGSTART = { 1.5 };
 const GLfloat FOGEND = { 4. };
 
+// helicopter lighting parameters:
+
+const GLfloat HELILIGHT[4] = { 0., 1., 0., 0. };			// straight down from above
+const GLfloat HELIAMBIENT[4] = { .25, .25, .25, 1. };
+
 
 // what options should we compile-in?
 // in general, you don't need to worry about these
@@ -176,7 +194,7 @@ const GLfloat FOGEND = { 4. };
 int		ActiveButton;			// current button that is down
 GLuint	AxesList;				// list to hold the axes
 int		AxesOn;					// != 0 means to draw the axes
-GLuint	HeliMoon;				// object display list
+GLuint	Planet;					// planet display list
 GLuint  TopBlade;               // top blade object list
 GLuint  RearBlade;              // rear blade object list
 int		DebugOn;				// != 0 means to print debugging info
@@ -192,7 +210,9 @@ int     WhichView;				// INSIDE or OUTSIDE
 int		Xmouse, Ymouse;			// mouse values
 float	Xrot, Yrot;				// rotation angles in degrees
 bool    Frozen;                 // current freeze status of animations
-float   BladeAngle;             // angle of blade in degrees for animations
+float   BladeAngle;             // angle of blade in degrees for animations, between the last 2 steps
+float   PrevBladeAngle;         // the angle at the next-to-last step
+float   NextBladeAngle;         // the angle at the last step
 
 #include "heli.550"
 
@@ -224,15 +244,1114 @@ void	Visibility(int);
 
 void			Axes(float);
 unsigned char* BmpToTexture(char*, int*, int*);
+void			BgrToRgb(const unsigned char*, unsigned char*, int);
 void			HsvRgb(float[3], float[3]);
-int				ReadInt(FILE*);
-short			ReadShort(FILE*);
+int				ReadInt(const unsigned char*);
+short			ReadShort(const unsigned char*);
 
 void			Cross(float[3], float[3], float[3]);
 float			Dot(float[3], float[3]);
 float			Unit(float[3], float[3]);
 
 
+// mesh optimizing, for any triangle mesh whose vertices start with their x, y, z.
+// after loading, the triangles are put in the order Tipsify (Sander, Nehab, and Barczak,
+// "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw") gives, which fans
+// around one vertex after another so the post-transform vertex cache keeps hitting.
+// where it runs into a dead end the cache has nothing useful in it anyway, so those are
+// the places the triangles are cut into clusters, and the clusters are then sorted to
+// draw the ones facing out from the middle of the mesh first, since they are the ones
+// most likely to hide the rest. last, the vertices are renumbered in the order the
+// triangles first use them, so fetching them walks forward through the buffer
+
+#define VERTEXCACHESIZE		16			// entries in the fifo cache Tipsify plans for and the ACMR is measured with
+
+struct meshcluster
+{
+	int		first, last;		// triangles [first,last)
+	float	outward;			// how much it faces away from the middle of the mesh
+};
+
+struct meshtriangle
+{
+	GLuint	v[3];				// turned so the lowest index is first, which keeps the winding
+};
+
+
+// average cache miss ratio: vertices transformed per triangle drawn, with a fifo cache
+// of VERTEXCACHESIZE. 3. is no reuse at all, and 0.5 is about the best a big grid can do:
+
+float
+MeshAcmr(const GLuint* indices, int numIndices, int numVerts)
+{
+	if (numIndices < 3)
+		return 0.;
+
+	int* inserted = new int[numVerts];			// the miss count when each vertex went into the cache
+	for (int v = 0; v < numVerts; v++)
+		inserted[v] = -VERTEXCACHESIZE;
+	int misses = 0;
+	for (int k = 0; k < numIndices; k++)
+	{
+		GLuint v = indices[k];
+		if (misses - inserted[v] >= VERTEXCACHESIZE)
+			inserted[v] = misses++;
+	}
+	delete[] inserted;
+	return (float)misses / (float)(numIndices / 3);
+}
+
+
+bool
+MeshClusterMoreOutward(const struct meshcluster& a, const struct meshcluster& b)
+{
+	return a.outward > b.outward;
+}
+
+
+bool
+MeshTriangleLess(const struct meshtriangle& a, const struct meshtriangle& b)
+{
+	for (int j = 0; j < 3; j++)
+	{
+		if (a.v[j] != b.v[j])
+			return a.v[j] < b.v[j];
+	}
+	return false;
+}
+
+
+// true if 2 index lists have the same triangles, each the same number of times, in any order:
+
+bool
+SameTriangles(const GLuint* a, const GLuint* b, int numIndices)
+{
+	int numTris = numIndices / 3;
+	struct meshtriangle* ta = new struct meshtriangle[numTris];
+	struct meshtriangle* tb = new struct meshtriangle[numTris];
+	for (int t = 0; t < numTris; t++)
+	{
+		const GLuint* pa = &a[3 * t];
+		const GLuint* pb = &b[3 * t];
+		int ra = (pa[1] < pa[0] && pa[1] <= pa[2]) ? 1 : (pa[2] < pa[0] && pa[2] < pa[1]) ? 2 : 0;
+		int rb = (pb[1] < pb[0] && pb[1] <= pb[2]) ? 1 : (pb[2] < pb[0] && pb[2] < pb[1]) ? 2 : 0;
+		for (int j = 0; j < 3; j++)
+		{
+			ta[t].v[j] = pa[(ra + j) % 3];
+			tb[t].v[j] = pb[(rb + j) % 3];
+		}
+	}
+	std::sort(ta, ta + numTris, MeshTriangleLess);
+	std::sort(tb, tb + numTris, MeshTriangleLess);
+	bool same = true;
+	for (int t = 0; t < numTris && same; t++)
+		same = !MeshTriangleLess(ta[t], tb[t]) && !MeshTriangleLess(tb[t], ta[t]);
+	delete[] ta;
+	delete[] tb;
+	return same;
+}
+
+
+// returns false if the reordering lost or repeated a triangle, and then the mesh is left as it was:
+
+bool
+OptimizeMesh(const char* name, GLuint* indices, int numIndices, void* verts, int numVerts, int vertexSize)
+{
+	int numTris = numIndices / 3;
+	if (numTris == 0)
+		return true;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	float acmrBefore = MeshAcmr(indices, numIndices, numVerts);
+	GLuint* original = new GLuint[numIndices];
+	memcpy(original, indices, numIndices * sizeof(GLuint));
+	char* bytes = (char*)verts;
+#define MESHPOSITION(v)		( (float*)( bytes + (size_t)(v) * vertexSize ) )
+
+	// which triangles each vertex is in, and how many of them are still to be drawn:
+
+	int* firstTri = new int[numVerts + 1];
+	int* triList = new int[numIndices];
+	int* live = new int[numVerts];
+	for (int v = 0; v < numVerts; v++)
+		live[v] = 0;
+	for (int k = 0; k < numIndices; k++)
+		live[indices[k]]++;
+	firstTri[0] = 0;
+	for (int v = 0; v < numVerts; v++)
+		firstTri[v + 1] = firstTri[v] + live[v];
+	int* next = new int[numVerts];
+	for (int v = 0; v < numVerts; v++)
+		next[v] = firstTri[v];
+	for (int k = 0; k < numIndices; k++)
+		triList[next[indices[k]]++] = k / 3;
+
+	// Tipsify:
+
+	GLuint* out = new GLuint[numIndices];
+	int* clusterStarts = new int[numTris + 1];
+	int* cached = new int[numVerts];			// the time each vertex went into the cache
+	bool* emitted = new bool[numTris];
+	int* deadEnds = new int[numIndices];		// recently used vertices, for when a fan runs out
+	int* candidates = new int[numIndices];
+	for (int v = 0; v < numVerts; v++)
+		cached[v] = 0;
+	for (int t = 0; t < numTris; t++)
+		emitted[t] = false;
+
+	// the first fan starts the first cluster, so a dead end only ever starts a later one:
+
+	clusterStarts[0] = 0;
+	int numOut = 0, numClusters = 1, numDeadEnds = 0;
+	int time = VERTEXCACHESIZE + 1;
+	int cursor = 0;
+	int fan = 0;
+	while (fan >= 0)
+	{
+		// draw all the triangles left around the fanning vertex:
+
+		int numCandidates = 0;
+		for (int k = firstTri[fan]; k < firstTri[fan + 1]; k++)
+		{
+			int t = triList[k];
+			if (emitted[t])
+				continue;
+			for (int j = 0; j < 3; j++)
+			{
+				int v = indices[3 * t + j];
+				out[numOut++] = v;
+				deadEnds[numDeadEnds++] = v;
+				candidates[numCandidates++] = v;
+				live[v]--;
+				if (time - cached[v] > VERTEXCACHESIZE)
+					cached[v] = time++;
+			}
+			emitted[t] = true;
+		}
+
+		// fan around the oldest of those that will still be in the cache
+		// after its own triangles are drawn:
+
+		int best = -1, bestPriority = -1;
+		for (int c = 0; c < numCandidates; c++)
+		{
+			int v = candidates[c];
+			if (live[v] <= 0)
+				continue;
+			int priority = 0;
+			if (time - cached[v] + 2 * live[v] <= VERTEXCACHESIZE)
+				priority = time - cached[v];
+			if (priority > bestPriority)
+			{
+				bestPriority = priority;
+				best = v;
+			}
+		}
+
+		// a dead end -- start a new cluster at the latest vertex that still has
+		// triangles, or failing that the next one in the vertex buffer:
+
+		if (best < 0)
+		{
+			while (best < 0 && numDeadEnds > 0)
+			{
+				int v = deadEnds[--numDeadEnds];
+				if (live[v] > 0)
+					best = v;
+			}
+			for (; best < 0 && cursor < numVerts; cursor++)
+			{
+				if (live[cursor] > 0)
+					best = cursor;
+			}
+			if (best >= 0 && clusterStarts[numClusters - 1] != numOut / 3)
+				clusterStarts[numClusters++] = numOut / 3;
+		}
+		fan = best;
+	}
+	clusterStarts[numClusters] = numTris;
+
+	// sort the clusters, most outward facing first. outward is how far the cluster's
+	// middle is from the middle of the mesh, along the cluster's area-weighted normal:
+
+	float middle[3] = { 0., 0., 0. };
+	for (int v = 0; v < numVerts; v++)
+	{
+		float* p = MESHPOSITION(v);
+		middle[0] += p[0] / (float)numVerts;
+		middle[1] += p[1] / (float)numVerts;
+		middle[2] += p[2] / (float)numVerts;
+	}
+	struct meshcluster* clusters = new struct meshcluster[numClusters];
+	for (int c = 0; c < numClusters; c++)
+	{
+		float center[3] = { 0., 0., 0. }, normal[3] = { 0., 0., 0. };
+		for (int t = clusterStarts[c]; t < clusterStarts[c + 1]; t++)
+		{
+			float* p0 = MESHPOSITION(out[3 * t + 0]);
+			float* p1 = MESHPOSITION(out[3 * t + 1]);
+			float* p2 = MESHPOSITION(out[3 * t + 2]);
+			float p01[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+			float p02[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+			float n[3];
+			Cross(p01, p02, n);
+			for (int i = 0; i < 3; i++)
+			{
+				normal[i] += n[i];
+				center[i] += (p0[i] + p1[i] + p2[i]) / 3.f;
+			}
+		}
+		int n = clusterStarts[c + 1] - clusterStarts[c];
+		float d[3] = { center[0] / n - middle[0], center[1] / n - middle[1], center[2] / n - middle[2] };
+		Unit(normal, normal);
+		clusters[c].first = clusterStarts[c];
+		clusters[c].last = clusterStarts[c + 1];
+		clusters[c].outward = Dot(d, normal);
+	}
+	std::stable_sort(clusters, clusters + numClusters, MeshClusterMoreOutward);
+	int k = 0;
+	for (int c = 0; c < numClusters; c++)
+	{
+		for (int i = 3 * clusters[c].first; i < 3 * clusters[c].last; i++)
+			indices[k++] = out[i];
+	}
+
+	// every triangle has to have come out exactly once:
+
+	bool ok = k == numIndices && SameTriangles(original, indices, numIndices);
+	if (!ok)
+	{
+		fprintf(stderr, "%s: reordering wrote %d of %d triangles or changed them -- leaving it unoptimized\n",
+			name, k / 3, numTris);
+		memcpy(indices, original, numIndices * sizeof(GLuint));
+		delete[] firstTri;
+		delete[] triList;
+		delete[] live;
+		delete[] next;
+		delete[] out;
+		delete[] clusterStarts;
+		delete[] cached;
+		delete[] emitted;
+		delete[] deadEnds;
+		delete[] candidates;
+		delete[] clusters;
+		delete[] original;
+		return false;
+	}
+
+	// renumber the vertices in the order they are first used, and move them to match:
+
+	int* renumber = next;
+	for (int v = 0; v < numVerts; v++)
+		renumber[v] = -1;
+	int numUsed = 0;
+	for (int i = 0; i < numIndices; i++)
+	{
+		if (renumber[indices[i]] < 0)
+			renumber[indices[i]] = numUsed++;
+		indices[i] = renumber[indices[i]];
+	}
+	for (int v = 0; v < numVerts; v++)
+	{
+		if (renumber[v] < 0)
+			renumber[v] = numUsed++;
+	}
+	char* moved = new char[(size_t)numVerts * vertexSize];
+	for (int v = 0; v < numVerts; v++)
+		memcpy(moved + (size_t)renumber[v] * vertexSize, bytes + (size_t)v * vertexSize, vertexSize);
+	memcpy(bytes, moved, (size_t)numVerts * vertexSize);
+#undef MESHPOSITION
+
+	fprintf(stderr, "%s: ACMR %.3f -> %.3f with a %d-vertex cache, %d triangles in %d clusters, in %.2f ms\n",
+		name, acmrBefore, MeshAcmr(indices, numIndices, numVerts), VERTEXCACHESIZE, numTris, numClusters,
+		std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+	delete[] firstTri;
+	delete[] triList;
+	delete[] live;
+	delete[] next;
+	delete[] out;
+	delete[] clusterStarts;
+	delete[] cached;
+	delete[] emitted;
+	delete[] deadEnds;
+	delete[] candidates;
+	delete[] clusters;
+	delete[] moved;
+	delete[] original;
+	return true;
+}
+
+
+// the helicopter from heli.550, as one indexed vertex buffer with smooth normals.
+// heli.550 repeats a point wherever its triangles meet at an edge, so the points are
+// welded on their coordinates first. then each triangle gets its normal, and each welded
+// point adds up the normals of the triangles around it. a triangle's cross product is as
+// long as twice its area, so big triangles count for more. both normal passes split
+// their loop across threads, and no 2 threads ever write the same thing:
+
+struct helivertex
+{
+	float x, y, z;		// coordinates
+	float nx, ny, nz;	// surface normal
+};
+
+struct helibuild
+{
+	struct helivertex*	verts;
+	GLuint*				indices;
+	float*				faceNormals;		// 3 per triangle, not unitized
+	int*				firstTri;			// where each vertex's triangles start in triList, and one more for where they all end
+	int*				triList;
+};
+
+// the helicopter's levels of detail: level 0 is all of heli.550, and the others are
+// simplified from it when it is loaded. each helicopter drawn keeps the level it was
+// drawn at last frame, so it can have some hysteresis:
+
+#define HELILODS			4
+
+const float HELILODTRIANGLES[HELILODS] = { 1.f, 0.35f, 0.12f, 0.04f };	// the fraction of the triangles each level keeps
+const float HELILODPIXELS[HELILODS] = { 0.f, 120.f, 50.f, 20.f };		// level i is for a bounding sphere less than this many pixels in radius
+const float HELILODHYSTERESIS = { 0.15f };		// how far past a switch point the size has to go before the level changes
+
+struct helilod
+{
+	GLuint	vbo;
+	GLuint	ibo;
+	int		numVertices;
+	int		numIndices;
+};
+
+struct helilod	HeliLods[HELILODS];
+float			HeliCenter[3];					// the bounding sphere, in heli.550 coordinates
+float			HeliRadius;
+bool			HeliLodOn;						// false means always draw level 0
+int				HeliLod;						// the level the helicopter itself is at
+float			HeliPixelScale;					// pixels of radius per unit, at 1 unit in front of the eye
+bool			HeliPerspective;				// false means the size on the screen does not depend on the distance
+int				HeliLodCounts[HELILODS];		// helicopters drawn at each level this frame
+
+
+// sorts heli.550's points so the ones in the same place are next to each other:
+
+bool
+HeliPointLess(int a, int b)
+{
+	struct point* pa = &Helipoints[a];
+	struct point* pb = &Helipoints[b];
+	if (pa->x != pb->x)
+		return pa->x < pb->x;
+	if (pa->y != pb->y)
+		return pa->y < pb->y;
+	return pa->z < pb->z;
+}
+
+
+void
+HeliFaceNormals(struct helibuild* b, int first, int last)
+{
+	for (int t = first; t < last; t++)
+	{
+		struct helivertex* v0 = &b->verts[b->indices[3 * t + 0]];
+		struct helivertex* v1 = &b->verts[b->indices[3 * t + 1]];
+		struct helivertex* v2 = &b->verts[b->indices[3 * t + 2]];
+		float v01[3] = { v1->x - v0->x, v1->y - v0->y, v1->z - v0->z };
+		float v02[3] = { v2->x - v0->x, v2->y - v0->y, v2->z - v0->z };
+		Cross(v01, v02, &b->faceNormals[3 * t]);
+	}
+}
+
+
+void
+HeliVertexNormals(struct helibuild* b, int first, int last)
+{
+	for (int v = first; v < last; v++)
+	{
+		float n[3] = { 0., 0., 0. };
+		for (int k = b->firstTri[v]; k < b->firstTri[v + 1]; k++)
+		{
+			float* fn = &b->faceNormals[3 * b->triList[k]];
+			n[0] += fn[0];
+			n[1] += fn[1];
+			n[2] += fn[2];
+		}
+		Unit(n, n);
+		b->verts[v].nx = n[0];
+		b->verts[v].ny = n[1];
+		b->verts[v].nz = n[2];
+	}
+}
+
+
+// run work( ) over [0,n) in one range per thread:
+
+void
+SplitAcrossThreads(void (*work)(struct helibuild*, int, int), struct helibuild* b, int n)
+{
+	int numThreads = (int)std::thread::hardware_concurrency();
+	if (numThreads > n / 256)
+		numThreads = n / 256;			// not worth starting a thread for fewer than this
+	if (numThreads < 1)
+		numThreads = 1;
+
+	std::thread* threads = new std::thread[numThreads];
+	for (int i = 1; i < numThreads; i++)
+		threads[i] = std::thread(work, b, n * i / numThreads, n * (i + 1) / numThreads);
+	work(b, 0, n / numThreads);			// this thread does the first range itself
+	for (int i = 1; i < numThreads; i++)
+		threads[i].join();
+	delete[] threads;
+}
+
+
+// optimize one level of the helicopter for the vertex cache, give it smooth normals,
+// and put it in its buffers. the vertices need only their coordinates filled in:
+
+void
+MakeHeliLod(int lod, struct helivertex* verts, int numVerts, GLuint* indices, int numIndices)
+{
+	char name[32];
+	sprintf(name, "Helicopter LOD %d", lod);
+
+	// the simplified levels are the likeliest to come apart into little separate pieces,
+	// so make sure every level still has all its triangles once they are reordered:
+
+	if (!OptimizeMesh(name, indices, numIndices, verts, numVerts, sizeof(struct helivertex)))
+		fprintf(stderr, "%s: drawing its %d triangles in the order they were made\n", name, numIndices / 3);
+
+	struct helibuild b;
+	b.verts = verts;
+	b.indices = indices;
+	int numTris = numIndices / 3;
+	b.faceNormals = new float[3 * numTris];
+	SplitAcrossThreads(HeliFaceNormals, &b, numTris);
+
+	// which triangles each vertex is in, all in one list:
+
+	b.firstTri = new int[numVerts + 1];
+	b.triList = new int[numIndices];
+	for (int v = 0; v <= numVerts; v++)
+		b.firstTri[v] = 0;
+	for (int k = 0; k < numIndices; k++)
+		b.firstTri[b.indices[k] + 1]++;
+	for (int v = 0; v < numVerts; v++)
+		b.firstTri[v + 1] += b.firstTri[v];
+	int* next = new int[numVerts];
+	for (int v = 0; v < numVerts; v++)
+		next[v] = b.firstTri[v];
+	for (int k = 0; k < numIndices; k++)
+		b.triList[next[b.indices[k]]++] = k / 3;
+
+	SplitAcrossThreads(HeliVertexNormals, &b, numVerts);
+
+	struct helilod* l = &HeliLods[lod];
+	l->numVertices = numVerts;
+	l->numIndices = numIndices;
+
+	glGenBuffers(1, &l->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, l->vbo);
+	glBufferData(GL_ARRAY_BUFFER, numVerts * sizeof(struct helivertex), verts, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glGenBuffers(1, &l->ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, l->ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices * sizeof(GLuint), indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	delete[] next;
+	delete[] b.faceNormals;
+	delete[] b.firstTri;
+	delete[] b.triList;
+}
+
+
+// quadric error simplifying (Garland and Heckbert, "Surface Simplification Using Quadric
+// Error Metrics"). each vertex keeps the sum of the squared distances to the planes of the
+// triangles around it, weighted by their areas, as a symmetric 4x4 matrix in 10 numbers.
+// the edge whose collapse adds the least to that goes first, and its 2 ends merge at the
+// point that minimizes it. an edge only one triangle uses also gets a steep plane at right
+// angles to that triangle, so open edges keep their shape. a collapse that would turn a
+// triangle over is skipped. the triangles around each vertex are a linked list through
+// the triangles' corners, so merging 2 vertices is just joining 2 lists
+
+#define QEMBOUNDARYWEIGHT	1000.
+
+struct quadric
+{
+	double	q[10];				// aa ab ac ad bb bc bd cc cd dd, for the plane ax + by + cz + d = 0
+};
+
+struct collapse
+{
+	double	cost;
+	int		a, b;				// the edge, a is the one that is kept
+	int		versionA, versionB;	// out of date if either end has changed since
+	float	p[3];				// where the merged vertex goes
+};
+
+struct qemmesh
+{
+	int					numVerts, numTris, numLiveTris;
+	float*				pos;				// 3 per vertex
+	GLuint*				tris;				// 3 per triangle
+	bool*				dead;				// per triangle
+	int*				firstCorner;		// per vertex, a corner (3 * triangle + 0, 1, or 2) it is at, or -1
+	int*				nextCorner;			// per corner, the next corner of the same vertex, or -1
+	struct quadric*		quadrics;
+	int*				version;			// per vertex, -1 once it has been merged away
+	struct collapse*	heap;
+	int					heapSize, heapCapacity;
+};
+
+
+void
+AddPlane(struct quadric* qd, double a, double b, double c, double d, double w)
+{
+	double* q = qd->q;
+	q[0] += w * a * a;	q[1] += w * a * b;	q[2] += w * a * c;	q[3] += w * a * d;
+	q[4] += w * b * b;	q[5] += w * b * c;	q[6] += w * b * d;
+	q[7] += w * c * c;	q[8] += w * c * d;
+	q[9] += w * d * d;
+}
+
+
+double
+QuadricError(const struct quadric* qd, const float p[3])
+{
+	const double* q = qd->q;
+	double x = p[0], y = p[1], z = p[2];
+	return q[0] * x * x + 2. * q[1] * x * y + 2. * q[2] * x * z + 2. * q[3] * x
+		+ q[4] * y * y + 2. * q[5] * y * z + 2. * q[6] * y
+		+ q[7] * z * z + 2. * q[8] * z + q[9];
+}
+
+
+bool
+CollapseCostMore(const struct collapse& c0, const struct collapse& c1)
+{
+	return c0.cost > c1.cost;		// so the heap has the cheapest on top
+}
+
+
+// put the collapse of edge (a,b) on the heap, with where the merged vertex would go:
+
+void
+QemPush(struct qemmesh* m, int a, int b)
+{
+	struct quadric q;
+	for (int i = 0; i < 10; i++)
+		q.q[i] = m->quadrics[a].q[i] + m->quadrics[b].q[i];
+
+	// the best of the ends and the middle, and the point that minimizes the error
+	// if there is one and it is not off somewhere far from the edge:
+
+	float* pa = &m->pos[3 * a];
+	float* pb = &m->pos[3 * b];
+	float mid[3] = { (pa[0] + pb[0]) / 2.f, (pa[1] + pb[1]) / 2.f, (pa[2] + pb[2]) / 2.f };
+	float* tries[3] = { pa, pb, mid };
+	struct collapse c;
+	c.cost = -1.;
+	for (int i = 0; i < 3; i++)
+	{
+		double e = QuadricError(&q, tries[i]);
+		if (c.cost < 0. || e < c.cost)
+		{
+			c.cost = e;
+			c.p[0] = tries[i][0];	c.p[1] = tries[i][1];	c.p[2] = tries[i][2];
+		}
+	}
+
+	double* k = q.q;
+	double det = k[0] * (k[4] * k[7] - k[5] * k[5]) - k[1] * (k[1] * k[7] - k[5] * k[2]) + k[2] * (k[1] * k[5] - k[4] * k[2]);
+	if (det != 0.)
+	{
+		// Cramer's rule on [ aa ab ac; ab bb bc; ac bc cc ] p = -[ ad bd cd ]:
+
+		double r0 = -k[3], r1 = -k[6], r2 = -k[8];
+		float p[3];
+		p[0] = (float)((r0 * (k[4] * k[7] - k[5] * k[5]) - k[1] * (r1 * k[7] - k[5] * r2) + k[2] * (r1 * k[5] - k[4] * r2)) / det);
+		p[1] = (float)((k[0] * (r1 * k[7] - k[5] * r2) - r0 * (k[1] * k[7] - k[5] * k[2]) + k[2] * (k[1] * r2 - r1 * k[2])) / det);
+		p[2] = (float)((k[0] * (k[4] * r2 - r1 * k[5]) - k[1] * (k[1] * r2 - r1 * k[2]) + r0 * (k[1] * k[5] - k[4] * k[2])) / det);
+		float dx = p[0] - mid[0], dy = p[1] - mid[1], dz = p[2] - mid[2];
+		float ex = pb[0] - pa[0], ey = pb[1] - pa[1], ez = pb[2] - pa[2];
+		double e = QuadricError(&q, p);
+		if (dx * dx + dy * dy + dz * dz <= ex * ex + ey * ey + ez * ez && e < c.cost)
+		{
+			c.cost = e;
+			c.p[0] = p[0];	c.p[1] = p[1];	c.p[2] = p[2];
+		}
+	}
+
+	c.a = a;
+	c.b = b;
+	c.versionA = m->version[a];
+	c.versionB = m->version[b];
+
+	if (m->heapSize == m->heapCapacity)
+	{
+		m->heapCapacity *= 2;
+		struct collapse* bigger = new struct collapse[m->heapCapacity];
+		memcpy(bigger, m->heap, m->heapSize * sizeof(struct collapse));
+		delete[] m->heap;
+		m->heap = bigger;
+	}
+	m->heap[m->heapSize++] = c;
+	std::push_heap(m->heap, m->heap + m->heapSize, CollapseCostMore);
+}
+
+
+// true if moving vertex v to p turns over one of its triangles that edge (v,other) is not in:
+
+bool
+QemFlips(struct qemmesh* m, int v, int other, const float p[3])
+{
+	for (int k = m->firstCorner[v]; k >= 0; k = m->nextCorner[k])
+	{
+		int t = k / 3;
+		if (m->dead[t])
+			continue;
+		GLuint* tri = &m->tris[3 * t];
+		if (tri[0] == (GLuint)other || tri[1] == (GLuint)other || tri[2] == (GLuint)other)
+			continue;
+
+		int j = k % 3;
+		float* p1 = &m->pos[3 * tri[(j + 1) % 3]];
+		float* p2 = &m->pos[3 * tri[(j + 2) % 3]];
+		float* p0 = &m->pos[3 * v];
+		float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+		float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+		float f1[3] = { p1[0] - p[0], p1[1] - p[1], p1[2] - p[2] };
+		float f2[3] = { p2[0] - p[0], p2[1] - p[1], p2[2] - p[2] };
+		float before[3], after[3];
+		Cross(e1, e2, before);
+		Cross(f1, f2, after);
+		if (Dot(before, after) <= 0.)
+			return true;
+	}
+	return false;
+}
+
+
+// merge b into a at c->p:
+
+void
+QemCollapse(struct qemmesh* m, struct collapse* c)
+{
+	int a = c->a, b = c->b;
+	m->pos[3 * a + 0] = c->p[0];
+	m->pos[3 * a + 1] = c->p[1];
+	m->pos[3 * a + 2] = c->p[2];
+	for (int i = 0; i < 10; i++)
+		m->quadrics[a].q[i] += m->quadrics[b].q[i];
+
+	// the triangles with both ends in them are gone, and the rest of b's are a's now:
+
+	int last = -1;
+	for (int k = m->firstCorner[b]; k >= 0; k = m->nextCorner[k])
+	{
+		last = k;
+		int t = k / 3;
+		if (m->dead[t])
+			continue;
+		GLuint* tri = &m->tris[3 * t];
+		if (tri[0] == (GLuint)a || tri[1] == (GLuint)a || tri[2] == (GLuint)a)
+		{
+			m->dead[t] = true;
+			m->numLiveTris--;
+		}
+		else
+			m->tris[k] = a;
+	}
+	if (last >= 0)
+	{
+		m->nextCorner[last] = m->firstCorner[a];
+		m->firstCorner[a] = m->firstCorner[b];
+	}
+	m->firstCorner[b] = -1;
+	m->version[a]++;
+	m->version[b] = -1;
+
+	// a's edges all cost something different now:
+
+	for (int k = m->firstCorner[a]; k >= 0; k = m->nextCorner[k])
+	{
+		int t = k / 3;
+		if (m->dead[t])
+			continue;
+		int j = k % 3;
+		QemPush(m, a, m->tris[3 * t + (j + 1) % 3]);
+		QemPush(m, a, m->tris[3 * t + (j + 2) % 3]);
+	}
+}
+
+
+struct qemedge
+{
+	int		a, b;				// a < b
+	int		t;
+};
+
+bool
+QemEdgeLess(const struct qemedge& e0, const struct qemedge& e1)
+{
+	if (e0.a != e1.a)
+		return e0.a < e1.a;
+	return e0.b < e1.b;
+}
+
+
+// make levels 1 and up from level 0, collapsing edges until each one has its
+// share of the triangles:
+
+void
+SimplifyHeli(const struct helivertex* verts, int numVerts, const GLuint* indices, int numIndices)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	struct qemmesh m;
+	m.numVerts = numVerts;
+	m.numTris = m.numLiveTris = numIndices / 3;
+	m.pos = new float[3 * numVerts];
+	m.tris = new GLuint[numIndices];
+	m.dead = new bool[m.numTris];
+	m.firstCorner = new int[numVerts];
+	m.nextCorner = new int[numIndices];
+	m.quadrics = new struct quadric[numVerts];
+	m.version = new int[numVerts];
+	m.heapCapacity = 2 * numIndices + 16;
+	m.heap = new struct collapse[m.heapCapacity];
+	m.heapSize = 0;
+
+	for (int v = 0; v < numVerts; v++)
+	{
+		m.pos[3 * v + 0] = verts[v].x;
+		m.pos[3 * v + 1] = verts[v].y;
+		m.pos[3 * v + 2] = verts[v].z;
+		m.firstCorner[v] = -1;
+		m.version[v] = 0;
+		for (int i = 0; i < 10; i++)
+			m.quadrics[v].q[i] = 0.;
+	}
+	memcpy(m.tris, indices, numIndices * sizeof(GLuint));
+	for (int k = numIndices - 1; k >= 0; k--)
+	{
+		m.nextCorner[k] = m.firstCorner[indices[k]];
+		m.firstCorner[indices[k]] = k;
+	}
+
+	// every triangle's plane goes in the quadrics of its 3 corners:
+
+	float* normals = new float[3 * m.numTris];			// not unitized, as long as twice the area
+	for (int t = 0; t < m.numTris; t++)
+	{
+		m.dead[t] = false;
+		float* p0 = &m.pos[3 * indices[3 * t + 0]];
+		float* p1 = &m.pos[3 * indices[3 * t + 1]];
+		float* p2 = &m.pos[3 * indices[3 * t + 2]];
+		float p01[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+		float p02[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+		float* n = &normals[3 * t];
+		Cross(p01, p02, n);
+		float plane[3];
+		float area = Unit(n, plane) / 2.f;
+		double d = -(plane[0] * p0[0] + plane[1] * p0[1] + plane[2] * p0[2]);
+		for (int j = 0; j < 3; j++)
+			AddPlane(&m.quadrics[indices[3 * t + j]], plane[0], plane[1], plane[2], d, area);
+	}
+
+	// the edges, sorted so the same edge from its 2 triangles ends up together:
+
+	struct qemedge* edges = new struct qemedge[numIndices];
+	for (int k = 0; k < numIndices; k++)
+	{
+		int a = indices[k];
+		int b = indices[3 * (k / 3) + (k + 1) % 3];
+		edges[k].a = a < b ? a : b;
+		edges[k].b = a < b ? b : a;
+		edges[k].t = k / 3;
+	}
+	std::sort(edges, edges + numIndices, QemEdgeLess);
+	for (int k = 0; k < numIndices; )
+	{
+		int n = 1;
+		while (k + n < numIndices && edges[k + n].a == edges[k].a && edges[k + n].b == edges[k].b)
+			n++;
+		if (n == 1)
+		{
+			// an open edge -- a plane through it, at right angles to its triangle:
+
+			float* pa = &m.pos[3 * edges[k].a];
+			float* pb = &m.pos[3 * edges[k].b];
+			float e[3] = { pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2] };
+			float side[3];
+			Cross(e, &normals[3 * edges[k].t], side);
+			float length = Unit(side, side);
+			if (length > 0.)
+			{
+				double d = -(side[0] * pa[0] + side[1] * pa[1] + side[2] * pa[2]);
+				double w = QEMBOUNDARYWEIGHT * Dot(e, e);
+				AddPlane(&m.quadrics[edges[k].a], side[0], side[1], side[2], d, w);
+				AddPlane(&m.quadrics[edges[k].b], side[0], side[1], side[2], d, w);
+			}
+		}
+		k += n;
+	}
+	for (int k = 0; k < numIndices; k++)
+	{
+		if (k == 0 || edges[k].a != edges[k - 1].a || edges[k].b != edges[k - 1].b)
+			QemPush(&m, edges[k].a, edges[k].b);
+	}
+
+	int* renumber = new int[numVerts];
+	struct helivertex* lodVerts = new struct helivertex[numVerts];
+	GLuint* lodIndices = new GLuint[numIndices];
+	for (int lod = 1; lod < HELILODS; lod++)
+	{
+		int target = (int)(HELILODTRIANGLES[lod] * (float)m.numTris);
+		while (m.numLiveTris > target && m.heapSize > 0)
+		{
+			std::pop_heap(m.heap, m.heap + m.heapSize, CollapseCostMore);
+			struct collapse c = m.heap[--m.heapSize];
+			if (m.version[c.a] != c.versionA || m.version[c.b] != c.versionB)
+				continue;
+			if (QemFlips(&m, c.a, c.b, c.p) || QemFlips(&m, c.b, c.a, c.p))
+				continue;
+			QemCollapse(&m, &c);
+		}
+
+		// the triangles that are left, on just the vertices they use:
+
+		for (int v = 0; v < numVerts; v++)
+			renumber[v] = -1;
+		int nv = 0, ni = 0;
+		for (int t = 0; t < m.numTris; t++)
+		{
+			if (m.dead[t])
+				continue;
+			for (int j = 0; j < 3; j++)
+			{
+				int v = m.tris[3 * t + j];
+				if (renumber[v] < 0)
+				{
+					renumber[v] = nv;
+					lodVerts[nv].x = m.pos[3 * v + 0];
+					lodVerts[nv].y = m.pos[3 * v + 1];
+					lodVerts[nv].z = m.pos[3 * v + 2];
+					nv++;
+				}
+				lodIndices[ni++] = renumber[v];
+			}
+		}
+		MakeHeliLod(lod, lodVerts, nv, lodIndices, ni);
+	}
+
+	fprintf(stderr, "Helicopter LODs:");
+	for (int lod = 0; lod < HELILODS; lod++)
+		fprintf(stderr, " %d", HeliLods[lod].numIndices / 3);
+	fprintf(stderr, " triangles, simplified in %.2f ms\n",
+		std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+	delete[] m.pos;
+	delete[] m.tris;
+	delete[] m.dead;
+	delete[] m.firstCorner;
+	delete[] m.nextCorner;
+	delete[] m.quadrics;
+	delete[] m.version;
+	delete[] m.heap;
+	delete[] normals;
+	delete[] edges;
+	delete[] renumber;
+	delete[] lodVerts;
+	delete[] lodIndices;
+}
+
+
+void
+InitHeli()
+{
+	// heli.550 does not say how many points it has, so go by the triangles:
+
+	int numPts = 0;
+	for (int i = 0; i < Helintris; i++)
+	{
+		struct tri* tp = &Helitris[i];
+		int most = std::max(tp->p0, std::max(tp->p1, tp->p2));
+		if (most >= numPts)
+			numPts = most + 1;
+	}
+
+	// weld the points that are in the same place:
+
+	int* order = new int[numPts];
+	for (int i = 0; i < numPts; i++)
+		order[i] = i;
+	std::sort(order, order + numPts, HeliPointLess);
+
+	struct helivertex* verts = new struct helivertex[numPts];
+	int* weld = new int[numPts];
+	int numVerts = 0;
+	for (int k = 0; k < numPts; k++)
+	{
+		int i = order[k];
+		if (k == 0 || HeliPointLess(order[k - 1], i))
+		{
+			struct helivertex* v = &verts[numVerts++];
+			v->x = Helipoints[i].x;
+			v->y = Helipoints[i].y;
+			v->z = Helipoints[i].z;
+		}
+		weld[i] = numVerts - 1;
+	}
+
+	// the triangles on the welded points, less any that welding squashed flat:
+
+	GLuint* indices = new GLuint[3 * Helintris];
+	int numIndices = 0;
+	for (int i = 0; i < Helintris; i++)
+	{
+		int a0 = weld[Helitris[i].p0];
+		int a1 = weld[Helitris[i].p1];
+		int a2 = weld[Helitris[i].p2];
+		if (a0 == a1 || a1 == a2 || a2 == a0)
+			continue;
+		indices[numIndices++] = a0;
+		indices[numIndices++] = a1;
+		indices[numIndices++] = a2;
+	}
+	if (DebugOn != 0)
+		fprintf(stderr, "Helicopter: %d points welded to %d, %d triangles\n", numPts, numVerts, numIndices / 3);
+
+	// the bounding sphere, around the middle of the bounding box:
+
+	float lo[3] = { verts[0].x, verts[0].y, verts[0].z };
+	float hi[3] = { verts[0].x, verts[0].y, verts[0].z };
+	for (int v = 1; v < numVerts; v++)
+	{
+		lo[0] = std::min(lo[0], verts[v].x);	hi[0] = std::max(hi[0], verts[v].x);
+		lo[1] = std::min(lo[1], verts[v].y);	hi[1] = std::max(hi[1], verts[v].y);
+		lo[2] = std::min(lo[2], verts[v].z);	hi[2] = std::max(hi[2], verts[v].z);
+	}
+	HeliRadius = 0.;
+	for (int i = 0; i < 3; i++)
+		HeliCenter[i] = (lo[i] + hi[i]) / 2.f;
+	for (int v = 0; v < numVerts; v++)
+	{
+		float d[3] = { verts[v].x - HeliCenter[0], verts[v].y - HeliCenter[1], verts[v].z - HeliCenter[2] };
+		HeliRadius = std::max(HeliRadius, sqrtf(Dot(d, d)));
+	}
+
+	MakeHeliLod(0, verts, numVerts, indices, numIndices);
+	SimplifyHeli(verts, numVerts, indices, numIndices);
+
+	delete[] order;
+	delete[] weld;
+	delete[] verts;
+	delete[] indices;
+}
+
+
+// how many pixels of radius a helicopter's bounding sphere covers, for this frame's
+// projection and viewport. call it after they are set:
+
+void
+SetHeliPixelScale()
+{
+	float p[16];
+	GLint viewport[4];
+	glGetFloatv(GL_PROJECTION_MATRIX, p);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	HeliPixelScale = p[5] * (float)viewport[3] / 2.f;
+	HeliPerspective = p[11] != 0.;
+	for (int lod = 0; lod < HELILODS; lod++)
+		HeliLodCounts[lod] = 0;
+}
+
+
+// pick the level for a helicopter the modelview matrix has already put in place.
+// *lod is the level it was at last frame. it goes coarser only once its size is
+// HELILODHYSTERESIS under the switch point, and finer only once it is that far
+// over, so a helicopter sitting right at a switch point does not flicker:
+
+void
+PickHeliLod(int* lod)
+{
+	if (!HeliLodOn)
+	{
+		*lod = 0;
+		return;
+	}
+
+	float mv[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+	float z = mv[2] * HeliCenter[0] + mv[6] * HeliCenter[1] + mv[10] * HeliCenter[2] + mv[14];
+	float scale = sqrtf(mv[0] * mv[0] + mv[1] * mv[1] + mv[2] * mv[2]);
+	float pixels = HeliRadius * scale * HeliPixelScale;
+	if (HeliPerspective)
+		pixels /= std::max(-z, 0.001f);
+
+	while (*lod > 0 && pixels > HELILODPIXELS[*lod] * (1.f + HELILODHYSTERESIS))
+		(*lod)--;
+	while (*lod < HELILODS - 1 && pixels < HELILODPIXELS[*lod + 1] * (1.f - HELILODHYSTERESIS))
+		(*lod)++;
+}
+
+
+// a helicopter, turned the way it always has been, in one draw at the level *lod picks:
+
+void
+DrawHeli(int* lod)
+{
+	glPushMatrix();
+	glTranslatef(0., -1., 0.);
+	glRotatef(97., 0., 1., 0.);
+	glRotatef(-15., 0., 0., 1.);
+	PickHeliLod(lod);
+	HeliLodCounts[*lod]++;
+
+	struct helilod* l = &HeliLods[*lod];
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, l->ibo);
+	glBindBuffer(GL_ARRAY_BUFFER, l->vbo);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(struct helivertex), (void*)offsetof(struct helivertex, x));
+	glNormalPointer(GL_FLOAT, sizeof(struct helivertex), (void*)offsetof(struct helivertex, nx));
+	glDrawElements(GL_TRIANGLES, l->numIndices, GL_UNSIGNED_INT, (void*)0);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glPopMatrix();
+}
+
+
+// the swarm: a benchmark of SWARMX x SWARMZ more helicopters, in rows going off
+// towards the planet, so most of them are small on the screen:
+
+#define SWARMX				40
+#define SWARMZ				25
+
+const float SWARMSPACING = { 12.f };
+
+bool	SwarmOn;
+int		SwarmLods[SWARMX * SWARMZ];
+
+
+void
+DrawSwarm()
+{
+	for (int i = 0; i < SWARMX; i++)
+	{
+		for (int j = 0; j < SWARMZ; j++)
+		{
+			glPushMatrix();
+			glTranslatef(SWARMSPACING * ((float)i - (float)(SWARMX - 1) / 2.f), 0., -SWARMSPACING * (float)(j + 1));
+			DrawHeli(&SwarmLods[SWARMZ * i + j]);
+			glPopMatrix();
+		}
+	}
+}
+
+
 // main program:
 
 int
@@ -252,6 +1371,19 @@ main(int argc, char* argv[])
 
 	Reset();
 
+	// -swarm starts with the swarm on, and -nolod draws every helicopter at full
+	// detail (for benchmarking the two against each other):
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-swarm") == 0)
+			SwarmOn = true;
+		else if (strcmp(argv[i], "-nolod") == 0)
+			HeliLodOn = false;
+		else
+			fprintf(stderr, "Unknown argument: '%s'\n", argv[i]);
+	}
+
 	// create the display structures that will not change:
 
 	InitLists();
@@ -291,7 +1423,17 @@ Animate()
 	ms %= MS_IN_THE_ANIMATION_CYCLE;				// milliseconds in the range 0 to MS_IN_THE_ANIMATION_CYCLE-1
 	Time = (float)ms / (float)MS_IN_THE_ANIMATION_CYCLE;        // [ 0., 1. )
 
-	BladeAngle += 2;
+	// the blade turns 2 degrees a step, 120 degrees a second:
+
+	int steps = CountSteps();
+	for (int i = 0; i < steps; i++)
+	{
+		PrevBladeAngle = NextBladeAngle;
+		NextBladeAngle += 2;
+	}
+	BladeAngle = PrevBladeAngle + StepAlpha * (NextBladeAngle - PrevBladeAngle);
+	CapFrameRate();
+
 	// force a call to Display( ) next time it is convenient:
 	glFlush();
 	glutSetWindow(MainWindow);
@@ -348,6 +1490,7 @@ Display()
 		glOrtho(-50., 50., -50., 50., 0.1, 1000.);
 	else
 		gluPerspective(90., 1., 0.1, 1000.);
+	SetHeliPixelScale();
 
 
 
@@ -408,9 +1551,27 @@ Display()
 
 	glEnable(GL_NORMALIZE);
 
-	// draw the helicopter and planet:
+	// draw the helicopter (and the swarm), lit from above with a little ambient so
+	// its underside is not black, and smooth shaded since its normals are smooth.
+	// then the planet:
+
+	glLightfv(GL_LIGHT0, GL_POSITION, HELILIGHT);
+	glLightModelfv(GL_LIGHT_MODEL_AMBIENT, HELIAMBIENT);
+	glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
+	glEnable(GL_LIGHT0);
+	glEnable(GL_LIGHTING);
+	glEnable(GL_COLOR_MATERIAL);
+	glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
+	glColor3f(.5, 0., 1.);
+	glShadeModel(GL_SMOOTH);
+	DrawHeli(&HeliLod);
+	if (SwarmOn)
+		DrawSwarm();
+	glShadeModel(GL_FLAT);
+	glDisable(GL_COLOR_MATERIAL);
+	glDisable(GL_LIGHTING);
 
-	glCallList(HeliMoon);
+	glCallList(Planet);
 
 	// draw the top blade spinning
 
@@ -435,7 +1596,8 @@ Display()
 	{
 		glPushMatrix();
 		glRotatef(90., 0., 1., 0.);
-		glCallList(HeliMoon);
+		DrawHeli(&HeliLod);
+		glCallList(Planet);
 		glPopMatrix();
 	}
 #endif
@@ -463,6 +1625,14 @@ Display()
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 	glColor3f(1., 1., 1.);
+	if (SwarmOn)
+	{
+		char counts[64];
+		sprintf(counts, "Helicopters at LOD 0-3: %d %d %d %d", HeliLodCounts[0], HeliLodCounts[1], HeliLodCounts[2], HeliLodCounts[3]);
+		DoRasterString(5., 95., 0., counts);
+	}
+	DoRasterString(5., 40., 0., (char*)"( S ) - Swarm of 1000");
+	DoRasterString(5., 35., 0., (char*)"( L ) - Levels of Detail");
 	DoRasterString(5., 30., 0., (char*)"( I ) - Inside View");
 	DoRasterString(5., 25., 0., (char*)"( O ) - Outside View");
 	DoRasterString(5., 20., 0., (char*)"( F ) - Freeze Animation");
@@ -780,49 +1950,12 @@ InitLists()
 
 	// create the Helicopter:
 
-	HeliMoon = glGenLists(1);
-	glNewList(HeliMoon, GL_COMPILE);
+	InitHeli();
 
-	// code used to create heli from http://web.engr.oregonstate.edu/~mjb/cs550/Projects/proj02.html
+	// the planet is in a display list, since it is all glut solids:
 
-	int i;
-	struct point* p0, * p1, * p2;
-	struct tri* tp;
-	float p01[3], p02[3], n[3];
-
-	glPushMatrix();
-	glTranslatef(0., -1., 0.);
-	glRotatef(97., 0., 1., 0.);
-	glRotatef(-15., 0., 0., 1.);
-	glBegin(GL_TRIANGLES);
-	for (i = 0, tp = Helitris; i < Helintris; i++, tp++)
-	{
-		p0 = &Helipoints[tp->p0];
-		p1 = &Helipoints[tp->p1];
-		p2 = &Helipoints[tp->p2];
-
-		// fake "lighting" from above:
-
-		p01[0] = p1->x - p0->x;
-		p01[1] = p1->y - p0->y;
-		p01[2] = p1->z - p0->z;
-		p02[0] = p2->x - p0->x;
-		p02[1] = p2->y - p0->y;
-		p02[2] = p2->z - p0->z;
-		Cross(p01, p02, n);
-		Unit(n, n);
-		n[1] = fabs(n[1]);
-		n[1] += .25;
-		if (n[1] > 1.)
-			n[1] = 1.;
-		glColor3f(.5, 0., n[1]);
-
-		glVertex3f(p0->x, p0->y, p0->z);
-		glVertex3f(p1->x, p1->y, p1->z);
-		glVertex3f(p2->x, p2->y, p2->z);
-	}
-	glEnd();
-	glPopMatrix();
+	Planet = glGenLists(1);
+	glNewList(Planet, GL_COMPILE);
 
 	// create planet in the far -z direction
 
@@ -938,7 +2071,10 @@ Keyboard(unsigned char c, int x, int y)
 		if (Frozen)
 			glutIdleFunc(NULL);
 		else
+		{
+			LastStepMs = -1;
 			glutIdleFunc(Animate);
+		}
 		break;
 
 	case 'p':
@@ -951,6 +2087,16 @@ Keyboard(unsigned char c, int x, int y)
 		Reset();
 		break;
 
+	case 's':
+	case 'S':
+		SwarmOn = !SwarmOn;
+		break;
+
+	case 'l':
+	case 'L':
+		HeliLodOn = !HeliLodOn;
+		break;
+
 
 	case 'q':
 	case 'Q':
@@ -960,6 +2106,7 @@ Keyboard(unsigned char c, int x, int y)
 
 	default:
 		fprintf(stderr, "Don't know what to do with keyboard hit: '%c' (0x%0x)\n", c, c);
+		return;			// nothing changed, so there is nothing to redraw
 	}
 
 	// force a call to Display( ):
@@ -1025,8 +2172,14 @@ MouseButton(int button, int state, int x, int y)
 			ActiveButton &= ~b;		// clear the proper bit
 		}
 
-		glutSetWindow(MainWindow);
-		glutPostRedisplay();
+		// pressing or letting go of a button only changes what the next moves do,
+		// but the wheel changes the scale right away:
+
+		if (button == SCROLL_WHEEL_UP || button == SCROLL_WHEEL_DOWN)
+		{
+			glutSetWindow(MainWindow);
+			glutPostRedisplay();
+		}
 	}
 
 }
@@ -1063,8 +2216,16 @@ MouseMotion(int x, int y)
 		Xmouse = x;			// new current position
 		Ymouse = y;
 
-		glutSetWindow(MainWindow);
-		glutPostRedisplay();
+		// glut calls this for every move, with or without a button down, and most of
+		// them change nothing on the screen. only the ones that turned or scaled the
+		// scene ask for a redraw, and however many of those come in before the next
+		// Display( ), glut still draws just once for them:
+
+		if ((dx != 0 || dy != 0) && (ActiveButton & (LEFT | MIDDLE)) != 0)
+		{
+			glutSetWindow(MainWindow);
+			glutPostRedisplay();
+		}
 	}
 }
 
@@ -1088,7 +2249,9 @@ Reset()
 	WhichProjection = PERSP;
 	Xrot = Yrot = 0.;
 	Frozen = false;
-	BladeAngle = 0;
+	BladeAngle = PrevBladeAngle = NextBladeAngle = 0;
+	HeliLodOn = true;
+	SwarmOn = false;
 }
 
 
@@ -1266,7 +2429,9 @@ struct bmfh
 	short bfReserved1;
 	short bfReserved2;
 	int bfOffBytes;		// # bytes to get to the start of the per-pixel data
-} FileHeader;
+};
+
+#define BMFH_SIZE		14	// bytes the file header takes up in the file (sizeof(struct bmfh) is padded)
 
 // bmp info header:
 struct bmih
@@ -1282,9 +2447,39 @@ struct bmih
 	int biYPixelsPerMeter;
 	int biClrUsed;		// # colors in the palette
 	int biClrImportant;
-} InfoHeader;
+};
+
+
+// turn one row of bgr pixels into rgb.
+// with ssse3, 5 pixels at a time are swapped with a single byte shuffle:
+// 16 bytes are loaded and stored, but only the first 15 are kept, the 16th
+// gets overwritten by the next group. the shuffle is only compiled in when the
+// compiler targets ssse3 (-mssse3 or -mavx with g++, /arch:AVX with msvc) --
+// without that it is all the plain loop
+
+void
+BgrToRgb(const unsigned char* bgr, unsigned char* rgb, int numPixels)
+{
+	int s = 0;
+#if defined(__SSSE3__) || defined(__AVX__)
+	const __m128i swap = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+	for (; s + 6 <= numPixels; s += 5)
+	{
+		__m128i pixels = _mm_loadu_si128((const __m128i*)(bgr + 3 * s));
+		_mm_storeu_si128((__m128i*)(rgb + 3 * s), _mm_shuffle_epi8(pixels, swap));
+	}
+#endif
+	for (; s < numPixels; s++)
+	{
+		rgb[3 * s + 0] = bgr[3 * s + 2];		// r
+		rgb[3 * s + 1] = bgr[3 * s + 1];		// g
+		rgb[3 * s + 2] = bgr[3 * s + 0];		// b
+	}
+}
+
 
 // read a BMP file into a Texture:
+// the whole file is read with one fread( ) and then decoded from memory
 
 unsigned char*
 BmpToTexture(char* filename, int* width, int* height)
@@ -1298,7 +2493,7 @@ BmpToTexture(char* filename, int* width, int* height)
 		return NULL;
 	}
 #else
-	FILE* fp = fopen(filename, "rb");
+	fp = fopen(filename, "rb");
 	if (fp == NULL)
 	{
 		fprintf(stderr, "Cannot open Bmp file '%s'\n", filename);
@@ -1306,7 +2501,33 @@ BmpToTexture(char* filename, int* width, int* height)
 	}
 #endif
 
-	FileHeader.bfType = ReadShort(fp);
+	fseek(fp, 0, SEEK_END);
+	long fileSize = ftell(fp);
+	rewind(fp);
+	if (fileSize < BMFH_SIZE + 40)
+	{
+		fprintf(stderr, "Bmp file '%s' is too short to be a bmp\n", filename);
+		fclose(fp);
+		return NULL;
+	}
+
+	unsigned char* file = new unsigned char[fileSize];
+	size_t numRead = fread(file, 1, fileSize, fp);
+	fclose(fp);
+	if (numRead != (size_t)fileSize)
+	{
+		fprintf(stderr, "Cannot read Bmp file '%s'\n", filename);
+		delete[] file;
+		return NULL;
+	}
+
+	// the headers are local so that more than one file can be loaded at a time:
+
+	struct bmfh FileHeader;
+	struct bmih InfoHeader;
+
+	FileHeader.bfType = ReadShort(&file[0]);
+
 
 	// if bfType is not BMP_MAGIC_NUMBER, the file is not a bmp:
 
@@ -1315,150 +2536,127 @@ BmpToTexture(char* filename, int* width, int* height)
 	if (FileHeader.bfType != BMP_MAGIC_NUMBER)
 	{
 		fprintf(stderr, "Wrong type of file: 0x%0x\n", FileHeader.bfType);
-		fclose(fp);
+		delete[] file;
 		return NULL;
 	}
 
-	FileHeader.bfSize = ReadInt(fp);
+
+	FileHeader.bfSize = ReadInt(&file[2]);
 	if (VERBOSE)	fprintf(stderr, "FileHeader.bfSize = %d\n", FileHeader.bfSize);
 
-	FileHeader.bfReserved1 = ReadShort(fp);
-	FileHeader.bfReserved2 = ReadShort(fp);
+	FileHeader.bfReserved1 = ReadShort(&file[6]);
+	FileHeader.bfReserved2 = ReadShort(&file[8]);
 
-	FileHeader.bfOffBytes = ReadInt(fp);
+	FileHeader.bfOffBytes = ReadInt(&file[10]);
 	if (VERBOSE)	fprintf(stderr, "FileHeader.bfOffBytes = %d\n", FileHeader.bfOffBytes);
 
-	InfoHeader.biSize = ReadInt(fp);
+
+	InfoHeader.biSize = ReadInt(&file[14]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biSize = %d\n", InfoHeader.biSize);
-	InfoHeader.biWidth = ReadInt(fp);
+	InfoHeader.biWidth = ReadInt(&file[18]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biWidth = %d\n", InfoHeader.biWidth);
-	InfoHeader.biHeight = ReadInt(fp);
+	InfoHeader.biHeight = ReadInt(&file[22]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biHeight = %d\n", InfoHeader.biHeight);
 
 	const int nums = InfoHeader.biWidth;
 	const int numt = InfoHeader.biHeight;
 
-	InfoHeader.biPlanes = ReadShort(fp);
+	InfoHeader.biPlanes = ReadShort(&file[26]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biPlanes = %d\n", InfoHeader.biPlanes);
 
-	InfoHeader.biBitCount = ReadShort(fp);
+	InfoHeader.biBitCount = ReadShort(&file[28]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biBitCount = %d\n", InfoHeader.biBitCount);
 
-	InfoHeader.biCompression = ReadInt(fp);
+	InfoHeader.biCompression = ReadInt(&file[30]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biCompression = %d\n", InfoHeader.biCompression);
 
-	InfoHeader.biSizeImage = ReadInt(fp);
+	InfoHeader.biSizeImage = ReadInt(&file[34]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biSizeImage = %d\n", InfoHeader.biSizeImage);
 
-	InfoHeader.biXPixelsPerMeter = ReadInt(fp);
-	InfoHeader.biYPixelsPerMeter = ReadInt(fp);
+	InfoHeader.biXPixelsPerMeter = ReadInt(&file[38]);
+	InfoHeader.biYPixelsPerMeter = ReadInt(&file[42]);
 
-	InfoHeader.biClrUsed = ReadInt(fp);
+	InfoHeader.biClrUsed = ReadInt(&file[46]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biClrUsed = %d\n", InfoHeader.biClrUsed);
 
-	InfoHeader.biClrImportant = ReadInt(fp);
+	InfoHeader.biClrImportant = ReadInt(&file[50]);
+
 
 	// fprintf( stderr, "Image size found: %d x %d\n", ImageWidth, ImageHeight );
 
-	// pixels will be stored bottom-to-top, left-to-right:
-	unsigned char* texture = new unsigned char[3 * nums * numt];
-	if (texture == NULL)
+
+	// this function does not support compression:
+
+	if (InfoHeader.biCompression != 0)
 	{
-		fprintf(stderr, "Cannot allocate the texture array!\n");
+		fprintf(stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression);
+		delete[] file;
 		return NULL;
 	}
 
-	// extra padding bytes:
+
+	// each row is padded out to a multiple of 4 bytes:
 
 	int requiredRowSizeInBytes = 4 * ((InfoHeader.biBitCount * InfoHeader.biWidth + 31) / 32);
 	if (VERBOSE)	fprintf(stderr, "requiredRowSizeInBytes = %d\n", requiredRowSizeInBytes);
 
-	int myRowSizeInBytes = (InfoHeader.biBitCount * InfoHeader.biWidth + 7) / 8;
-	if (VERBOSE)	fprintf(stderr, "myRowSizeInBytes = %d\n", myRowSizeInBytes);
-
-	int oldNumExtra = 4 * (((3 * InfoHeader.biWidth) + 3) / 4) - 3 * InfoHeader.biWidth;
-	if (VERBOSE)	fprintf(stderr, "Old NumExtra padding = %d\n", oldNumExtra);
-
-	int numExtra = requiredRowSizeInBytes - myRowSizeInBytes;
-	if (VERBOSE)	fprintf(stderr, "New NumExtra padding = %d\n", numExtra);
+	if (nums <= 0 || numt <= 0 || FileHeader.bfOffBytes < 0 ||
+		(long)FileHeader.bfOffBytes + (long)requiredRowSizeInBytes * numt > fileSize)
+	{
+		fprintf(stderr, "Bmp file '%s' is too short for a %d x %d image\n", filename, nums, numt);
+		delete[] file;
+		return NULL;
+	}
 
-	// this function does not support compression:
 
-	if (InfoHeader.biCompression != 0)
+	// pixels will be stored bottom-to-top, left-to-right:
+	unsigned char* texture = new unsigned char[3 * nums * numt];
+	if (texture == NULL)
 	{
-		fprintf(stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression);
-		fclose(fp);
+		fprintf(stderr, "Cannot allocate the texture array!\n");
+		delete[] file;
 		return NULL;
 	}
 
+
 	// we can handle 24 bits of direct color:
 	if (InfoHeader.biBitCount == 24)
 	{
-		rewind(fp);
-		fseek(fp, FileHeader.bfOffBytes, SEEK_SET);
-		int t;
-		unsigned char* tp;
-		for (t = 0, tp = texture; t < numt; t++)
+		for (int t = 0; t < numt; t++)
 		{
-			for (int s = 0; s < nums; s++, tp += 3)
-			{
-				*(tp + 2) = fgetc(fp);		// b
-				*(tp + 1) = fgetc(fp);		// g
-				*(tp + 0) = fgetc(fp);		// r
-			}
-
-			for (int e = 0; e < numExtra; e++)
-			{
-				fgetc(fp);
-			}
+			const unsigned char* row = &file[FileHeader.bfOffBytes + requiredRowSizeInBytes * t];
+			BgrToRgb(row, &texture[3 * nums * t], nums);
 		}
 	}
 
 	// we can also handle 8 bits of indirect color:
+	// (the color table is stored as b, g, r, a)
 	if (InfoHeader.biBitCount == 8 && InfoHeader.biClrUsed == 256)
 	{
-		struct rgba32
+		const unsigned char* colorTable = &file[BMFH_SIZE + InfoHeader.biSize];
+		if (colorTable + 4 * InfoHeader.biClrUsed > file + fileSize)
 		{
-			unsigned char r, g, b, a;
-		};
-		struct rgba32* colorTable = new struct rgba32[InfoHeader.biClrUsed];
-
-		rewind(fp);
-		fseek(fp, sizeof(struct bmfh) + InfoHeader.biSize - 2, SEEK_SET);
-		for (int c = 0; c < InfoHeader.biClrUsed; c++)
-		{
-			colorTable[c].r = fgetc(fp);
-			colorTable[c].g = fgetc(fp);
-			colorTable[c].b = fgetc(fp);
-			colorTable[c].a = fgetc(fp);
-			if (VERBOSE)	fprintf(stderr, "%4d:\t0x%02x\t0x%02x\t0x%02x\t0x%02x\n",
-				c, colorTable[c].r, colorTable[c].g, colorTable[c].b, colorTable[c].a);
+			fprintf(stderr, "Bmp file '%s' is too short for its color table\n", filename);
+			delete[] texture;
+			delete[] file;
+			return NULL;
 		}
 
-		rewind(fp);
-		fseek(fp, FileHeader.bfOffBytes, SEEK_SET);
-		int t;
-		unsigned char* tp;
-		for (t = 0, tp = texture; t < numt; t++)
+		for (int t = 0; t < numt; t++)
 		{
+			const unsigned char* row = &file[FileHeader.bfOffBytes + requiredRowSizeInBytes * t];
+			unsigned char* tp = &texture[3 * nums * t];
 			for (int s = 0; s < nums; s++, tp += 3)
 			{
-				int index = fgetc(fp);
-				*(tp + 0) = colorTable[index].r;	// r
-				*(tp + 1) = colorTable[index].g;	// g
-				*(tp + 2) = colorTable[index].b;	// b
-			}
-
-			for (int e = 0; e < numExtra; e++)
-			{
-				fgetc(fp);
+				const unsigned char* color = &colorTable[4 * row[s]];
+				*(tp + 0) = color[2];	// r
+				*(tp + 1) = color[1];	// g
+				*(tp + 2) = color[0];	// b
 			}
 		}
-
-		delete[] colorTable;
 	}
 
-	fclose(fp);
+	delete[] file;
 
 	*width = nums;
 	*height = numt;
@@ -1466,21 +2664,15 @@ BmpToTexture(char* filename, int* width, int* height)
 }
 
 int
-ReadInt(FILE* fp)
+ReadInt(const unsigned char* p)
 {
-	const unsigned char b0 = fgetc(fp);
-	const unsigned char b1 = fgetc(fp);
-	const unsigned char b2 = fgetc(fp);
-	const unsigned char b3 = fgetc(fp);
-	return (b3 << 24) | (b2 << 16) | (b1 << 8) | b0;
+	return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
 }
 
 short
-ReadShort(FILE* fp)
+ReadShort(const unsigned char* p)
 {
-	const unsigned char b0 = fgetc(fp);
-	const unsigned char b1 = fgetc(fp);
-	return (b1 << 8) | b0;
+	return (p[1] << 8) | p[0];
 }
 
 
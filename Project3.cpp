@@ -1,10 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
 
+#if defined(__SSSE3__) || defined(__AVX__)
+#include <tmmintrin.h>		// pshufb for the bmp bgr -> rgb swap
+#endif
+
 #ifdef WIN32
 #include <windows.h>
 #pragma warning(disable:4996)
@@ -14,6 +22,11 @@
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include "glut.h"
+#ifdef HEADLESS
+#include "headless.cpp"		// draw offscreen with egl instead of in a glut window (benchmarking)
+#endif
+#include "timestep.cpp"		// fixed-timestep animation and the frame cap
+#include "glslprogram.cpp"
 
 
 //	This is a sample OpenGL / GLUT program
@@ -64,6 +77,12 @@ const int INIT_WINDOW_SIZE = { 600 };
 
 const float BOXSIZE = { 2.f };
 
+// tessellation of the earth -- the distortion happens in the shader now, so
+// the cost of a frame no longer grows with the number of points:
+
+const int EARTHSLICES = { 200 };
+const int EARTHSTACKS = { 200 };
+
 // multiplication factors for input interaction:
 //  (these are known from previous experience)
 
@@ -97,6 +116,15 @@ enum Projections
 	PERSP
 };
 
+// which texture minification filter:
+
+enum TextureFilters
+{
+	BILINEAR,			// no mipmaps
+	TRILINEAR,			// blend between the two nearest mipmaps
+	ANISOTROPIC			// trilinear, plus more samples along the direction the texture is squashed
+};
+
 // which button:
 
 enum ButtonVals
@@ -125,6 +153,8 @@ int				ActiveButton;			// current button that is down
 GLuint			AxesList;				// list to hold the axes
 int				TextureOn;				// != 0 means to draw the axes
 int				DebugOn;				// != 0 means to print debugging info
+float			MaxAnisotropy;			// 1. means anisotropic filtering is not available
+int				WhichFilter;			// BILINEAR, TRILINEAR, or ANISOTROPIC
 int				DepthBufferOn;			// != 0 means to use the z-buffer
 int				DepthFightingOn;		// != 0 means to force the creation of z-fighting
 GLuint			Sphere;					// object display list
@@ -141,6 +171,7 @@ int				width;					// width of texture
 int				height;					// height of texture
 unsigned char* Texture;				// texture file
 GLuint			Tex0;					// texture id
+GLSLProgram*	DistortShader;			// jitters the texture coords on the gpu
 
 // function prototypes:
 
@@ -148,6 +179,7 @@ void	Animate();
 void	Display();
 void	DoTextureMenu(int);
 void	DoDebugMenu(int);
+void	DoFilterMenu(int);
 void	DoDistortMenu(int);
 void	DoMainMenu(int);
 void	DoProjectMenu(int);
@@ -163,12 +195,14 @@ void	MouseButton(int, int, int, int);
 void	MouseMotion(int, int);
 void	Reset();
 void	Resize(int, int);
+void	SetTextureFilter();
 void	Visibility(int);
 
 unsigned char* BmpToTexture(char*, int*, int*);
+void			BgrToRgb(const unsigned char*, unsigned char*, int);
 void			HsvRgb(float[3], float[3]);
-int				ReadInt(FILE*);
-short			ReadShort(FILE*);
+int				ReadInt(const unsigned char*);
+short			ReadShort(const unsigned char*);
 
 void			Cross(float[3], float[3], float[3]);
 float			Dot(float[3], float[3]);
@@ -176,9 +210,12 @@ float			Unit(float[3], float[3]);
 
 
 // OsuSphere.cpp provided by Mike Bailey for this assignment
+//
+// the points and triangles of a sphere only depend on (slices, stacks), so each
+// tessellation is built once into a vertex buffer of unit-radius points and an
+// index buffer of triangles -- the radius becomes a scale applied at draw time
 
-int		NumLngs, NumLats;
-struct point* Pts;
+#define MAXSPHEREMESHES		8
 
 struct point
 {
@@ -187,133 +224,147 @@ struct point
 	float s, t;		// texture coords
 };
 
-inline
-struct point*
-	PtsPointer(int lat, int lng)
+struct spheremesh
 {
-	if (lat < 0)	lat += (NumLats - 1);
-	if (lng < 0)	lng += (NumLngs - 0);
-	if (lat > NumLats - 1)	lat -= (NumLats - 1);
-	if (lng > NumLngs - 1)	lng -= (NumLngs - 0);
-	return &Pts[NumLngs * lat + lng];
-}
+	int				numLngs, numLats;	// tessellation this mesh was built with
+	int				numPts;				// # of points in the vertex buffer
+	int				numIndices;			// # of indices in the index buffer
+	GLuint			vbo;				// interleaved points
+	GLuint			ibo;				// triangle indices
+};
 
-inline
-void
-DrawPoint(struct point* p)
-{
-	glNormal3fv(&p->nx);
-	glTexCoord2fv(&p->s);
-	glVertex3fv(&p->x);
-}
+struct spheremesh	SphereMeshes[MAXSPHEREMESHES];
+int					NumSphereMeshes;
 
-void
-OsuSphere(float radius, int slices, int stacks)
-{
-	// set the globals:
 
-	NumLngs = slices;
-	NumLats = stacks;
-	if (NumLngs < 3)
-		NumLngs = 3;
-	if (NumLats < 3)
-		NumLats = 3;
+// find the cached mesh for this tessellation, building it the first time it is asked for:
 
-	// allocate the point data structure:
+struct spheremesh*
+GetSphereMesh(int slices, int stacks)
+{
+	int numLngs = slices;
+	int numLats = stacks;
+	if (numLngs < 3)
+		numLngs = 3;
+	if (numLats < 3)
+		numLats = 3;
+
+	for (int i = 0; i < NumSphereMeshes; i++)
+	{
+		if (SphereMeshes[i].numLngs == numLngs && SphereMeshes[i].numLats == numLats)
+			return &SphereMeshes[i];
+	}
+
+	if (NumSphereMeshes >= MAXSPHEREMESHES)
+	{
+		fprintf(stderr, "Too many sphere tessellations -- cannot cache %d x %d\n", numLngs, numLats);
+		return NULL;
+	}
 
-	Pts = new struct point[NumLngs * NumLats];
+	struct spheremesh* m = &SphereMeshes[NumSphereMeshes++];
+	m->numLngs = numLngs;
+	m->numLats = numLats;
+	m->numPts = numLngs * numLats;
 
-	// fill the Pts structure:
+	// fill the points, ilat=0 is the south pole and ilat=numLats-1 is the north pole:
 
-	for (int ilat = 0; ilat < NumLats; ilat++)
+	struct point* pts = new struct point[m->numPts];
+	for (int ilat = 0; ilat < numLats; ilat++)
 	{
-		float lat = -M_PI / 2. + M_PI * (float)ilat / (float)(NumLats - 1);	// ilat=0/lat=0. is the south pole
-											// ilat=NumLats-1, lat=+M_PI/2. is the north pole
+		float lat = -M_PI / 2. + M_PI * (float)ilat / (float)(numLats - 1);
 		float xz = cosf(lat);
 		float  y = sinf(lat);
-		for (int ilng = 0; ilng < NumLngs; ilng++)				// ilng=0, lng=-M_PI and
-											// ilng=NumLngs-1, lng=+M_PI are the same meridian
+		for (int ilng = 0; ilng < numLngs; ilng++)				// ilng=0, lng=-M_PI and
+											// ilng=numLngs-1, lng=+M_PI are the same meridian
 		{
-			float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(NumLngs - 1);
+			float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(numLngs - 1);
 			float x = xz * cosf(lng);
 			float z = -xz * sinf(lng);
-			struct point* p = PtsPointer(ilat, ilng);
-			p->x = radius * x;
-			p->y = radius * y;
-			p->z = radius * z;
+			struct point* p = &pts[numLngs * ilat + ilng];
+			p->x = x;
+			p->y = y;
+			p->z = z;
 			p->nx = x;
 			p->ny = y;
 			p->nz = z;
-			if (Distort == 1)
-			{
-				p->s = ((lng + M_PI) / (2. * M_PI)) + (cos(rand())) / 100;
-				p->t = ((lat + M_PI / 2.) / M_PI) + (cos(rand())) / 100;
-			}
-			else
-			{
-				p->s = (lng + M_PI) / (2. * M_PI);
-				p->t = (lat + M_PI / 2.) / M_PI;
-			}
+			p->s = (lng + M_PI) / (2. * M_PI);
+			p->t = (lat + M_PI / 2.) / M_PI;
 		}
 	}
 
-	struct point top, bot;		// top, bottom points
+	// two triangles between each pair of neighboring latitudes, wound the same
+	// way the old triangle strips were:
 
-	top.x = 0.;		top.y = radius;	top.z = 0.;
-	top.nx = 0.;		top.ny = 1.;		top.nz = 0.;
-	top.s = 0.;		top.t = 1.;
+	m->numIndices = 6 * (numLats - 1) * (numLngs - 1);
+	GLuint* indices = new GLuint[m->numIndices];
+	GLuint* ip = indices;
+	for (int ilat = 1; ilat < numLats; ilat++)
+	{
+		for (int ilng = 0; ilng < numLngs - 1; ilng++)
+		{
+			GLuint a0 = numLngs * ilat + ilng;			// this latitude
+			GLuint b0 = numLngs * (ilat - 1) + ilng;	// the one below it
+			*ip++ = a0;		*ip++ = b0;		*ip++ = a0 + 1;
+			*ip++ = a0 + 1;	*ip++ = b0;		*ip++ = b0 + 1;
+		}
+	}
 
-	bot.x = 0.;		bot.y = -radius;	bot.z = 0.;
-	bot.nx = 0.;		bot.ny = -1.;		bot.nz = 0.;
-	bot.s = 0.;		bot.t = 0.;
+	glGenBuffers(1, &m->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, m->vbo);
+	glBufferData(GL_ARRAY_BUFFER, m->numPts * sizeof(struct point), pts, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-	// connect the north pole to the latitude NumLats-2:
+	glGenBuffers(1, &m->ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, m->numIndices * sizeof(GLuint), indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
+	delete[] pts;
+	delete[] indices;
 
-	glBegin(GL_TRIANGLE_STRIP);
-	for (int ilng = 0; ilng < NumLngs; ilng++)
-	{
-		glTexCoord2f(bot.s, bot.t);
-		float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(NumLngs - 1);
-		top.s = (lng + M_PI) / (2. * M_PI);
-		DrawPoint(&top);
-		struct point* p = PtsPointer(NumLats - 2, ilng);	// ilat=NumLats-1 is the north pole
-		DrawPoint(p);
-	}
-	glEnd();
+	return m;
+}
 
-	// connect the south pole to the latitude 1:
+// point the vertex arrays at a buffer of points -- base is NULL when a vbo is bound:
 
-	glBegin(GL_TRIANGLE_STRIP);
-	for (int ilng = NumLngs - 1; ilng >= 0; ilng--)
-	{
-		glTexCoord2f(bot.s, bot.t);
-		float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(NumLngs - 1);
-		bot.s = (lng + M_PI) / (2. * M_PI);
-		DrawPoint(&bot);
-		struct point* p = PtsPointer(1, ilng);					// ilat=0 is the south pole
-		DrawPoint(p);
-	}
-	glEnd();
+inline
+void
+SetPointPointers(char* base)
+{
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(struct point), base + offsetof(struct point, x));
+	glNormalPointer(GL_FLOAT, sizeof(struct point), base + offsetof(struct point, nx));
+	glTexCoordPointer(2, GL_FLOAT, sizeof(struct point), base + offsetof(struct point, s));
+}
 
-	// connect the horizontal strips:
+inline
+void
+UnsetPointPointers()
+{
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+}
 
-	for (int ilat = 2; ilat < NumLats - 1; ilat++)
-	{
-		struct point* p;
-		glBegin(GL_TRIANGLE_STRIP);
-		for (int ilng = 0; ilng < NumLngs; ilng++)
-		{
-			p = PtsPointer(ilat, ilng);
-			DrawPoint(p);
-			p = PtsPointer(ilat - 1, ilng);
-			DrawPoint(p);
-		}
-		glEnd();
-	}
-	// clean-up:
-	delete[] Pts;
-	Pts = NULL;
+void
+OsuSphere(float radius, int slices, int stacks)
+{
+	struct spheremesh* m = GetSphereMesh(slices, stacks);
+	if (m == NULL)
+		return;
+
+	glPushMatrix();
+	glScalef(radius, radius, radius);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
+	glBindBuffer(GL_ARRAY_BUFFER, m->vbo);
+	SetPointPointers(NULL);
+	glDrawElements(GL_TRIANGLES, m->numIndices, GL_UNSIGNED_INT, (void*)0);
+	UnsetPointPointers();
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glPopMatrix();
 }
 
 
@@ -377,6 +428,7 @@ Animate()
 	int ms = glutGet(GLUT_ELAPSED_TIME);
 	ms %= MS_PER_CYCLE;
 	Time = (float)ms / (float)MS_PER_CYCLE;		// [0.,1.)
+	CapFrameRate();
 	glFlush();
 	glutSetWindow(MainWindow);
 	glutPostRedisplay();
@@ -468,15 +520,25 @@ Display()
 		glEnable(GL_TEXTURE_2D);
 		glBindTexture(GL_TEXTURE_2D, Tex0);
 		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-		glMatrixMode(GL_TEXTURE_2D);
 		glColor3f(.8, .8, .8);
-		OsuSphere(10, 50, 50);
+		if (Distort == 1)
+		{
+			// the sphere stays in its static vbo, the shader jitters the texture coords:
+
+			DistortShader->Use();
+			DistortShader->SetUniformVariable("uTime", Time);
+			DistortShader->SetUniformVariable("uTexUnit", 0);
+			OsuSphere(10, EARTHSLICES, EARTHSTACKS);
+			DistortShader->Use(0);
+		}
+		else
+			OsuSphere(10, EARTHSLICES, EARTHSTACKS);
 		glDisable(GL_TEXTURE_2D);
 	}
 	else {
 		glDisable(GL_TEXTURE_2D);
 		glColor3f(.8, .8, .8);
-		OsuSphere(10, 50, 50);
+		OsuSphere(10, EARTHSLICES, EARTHSTACKS);
 	}
 
 
@@ -538,6 +600,17 @@ DoDebugMenu(int id)
 }
 
 
+void
+DoFilterMenu(int id)
+{
+	WhichFilter = id;
+	SetTextureFilter();
+
+	glutSetWindow(MainWindow);
+	glutPostRedisplay();
+}
+
+
 void
 DoDistortMenu(int id)
 {
@@ -660,6 +733,11 @@ InitMenus()
 	glutAddMenuEntry("Off", 0);
 	glutAddMenuEntry("On", 1);
 
+	int filtermenu = glutCreateMenu(DoFilterMenu);
+	glutAddMenuEntry("Bilinear", BILINEAR);
+	glutAddMenuEntry("Trilinear (Mipmaps)", TRILINEAR);
+	glutAddMenuEntry("Anisotropic", ANISOTROPIC);
+
 	int debugmenu = glutCreateMenu(DoDebugMenu);
 	glutAddMenuEntry("Off", 0);
 	glutAddMenuEntry("On", 1);
@@ -670,6 +748,7 @@ InitMenus()
 
 	int mainmenu = glutCreateMenu(DoMainMenu);
 	glutAddSubMenu("Texture", texturemenu);
+	glutAddSubMenu("Texture Filtering", filtermenu);
 	glutAddSubMenu("Distortion", distortmenu);
 	glutAddSubMenu("Projection", projmenu);
 	glutAddMenuEntry("Reset", RESET);
@@ -738,8 +817,15 @@ InitGraphics()
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);		// build the mipmaps when the image is loaded
 	glTexImage2D(GL_TEXTURE_2D, 0, 3, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, Texture);
 
+	// see how much anisotropic filtering this card can do:
+
+	MaxAnisotropy = 1.;
+	if (strstr((char*)glGetString(GL_EXTENSIONS), "GL_EXT_texture_filter_anisotropic") != NULL)
+		glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &MaxAnisotropy);
+
 	glutSetWindow(MainWindow);
 	glutDisplayFunc(Display);
 	glutReshapeFunc(Resize);
@@ -775,6 +861,15 @@ InitGraphics()
 	fprintf(stderr, "Status: Using GLEW %s\n", glewGetString(GLEW_VERSION));
 #endif
 
+	DistortShader = new GLSLProgram();
+	bool valid = DistortShader->Create("distort.vert", "distort.frag");
+	if (!valid) {
+		fprintf(stderr, "Distortion shader cannot be created.\n");
+		DoMainMenu(QUIT);
+	}
+	else
+		fprintf(stderr, "Distortion shader created.\n");
+	DistortShader->SetVerbose(false);
 }
 
 
@@ -792,7 +887,7 @@ InitLists()
 	Sphere = glGenLists(1);
 	glNewList(Sphere, GL_COMPILE);
 	glColor3f(1, 0, 0);
-	OsuSphere(10, 50, 50);
+	OsuSphere(10, EARTHSLICES, EARTHSTACKS);
 	glEnd();
 	glEndList();
 }
@@ -826,6 +921,7 @@ Keyboard(unsigned char c, int x, int y)
 
 	default:
 		fprintf(stderr, "Don't know what to do with keyboard hit: '%c' (0x%0x)\n", c, c);
+		return;			// nothing changed, so there is nothing to redraw
 	}
 
 	// force a call to Display( ):
@@ -891,8 +987,14 @@ MouseButton(int button, int state, int x, int y)
 		ActiveButton &= ~b;		// clear the proper bit
 	}
 
-	glutSetWindow(MainWindow);
-	glutPostRedisplay();
+	// pressing or letting go of a button only changes what the next moves do,
+	// but the wheel changes the scale right away:
+
+	if (button == SCROLL_WHEEL_UP || button == SCROLL_WHEEL_DOWN)
+	{
+		glutSetWindow(MainWindow);
+		glutPostRedisplay();
+	}
 
 }
 
@@ -902,7 +1004,7 @@ MouseButton(int button, int state, int x, int y)
 void
 MouseMotion(int x, int y)
 {
-	if (true)
+	if (DebugOn != 0)
 		fprintf(stderr, "MouseMotion: %d, %d\n", x, y);
 
 
@@ -929,8 +1031,16 @@ MouseMotion(int x, int y)
 	Xmouse = x;			// new current position
 	Ymouse = y;
 
-	glutSetWindow(MainWindow);
-	glutPostRedisplay();
+	// glut calls this for every move, with or without a button down, and most of
+	// them change nothing on the screen. only the ones that turned or scaled the
+	// scene ask for a redraw, and however many of those come in before the next
+	// Display( ), glut still draws just once for them:
+
+	if ((dx != 0 || dy != 0) && (ActiveButton & (LEFT | MIDDLE)) != 0)
+	{
+		glutSetWindow(MainWindow);
+		glutPostRedisplay();
+	}
 }
 
 
@@ -951,10 +1061,24 @@ Reset()
 	ShadowsOn = 0;
 	WhichProjection = ORTHO;
 	Xrot = Yrot = 0.;
+	WhichFilter = TRILINEAR;
+	SetTextureFilter();
 	glFlush();
 }
 
 
+// set the minification filter of the texture from WhichFilter:
+
+void
+SetTextureFilter()
+{
+	glBindTexture(GL_TEXTURE_2D, Tex0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (WhichFilter == BILINEAR) ? GL_LINEAR : GL_LINEAR_MIPMAP_LINEAR);
+	if (MaxAnisotropy > 1.)
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, (WhichFilter == ANISOTROPIC) ? MaxAnisotropy : 1.f);
+}
+
+
 // called when user resizes the window:
 
 void
@@ -1129,7 +1253,9 @@ struct bmfh
 	short bfReserved1;
 	short bfReserved2;
 	int bfOffBytes;		// # bytes to get to the start of the per-pixel data
-} FileHeader;
+};
+
+#define BMFH_SIZE		14	// bytes the file header takes up in the file (sizeof(struct bmfh) is padded)
 
 // bmp info header:
 struct bmih
@@ -1145,11 +1271,39 @@ struct bmih
 	int biYPixelsPerMeter;
 	int biClrUsed;		// # colors in the palette
 	int biClrImportant;
-} InfoHeader;
+};
+
+
+// turn one row of bgr pixels into rgb.
+// with ssse3, 5 pixels at a time are swapped with a single byte shuffle:
+// 16 bytes are loaded and stored, but only the first 15 are kept, the 16th
+// gets overwritten by the next group. the shuffle is only compiled in when the
+// compiler targets ssse3 (-mssse3 or -mavx with g++, /arch:AVX with msvc) --
+// without that it is all the plain loop
 
+void
+BgrToRgb(const unsigned char* bgr, unsigned char* rgb, int numPixels)
+{
+	int s = 0;
+#if defined(__SSSE3__) || defined(__AVX__)
+	const __m128i swap = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+	for (; s + 6 <= numPixels; s += 5)
+	{
+		__m128i pixels = _mm_loadu_si128((const __m128i*)(bgr + 3 * s));
+		_mm_storeu_si128((__m128i*)(rgb + 3 * s), _mm_shuffle_epi8(pixels, swap));
+	}
+#endif
+	for (; s < numPixels; s++)
+	{
+		rgb[3 * s + 0] = bgr[3 * s + 2];		// r
+		rgb[3 * s + 1] = bgr[3 * s + 1];		// g
+		rgb[3 * s + 2] = bgr[3 * s + 0];		// b
+	}
+}
 
 
 // read a BMP file into a Texture:
+// the whole file is read with one fread( ) and then decoded from memory
 
 unsigned char*
 BmpToTexture(char* filename, int* width, int* height)
@@ -1171,7 +1325,32 @@ BmpToTexture(char* filename, int* width, int* height)
 	}
 #endif
 
-	FileHeader.bfType = ReadShort(fp);
+	fseek(fp, 0, SEEK_END);
+	long fileSize = ftell(fp);
+	rewind(fp);
+	if (fileSize < BMFH_SIZE + 40)
+	{
+		fprintf(stderr, "Bmp file '%s' is too short to be a bmp\n", filename);
+		fclose(fp);
+		return NULL;
+	}
+
+	unsigned char* file = new unsigned char[fileSize];
+	size_t numRead = fread(file, 1, fileSize, fp);
+	fclose(fp);
+	if (numRead != (size_t)fileSize)
+	{
+		fprintf(stderr, "Cannot read Bmp file '%s'\n", filename);
+		delete[] file;
+		return NULL;
+	}
+
+	// the headers are local so that more than one file can be loaded at a time:
+
+	struct bmfh FileHeader;
+	struct bmih InfoHeader;
+
+	FileHeader.bfType = ReadShort(&file[0]);
 
 
 	// if bfType is not BMP_MAGIC_NUMBER, the file is not a bmp:
@@ -1181,84 +1360,85 @@ BmpToTexture(char* filename, int* width, int* height)
 	if (FileHeader.bfType != BMP_MAGIC_NUMBER)
 	{
 		fprintf(stderr, "Wrong type of file: 0x%0x\n", FileHeader.bfType);
-		fclose(fp);
+		delete[] file;
 		return NULL;
 	}
 
 
-	FileHeader.bfSize = ReadInt(fp);
+	FileHeader.bfSize = ReadInt(&file[2]);
 	if (VERBOSE)	fprintf(stderr, "FileHeader.bfSize = %d\n", FileHeader.bfSize);
 
-	FileHeader.bfReserved1 = ReadShort(fp);
-	FileHeader.bfReserved2 = ReadShort(fp);
+	FileHeader.bfReserved1 = ReadShort(&file[6]);
+	FileHeader.bfReserved2 = ReadShort(&file[8]);
 
-	FileHeader.bfOffBytes = ReadInt(fp);
+	FileHeader.bfOffBytes = ReadInt(&file[10]);
 	if (VERBOSE)	fprintf(stderr, "FileHeader.bfOffBytes = %d\n", FileHeader.bfOffBytes);
 
 
-	InfoHeader.biSize = ReadInt(fp);
+	InfoHeader.biSize = ReadInt(&file[14]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biSize = %d\n", InfoHeader.biSize);
-	InfoHeader.biWidth = ReadInt(fp);
+	InfoHeader.biWidth = ReadInt(&file[18]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biWidth = %d\n", InfoHeader.biWidth);
-	InfoHeader.biHeight = ReadInt(fp);
+	InfoHeader.biHeight = ReadInt(&file[22]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biHeight = %d\n", InfoHeader.biHeight);
 
 	const int nums = InfoHeader.biWidth;
 	const int numt = InfoHeader.biHeight;
 
-	InfoHeader.biPlanes = ReadShort(fp);
+	InfoHeader.biPlanes = ReadShort(&file[26]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biPlanes = %d\n", InfoHeader.biPlanes);
 
-	InfoHeader.biBitCount = ReadShort(fp);
+	InfoHeader.biBitCount = ReadShort(&file[28]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biBitCount = %d\n", InfoHeader.biBitCount);
 
-	InfoHeader.biCompression = ReadInt(fp);
+	InfoHeader.biCompression = ReadInt(&file[30]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biCompression = %d\n", InfoHeader.biCompression);
 
-	InfoHeader.biSizeImage = ReadInt(fp);
+	InfoHeader.biSizeImage = ReadInt(&file[34]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biSizeImage = %d\n", InfoHeader.biSizeImage);
 
-	InfoHeader.biXPixelsPerMeter = ReadInt(fp);
-	InfoHeader.biYPixelsPerMeter = ReadInt(fp);
+	InfoHeader.biXPixelsPerMeter = ReadInt(&file[38]);
+	InfoHeader.biYPixelsPerMeter = ReadInt(&file[42]);
 
-	InfoHeader.biClrUsed = ReadInt(fp);
+	InfoHeader.biClrUsed = ReadInt(&file[46]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biClrUsed = %d\n", InfoHeader.biClrUsed);
 
-	InfoHeader.biClrImportant = ReadInt(fp);
+	InfoHeader.biClrImportant = ReadInt(&file[50]);
 
 
 	// fprintf( stderr, "Image size found: %d x %d\n", ImageWidth, ImageHeight );
 
 
-	// pixels will be stored bottom-to-top, left-to-right:
-	unsigned char* texture = new unsigned char[3 * nums * numt];
-	if (texture == NULL)
+	// this function does not support compression:
+
+	if (InfoHeader.biCompression != 0)
 	{
-		fprintf(stderr, "Cannot allocate the texture array!\n");
+		fprintf(stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression);
+		delete[] file;
 		return NULL;
 	}
 
-	// extra padding bytes:
+
+	// each row is padded out to a multiple of 4 bytes:
 
 	int requiredRowSizeInBytes = 4 * ((InfoHeader.biBitCount * InfoHeader.biWidth + 31) / 32);
 	if (VERBOSE)	fprintf(stderr, "requiredRowSizeInBytes = %d\n", requiredRowSizeInBytes);
 
-	int myRowSizeInBytes = (InfoHeader.biBitCount * InfoHeader.biWidth + 7) / 8;
-	if (VERBOSE)	fprintf(stderr, "myRowSizeInBytes = %d\n", myRowSizeInBytes);
-
-	int oldNumExtra = 4 * (((3 * InfoHeader.biWidth) + 3) / 4) - 3 * InfoHeader.biWidth;
-	if (VERBOSE)	fprintf(stderr, "Old NumExtra padding = %d\n", oldNumExtra);
-
-	int numExtra = requiredRowSizeInBytes - myRowSizeInBytes;
-	if (VERBOSE)	fprintf(stderr, "New NumExtra padding = %d\n", numExtra);
-
+	if (nums <= 0 || numt <= 0 || FileHeader.bfOffBytes < 0 ||
+		(long)FileHeader.bfOffBytes + (long)requiredRowSizeInBytes * numt > fileSize)
+	{
+		fprintf(stderr, "Bmp file '%s' is too short for a %d x %d image\n", filename, nums, numt);
+		delete[] file;
+		return NULL;
+	}
 
-	// this function does not support compression:
 
-	if (InfoHeader.biCompression != 0)
+	// pixels will be stored bottom-to-top, left-to-right:
+	unsigned char* texture = new unsigned char[3 * nums * numt];
+	if (texture == NULL)
 	{
-		fprintf(stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression);
-		fclose(fp);
+		fprintf(stderr, "Cannot allocate the texture array!\n");
+		delete[] file;
 		return NULL;
 	}
 
@@ -1266,71 +1446,41 @@ BmpToTexture(char* filename, int* width, int* height)
 	// we can handle 24 bits of direct color:
 	if (InfoHeader.biBitCount == 24)
 	{
-		rewind(fp);
-		fseek(fp, FileHeader.bfOffBytes, SEEK_SET);
-		int t;
-		unsigned char* tp;
-		for (t = 0, tp = texture; t < numt; t++)
+		for (int t = 0; t < numt; t++)
 		{
-			for (int s = 0; s < nums; s++, tp += 3)
-			{
-				*(tp + 2) = fgetc(fp);		// b
-				*(tp + 1) = fgetc(fp);		// g
-				*(tp + 0) = fgetc(fp);		// r
-			}
-
-			for (int e = 0; e < numExtra; e++)
-			{
-				fgetc(fp);
-			}
+			const unsigned char* row = &file[FileHeader.bfOffBytes + requiredRowSizeInBytes * t];
+			BgrToRgb(row, &texture[3 * nums * t], nums);
 		}
 	}
 
 	// we can also handle 8 bits of indirect color:
+	// (the color table is stored as b, g, r, a)
 	if (InfoHeader.biBitCount == 8 && InfoHeader.biClrUsed == 256)
 	{
-		struct rgba32
-		{
-			unsigned char r, g, b, a;
-		};
-		struct rgba32* colorTable = new struct rgba32[InfoHeader.biClrUsed];
-
-		rewind(fp);
-		fseek(fp, sizeof(struct bmfh) + InfoHeader.biSize - 2, SEEK_SET);
-		for (int c = 0; c < InfoHeader.biClrUsed; c++)
+		const unsigned char* colorTable = &file[BMFH_SIZE + InfoHeader.biSize];
+		if (colorTable + 4 * InfoHeader.biClrUsed > file + fileSize)
 		{
-			colorTable[c].r = fgetc(fp);
-			colorTable[c].g = fgetc(fp);
-			colorTable[c].b = fgetc(fp);
-			colorTable[c].a = fgetc(fp);
-			if (VERBOSE)	fprintf(stderr, "%4d:\t0x%02x\t0x%02x\t0x%02x\t0x%02x\n",
-				c, colorTable[c].r, colorTable[c].g, colorTable[c].b, colorTable[c].a);
+			fprintf(stderr, "Bmp file '%s' is too short for its color table\n", filename);
+			delete[] texture;
+			delete[] file;
+			return NULL;
 		}
 
-		rewind(fp);
-		fseek(fp, FileHeader.bfOffBytes, SEEK_SET);
-		int t;
-		unsigned char* tp;
-		for (t = 0, tp = texture; t < numt; t++)
+		for (int t = 0; t < numt; t++)
 		{
+			const unsigned char* row = &file[FileHeader.bfOffBytes + requiredRowSizeInBytes * t];
+			unsigned char* tp = &texture[3 * nums * t];
 			for (int s = 0; s < nums; s++, tp += 3)
 			{
-				int index = fgetc(fp);
-				*(tp + 0) = colorTable[index].r;	// r
-				*(tp + 1) = colorTable[index].g;	// g
-				*(tp + 2) = colorTable[index].b;	// b
-			}
-
-			for (int e = 0; e < numExtra; e++)
-			{
-				fgetc(fp);
+				const unsigned char* color = &colorTable[4 * row[s]];
+				*(tp + 0) = color[2];	// r
+				*(tp + 1) = color[1];	// g
+				*(tp + 2) = color[0];	// b
 			}
 		}
-
-		delete[] colorTable;
 	}
 
-	fclose(fp);
+	delete[] file;
 
 	*width = nums;
 	*height = numt;
@@ -1338,21 +1488,15 @@ BmpToTexture(char* filename, int* width, int* height)
 }
 
 int
-ReadInt(FILE* fp)
+ReadInt(const unsigned char* p)
 {
-	const unsigned char b0 = fgetc(fp);
-	const unsigned char b1 = fgetc(fp);
-	const unsigned char b2 = fgetc(fp);
-	const unsigned char b3 = fgetc(fp);
-	return (b3 << 24) | (b2 << 16) | (b1 << 8) | b0;
+	return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
 }
 
 short
-ReadShort(FILE* fp)
+ReadShort(const unsigned char* p)
 {
-	const unsigned char b0 = fgetc(fp);
-	const unsigned char b1 = fgetc(fp);
-	return (b1 << 8) | b0;
+	return (p[1] << 8) | p[0];
 }
 
 
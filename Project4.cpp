@@ -1,10 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
 
+#if defined(__SSSE3__) || defined(__AVX__)
+#include <tmmintrin.h>		// pshufb for the bmp bgr -> rgb swap
+#endif
+
 #ifdef WIN32
 #include <windows.h>
 #pragma warning(disable:4996)
@@ -14,6 +22,11 @@
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include "glut.h"
+#ifdef HEADLESS
+#include "headless.cpp"		// draw offscreen with egl instead of in a glut window (benchmarking)
+#endif
+#include "timestep.cpp"		// fixed-timestep animation and the frame cap
+#include "glslprogram.cpp"
 
 
 //	This is a sample OpenGL / GLUT program
@@ -97,6 +110,15 @@ enum Projections
 	PERSP
 };
 
+// which texture minification filter:
+
+enum TextureFilters
+{
+	BILINEAR,			// no mipmaps
+	TRILINEAR,			// blend between the two nearest mipmaps
+	ANISOTROPIC			// trilinear, plus more samples along the direction the texture is squashed
+};
+
 // which button:
 
 enum ButtonVals
@@ -135,6 +157,8 @@ const GLfloat FOGEND = { 4. };
 int				ActiveButton;							// current button that is down
 int				TextureOn;								// != 0 means to draw the axes
 int				DebugOn;								// != 0 means to print debugging info
+float			MaxAnisotropy;							// 1. means anisotropic filtering is not available
+int				WhichFilter;							// BILINEAR, TRILINEAR, or ANISOTROPIC
 int				DepthBufferOn;							// != 0 means to use the z-buffer
 int				DepthFightingOn;						// != 0 means to force the creation of z-fighting
 GLuint			Sphere;									// object display list
@@ -153,7 +177,9 @@ GLuint			Tex0;									// texture id
 bool			Light0On, Light1On, Light2On = true;	// keeps track of light statuses
 bool			Light1Disco;							// keeps track of UFO light disco mode
 bool			Frozen;									// current freeze status of animations
-float			WorldAngle;								// angle of Earth in degrees for animations
+float			WorldAngle;								// angle of Earth in degrees for animations, between the last 2 steps
+float			PrevWorldAngle;							// the angle at the next-to-last step
+float			NextWorldAngle;							// the angle at the last step
 int				WhichView;								// Inside ring, UFO POV, or Regular
 float			redufo;									// red color code for ufo disco spotlight
 float			blueufo;								// blue color code for ufo disco spotlight
@@ -165,32 +191,50 @@ bool			ScaleOnly = false;						// scroll lock status
 // function prototypes:
 
 void	Animate();
+void	BeginShadows();
+void	BeginZone(int);
+void	BinLights(float, float);
+void	BindShadows(struct shadowuniforms*);
+void	ClearLights();
 void	Display();
 void	DoViewMenu(int);
 void	DoDebugMenu(int);
+void	DoFilterMenu(int);
 void	DoDiscoMenu(int);
 void	DoLightsMenu(int);
 void	DoDistortMenu(int);
 void	DoMainMenu(int);
 void	DoProjectMenu(int);
-void	DoShadowMenu();
+void	DoShadowsMenu(int);
 void	DoRasterString(float, float, float, char*);
 void	DoStrokeString(float, float, float, float, char*);
+void	DrawProfile(float, float);
+void	DrawShadowCasters(int, float*);
 float	ElapsedSeconds();
+void	EndProfileFrame();
+void	EndZone();
 void	InitGraphics();
 void	InitLists();
+void	InitClusters();
 void	InitMenus();
+void	InitProfiler();
+void	InitShadows();
 void	Keyboard(unsigned char, int, int);
 void	MouseButton(int, int, int, int);
 void	MouseMotion(int, int);
+int		RenderShadowCube(float, float, float);
 void	Reset();
+void	ResetProfiler();
 void	Resize(int, int);
+void	SetTextureFilter();
 void	Visibility(int);
 
 unsigned char* BmpToTexture(char*, int*, int*);
+void			BgrToRgb(const unsigned char*, unsigned char*, int);
 void			HsvRgb(float[3], float[3]);
-int				ReadInt(FILE*);
-short			ReadShort(FILE*);
+double			MillisecondsSince(std::chrono::steady_clock::time_point);
+int				ReadInt(const unsigned char*);
+short			ReadShort(const unsigned char*);
 
 void			Cross(float[3], float[3], float[3]);
 float			Dot(float[3], float[3]);
@@ -274,145 +318,1342 @@ void SetSpotLight(int ilight, float x, float y, float z, float xdir, float ydir,
 }
 
 
-// OsuSphere.cpp provided by Mike Bailey for this assignment
-
-int		NumLngs, NumLats;
-struct point* Pts;
+// OsuSphere.cpp provided by Mike Bailey for this assignment
+//
+// the sphere, and the torus, cylinder, and cone that go with it, are all surfaces
+// of revolution: a profile of rows, each a distance from the axis and a height along
+// it, swept around the axis. their points and triangles only depend on the type and
+// the tessellation, so each one is built once at unit size into a vertex buffer and
+// an index buffer -- the real size becomes a scale applied at draw time
+
+#define MAXMESHES		16
+
+#define SPHEREMESH		0		// poles on the y axis
+#define TORUSMESH		1		// around the z axis, like glutSolidTorus( )
+#define CYLINDERMESH	2		// along the z axis from z=0. to z=1., like glutSolidCylinder( )
+#define CONEMESH		3		// along the z axis, the base at z=0. and the tip at z=1., like glutSolidCone( )
+
+struct point
+{
+	float x, y, z;		// coordinates
+	float nx, ny, nz;	// surface normal
+	float s, t;		// texture coords
+};
+
+struct profilerow
+{
+	float r, h;			// distance from the axis and height along it
+	float nr, nh;		// the profile's normal
+	float t;			// texture coord
+	bool joined;		// false for the first row of a piece, like a cap, that has no triangles back to the row before it
+};
+
+struct parametricmesh
+{
+	int				type;				// SPHEREMESH, TORUSMESH, ...
+	int				numLngs, stacks;	// tessellation this mesh was built with
+	float			ratio;				// the torus's tube radius over its ring radius
+	int				numPts;				// # of points in the vertex buffer
+	int				numIndices;			// # of indices in the index buffer
+	struct point*	pts;				// cpu copy of the points
+	struct point*	distortPts;			// per-frame copy with jittered texture coords
+	GLuint			vbo;				// interleaved points
+	GLuint			ibo;				// triangle indices
+};
+
+struct parametricmesh	Meshes[MAXMESHES];
+int						NumMeshes;
+
+
+// fill in the profile of a unit-sized mesh, from the bottom up, and return the # of rows.
+// rows needs room for stacks+5 of them:
+
+int
+FillProfile(int type, int stacks, float ratio, struct profilerow* rows)
+{
+	int n = 0;
+	switch (type)
+	{
+	case SPHEREMESH:
+		for (int ilat = 0; ilat < stacks; ilat++)	// ilat=0 is the south pole and ilat=stacks-1 is the north pole
+		{
+			float lat = -M_PI / 2. + M_PI * (float)ilat / (float)(stacks - 1);
+			struct profilerow* row = &rows[n++];
+			row->r = row->nr = cosf(lat);
+			row->h = row->nh = sinf(lat);
+			row->t = (lat + M_PI / 2.) / M_PI;
+			row->joined = ilat > 0;
+		}
+		break;
+
+	case TORUSMESH:
+		for (int iside = 0; iside <= stacks; iside++)	// around the tube, starting and ending on its inside
+		{
+			float phi = -M_PI + 2. * M_PI * (float)iside / (float)stacks;
+			struct profilerow* row = &rows[n++];
+			row->nr = cosf(phi);
+			row->nh = sinf(phi);
+			row->r = 1. + ratio * row->nr;
+			row->h = ratio * row->nh;
+			row->t = (float)iside / (float)stacks;
+			row->joined = iside > 0;
+		}
+		break;
+
+	case CYLINDERMESH:
+	case CONEMESH:
+	{
+		// the bottom cap, from the center out to the rim:
+
+		struct profilerow center = { 0., 0., 0., -1., 0., false };
+		struct profilerow rim = { 1., 0., 0., -1., 0., true };
+		rows[n++] = center;
+		rows[n++] = rim;
+
+		// the side -- the cone's normal is the same all the way up to the tip:
+
+		float nr = type == CONEMESH ? M_SQRT1_2 : 1.;
+		float nh = type == CONEMESH ? M_SQRT1_2 : 0.;
+		for (int istack = 0; istack <= stacks; istack++)
+		{
+			float f = (float)istack / (float)stacks;
+			struct profilerow* row = &rows[n++];
+			row->r = type == CONEMESH ? 1. - f : 1.;
+			row->h = f;
+			row->nr = nr;
+			row->nh = nh;
+			row->t = f;
+			row->joined = istack > 0;
+		}
+
+		// and the cylinder's top cap, from the rim in to the center:
+
+		if (type == CYLINDERMESH)
+		{
+			struct profilerow topRim = { 1., 1., 0., 1., 1., false };
+			struct profilerow topCenter = { 0., 1., 0., 1., 1., true };
+			rows[n++] = topRim;
+			rows[n++] = topCenter;
+		}
+		break;
+	}
+	}
+	return n;
+}
+
+
+// find the cached mesh for this type and tessellation, building it the first time it is asked for.
+// numLngs counts the points around the axis, where the first and the last are the same meridian:
+
+struct parametricmesh*
+GetMesh(int type, int numLngs, int stacks, float ratio)
+{
+	if (numLngs < 3)
+		numLngs = 3;
+	if (stacks < 3)
+		stacks = 3;
+
+	for (int i = 0; i < NumMeshes; i++)
+	{
+		struct parametricmesh* m = &Meshes[i];
+		if (m->type == type && m->numLngs == numLngs && m->stacks == stacks && m->ratio == ratio)
+			return m;
+	}
+
+	if (NumMeshes >= MAXMESHES)
+	{
+		fprintf(stderr, "Too many mesh tessellations -- cannot cache type %d, %d x %d\n", type, numLngs, stacks);
+		return NULL;
+	}
+
+	struct parametricmesh* m = &Meshes[NumMeshes++];
+	m->type = type;
+	m->numLngs = numLngs;
+	m->stacks = stacks;
+	m->ratio = ratio;
+
+	struct profilerow* rows = new struct profilerow[stacks + 5];
+	int numRows = FillProfile(type, stacks, ratio, rows);
+
+	// sweep the profile around the axis:
+
+	m->numPts = numLngs * numRows;
+	struct point* pts = new struct point[m->numPts];
+	for (int irow = 0; irow < numRows; irow++)
+	{
+		struct profilerow* row = &rows[irow];
+		for (int ilng = 0; ilng < numLngs; ilng++)				// ilng=0, lng=-M_PI and
+											// ilng=numLngs-1, lng=+M_PI are the same meridian
+		{
+			float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(numLngs - 1);
+			float c = cosf(lng);
+			float s = sinf(lng);
+			struct point* p = &pts[numLngs * irow + ilng];
+			if (type == SPHEREMESH)
+			{
+				p->x = row->r * c;
+				p->y = row->h;
+				p->z = -row->r * s;
+				p->nx = row->nr * c;
+				p->ny = row->nh;
+				p->nz = -row->nr * s;
+			}
+			else
+			{
+				p->x = row->r * c;
+				p->y = row->r * s;
+				p->z = row->h;
+				p->nx = row->nr * c;
+				p->ny = row->nr * s;
+				p->nz = row->nh;
+			}
+			p->s = (lng + M_PI) / (2. * M_PI);
+			p->t = row->t;
+		}
+	}
+
+	// two triangles between each row and the one before it, wound the same
+	// way the old sphere's triangle strips were:
+
+	int numJoined = 0;
+	for (int irow = 1; irow < numRows; irow++)
+	{
+		if (rows[irow].joined)
+			numJoined++;
+	}
+	m->numIndices = 6 * numJoined * (numLngs - 1);
+	GLuint* indices = new GLuint[m->numIndices];
+	GLuint* ip = indices;
+	for (int irow = 1; irow < numRows; irow++)
+	{
+		if (!rows[irow].joined)
+			continue;
+		for (int ilng = 0; ilng < numLngs - 1; ilng++)
+		{
+			GLuint a0 = numLngs * irow + ilng;			// this row
+			GLuint b0 = numLngs * (irow - 1) + ilng;	// the one below it
+			*ip++ = a0;		*ip++ = b0;		*ip++ = a0 + 1;
+			*ip++ = a0 + 1;	*ip++ = b0;		*ip++ = b0 + 1;
+		}
+	}
+
+	glGenBuffers(1, &m->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, m->vbo);
+	glBufferData(GL_ARRAY_BUFFER, m->numPts * sizeof(struct point), pts, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glGenBuffers(1, &m->ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, m->numIndices * sizeof(GLuint), indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	delete[] indices;
+	delete[] rows;
+	m->pts = pts;
+	m->distortPts = NULL;
+
+	return m;
+}
+
+// point the vertex arrays at a buffer of points -- base is NULL when a vbo is bound:
+
+inline
+void
+SetPointPointers(char* base)
+{
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(struct point), base + offsetof(struct point, x));
+	glNormalPointer(GL_FLOAT, sizeof(struct point), base + offsetof(struct point, nx));
+	glTexCoordPointer(2, GL_FLOAT, sizeof(struct point), base + offsetof(struct point, s));
+}
+
+inline
+void
+UnsetPointPointers()
+{
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+}
+
+// draw a cached mesh scaled by (sx, sy, sz):
+
+void
+DrawMesh(struct parametricmesh* m, float sx, float sy, float sz, bool distort)
+{
+	if (m == NULL)
+		return;
+
+	glPushMatrix();
+	glScalef(sx, sy, sz);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
+
+	if (distort)
+	{
+		// the jittered texture coordinates change every frame, so they
+		// come from client memory instead of the static vbo:
+
+		if (m->distortPts == NULL)
+			m->distortPts = new struct point[m->numPts];
+		for (int i = 0; i < m->numPts; i++)
+		{
+			m->distortPts[i] = m->pts[i];
+			m->distortPts[i].s += (cos(rand())) / 100;
+			m->distortPts[i].t += (cos(rand())) / 100;
+		}
+		SetPointPointers((char*)m->distortPts);
+	}
+	else
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, m->vbo);
+		SetPointPointers(NULL);
+	}
+	glDrawElements(GL_TRIANGLES, m->numIndices, GL_UNSIGNED_INT, (void*)0);
+	UnsetPointPointers();
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glPopMatrix();
+}
+
+void
+OsuSphere(float radius, int slices, int stacks)
+{
+	DrawMesh(GetMesh(SPHEREMESH, slices, stacks, 0.), radius, radius, radius, Distort == 1);
+}
+
+// the same arguments as glutSolidTorus( ), glutSolidCylinder( ), and glutSolidCone( ):
+
+void
+OsuTorus(float innerRadius, float outerRadius, int sides, int rings)
+{
+	DrawMesh(GetMesh(TORUSMESH, rings + 1, sides, innerRadius / outerRadius), outerRadius, outerRadius, outerRadius, false);
+}
+
+void
+OsuCylinder(float radius, float height, int slices, int stacks)
+{
+	DrawMesh(GetMesh(CYLINDERMESH, slices + 1, stacks, 0.), radius, radius, height, false);
+}
+
+void
+OsuCone(float base, float height, int slices, int stacks)
+{
+	DrawMesh(GetMesh(CONEMESH, slices + 1, stacks, 0.), base, base, height, false);
+}
+
+
+// the ufo's flattened rim and the ring, which the shadow cube maps draw too:
+
+void
+DrawUfoRim()
+{
+	glPushMatrix();
+	glScalef(1., 1., 0.25);
+	OsuTorus(1., 1.5, 100, 100);
+	glPopMatrix();
+}
+
+void
+DrawRing()
+{
+	glPushMatrix();
+	glScalef(1., 1., 0.75);
+	OsuTorus(1., 1.5, 200, 200);
+	glPopMatrix();
+}
+
+
+// the display profiler:
+//
+// Display( ) is split into zones, each one timed on the cpu (how long its
+// commands take to submit) and on the gpu (a GL_TIME_ELAPSED query around the
+// same commands). a frame's queries are read PROFILEFRAMES-1 frames later, when
+// the gpu is long done with them, so reading them never stalls the pipeline.
+// the hud shows each zone averaged over the last PROFILEHISTORY frames
+
+#define PROFILEFRAMES		4			// frames of queries in flight
+#define PROFILEHISTORY		60			// frames in the rolling averages
+
+enum Zones
+{
+	ZONE_CLEAR,
+	ZONE_SHADOWS,
+	ZONE_BINNING,
+	ZONE_EARTH,
+	ZONE_MOON,
+	ZONE_UFO,
+	ZONE_RING,
+	ZONE_LIGHTS,
+	ZONE_TEXT,
+	NUMZONES
+};
+
+const char* ZoneNames[NUMZONES] = { "clear", "shadows", "binning", "earth", "moon", "ufo", "ring", "lights", "text" };
+
+bool			ShowProfile;							// true means time the zones and put them on the screen
+bool			HasTimerQuery;							// false means there are only cpu times
+GLuint			ZoneQueries[PROFILEFRAMES][NUMZONES];
+bool			ZoneIssued[PROFILEFRAMES][NUMZONES];	// true if that frame used the query
+int				ProfileFrame;							// # of frames since the profile was turned on
+int				CurrentZone = -1;						// -1 means not in a zone
+std::chrono::steady_clock::time_point	ZoneStart;
+float			ZoneCpuMs[NUMZONES][PROFILEHISTORY];
+float			ZoneGpuMs[NUMZONES][PROFILEHISTORY];
+
+
+// call this once the opengl context exists:
+
+void
+InitProfiler()
+{
+	HasTimerQuery = strstr((char*)glGetString(GL_EXTENSIONS), "GL_ARB_timer_query") != NULL;
+	if (HasTimerQuery)
+		glGenQueries(PROFILEFRAMES * NUMZONES, &ZoneQueries[0][0]);
+	else
+		fprintf(stderr, "No GL_ARB_timer_query -- the profiler will only show cpu times\n");
+}
+
+
+// start the averages over (whenever the profile gets turned on):
+
+void
+ResetProfiler()
+{
+	ProfileFrame = 0;
+	CurrentZone = -1;
+	memset(ZoneIssued, 0, sizeof(ZoneIssued));
+	memset(ZoneCpuMs, 0, sizeof(ZoneCpuMs));
+	memset(ZoneGpuMs, 0, sizeof(ZoneGpuMs));
+}
+
+
+// zones cannot nest -- a GL_TIME_ELAPSED query cannot be started inside another one:
+
+void
+BeginZone(int zone)
+{
+	if (!ShowProfile)
+		return;
+
+	CurrentZone = zone;
+	if (HasTimerQuery)
+	{
+		int slot = ProfileFrame % PROFILEFRAMES;
+		glBeginQuery(GL_TIME_ELAPSED, ZoneQueries[slot][zone]);
+		ZoneIssued[slot][zone] = true;
+	}
+	ZoneStart = std::chrono::steady_clock::now();
+}
+
+
+void
+EndZone()
+{
+	if (!ShowProfile || CurrentZone < 0)
+		return;
+
+	ZoneCpuMs[CurrentZone][ProfileFrame % PROFILEHISTORY] = MillisecondsSince(ZoneStart);
+	if (HasTimerQuery)
+		glEndQuery(GL_TIME_ELAPSED);
+	CurrentZone = -1;
+}
+
+
+// call this after the last zone of the frame:
+// it collects the gpu times of the oldest frame in flight, since the next frame reuses its queries
+
+void
+EndProfileFrame()
+{
+	if (!ShowProfile)
+		return;
+
+	ProfileFrame++;
+	if (!HasTimerQuery)
+		return;
+
+	int slot = ProfileFrame % PROFILEFRAMES;
+	int frame = ProfileFrame - PROFILEFRAMES;		// the frame that used this slot
+	for (int z = 0; z < NUMZONES; z++)
+	{
+		if (ZoneIssued[slot][z])
+		{
+			GLuint64 ns;
+			glGetQueryObjectui64v(ZoneQueries[slot][z], GL_QUERY_RESULT, &ns);
+			ZoneGpuMs[z][frame % PROFILEHISTORY] = (float)ns / 1000000.f;
+			ZoneIssued[slot][z] = false;
+		}
+	}
+}
+
+
+// put the averages on the screen, one line per zone going down from (x,y) in percent units:
+
+void
+DrawProfile(float x, float y)
+{
+	int cpuFrames = ProfileFrame < PROFILEHISTORY ? ProfileFrame : PROFILEHISTORY;
+	int gpuFrames = ProfileFrame - PROFILEFRAMES + 1;
+	if (gpuFrames < 0)
+		gpuFrames = 0;
+	if (gpuFrames > PROFILEHISTORY)
+		gpuFrames = PROFILEHISTORY;
+
+	char line[64];
+	float cpuTotal = 0., gpuTotal = 0.;
+	for (int z = 0; z < NUMZONES; z++)
+	{
+		float cpu = 0., gpu = 0.;
+		for (int i = 0; i < PROFILEHISTORY; i++)
+		{
+			cpu += ZoneCpuMs[z][i];
+			gpu += ZoneGpuMs[z][i];
+		}
+		cpu = cpuFrames > 0 ? cpu / (float)cpuFrames : 0.;
+		gpu = gpuFrames > 0 ? gpu / (float)gpuFrames : 0.;
+		cpuTotal += cpu;
+		gpuTotal += gpu;
+
+		if (HasTimerQuery)
+			sprintf(line, "%s:  cpu %.2f  gpu %.2f ms", ZoneNames[z], cpu, gpu);
+		else
+			sprintf(line, "%s:  cpu %.2f ms", ZoneNames[z], cpu);
+		DoRasterString(x, y - 4. * (float)z, 0., line);
+	}
+
+	if (HasTimerQuery)
+		sprintf(line, "frame:  cpu %.2f  gpu %.2f ms", cpuTotal, gpuTotal);
+	else
+		sprintf(line, "frame:  cpu %.2f ms", cpuTotal);
+	DoRasterString(x, y - 4. * (float)NUMZONES, 0., line);
+}
+
+
+// clustered forward lighting:
+//
+// fixed-function opengl stops at 8 lights, and every enabled light costs every
+// vertex of every lit object. instead, the lights for a frame go into Lights[ ],
+// BinLights( ) sorts them into a grid of clusters -- CLUSTERSX x CLUSTERSY tiles
+// of the viewport times CLUSTERSZ slices of depth -- and the lighting shader only
+// loops over the lights in the cluster its fragment falls in. the light list, the
+// cluster grid, and the list of light indices all go to the shader as float
+// textures. the shaders have these same numbers in them, so change both together
+
+#define MAXLIGHTS			1024		// lights in one frame
+#define CLUSTERSX			16			// tiles across the viewport
+#define CLUSTERSY			16			// tiles up the viewport
+#define CLUSTERSZ			24			// depth slices, spaced exponentially from the near to the far plane
+#define LIGHTINDEXWIDTH		1024		// the light index texture is LIGHTINDEXWIDTH x LIGHTINDEXHEIGHT
+#define LIGHTINDEXHEIGHT	256
+#define MAXLIGHTINDICES		( LIGHTINDEXWIDTH * LIGHTINDEXHEIGHT )
+#define LIGHTROWS			4			// texels per light in the light texture, one in each row
+#define LIGHTSUNIT			1			// texture units the light data is bound to
+#define CLUSTERSUNIT		2
+#define LIGHTINDEXUNIT		3
+
+const float LIGHTCUTOFF = { 1.f / 256.f };		// a light ends where it adds less than this to a color component
+const float NOCUTOFF = { 1.e+30f };				// the radius of a light that never falls off
+
+// a light in eye coordinates, the same way glLightfv( ) would have stored it:
+
+struct light
+{
+	float	x, y, z;				// position
+	float	radius;					// how far the light reaches, NOCUTOFF if it never falls off
+	float	r, g, b;				// diffuse and specular color
+	float	spotCos;				// cos of the spot cutoff angle, -1. for a point light
+	float	xdir, ydir, zdir;		// spot direction
+	float	spotExponent;
+	float	consatten, quadatten;
+	int		group;					// LightGroup when it was added, 0 is no group
+	int		shadow;					// its shadow cube map from RenderShadowCube( ), 0 is none
+};
+
+struct light	Lights[MAXLIGHTS];
+int				NumLights;
+int				LightGroup;								// the group AddLight( ) puts new lights in
+int				NumLightIndices;						// # of light indices the last BinLights( ) used
+bool			HasClusters;							// false means there are no float textures -- fixed-function only
+bool			ClusteredOn;							// true means light with the clustered shader
+GLuint			LightsTex;								// MAXLIGHTS x LIGHTROWS rgba
+GLuint			ClustersTex;							// (CLUSTERSX*CLUSTERSY) x CLUSTERSZ luminance (offset) + alpha (count)
+GLuint			LightIndexTex;							// LIGHTINDEXWIDTH x LIGHTINDEXHEIGHT luminance
+float			ClusterNear, ClusterFar;				// the depths the slices go between
+int				ClusterRange[MAXLIGHTS][6];				// x0, x1, y0, y1, z0, z1 clusters each light touches
+float			LightData[LIGHTROWS][MAXLIGHTS][4];
+float			ClusterData[CLUSTERSZ][CLUSTERSX * CLUSTERSY][2];
+float			LightIndices[MAXLIGHTINDICES];
+
+// where a lighting shader keeps the uniforms BindClusters( ) sets, looked up once after it links:
+
+struct clusteruniforms
+{
+	GLint	lights, clusters, lightIndices;
+	GLint	viewport;
+	GLint	clusterNear, clusterLogRatio;
+	GLint	skipGroup;
+};
+
+
+// call this once the opengl context exists:
+
+void
+InitClusters()
+{
+	HasClusters = strstr((char*)glGetString(GL_EXTENSIONS), "GL_ARB_texture_float") != NULL;
+	if (!HasClusters)
+	{
+		fprintf(stderr, "No GL_ARB_texture_float -- the lights will be fixed-function only\n");
+		return;
+	}
+
+	GLuint* texs[3] = { &LightsTex, &ClustersTex, &LightIndexTex };
+	GLint internal[3] = { GL_RGBA32F_ARB, GL_LUMINANCE_ALPHA32F_ARB, GL_LUMINANCE32F_ARB };
+	GLenum format[3] = { GL_RGBA, GL_LUMINANCE_ALPHA, GL_LUMINANCE };
+	int widths[3] = { MAXLIGHTS, CLUSTERSX * CLUSTERSY, LIGHTINDEXWIDTH };
+	int heights[3] = { LIGHTROWS, CLUSTERSZ, LIGHTINDEXHEIGHT };
+	for (int i = 0; i < 3; i++)
+	{
+		glGenTextures(1, texs[i]);
+		glBindTexture(GL_TEXTURE_2D, *texs[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, internal[i], widths[i], heights[i], 0, format[i], GL_FLOAT, NULL);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+
+// start a new frame's list of lights:
+
+void
+ClearLights()
+{
+	NumLights = 0;
+}
+
+
+// these take the same arguments as SetPointLight( ) and SetSpotLight( ), and like
+// glLightfv( ), the position and direction go through the current modelview matrix.
+// a shader can leave out one group of lights (uSkipGroup), the way an object can be
+// drawn with some of the GL_LIGHTs disabled -- set LightGroup before adding them:
+
+struct light*
+AddLight(float x, float y, float z, float r, float g, float b, float consatten, float quadatten)
+{
+	if (NumLights >= MAXLIGHTS)
+	{
+		fprintf(stderr, "Too many lights -- only %d fit in a frame\n", MAXLIGHTS);
+		return NULL;
+	}
+
+	float mv[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+	struct light* l = &Lights[NumLights++];
+	l->x = mv[0] * x + mv[4] * y + mv[8] * z + mv[12];
+	l->y = mv[1] * x + mv[5] * y + mv[9] * z + mv[13];
+	l->z = mv[2] * x + mv[6] * y + mv[10] * z + mv[14];
+	l->r = r;
+	l->g = g;
+	l->b = b;
+	l->consatten = consatten;
+	l->quadatten = quadatten;
+	l->spotCos = -1.;
+	l->xdir = l->ydir = l->zdir = 0.;
+	l->spotExponent = 0.;
+	l->group = LightGroup;
+	l->shadow = 0;
+
+	// solve consatten + quadatten*d^2 = brightest/LIGHTCUTOFF for the distance d:
+
+	float brightest = r > g ? r : g;
+	if (b > brightest)
+		brightest = b;
+	if (quadatten > 0.)
+	{
+		float d2 = (brightest / LIGHTCUTOFF - consatten) / quadatten;
+		l->radius = d2 > 0. ? sqrtf(d2) : 0.;
+	}
+	else
+		l->radius = NOCUTOFF;
+	return l;
+}
+
+struct light*
+AddPointLight(float x, float y, float z, float r, float g, float b, float consatten, float quadatten)
+{
+	return AddLight(x, y, z, r, g, b, consatten, quadatten);
+}
+
+void
+AddSpotLight(float x, float y, float z, float xdir, float ydir, float zdir, float r, float g, float b)
+{
+	struct light* l = AddLight(x, y, z, r, g, b, 1., 0.);
+	if (l == NULL)
+		return;
+
+	float mv[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+	float dir[3], eyeDir[3];
+	dir[0] = mv[0] * xdir + mv[4] * ydir + mv[8] * zdir;
+	dir[1] = mv[1] * xdir + mv[5] * ydir + mv[9] * zdir;
+	dir[2] = mv[2] * xdir + mv[6] * ydir + mv[10] * zdir;
+	Unit(dir, eyeDir);
+	l->xdir = eyeDir[0];
+	l->ydir = eyeDir[1];
+	l->zdir = eyeDir[2];
+	l->spotCos = cosf(45. * M_PI / 180.);		// GL_SPOT_CUTOFF and GL_SPOT_EXPONENT from SetSpotLight( )
+	l->spotExponent = 1.;
+}
+
+
+// which depth slice an eye-space depth (a positive distance in front of the eye) is in:
+
+inline
+int
+ClusterSlice(float depth)
+{
+	if (depth <= ClusterNear)
+		return 0;
+	int slice = (int)(logf(depth / ClusterNear) / logf(ClusterFar / ClusterNear) * (float)CLUSTERSZ);
+	return slice < CLUSTERSZ ? slice : CLUSTERSZ - 1;
+}
+
+inline
+int
+ClusterTile(float ndc, int numTiles)
+{
+	int tile = (int)floorf((ndc + 1.f) / 2.f * (float)numTiles);
+	if (tile < 0)
+		return 0;
+	return tile < numTiles ? tile : numTiles - 1;
+}
+
+
+// sort this frame's lights into the clusters and send everything to the textures.
+// call it after the projection matrix is set, with the near and far planes it used:
+
+void
+BinLights(float zNear, float zFar)
+{
+	if (!HasClusters)
+		return;
+
+	ClusterNear = zNear;
+	ClusterFar = zFar;
+	float p[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, p);
+
+	// find the block of clusters each light's sphere of influence touches.
+	// the screen tiles come from projecting the corners of the box around the
+	// sphere, with the part of the box behind the near plane cut off:
+
+	static int counts[CLUSTERSZ][CLUSTERSX * CLUSTERSY];
+	static int next[CLUSTERSZ][CLUSTERSX * CLUSTERSY];
+	memset(counts, 0, sizeof(counts));
+	for (int i = 0; i < NumLights; i++)
+	{
+		struct light* l = &Lights[i];
+		int* range = ClusterRange[i];
+		float front = -l->z - l->radius;
+		float back = -l->z + l->radius;
+		if (back < zNear || front > zFar)
+		{
+			range[4] = 1;			// an empty range of slices
+			range[5] = 0;
+			continue;
+		}
+		range[4] = ClusterSlice(front);
+		range[5] = ClusterSlice(back);
+
+		if (l->radius == NOCUTOFF)
+		{
+			range[0] = range[2] = 0;
+			range[1] = CLUSTERSX - 1;
+			range[3] = CLUSTERSY - 1;
+		}
+		else
+		{
+			float xmin = 1.e+30f, ymin = 1.e+30f, xmax = -1.e+30f, ymax = -1.e+30f;
+			for (int c = 0; c < 8; c++)
+			{
+				float x = l->x + ((c & 1) ? l->radius : -l->radius);
+				float y = l->y + ((c & 2) ? l->radius : -l->radius);
+				float z = l->z + ((c & 4) ? l->radius : -l->radius);
+				if (z > -zNear)
+					z = -zNear;
+				float w = p[3] * x + p[7] * y + p[11] * z + p[15];
+				float xndc = (p[0] * x + p[4] * y + p[8] * z + p[12]) / w;
+				float yndc = (p[1] * x + p[5] * y + p[9] * z + p[13]) / w;
+				if (xndc < xmin)	xmin = xndc;
+				if (xndc > xmax)	xmax = xndc;
+				if (yndc < ymin)	ymin = yndc;
+				if (yndc > ymax)	ymax = yndc;
+			}
+			if (xmax < -1. || xmin > 1. || ymax < -1. || ymin > 1.)
+			{
+				range[4] = 1;		// not on the screen at all
+				range[5] = 0;
+				continue;
+			}
+			range[0] = ClusterTile(xmin, CLUSTERSX);
+			range[1] = ClusterTile(xmax, CLUSTERSX);
+			range[2] = ClusterTile(ymin, CLUSTERSY);
+			range[3] = ClusterTile(ymax, CLUSTERSY);
+		}
+
+		for (int z = range[4]; z <= range[5]; z++)
+			for (int y = range[2]; y <= range[3]; y++)
+				for (int x = range[0]; x <= range[1]; x++)
+					counts[z][x + CLUSTERSX * y]++;
+	}
+
+	// each cluster's lights are one run of the index list:
+
+	NumLightIndices = 0;
+	for (int z = 0; z < CLUSTERSZ; z++)
+	{
+		for (int t = 0; t < CLUSTERSX * CLUSTERSY; t++)
+		{
+			if (NumLightIndices + counts[z][t] > MAXLIGHTINDICES)
+				counts[z][t] = MAXLIGHTINDICES - NumLightIndices;
+			ClusterData[z][t][0] = (float)NumLightIndices;
+			ClusterData[z][t][1] = 0.;
+			next[z][t] = NumLightIndices;
+			NumLightIndices += counts[z][t];
+		}
+	}
+	if (NumLightIndices == MAXLIGHTINDICES)
+		fprintf(stderr, "The light index list is full -- some clusters are missing lights\n");
+
+	for (int i = 0; i < NumLights; i++)
+	{
+		int* range = ClusterRange[i];
+		for (int z = range[4]; z <= range[5]; z++)
+		{
+			for (int y = range[2]; y <= range[3]; y++)
+			{
+				for (int x = range[0]; x <= range[1]; x++)
+				{
+					int t = x + CLUSTERSX * y;
+					if (ClusterData[z][t][1] >= (float)counts[z][t])
+						continue;
+					LightIndices[next[z][t]++] = (float)i;
+					ClusterData[z][t][1] += 1.;
+				}
+			}
+		}
+
+		struct light* l = &Lights[i];
+		float* d = LightData[0][i];
+		d[0] = l->x;	d[1] = l->y;	d[2] = l->z;	d[3] = l->radius;
+		d = LightData[1][i];
+		d[0] = l->r;	d[1] = l->g;	d[2] = l->b;	d[3] = l->spotCos;
+		d = LightData[2][i];
+		d[0] = l->xdir;	d[1] = l->ydir;	d[2] = l->zdir;	d[3] = l->spotExponent;
+		d = LightData[3][i];
+		d[0] = l->consatten;	d[1] = l->quadatten;	d[2] = (float)l->group;	d[3] = (float)l->shadow;
+	}
+
+	// only send the part of each texture that is in use:
+
+	if (NumLights > 0)
+	{
+		glBindTexture(GL_TEXTURE_2D, LightsTex);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, MAXLIGHTS);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, NumLights, LIGHTROWS, GL_RGBA, GL_FLOAT, LightData);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	}
+
+	glBindTexture(GL_TEXTURE_2D, ClustersTex);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTERSX * CLUSTERSY, CLUSTERSZ, GL_LUMINANCE_ALPHA, GL_FLOAT, ClusterData);
+
+	int rows = (NumLightIndices + LIGHTINDEXWIDTH - 1) / LIGHTINDEXWIDTH;
+	if (rows > 0)
+	{
+		glBindTexture(GL_TEXTURE_2D, LightIndexTex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, LIGHTINDEXWIDTH, rows, GL_LUMINANCE, GL_FLOAT, LightIndices);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+
+// GLSLProgram keeps its program handle to itself, so ask gl which one Use( ) makes current:
+
+GLuint
+ProgramHandle(GLSLProgram* shader)
+{
+	GLint program;
+	shader->Use();
+	glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+	shader->Use(0);
+	return (GLuint)program;
+}
+
+
+// GLSLProgram looks a uniform up by name every time it is set, so ask gl for them
+// once instead -- BindClusters( ) runs every frame:
+
+void
+LookUpClusterUniforms(GLuint program, struct clusteruniforms* u)
+{
+	u->lights = glGetUniformLocation(program, "uLights");
+	u->clusters = glGetUniformLocation(program, "uClusters");
+	u->lightIndices = glGetUniformLocation(program, "uLightIndices");
+	u->viewport = glGetUniformLocation(program, "uViewport");
+	u->clusterNear = glGetUniformLocation(program, "uClusterNear");
+	u->clusterLogRatio = glGetUniformLocation(program, "uClusterLogRatio");
+	u->skipGroup = glGetUniformLocation(program, "uSkipGroup");
+}
+
+
+// hand the cluster textures to the lighting shader that is in use, whose uniforms are in u.
+// the viewport is the square one Display( ) sets up, so one size is enough:
+
+void
+BindClusters(struct clusteruniforms* u)
+{
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	glActiveTexture(GL_TEXTURE0 + LIGHTSUNIT);
+	glBindTexture(GL_TEXTURE_2D, LightsTex);
+	glActiveTexture(GL_TEXTURE0 + CLUSTERSUNIT);
+	glBindTexture(GL_TEXTURE_2D, ClustersTex);
+	glActiveTexture(GL_TEXTURE0 + LIGHTINDEXUNIT);
+	glBindTexture(GL_TEXTURE_2D, LightIndexTex);
+	glActiveTexture(GL_TEXTURE0);
+
+	glUniform1i(u->lights, LIGHTSUNIT);
+	glUniform1i(u->clusters, CLUSTERSUNIT);
+	glUniform1i(u->lightIndices, LIGHTINDEXUNIT);
+	glUniform3f(u->viewport, (float)viewport[0], (float)viewport[1], (float)viewport[2]);
+	glUniform1f(u->clusterNear, ClusterNear);
+	glUniform1f(u->clusterLogRatio, logf(ClusterFar / ClusterNear));
+	glUniform1f(u->skipGroup, 0.f);
+}
+
+
+// shadows:
+//
+// a point light's shadows go in a cube map -- six 90-degree views out of the light,
+// each texel holding the distance from the light to the nearest caster (divided by
+// SHADOWFAR so that it fits in [0.,1.]). the lighting shaders compare a fragment's
+// own distance from the light to what the cube map has in that direction, 9 times
+// around it to soften the edge (percentage-closer filtering). the casters are drawn
+// by DrawShadowCasters( ) with the same vbos and display lists the main pass uses,
+// but with no textures, no lighting, and only the faces they fall in.
+// each light's cube map is sized by how close the light is to the eye
+
+#define MAXSHADOWCUBES		2
+#define SHADOWCUBEUNIT		7			// texture units of the cube maps, SHADOWCUBEUNIT+0, +1, ...
+#define EYETOWORLDMATRIX	7			// texture matrix the shaders get EyeToWorld[ ] from
+#define SHADOWMAXSIZE		1024		// texels along each side of a cube face
+#define SHADOWMINSIZE		256
+
+const float SHADOWNEAR = { 0.05f };
+const float SHADOWFAR = { 100.f };			// the shaders have this number in them too
+const float SHADOWSIZEREACH = { 12.f };		// a light closer to the eye than this gets SHADOWMAXSIZE, half the size every time that doubles
+
+// the look and up directions of the 6 cube faces, in GL_TEXTURE_CUBE_MAP_POSITIVE_X order:
+
+const float CubeFaces[6][2][3] =
+{
+	{ {  1.,  0.,  0. }, { 0., -1.,  0. } },
+	{ { -1.,  0.,  0. }, { 0., -1.,  0. } },
+	{ {  0.,  1.,  0. }, { 0.,  0.,  1. } },
+	{ {  0., -1.,  0. }, { 0.,  0., -1. } },
+	{ {  0.,  0.,  1. }, { 0., -1.,  0. } },
+	{ {  0.,  0., -1. }, { 0., -1.,  0. } },
+};
+
+struct shadowcube
+{
+	int		size;				// texels along each side of a face, 0 until it is first used
+	GLuint	tex;				// GL_R32F cube map of distances
+	GLuint	depth;				// depth renderbuffer the 6 faces share
+	GLuint	fbo;
+	float	x, y, z;			// where the light is, in world coordinates
+};
+
+struct shadowcube	ShadowCubes[MAXSHADOWCUBES];
+int					NumShadowCubes;			// # of cube maps drawn this frame
+bool				HasShadows;				// false means no framebuffer objects or no GL_R32F
+GLSLProgram*		ShadowCubeShader;		// writes the distance to the light
+float				EyeToWorld[16];			// undoes the viewing transformation, see BeginShadows( )
+
+// where a lighting shader keeps the uniforms BindShadows( ) sets, looked up once after it links:
+
+struct shadowuniforms
+{
+	GLint	shadowCubes[MAXSHADOWCUBES];
+	GLint	cubeLights[MAXSHADOWCUBES];
+	GLint	cubeTexels[MAXSHADOWCUBES];
+	GLint	shadowsOn;
+};
+
+
+// 4x4 matrices are column-major, the way glGetFloatv( ) hands them back:
+
+void
+MulMatrix(float a[16], float b[16], float ab[16])
+{
+	for (int c = 0; c < 4; c++)
+		for (int r = 0; r < 4; r++)
+			ab[4 * c + r] = a[r] * b[4 * c] + a[4 + r] * b[4 * c + 1] + a[8 + r] * b[4 * c + 2] + a[12 + r] * b[4 * c + 3];
+}
+
+void
+TransformPoint(float m[16], float x, float y, float z, float xyz[3])
+{
+	float w = m[3] * x + m[7] * y + m[11] * z + m[15];
+	xyz[0] = (m[0] * x + m[4] * y + m[8] * z + m[12]) / w;
+	xyz[1] = (m[1] * x + m[5] * y + m[9] * z + m[13]) / w;
+	xyz[2] = (m[2] * x + m[6] * y + m[10] * z + m[14]) / w;
+}
+
+// cofactors over the determinant, false if m cannot be inverted:
+
+bool
+InvertMatrix(float m[16], float inv[16])
+{
+	float t[16];
+	t[0] = m[5] * m[10] * m[15] - m[5] * m[11] * m[14] - m[9] * m[6] * m[15] + m[9] * m[7] * m[14] + m[13] * m[6] * m[11] - m[13] * m[7] * m[10];
+	t[4] = -m[4] * m[10] * m[15] + m[4] * m[11] * m[14] + m[8] * m[6] * m[15] - m[8] * m[7] * m[14] - m[12] * m[6] * m[11] + m[12] * m[7] * m[10];
+	t[8] = m[4] * m[9] * m[15] - m[4] * m[11] * m[13] - m[8] * m[5] * m[15] + m[8] * m[7] * m[13] + m[12] * m[5] * m[11] - m[12] * m[7] * m[9];
+	t[12] = -m[4] * m[9] * m[14] + m[4] * m[10] * m[13] + m[8] * m[5] * m[14] - m[8] * m[6] * m[13] - m[12] * m[5] * m[10] + m[12] * m[6] * m[9];
+	t[1] = -m[1] * m[10] * m[15] + m[1] * m[11] * m[14] + m[9] * m[2] * m[15] - m[9] * m[3] * m[14] - m[13] * m[2] * m[11] + m[13] * m[3] * m[10];
+	t[5] = m[0] * m[10] * m[15] - m[0] * m[11] * m[14] - m[8] * m[2] * m[15] + m[8] * m[3] * m[14] + m[12] * m[2] * m[11] - m[12] * m[3] * m[10];
+	t[9] = -m[0] * m[9] * m[15] + m[0] * m[11] * m[13] + m[8] * m[1] * m[15] - m[8] * m[3] * m[13] - m[12] * m[1] * m[11] + m[12] * m[3] * m[9];
+	t[13] = m[0] * m[9] * m[14] - m[0] * m[10] * m[13] - m[8] * m[1] * m[14] + m[8] * m[2] * m[13] + m[12] * m[1] * m[10] - m[12] * m[2] * m[9];
+	t[2] = m[1] * m[6] * m[15] - m[1] * m[7] * m[14] - m[5] * m[2] * m[15] + m[5] * m[3] * m[14] + m[13] * m[2] * m[7] - m[13] * m[3] * m[6];
+	t[6] = -m[0] * m[6] * m[15] + m[0] * m[7] * m[14] + m[4] * m[2] * m[15] - m[4] * m[3] * m[14] - m[12] * m[2] * m[7] + m[12] * m[3] * m[6];
+	t[10] = m[0] * m[5] * m[15] - m[0] * m[7] * m[13] - m[4] * m[1] * m[15] + m[4] * m[3] * m[13] + m[12] * m[1] * m[7] - m[12] * m[3] * m[5];
+	t[14] = -m[0] * m[5] * m[14] + m[0] * m[6] * m[13] + m[4] * m[1] * m[14] - m[4] * m[2] * m[13] - m[12] * m[1] * m[6] + m[12] * m[2] * m[5];
+	t[3] = -m[1] * m[6] * m[11] + m[1] * m[7] * m[10] + m[5] * m[2] * m[11] - m[5] * m[3] * m[10] - m[9] * m[2] * m[7] + m[9] * m[3] * m[6];
+	t[7] = m[0] * m[6] * m[11] - m[0] * m[7] * m[10] - m[4] * m[2] * m[11] + m[4] * m[3] * m[10] + m[8] * m[2] * m[7] - m[8] * m[3] * m[6];
+	t[11] = -m[0] * m[5] * m[11] + m[0] * m[7] * m[9] + m[4] * m[1] * m[11] - m[4] * m[3] * m[9] - m[8] * m[1] * m[7] + m[8] * m[3] * m[5];
+	t[15] = m[0] * m[5] * m[10] - m[0] * m[6] * m[9] - m[4] * m[1] * m[10] + m[4] * m[2] * m[9] + m[8] * m[1] * m[6] - m[8] * m[2] * m[5];
+
+	float det = m[0] * t[0] + m[1] * t[4] + m[2] * t[8] + m[3] * t[12];
+	if (det == 0.)
+		return false;
+	for (int i = 0; i < 16; i++)
+		inv[i] = t[i] / det;
+	return true;
+}
+
+
+// call this once the opengl context exists:
+
+void
+InitShadows()
+{
+	char* extensions = (char*)glGetString(GL_EXTENSIONS);
+	HasShadows = strstr(extensions, "GL_ARB_framebuffer_object") != NULL &&
+		strstr(extensions, "GL_ARB_texture_rg") != NULL;
+	if (!HasShadows)
+	{
+		fprintf(stderr, "No GL_ARB_framebuffer_object or GL_ARB_texture_rg -- there will be no shadows\n");
+		return;
+	}
+
+	ShadowCubeShader = new GLSLProgram();
+	bool valid = ShadowCubeShader->Create("shadowcube.vert", "shadowcube.frag");
+	if (!valid) {
+		fprintf(stderr, "Shadow cube shader cannot be created -- there will be no shadows\n");
+		HasShadows = false;
+	}
+	else
+		fprintf(stderr, "Shadow cube shader created.\n");
+	ShadowCubeShader->SetVerbose(false);
+}
+
+
+// (re)build a cube map and its framebuffer at a new size.
+// returns false, and turns the shadows off, if the framebuffer cannot be drawn into:
+
+bool
+SizeShadowCube(struct shadowcube* sc, int size)
+{
+	if (sc->size == 0)
+	{
+		glGenTextures(1, &sc->tex);
+		glGenRenderbuffers(1, &sc->depth);
+		glGenFramebuffers(1, &sc->fbo);
+	}
+	sc->size = size;
+
+	glBindTexture(GL_TEXTURE_CUBE_MAP, sc->tex);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	for (int f = 0; f < 6; f++)
+		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, 0, GL_R32F, size, size, 0, GL_RED, GL_FLOAT, NULL);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, sc->depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size, size);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	// the faces all have the same size and format, so checking with one of them is enough:
+
+	GLint oldFbo;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &oldFbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, sc->fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, sc->depth);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X, sc->tex, 0);
+	bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	glBindFramebuffer(GL_FRAMEBUFFER, oldFbo);
+	if (!complete)
+	{
+		fprintf(stderr, "Shadow cube framebuffer (%d x %d GL_R32F) is not complete -- there will be no shadows\n", size, size);
+		HasShadows = false;
+	}
+	return complete;
+}
+
+
+// call this right after the viewing transformation is set, before any shadows are drawn:
+// the shadow maps are all in world coordinates, and the shaders get from eye
+// coordinates back to world coordinates with the inverse of the viewing transformation
 
-struct point
+void
+BeginShadows()
 {
-	float x, y, z;		// coordinates
-	float nx, ny, nz;	// surface normal
-	float s, t;		// texture coords
-};
+	float mv[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+	InvertMatrix(mv, EyeToWorld);
+	NumShadowCubes = 0;
+}
 
-inline
-struct point*
-	PtsPointer(int lat, int lng)
+
+// draw the shadow cube map for a point light at (x,y,z), which, like AddLight( ),
+// goes through the current modelview matrix.
+// returns the cube map's slot for light->shadow, 0 if there is no cube map for it:
+
+int
+RenderShadowCube(float x, float y, float z)
 {
-	if (lat < 0)	lat += (NumLats - 1);
-	if (lng < 0)	lng += (NumLngs - 0);
-	if (lat > NumLats - 1)	lat -= (NumLats - 1);
-	if (lng > NumLngs - 1)	lng -= (NumLngs - 0);
-	return &Pts[NumLngs * lat + lng];
+	if (!HasShadows || NumShadowCubes >= MAXSHADOWCUBES)
+		return 0;
+
+	float mv[16], toWorld[16], eye[3];
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+	MulMatrix(EyeToWorld, mv, toWorld);
+	struct shadowcube* sc = &ShadowCubes[NumShadowCubes++];
+	float light[3];
+	TransformPoint(toWorld, x, y, z, light);
+	sc->x = light[0];
+	sc->y = light[1];
+	sc->z = light[2];
+
+	TransformPoint(EyeToWorld, 0., 0., 0., eye);
+	float dx = eye[0] - sc->x;
+	float dy = eye[1] - sc->y;
+	float dz = eye[2] - sc->z;
+	float distance = sqrtf(dx * dx + dy * dy + dz * dz);
+	int size = SHADOWMAXSIZE;
+	for (float reach = SHADOWSIZEREACH; distance > reach && size > SHADOWMINSIZE; reach *= 2.)
+		size /= 2;
+	if (size != sc->size && !SizeShadowCube(sc, size))
+	{
+		NumShadowCubes--;
+		return 0;
+	}
+
+	// draw into the cube map, and put everything back the way it was afterwards
+	// (the window might be drawing into a framebuffer object too):
+
+	GLint oldFbo, oldViewport[4];
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &oldFbo);
+	glGetIntegerv(GL_VIEWPORT, oldViewport);
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	gluPerspective(90., 1., SHADOWNEAR, SHADOWFAR);
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+
+	glBindFramebuffer(GL_FRAMEBUFFER, sc->fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, sc->depth);
+	glViewport(0, 0, sc->size, sc->size);
+	glClearColor(1., 1., 1., 1.);		// nothing in the way, as far as SHADOWFAR
+	ShadowCubeShader->Use();
+	for (int f = 0; f < 6; f++)
+	{
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, sc->tex, 0);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glLoadIdentity();
+		gluLookAt(sc->x, sc->y, sc->z,
+			sc->x + CubeFaces[f][0][0], sc->y + CubeFaces[f][0][1], sc->z + CubeFaces[f][0][2],
+			CubeFaces[f][1][0], CubeFaces[f][1][1], CubeFaces[f][1][2]);
+		DrawShadowCasters(f, light);
+	}
+	ShadowCubeShader->Use(0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, oldFbo);
+	glViewport(oldViewport[0], oldViewport[1], oldViewport[2], oldViewport[3]);
+	glClearColor(BACKCOLOR[0], BACKCOLOR[1], BACKCOLOR[2], BACKCOLOR[3]);
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPopMatrix();
+
+	return NumShadowCubes;
 }
 
-inline
+
 void
-DrawPoint(struct point* p)
+LookUpShadowUniforms(GLuint program, struct shadowuniforms* u)
 {
-	glNormal3fv(&p->nx);
-	glTexCoord2fv(&p->s);
-	glVertex3fv(&p->x);
+	char name[32];
+	for (int i = 0; i < MAXSHADOWCUBES; i++)
+	{
+		sprintf(name, "uShadowCube%d", i);
+		u->shadowCubes[i] = glGetUniformLocation(program, name);
+		sprintf(name, "uCubeLight%d", i);
+		u->cubeLights[i] = glGetUniformLocation(program, name);
+		sprintf(name, "uCubeTexel%d", i);
+		u->cubeTexels[i] = glGetUniformLocation(program, name);
+	}
+	u->shadowsOn = glGetUniformLocation(program, "uShadowsOn");
 }
 
+
+// hand the shadow maps to the lighting shader that is in use, whose uniforms are in u:
+
 void
-OsuSphere(float radius, int slices, int stacks)
+BindShadows(struct shadowuniforms* u)
 {
-	// set the globals:
+	glActiveTexture(GL_TEXTURE0 + EYETOWORLDMATRIX);
+	glMatrixMode(GL_TEXTURE);
+	glLoadMatrixf(EyeToWorld);
+	glMatrixMode(GL_MODELVIEW);
 
-	NumLngs = slices;
-	NumLats = stacks;
-	if (NumLngs < 3)
-		NumLngs = 3;
-	if (NumLats < 3)
-		NumLats = 3;
+	for (int i = 0; i < MAXSHADOWCUBES; i++)
+	{
+		struct shadowcube* sc = &ShadowCubes[i];
+		glActiveTexture(GL_TEXTURE0 + SHADOWCUBEUNIT + i);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, sc->tex);
 
-	// allocate the point data structure:
+		glUniform1i(u->shadowCubes[i], SHADOWCUBEUNIT + i);
+		glUniform3f(u->cubeLights[i], sc->x, sc->y, sc->z);
+		glUniform1f(u->cubeTexels[i], sc->size > 0 ? 2.f / (float)sc->size : 0.f);
+	}
+	glActiveTexture(GL_TEXTURE0);
+	glUniform1i(u->shadowsOn, (ShadowsOn != 0 && HasShadows) ? 1 : 0);
+}
 
-	Pts = new struct point[NumLngs * NumLats];
 
-	// fill the Pts structure:
+// the light field -- LIGHTFIELDSIZE small colored lights spread evenly over a shell
+// around the earth (a fibonacci spiral), turning with it. they are only real
+// lights with clustered lighting:
 
-	for (int ilat = 0; ilat < NumLats; ilat++)
-	{
-		float lat = -M_PI / 2. + M_PI * (float)ilat / (float)(NumLats - 1);	// ilat=0/lat=0. is the south pole
-											// ilat=NumLats-1, lat=+M_PI/2. is the north pole
-		float xz = cosf(lat);
-		float  y = sinf(lat);
-		for (int ilng = 0; ilng < NumLngs; ilng++)				// ilng=0, lng=-M_PI and
-											// ilng=NumLngs-1, lng=+M_PI are the same meridian
-		{
-			float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(NumLngs - 1);
-			float x = xz * cosf(lng);
-			float z = -xz * sinf(lng);
-			struct point* p = PtsPointer(ilat, ilng);
-			p->x = radius * x;
-			p->y = radius * y;
-			p->z = radius * z;
-			p->nx = x;
-			p->ny = y;
-			p->nz = z;
-			if (Distort == 1)
-			{
-				p->s = ((lng + M_PI) / (2. * M_PI)) + (cos(rand())) / 100;
-				p->t = ((lat + M_PI / 2.) / M_PI) + (cos(rand())) / 100;
-			}
-			else
-			{
-				p->s = (lng + M_PI) / (2. * M_PI);
-				p->t = (lat + M_PI / 2.) / M_PI;
-			}
-		}
-	}
+#define LIGHTFIELDSIZE		256
+#define MOONUFOLIGHTS		1		// light group of the moon and ufo lights, the ring is drawn without them
+
+const float LIGHTFIELDRADIUS = { 11.5f };
+const float LIGHTFIELDQUADATTEN = { 8.f };
+
+bool			LightFieldOn;			// true means draw (and light) the light field
+GLSLProgram*	LightShader;			// the clustered lighting for the lit objects
+struct clusteruniforms	LightClusterUniforms;		// its uniform locations, found once after linking
+struct shadowuniforms	LightShadowUniforms;
+GLint			LightTexturedLoc, LightTexUnitLoc;
 
-	struct point top, bot;		// top, bottom points
 
-	top.x = 0.;		top.y = radius;	top.z = 0.;
-	top.nx = 0.;		top.ny = 1.;		top.nz = 0.;
-	top.s = 0.;		top.t = 1.;
+// where light i of the field goes, and its color:
 
-	bot.x = 0.;		bot.y = -radius;	bot.z = 0.;
-	bot.nx = 0.;		bot.ny = -1.;		bot.nz = 0.;
-	bot.s = 0.;		bot.t = 0.;
+void
+FieldLight(int i, float xyz[3], float rgb[3])
+{
+	float y = 1. - 2. * ((float)i + 0.5) / (float)LIGHTFIELDSIZE;
+	float xz = sqrtf(1. - y * y);
+	float lng = (float)i * M_PI * (3. - sqrtf(5.));		// the golden angle
+	xyz[0] = LIGHTFIELDRADIUS * xz * cosf(lng);
+	xyz[1] = LIGHTFIELDRADIUS * y;
+	xyz[2] = LIGHTFIELDRADIUS * xz * sinf(lng);
+
+	float hsv[3] = { 360.f * (float)i / (float)LIGHTFIELDSIZE, 1., 1. };
+	HsvRgb(hsv, rgb);
+}
+
+
+// start drawing a lit object with the lighting shader, when clustered lighting is on:
+
+void
+UseLightShader(bool textured)
+{
+	LightShader->Use();
+	BindClusters(&LightClusterUniforms);
+	glUniform1i(LightTexturedLoc, textured ? 1 : 0);
+	glUniform1i(LightTexUnitLoc, 0);
+	BindShadows(&LightShadowUniforms);
+}
 
-	// connect the north pole to the latitude NumLats-2:
 
+// does a sphere (its center relative to a light, and its radius) reach into cube face f?
+// a face sees the 90-degree pyramid around its axis, so this is a little generous at the corners:
 
-	glBegin(GL_TRIANGLE_STRIP);
-	for (int ilng = 0; ilng < NumLngs; ilng++)
+bool
+InCubeFace(int f, float center[3], float radius)
+{
+	const float* axis = CubeFaces[f][0];
+	float along = axis[0] * center[0] + axis[1] * center[1] + axis[2] * center[2];
+	if (along + radius <= 0.)
+		return false;
+	float slack = radius * (float)M_SQRT2;
+	for (int k = 0; k < 3; k++)
 	{
-		glTexCoord2f(bot.s, bot.t);
-		float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(NumLngs - 1);
-		top.s = (lng + M_PI) / (2. * M_PI);
-		DrawPoint(&top);
-		struct point* p = PtsPointer(NumLats - 2, ilng);	// ilat=NumLats-1 is the north pole
-		DrawPoint(p);
+		if (axis[k] == 0. && fabsf(center[k]) - slack > along)
+			return false;
 	}
-	glEnd();
+	return true;
+}
 
-	// connect the south pole to the latitude 1:
 
-	glBegin(GL_TRIANGLE_STRIP);
-	for (int ilng = NumLngs - 1; ilng >= 0; ilng--)
+// everything that casts shadows, for the shadow cube maps: the earth, the ufo, and the ring,
+// each one only in the faces it falls in. the moon and the lights are where the lights are:
+
+void
+DrawShadowCasters(int face, float* light)
+{
+	float earth[3] = { -light[0], -light[1], -light[2] };
+	if (InCubeFace(face, earth, 10.))
 	{
-		glTexCoord2f(bot.s, bot.t);
-		float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(NumLngs - 1);
-		bot.s = (lng + M_PI) / (2. * M_PI);
-		DrawPoint(&bot);
-		struct point* p = PtsPointer(1, ilng);					// ilat=0 is the south pole
-		DrawPoint(p);
+		glPushMatrix();
+		glRotatef(WorldAngle, 0., 1., 0.);
+		OsuSphere(10, 50, 50);
+		glPopMatrix();
 	}
-	glEnd();
 
-	// connect the horizontal strips:
+	float ufo[3] = { -light[0], 25.f - light[1], -light[2] };
+	if (InCubeFace(face, ufo, 2.5))
+	{
+		glPushMatrix();
+		glTranslatef(0., 25., 0.);
+		glRotatef(90., 1., 0., 0.);
+		OsuSphere(1, 50, 50);
+		DrawUfoRim();
+		glPopMatrix();
+	}
 
-	for (int ilat = 2; ilat < NumLats - 1; ilat++)
+	float ring[3] = { -15.f - light[0], -light[1], -light[2] };
+	if (InCubeFace(face, ring, 2.5))
 	{
-		struct point* p;
-		glBegin(GL_TRIANGLE_STRIP);
-		for (int ilng = 0; ilng < NumLngs; ilng++)
-		{
-			p = PtsPointer(ilat, ilng);
-			DrawPoint(p);
-			p = PtsPointer(ilat - 1, ilng);
-			DrawPoint(p);
-		}
-		glEnd();
+		glPushMatrix();
+		glTranslatef(-15., 0., 0.);
+		glRotatef(90., 0., 1., 0.);
+		DrawRing();
+		glPopMatrix();
 	}
-	// clean-up:
-	delete[] Pts;
-	Pts = NULL;
 }
 
 
@@ -472,10 +1713,20 @@ Animate()
 	ms %= MS_IN_THE_ANIMATION_CYCLE;				// milliseconds in the range 0 to MS_IN_THE_ANIMATION_CYCLE-1
 	Time = (float)ms / (float)MS_IN_THE_ANIMATION_CYCLE;        // [ 0., 1. )
 
-	WorldAngle += 0.5;
-	redufo = (float)rand() / RAND_MAX;
-	blueufo = (float)rand() / RAND_MAX;
-	greenufo = (float)rand() / RAND_MAX;
+	// the world turns half a degree a step, 30 degrees a second, and the disco light
+	// changes color every step:
+
+	int steps = CountSteps();
+	for (int i = 0; i < steps; i++)
+	{
+		PrevWorldAngle = NextWorldAngle;
+		NextWorldAngle += 0.5;
+		redufo = (float)rand() / RAND_MAX;
+		blueufo = (float)rand() / RAND_MAX;
+		greenufo = (float)rand() / RAND_MAX;
+	}
+	WorldAngle = PrevWorldAngle + StepAlpha * (NextWorldAngle - PrevWorldAngle);
+	CapFrameRate();
 
 	glFlush();
 	glutSetWindow(MainWindow);
@@ -498,6 +1749,8 @@ Display()
 
 	glutSetWindow(MainWindow);
 
+	BeginZone(ZONE_CLEAR);
+
 	// erase the background:
 
 	glDrawBuffer(GL_BACK);
@@ -601,6 +1854,34 @@ Display()
 		Scale = MINSCALE;
 	glScalef((GLfloat)Scale, (GLfloat)Scale, (GLfloat)Scale);
 
+	EndZone();
+
+
+	// the shadow cube maps, for the moon and the red light, at the same places
+	// as their lights below. the shadows are done per fragment, so they need
+	// clustered lighting:
+
+	BeginZone(ZONE_SHADOWS);
+
+	int shadow0 = 0, shadow2 = 0;
+	if (ShadowsOn && ClusteredOn && HasShadows)
+	{
+		BeginShadows();
+		if (Light0On)
+		{
+			glPushMatrix();
+			glRotatef((WorldAngle / 5), 0., 1., 0.);
+			shadow0 = RenderShadowCube(0., 0., 50.);
+			glPopMatrix();
+		}
+		if (Light2On)
+			shadow2 = RenderShadowCube(-12., 10., 0.);
+	}
+
+	EndZone();
+
+	BeginZone(ZONE_BINNING);
+
 
 	// Turn the lights on
 
@@ -625,26 +1906,79 @@ Display()
 	glEnable(GL_NORMALIZE);
 
 
+	// with clustered lighting the lights go into the light list instead of
+	// GL_LIGHT0-2, at the same places the SetPointLight( ) and SetSpotLight( ) calls
+	// below put them. the ufo spot light only ends up on in disco mode:
+
+	if (ClusteredOn)
+	{
+		ClearLights();
+		LightGroup = MOONUFOLIGHTS;
+		if (Light0On)
+		{
+			glPushMatrix();
+			glRotatef((WorldAngle / 5), 0., 1., 0.);
+			struct light* l = AddPointLight(0., 0., 50., 1., 1., 1., 1., 0.);
+			if (l != NULL)
+				l->shadow = shadow0;
+			glPopMatrix();
+		}
+		if (Light1Disco)
+			AddSpotLight(0., 13., 0., 0., -1., 0., redufo, blueufo, greenufo);
+		LightGroup = 0;
+		if (Light2On)
+		{
+			struct light* l = AddPointLight(-12., 10., 0., 1., 0., 0., 1., 0.005);
+			if (l != NULL)
+				l->shadow = shadow2;
+		}
+		if (LightFieldOn)
+		{
+			glPushMatrix();
+			glRotatef(WorldAngle, 0., 1., 0.);
+			for (int i = 0; i < LIGHTFIELDSIZE; i++)
+			{
+				float xyz[3], rgb[3];
+				FieldLight(i, xyz, rgb);
+				AddPointLight(xyz[0], xyz[1], xyz[2], rgb[0], rgb[1], rgb[2], 1., LIGHTFIELDQUADATTEN);
+			}
+			glPopMatrix();
+		}
+		BinLights(0.1, 1000.);
+	}
+
+	EndZone();
+
+
 	// Draw Earth
 
+	BeginZone(ZONE_EARTH);
+
 	glEnable(GL_LIGHTING);
 	glPushMatrix();
 	glRotatef(WorldAngle, 0., 1., 0.);
 	glEnable(GL_TEXTURE_2D);
 	glBindTexture(GL_TEXTURE_2D, Tex0);
 	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
-	glMatrixMode(GL_TEXTURE_2D);
 	glShadeModel(GL_SMOOTH);
 	SetMaterial(1., 1., 1., 50.);
 	glColor3f(.8, .8, .8);
+	if (ClusteredOn)
+		UseLightShader(true);
 	OsuSphere(10, 50, 50);
+	if (ClusteredOn)
+		LightShader->Use(0);
 	glDisable(GL_TEXTURE_2D);
 	glPopMatrix();
 	glDisable(GL_LIGHTING);
 
+	EndZone();
+
 
 	// Draw Moon and Pointlight
 
+	BeginZone(ZONE_MOON);
+
 	glPushMatrix();
 	glRotatef((WorldAngle / 5), 0., 1., 0.);
 
@@ -661,9 +1995,13 @@ Display()
 	OsuSphere(0.7, 25, 25);
 	glPopMatrix();
 
+	EndZone();
+
 
 	// Draw the UFO
 
+	BeginZone(ZONE_UFO);
+
 	glShadeModel(GL_FLAT);
 	glEnable(GL_LIGHTING);
 
@@ -672,9 +2010,12 @@ Display()
 	glRotatef(90., 1., 0., 0.);
 	SetMaterial(0.1, 0.1, 0.1, 50.);
 	glColor3f(0.0, 0.0, 0.0);
+	if (ClusteredOn)
+		UseLightShader(false);
 	OsuSphere(1, 50, 50);
-	glScalef(1., 1., 0.25);
-	glutSolidTorus(1, 1.5, 100, 100);
+	DrawUfoRim();
+	if (ClusteredOn)
+		LightShader->Use(0);
 	glPopMatrix();
 
 	glDisable(GL_LIGHTING);
@@ -709,25 +2050,40 @@ Display()
 	{
 		glColor3f(0., 1., 0.);
 	}
-	glutSolidSphere(0.25, 25., 25.);
+	OsuSphere(0.25, 25, 25);
 	glPopMatrix();
 
+	EndZone();
+
 	// Torus Ring
 
+	BeginZone(ZONE_RING);
+
 	glPushMatrix();
 	glTranslatef(-15., 0., 0.);
 	glRotatef(90., 0., 1., 0.);
-	glScalef(1., 1., 0.75);
 	glShadeModel(GL_SMOOTH);
 	glEnable(GL_LIGHTING);
 	glDisable(GL_LIGHT0);
 	glDisable(GL_LIGHT1);
 	SetMaterial(0., 0., 1.0, 0.);
-	glutSolidTorus(1, 1.5, 200, 200);
+	if (ClusteredOn)
+	{
+		UseLightShader(false);
+		glUniform1f(LightClusterUniforms.skipGroup, (float)MOONUFOLIGHTS);
+	}
+	DrawRing();
+	if (ClusteredOn)
+		LightShader->Use(0);
 	glPopMatrix();
 
+	EndZone();
+
 
 	// Lighting Beside Ring
+
+	BeginZone(ZONE_LIGHTS);
+
 	glEnable(GL_LIGHTING);
 	glPushMatrix();
 	SetPointLight(GL_LIGHT2, -12., 10., 0., 1., 0., 0., 1., 0.005);
@@ -735,12 +2091,33 @@ Display()
 	glDisable(GL_LIGHTING);
 	glTranslatef(-12., 10., 0.);
 	glColor3f(1., 0., 0.);
-	glutSolidSphere(0.25, 25., 25.);
+	OsuSphere(0.25, 25, 25);
 	glPopMatrix();
 
+	if (LightFieldOn)
+	{
+		glPushMatrix();
+		glRotatef(WorldAngle, 0., 1., 0.);
+		for (int i = 0; i < LIGHTFIELDSIZE; i++)
+		{
+			float xyz[3], rgb[3];
+			FieldLight(i, xyz, rgb);
+			glPushMatrix();
+			glTranslatef(xyz[0], xyz[1], xyz[2]);
+			glColor3fv(rgb);
+			OsuSphere(0.1, 8, 8);
+			glPopMatrix();
+		}
+		glPopMatrix();
+	}
+
+	EndZone();
+
 
 	// draw some gratuitous text that just rotates on top of the scene:
 
+	BeginZone(ZONE_TEXT);
+
 	glDisable(GL_DEPTH_TEST);
 	glColor3f(0., 1., 1.);
 	DoRasterString(0., 1., 0., (char*)"");
@@ -782,6 +2159,16 @@ Display()
 	DoRasterString(69., 12., 0., (char*)"(1) Light Switch 1");
 	DoRasterString(69., 7., 0., (char*)"(2) Light Switch 2");
 	DoRasterString(69., 2., 0., (char*)"(3) Light Switch 3");
+	DoRasterString(69., 17., 0., (char*)"(T) Profile");
+	DoRasterString(69., 22., 0., (char*)"(4) Light Field");
+	DoRasterString(69., 27., 0., (char*)"(L) Clustered Lights");
+	DoRasterString(69., 32., 0., (char*)"(H) Shadows");
+
+	if (ShowProfile)
+		DrawProfile(2., 88.);
+
+	EndZone();
+	EndProfileFrame();
 
 
 	// swap the double-buffered framebuffers:
@@ -823,6 +2210,19 @@ DoLightsMenu(int id)
 		Light1On = !Light1On;
 	else if (id == 2)
 		Light2On = !Light2On;
+	else if (id == 3)
+		LightFieldOn = !LightFieldOn;
+	else if (id == 4)
+		ClusteredOn = HasClusters && !ClusteredOn;
+
+	glutSetWindow(MainWindow);
+	glutPostRedisplay();
+}
+
+void
+DoShadowsMenu(int id)
+{
+	ShadowsOn = id;
 
 	glutSetWindow(MainWindow);
 	glutPostRedisplay();
@@ -866,6 +2266,18 @@ DoDebugMenu(int id)
 	glutPostRedisplay();
 }
 
+
+void
+DoFilterMenu(int id)
+{
+	WhichFilter = id;
+	SetTextureFilter();
+
+	glutSetWindow(MainWindow);
+	glutPostRedisplay();
+}
+
+
 // main menu callback:
 
 void
@@ -962,6 +2374,12 @@ InitMenus()
 	glutAddMenuEntry("Light 1 - On/Off", 0);
 	glutAddMenuEntry("Light 2 - On/Off", 1);
 	glutAddMenuEntry("Light 3 - On/Off", 2);
+	glutAddMenuEntry("Light Field - On/Off", 3);
+	glutAddMenuEntry("Clustered Lighting - On/Off", 4);
+
+	int shadowsmenu = glutCreateMenu(DoShadowsMenu);
+	glutAddMenuEntry("Off", 0);
+	glutAddMenuEntry("On", 1);
 
 	int discomenu = glutCreateMenu(DoDiscoMenu);
 	glutAddMenuEntry("Off", 0);
@@ -975,6 +2393,11 @@ InitMenus()
 	glutAddMenuEntry("Orthographic", ORTHO);
 	glutAddMenuEntry("Perspective", PERSP);
 
+	int filtermenu = glutCreateMenu(DoFilterMenu);
+	glutAddMenuEntry("Bilinear", BILINEAR);
+	glutAddMenuEntry("Trilinear (Mipmaps)", TRILINEAR);
+	glutAddMenuEntry("Anisotropic", ANISOTROPIC);
+
 	int debugmenu = glutCreateMenu(DoDebugMenu);
 	glutAddMenuEntry("Off", 0);
 	glutAddMenuEntry("On", 1);
@@ -982,9 +2405,11 @@ InitMenus()
 	int mainmenu = glutCreateMenu(DoMainMenu);
 	glutAddSubMenu("Views", viewmenu);
 	glutAddSubMenu("Light Switches", lightsmenu);
+	glutAddSubMenu("Shadows", shadowsmenu);
 	glutAddSubMenu("Disco Mode", discomenu);
 	glutAddSubMenu("Distortion", distortmenu);
 	glutAddSubMenu("Projection", projmenu);
+	glutAddSubMenu("Texture Filtering", filtermenu);
 	glutAddSubMenu("Debug", debugmenu);
 	glutAddMenuEntry("Reset", RESET);
 	glutAddMenuEntry("Quit", QUIT);
@@ -1051,8 +2476,15 @@ InitGraphics()
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);		// build the mipmaps when the image is loaded
 	glTexImage2D(GL_TEXTURE_2D, 0, 3, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, Texture);
 
+	// see how much anisotropic filtering this card can do:
+
+	MaxAnisotropy = 1.;
+	if (strstr((char*)glGetString(GL_EXTENSIONS), "GL_EXT_texture_filter_anisotropic") != NULL)
+		glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &MaxAnisotropy);
+
 	glutSetWindow(MainWindow);
 	glutDisplayFunc(Display);
 	glutReshapeFunc(Resize);
@@ -1088,6 +2520,33 @@ InitGraphics()
 	fprintf(stderr, "Status: Using GLEW %s\n", glewGetString(GLEW_VERSION));
 #endif
 
+	// the timer queries are from glew too, and so are the clustered lights' float textures and shader,
+	// and the shadows' framebuffer objects (the shadows are done by the clustered lighting shader):
+
+	InitProfiler();
+	InitClusters();
+	if (HasClusters)
+	{
+		LightShader = new GLSLProgram();
+		bool valid = LightShader->Create("lights.vert", "lights.frag");
+		if (!valid) {
+			fprintf(stderr, "Light shader cannot be created -- the lights will be fixed-function only\n");
+			HasClusters = false;
+		}
+		else
+			fprintf(stderr, "Light shader created.\n");
+		LightShader->SetVerbose(false);
+		if (valid)
+		{
+			GLuint program = ProgramHandle(LightShader);
+			LightTexturedLoc = glGetUniformLocation(program, "uTextured");
+			LightTexUnitLoc = glGetUniformLocation(program, "uTexUnit");
+			LookUpClusterUniforms(program, &LightClusterUniforms);
+			LookUpShadowUniforms(program, &LightShadowUniforms);
+		}
+	}
+	if (HasClusters)
+		InitShadows();
 }
 
 
@@ -1137,7 +2596,10 @@ Keyboard(unsigned char c, int x, int y)
 		if (Frozen)
 			glutIdleFunc(NULL);
 		else
+		{
+			LastStepMs = -1;
 			glutIdleFunc(Animate);
+		}
 		break;
 
 	case 'v':
@@ -1170,6 +2632,27 @@ Keyboard(unsigned char c, int x, int y)
 		Light2On = !Light2On;
 		break;
 
+	case '4':
+		LightFieldOn = !LightFieldOn;
+		break;
+
+	case 'l':
+	case 'L':
+		ClusteredOn = HasClusters && !ClusteredOn;
+		break;
+
+	case 'h':
+	case 'H':
+		ShadowsOn = !ShadowsOn;
+		break;
+
+	case 't':
+	case 'T':
+		ShowProfile = !ShowProfile;
+		if (ShowProfile)
+			ResetProfiler();
+		break;
+
 	case 'q':
 	case 'Q':
 	case ESCAPE:
@@ -1178,6 +2661,7 @@ Keyboard(unsigned char c, int x, int y)
 
 	default:
 		fprintf(stderr, "Don't know what to do with keyboard hit: '%c' (0x%0x)\n", c, c);
+		return;			// nothing changed, so there is nothing to redraw
 	}
 
 	// force a call to Display( ):
@@ -1243,8 +2727,14 @@ MouseButton(int button, int state, int x, int y)
 		ActiveButton &= ~b;		// clear the proper bit
 	}
 
-	glutSetWindow(MainWindow);
-	glutPostRedisplay();
+	// pressing or letting go of a button only changes what the next moves do,
+	// but the wheel changes the scale right away:
+
+	if (button == SCROLL_WHEEL_UP || button == SCROLL_WHEEL_DOWN)
+	{
+		glutSetWindow(MainWindow);
+		glutPostRedisplay();
+	}
 
 }
 
@@ -1254,7 +2744,7 @@ MouseButton(int button, int state, int x, int y)
 void
 MouseMotion(int x, int y)
 {
-	if (true)
+	if (DebugOn != 0)
 		fprintf(stderr, "MouseMotion: %d, %d\n", x, y);
 
 
@@ -1281,8 +2771,16 @@ MouseMotion(int x, int y)
 	Xmouse = x;			// new current position
 	Ymouse = y;
 
-	glutSetWindow(MainWindow);
-	glutPostRedisplay();
+	// glut calls this for every move, with or without a button down, and most of
+	// them change nothing on the screen. only the ones that turned or scaled the
+	// scene ask for a redraw, and however many of those come in before the next
+	// Display( ), glut still draws just once for them:
+
+	if ((dx != 0 || dy != 0) && (ActiveButton & (LEFT | MIDDLE)) != 0)
+	{
+		glutSetWindow(MainWindow);
+		glutPostRedisplay();
+	}
 }
 
 
@@ -1305,14 +2803,30 @@ Reset()
 	Xrot = Yrot = 0.;
 	Light0On = Light1On = Light2On = true;
 	Light1Disco = false;
+	LightFieldOn = false;
+	ClusteredOn = HasClusters;
 	Distort = 0;
-	WorldAngle = 0;
+	WorldAngle = PrevWorldAngle = NextWorldAngle = 0;
 	MouseLock = false;
 	ScaleOnly = false;
+	WhichFilter = TRILINEAR;
+	SetTextureFilter();
 	glFlush();
 }
 
 
+// set the minification filter of the texture from WhichFilter:
+
+void
+SetTextureFilter()
+{
+	glBindTexture(GL_TEXTURE_2D, Tex0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (WhichFilter == BILINEAR) ? GL_LINEAR : GL_LINEAR_MIPMAP_LINEAR);
+	if (MaxAnisotropy > 1.)
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, (WhichFilter == ANISOTROPIC) ? MaxAnisotropy : 1.f);
+}
+
+
 // called when user resizes the window:
 
 void
@@ -1419,7 +2933,9 @@ struct bmfh
 	short bfReserved1;
 	short bfReserved2;
 	int bfOffBytes;		// # bytes to get to the start of the per-pixel data
-} FileHeader;
+};
+
+#define BMFH_SIZE		14	// bytes the file header takes up in the file (sizeof(struct bmfh) is padded)
 
 // bmp info header:
 struct bmih
@@ -1435,11 +2951,39 @@ struct bmih
 	int biYPixelsPerMeter;
 	int biClrUsed;		// # colors in the palette
 	int biClrImportant;
-} InfoHeader;
+};
+
 
+// turn one row of bgr pixels into rgb.
+// with ssse3, 5 pixels at a time are swapped with a single byte shuffle:
+// 16 bytes are loaded and stored, but only the first 15 are kept, the 16th
+// gets overwritten by the next group. the shuffle is only compiled in when the
+// compiler targets ssse3 (-mssse3 or -mavx with g++, /arch:AVX with msvc) --
+// without that it is all the plain loop
+
+void
+BgrToRgb(const unsigned char* bgr, unsigned char* rgb, int numPixels)
+{
+	int s = 0;
+#if defined(__SSSE3__) || defined(__AVX__)
+	const __m128i swap = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+	for (; s + 6 <= numPixels; s += 5)
+	{
+		__m128i pixels = _mm_loadu_si128((const __m128i*)(bgr + 3 * s));
+		_mm_storeu_si128((__m128i*)(rgb + 3 * s), _mm_shuffle_epi8(pixels, swap));
+	}
+#endif
+	for (; s < numPixels; s++)
+	{
+		rgb[3 * s + 0] = bgr[3 * s + 2];		// r
+		rgb[3 * s + 1] = bgr[3 * s + 1];		// g
+		rgb[3 * s + 2] = bgr[3 * s + 0];		// b
+	}
+}
 
 
 // read a BMP file into a Texture:
+// the whole file is read with one fread( ) and then decoded from memory
 
 unsigned char*
 BmpToTexture(char* filename, int* width, int* height)
@@ -1461,7 +3005,32 @@ BmpToTexture(char* filename, int* width, int* height)
 	}
 #endif
 
-	FileHeader.bfType = ReadShort(fp);
+	fseek(fp, 0, SEEK_END);
+	long fileSize = ftell(fp);
+	rewind(fp);
+	if (fileSize < BMFH_SIZE + 40)
+	{
+		fprintf(stderr, "Bmp file '%s' is too short to be a bmp\n", filename);
+		fclose(fp);
+		return NULL;
+	}
+
+	unsigned char* file = new unsigned char[fileSize];
+	size_t numRead = fread(file, 1, fileSize, fp);
+	fclose(fp);
+	if (numRead != (size_t)fileSize)
+	{
+		fprintf(stderr, "Cannot read Bmp file '%s'\n", filename);
+		delete[] file;
+		return NULL;
+	}
+
+	// the headers are local so that more than one file can be loaded at a time:
+
+	struct bmfh FileHeader;
+	struct bmih InfoHeader;
+
+	FileHeader.bfType = ReadShort(&file[0]);
 
 
 	// if bfType is not BMP_MAGIC_NUMBER, the file is not a bmp:
@@ -1471,84 +3040,85 @@ BmpToTexture(char* filename, int* width, int* height)
 	if (FileHeader.bfType != BMP_MAGIC_NUMBER)
 	{
 		fprintf(stderr, "Wrong type of file: 0x%0x\n", FileHeader.bfType);
-		fclose(fp);
+		delete[] file;
 		return NULL;
 	}
 
 
-	FileHeader.bfSize = ReadInt(fp);
+	FileHeader.bfSize = ReadInt(&file[2]);
 	if (VERBOSE)	fprintf(stderr, "FileHeader.bfSize = %d\n", FileHeader.bfSize);
 
-	FileHeader.bfReserved1 = ReadShort(fp);
-	FileHeader.bfReserved2 = ReadShort(fp);
+	FileHeader.bfReserved1 = ReadShort(&file[6]);
+	FileHeader.bfReserved2 = ReadShort(&file[8]);
 
-	FileHeader.bfOffBytes = ReadInt(fp);
+	FileHeader.bfOffBytes = ReadInt(&file[10]);
 	if (VERBOSE)	fprintf(stderr, "FileHeader.bfOffBytes = %d\n", FileHeader.bfOffBytes);
 
 
-	InfoHeader.biSize = ReadInt(fp);
+	InfoHeader.biSize = ReadInt(&file[14]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biSize = %d\n", InfoHeader.biSize);
-	InfoHeader.biWidth = ReadInt(fp);
+	InfoHeader.biWidth = ReadInt(&file[18]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biWidth = %d\n", InfoHeader.biWidth);
-	InfoHeader.biHeight = ReadInt(fp);
+	InfoHeader.biHeight = ReadInt(&file[22]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biHeight = %d\n", InfoHeader.biHeight);
 
 	const int nums = InfoHeader.biWidth;
 	const int numt = InfoHeader.biHeight;
 
-	InfoHeader.biPlanes = ReadShort(fp);
+	InfoHeader.biPlanes = ReadShort(&file[26]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biPlanes = %d\n", InfoHeader.biPlanes);
 
-	InfoHeader.biBitCount = ReadShort(fp);
+	InfoHeader.biBitCount = ReadShort(&file[28]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biBitCount = %d\n", InfoHeader.biBitCount);
 
-	InfoHeader.biCompression = ReadInt(fp);
+	InfoHeader.biCompression = ReadInt(&file[30]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biCompression = %d\n", InfoHeader.biCompression);
 
-	InfoHeader.biSizeImage = ReadInt(fp);
+	InfoHeader.biSizeImage = ReadInt(&file[34]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biSizeImage = %d\n", InfoHeader.biSizeImage);
 
-	InfoHeader.biXPixelsPerMeter = ReadInt(fp);
-	InfoHeader.biYPixelsPerMeter = ReadInt(fp);
+	InfoHeader.biXPixelsPerMeter = ReadInt(&file[38]);
+	InfoHeader.biYPixelsPerMeter = ReadInt(&file[42]);
 
-	InfoHeader.biClrUsed = ReadInt(fp);
+	InfoHeader.biClrUsed = ReadInt(&file[46]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biClrUsed = %d\n", InfoHeader.biClrUsed);
 
-	InfoHeader.biClrImportant = ReadInt(fp);
+	InfoHeader.biClrImportant = ReadInt(&file[50]);
 
 
 	// fprintf( stderr, "Image size found: %d x %d\n", ImageWidth, ImageHeight );
 
 
-	// pixels will be stored bottom-to-top, left-to-right:
-	unsigned char* texture = new unsigned char[3 * nums * numt];
-	if (texture == NULL)
+	// this function does not support compression:
+
+	if (InfoHeader.biCompression != 0)
 	{
-		fprintf(stderr, "Cannot allocate the texture array!\n");
+		fprintf(stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression);
+		delete[] file;
 		return NULL;
 	}
 
-	// extra padding bytes:
+
+	// each row is padded out to a multiple of 4 bytes:
 
 	int requiredRowSizeInBytes = 4 * ((InfoHeader.biBitCount * InfoHeader.biWidth + 31) / 32);
 	if (VERBOSE)	fprintf(stderr, "requiredRowSizeInBytes = %d\n", requiredRowSizeInBytes);
 
-	int myRowSizeInBytes = (InfoHeader.biBitCount * InfoHeader.biWidth + 7) / 8;
-	if (VERBOSE)	fprintf(stderr, "myRowSizeInBytes = %d\n", myRowSizeInBytes);
-
-	int oldNumExtra = 4 * (((3 * InfoHeader.biWidth) + 3) / 4) - 3 * InfoHeader.biWidth;
-	if (VERBOSE)	fprintf(stderr, "Old NumExtra padding = %d\n", oldNumExtra);
-
-	int numExtra = requiredRowSizeInBytes - myRowSizeInBytes;
-	if (VERBOSE)	fprintf(stderr, "New NumExtra padding = %d\n", numExtra);
-
+	if (nums <= 0 || numt <= 0 || FileHeader.bfOffBytes < 0 ||
+		(long)FileHeader.bfOffBytes + (long)requiredRowSizeInBytes * numt > fileSize)
+	{
+		fprintf(stderr, "Bmp file '%s' is too short for a %d x %d image\n", filename, nums, numt);
+		delete[] file;
+		return NULL;
+	}
 
-	// this function does not support compression:
 
-	if (InfoHeader.biCompression != 0)
+	// pixels will be stored bottom-to-top, left-to-right:
+	unsigned char* texture = new unsigned char[3 * nums * numt];
+	if (texture == NULL)
 	{
-		fprintf(stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression);
-		fclose(fp);
+		fprintf(stderr, "Cannot allocate the texture array!\n");
+		delete[] file;
 		return NULL;
 	}
 
@@ -1556,71 +3126,41 @@ BmpToTexture(char* filename, int* width, int* height)
 	// we can handle 24 bits of direct color:
 	if (InfoHeader.biBitCount == 24)
 	{
-		rewind(fp);
-		fseek(fp, FileHeader.bfOffBytes, SEEK_SET);
-		int t;
-		unsigned char* tp;
-		for (t = 0, tp = texture; t < numt; t++)
+		for (int t = 0; t < numt; t++)
 		{
-			for (int s = 0; s < nums; s++, tp += 3)
-			{
-				*(tp + 2) = fgetc(fp);		// b
-				*(tp + 1) = fgetc(fp);		// g
-				*(tp + 0) = fgetc(fp);		// r
-			}
-
-			for (int e = 0; e < numExtra; e++)
-			{
-				fgetc(fp);
-			}
+			const unsigned char* row = &file[FileHeader.bfOffBytes + requiredRowSizeInBytes * t];
+			BgrToRgb(row, &texture[3 * nums * t], nums);
 		}
 	}
 
 	// we can also handle 8 bits of indirect color:
+	// (the color table is stored as b, g, r, a)
 	if (InfoHeader.biBitCount == 8 && InfoHeader.biClrUsed == 256)
 	{
-		struct rgba32
-		{
-			unsigned char r, g, b, a;
-		};
-		struct rgba32* colorTable = new struct rgba32[InfoHeader.biClrUsed];
-
-		rewind(fp);
-		fseek(fp, sizeof(struct bmfh) + InfoHeader.biSize - 2, SEEK_SET);
-		for (int c = 0; c < InfoHeader.biClrUsed; c++)
+		const unsigned char* colorTable = &file[BMFH_SIZE + InfoHeader.biSize];
+		if (colorTable + 4 * InfoHeader.biClrUsed > file + fileSize)
 		{
-			colorTable[c].r = fgetc(fp);
-			colorTable[c].g = fgetc(fp);
-			colorTable[c].b = fgetc(fp);
-			colorTable[c].a = fgetc(fp);
-			if (VERBOSE)	fprintf(stderr, "%4d:\t0x%02x\t0x%02x\t0x%02x\t0x%02x\n",
-				c, colorTable[c].r, colorTable[c].g, colorTable[c].b, colorTable[c].a);
+			fprintf(stderr, "Bmp file '%s' is too short for its color table\n", filename);
+			delete[] texture;
+			delete[] file;
+			return NULL;
 		}
 
-		rewind(fp);
-		fseek(fp, FileHeader.bfOffBytes, SEEK_SET);
-		int t;
-		unsigned char* tp;
-		for (t = 0, tp = texture; t < numt; t++)
+		for (int t = 0; t < numt; t++)
 		{
+			const unsigned char* row = &file[FileHeader.bfOffBytes + requiredRowSizeInBytes * t];
+			unsigned char* tp = &texture[3 * nums * t];
 			for (int s = 0; s < nums; s++, tp += 3)
 			{
-				int index = fgetc(fp);
-				*(tp + 0) = colorTable[index].r;	// r
-				*(tp + 1) = colorTable[index].g;	// g
-				*(tp + 2) = colorTable[index].b;	// b
-			}
-
-			for (int e = 0; e < numExtra; e++)
-			{
-				fgetc(fp);
+				const unsigned char* color = &colorTable[4 * row[s]];
+				*(tp + 0) = color[2];	// r
+				*(tp + 1) = color[1];	// g
+				*(tp + 2) = color[0];	// b
 			}
 		}
-
-		delete[] colorTable;
 	}
 
-	fclose(fp);
+	delete[] file;
 
 	*width = nums;
 	*height = numt;
@@ -1628,21 +3168,22 @@ BmpToTexture(char* filename, int* width, int* height)
 }
 
 int
-ReadInt(FILE* fp)
+ReadInt(const unsigned char* p)
 {
-	const unsigned char b0 = fgetc(fp);
-	const unsigned char b1 = fgetc(fp);
-	const unsigned char b2 = fgetc(fp);
-	const unsigned char b3 = fgetc(fp);
-	return (b3 << 24) | (b2 << 16) | (b1 << 8) | b0;
+	return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
 }
 
 short
-ReadShort(FILE* fp)
+ReadShort(const unsigned char* p)
+{
+	return (p[1] << 8) | p[0];
+}
+
+
+double
+MillisecondsSince(std::chrono::steady_clock::time_point start)
 {
-	const unsigned char b0 = fgetc(fp);
-	const unsigned char b1 = fgetc(fp);
-	return (b1 << 8) | b0;
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
 
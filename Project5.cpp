@@ -1,19 +1,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
 
+#if defined(__SSSE3__) || defined(__AVX__)
+#include <tmmintrin.h>		// pshufb for the bmp bgr -> rgb swap
+#endif
+
 #ifdef WIN32
 #include <windows.h>
 #pragma warning(disable:4996)
 #endif
 
+#ifdef __linux__
+#include <sys/inotify.h>		// watching the shader files
+#include <unistd.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
 #include "glew.h"
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include "glut.h"
+#ifdef HEADLESS
+#include "headless.cpp"		// draw offscreen with egl instead of in a glut window (benchmarking)
+#endif
+#include "timestep.cpp"		// fixed-timestep animation and the frame cap
 #include "glslprogram.cpp"
 
 //	This is a sample OpenGL / GLUT program
@@ -157,6 +177,58 @@ const GLfloat FOGSTART = { 1.5 };
 const GLfloat FOGEND = { 4. };
 
 
+// the pattern shader's uniforms:
+//
+// their locations are looked up once, after the shader is linked, instead of by
+// name on every frame. a shader that declares the uniform block
+//
+//	layout(std140) uniform PatternBlock { float uTimeV; float uTimeF; vec3 uColor; float uMode; };
+//
+// gets all four of them from a single buffer upload per frame instead
+
+#define PATTERNBLOCKBINDING		0
+
+struct patternblock			// PatternBlock in std140 layout
+{
+	float	uTimeV;
+	float	uTimeF;
+	float	pad[2];			// a vec3 starts on a 16-byte boundary
+	float	uColor[3];
+	float	uMode;			// packs into the rest of uColor's 16 bytes
+};
+
+
+// the linked pattern shader is saved with glGetProgramBinary( ) so later runs
+// can skip compiling and linking it. the cache is only used if it was made from
+// the same shader sources by the same driver:
+
+const char* PATTERNCACHE = { "pattern.bin" };
+
+struct binaryheader
+{
+	char				magic[8];		// BINMAGIC
+	unsigned long long	hash;			// HashPatternSources( ) when the binary was saved
+	GLenum				format;			// from glGetProgramBinary( )
+	GLint				length;			// # of bytes of binary after the header
+};
+
+const char BINMAGIC[8] = { 'P', 'R', 'O', 'G', 'B', 'I', 'N', '1' };
+
+
+// shader hot reload:
+//
+// pattern.vert and pattern.frag are watched (with inotify on linux, by their
+// modify times elsewhere) every WATCHMS milliseconds. an edit starts a new
+// compile and link -- with GL_ARB_parallel_shader_compile the driver does that
+// on its own threads and WatchShaders( ) just checks back on the next tick, so a
+// frame never waits for it. once it links, it replaces PatternProgram between
+// two frames. if it does not, the errors are printed and the old program stays
+
+const int WATCHMS = { 100 };
+
+const char* PATTERNFILES[2] = { "pattern.vert", "pattern.frag" };
+
+
 // what options should we compile-in?
 // in general, you don't need to worry about these
 // i compile these in to show class examples of things going wrong
@@ -186,7 +258,20 @@ int				WhichProjection;		// ORTHO or PERSP
 int				Xmouse, Ymouse;			// mouse values
 float			Xrot, Yrot;				// rotation angles in degrees
 bool			Frozen;                 // current freeze status of animations
-GLSLProgram*	Pattern;				// pattern for shaders
+GLSLProgram*	Pattern;				// pattern for shaders, NULL if it came from the cache
+GLuint			PatternProgram;			// the pattern shader's opengl program handle
+GLint			PatternTimeVLoc;		// uniform locations, found once after linking
+GLint			PatternTimeFLoc;
+GLint			PatternColorLoc;
+GLint			PatternModeLoc;
+GLuint			PatternUbo;				// != 0 means the uniforms go through PatternBlock
+GLuint			PendingProgram;			// != 0 means an edited pattern shader is compiling
+bool			ParallelCompile;		// true means compiles do not block
+#ifdef __linux__
+int				WatchFd = -1;			// inotify on the current directory
+#else
+time_t			PatternTimes[2];		// when PATTERNFILES were last modified
+#endif
 bool			VertShader = true;
 bool			FragShader = true;
 float			TimeVert = -1;
@@ -197,6 +282,8 @@ GLfloat			mode = 0;
 // function prototypes:
 
 void	Animate();
+bool	CanCacheBinaries();
+bool	CreatePattern();
 void	Display();
 void	DoAxesMenu(int);
 void	DoColorMenu(int);
@@ -215,18 +302,32 @@ float	ElapsedSeconds();
 void	InitGraphics();
 void	InitLists();
 void	InitMenus();
+void	InitPatternUniforms();
+void	InitShaderWatch();
 void	Keyboard(unsigned char, int, int);
 void	MouseButton(int, int, int, int);
 void	MouseMotion(int, int);
 void	Reset();
 void	Resize(int, int);
+void	SetPatternUniforms(float, float, float[3], float);
 void	Visibility(int);
+void	WatchShaders(int);
 
 void			Axes(float);
 unsigned char* BmpToTexture(char*, int*, int*);
+void			BgrToRgb(const unsigned char*, unsigned char*, int);
+unsigned long long	Fnv1a(unsigned long long, const unsigned char*, long);
+unsigned long long	HashProgramSources(const char*, const char*);
+bool			PatternFilesChanged();
+void			PrintProgramLog(GLuint);
 void			HsvRgb(float[3], float[3]);
-int				ReadInt(FILE*);
-short			ReadShort(FILE*);
+GLuint			LoadProgramBinary(const char*, unsigned long long);
+double			MillisecondsSince(std::chrono::steady_clock::time_point);
+int				ReadInt(const unsigned char*);
+char*			ReadShaderFile(const char*);
+short			ReadShort(const unsigned char*);
+void			SaveProgramBinary(const char*, unsigned long long, GLuint);
+GLuint			StartProgramCompile(const char*, const char*);
 
 void			Cross(float[3], float[3], float[3]);
 float			Dot(float[3], float[3]);
@@ -235,9 +336,12 @@ float			Unit(float[3], float[3]);
 
 
 // OsuSphere.cpp provided by Mike Bailey for this assignment
+//
+// the points and triangles of a sphere only depend on (slices, stacks), so each
+// tessellation is built once into a vertex buffer of unit-radius points and an
+// index buffer of triangles -- the radius becomes a scale applied at draw time
 
-int		NumLngs, NumLats;
-struct point* Pts;
+#define MAXSPHEREMESHES		8
 
 struct point
 {
@@ -246,60 +350,66 @@ struct point
 	float s, t;		// texture coords
 };
 
-inline
-struct point*
-	PtsPointer(int lat, int lng)
-{
-	if (lat < 0)	lat += (NumLats - 1);
-	if (lng < 0)	lng += (NumLngs - 0);
-	if (lat > NumLats - 1)	lat -= (NumLats - 1);
-	if (lng > NumLngs - 1)	lng -= (NumLngs - 0);
-	return &Pts[NumLngs * lat + lng];
-}
-
-inline
-void
-DrawPoint(struct point* p)
+struct spheremesh
 {
-	glNormal3fv(&p->nx);
-	glTexCoord2fv(&p->s);
-	glVertex3fv(&p->x);
-}
+	int				numLngs, numLats;	// tessellation this mesh was built with
+	int				numPts;				// # of points in the vertex buffer
+	int				numIndices;			// # of indices in the index buffer
+	GLuint			vbo;				// interleaved points
+	GLuint			ibo;				// triangle indices
+};
+
+struct spheremesh	SphereMeshes[MAXSPHEREMESHES];
+int					NumSphereMeshes;
 
-void
-OsuSphere(float radius, int slices, int stacks)
-{
-	// set the globals:
 
-	NumLngs = slices;
-	NumLats = stacks;
-	if (NumLngs < 3)
-		NumLngs = 3;
-	if (NumLats < 3)
-		NumLats = 3;
+// find the cached mesh for this tessellation, building it the first time it is asked for:
 
-	// allocate the point data structure:
+struct spheremesh*
+GetSphereMesh(int slices, int stacks)
+{
+	int numLngs = slices;
+	int numLats = stacks;
+	if (numLngs < 3)
+		numLngs = 3;
+	if (numLats < 3)
+		numLats = 3;
+
+	for (int i = 0; i < NumSphereMeshes; i++)
+	{
+		if (SphereMeshes[i].numLngs == numLngs && SphereMeshes[i].numLats == numLats)
+			return &SphereMeshes[i];
+	}
+
+	if (NumSphereMeshes >= MAXSPHEREMESHES)
+	{
+		fprintf(stderr, "Too many sphere tessellations -- cannot cache %d x %d\n", numLngs, numLats);
+		return NULL;
+	}
 
-	Pts = new struct point[NumLngs * NumLats];
+	struct spheremesh* m = &SphereMeshes[NumSphereMeshes++];
+	m->numLngs = numLngs;
+	m->numLats = numLats;
+	m->numPts = numLngs * numLats;
 
-	// fill the Pts structure:
+	// fill the points, ilat=0 is the south pole and ilat=numLats-1 is the north pole:
 
-	for (int ilat = 0; ilat < NumLats; ilat++)
+	struct point* pts = new struct point[m->numPts];
+	for (int ilat = 0; ilat < numLats; ilat++)
 	{
-		float lat = -M_PI / 2. + M_PI * (float)ilat / (float)(NumLats - 1);	// ilat=0/lat=0. is the south pole
-											// ilat=NumLats-1, lat=+M_PI/2. is the north pole
+		float lat = -M_PI / 2. + M_PI * (float)ilat / (float)(numLats - 1);
 		float xz = cosf(lat);
 		float  y = sinf(lat);
-		for (int ilng = 0; ilng < NumLngs; ilng++)				// ilng=0, lng=-M_PI and
-											// ilng=NumLngs-1, lng=+M_PI are the same meridian
+		for (int ilng = 0; ilng < numLngs; ilng++)				// ilng=0, lng=-M_PI and
+											// ilng=numLngs-1, lng=+M_PI are the same meridian
 		{
-			float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(NumLngs - 1);
+			float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(numLngs - 1);
 			float x = xz * cosf(lng);
 			float z = -xz * sinf(lng);
-			struct point* p = PtsPointer(ilat, ilng);
-			p->x = radius * x;
-			p->y = radius * y;
-			p->z = radius * z;
+			struct point* p = &pts[numLngs * ilat + ilng];
+			p->x = x;
+			p->y = y;
+			p->z = z;
 			p->nx = x;
 			p->ny = y;
 			p->nz = z;
@@ -308,63 +418,79 @@ OsuSphere(float radius, int slices, int stacks)
 		}
 	}
 
-	struct point top, bot;		// top, bottom points
+	// two triangles between each pair of neighboring latitudes, wound the same
+	// way the old triangle strips were:
 
-	top.x = 0.;		top.y = radius;	top.z = 0.;
-	top.nx = 0.;		top.ny = 1.;		top.nz = 0.;
-	top.s = 0.;		top.t = 1.;
+	m->numIndices = 6 * (numLats - 1) * (numLngs - 1);
+	GLuint* indices = new GLuint[m->numIndices];
+	GLuint* ip = indices;
+	for (int ilat = 1; ilat < numLats; ilat++)
+	{
+		for (int ilng = 0; ilng < numLngs - 1; ilng++)
+		{
+			GLuint a0 = numLngs * ilat + ilng;			// this latitude
+			GLuint b0 = numLngs * (ilat - 1) + ilng;	// the one below it
+			*ip++ = a0;		*ip++ = b0;		*ip++ = a0 + 1;
+			*ip++ = a0 + 1;	*ip++ = b0;		*ip++ = b0 + 1;
+		}
+	}
 
-	bot.x = 0.;		bot.y = -radius;	bot.z = 0.;
-	bot.nx = 0.;		bot.ny = -1.;		bot.nz = 0.;
-	bot.s = 0.;		bot.t = 0.;
+	glGenBuffers(1, &m->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, m->vbo);
+	glBufferData(GL_ARRAY_BUFFER, m->numPts * sizeof(struct point), pts, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-	// connect the north pole to the latitude NumLats-2:
+	glGenBuffers(1, &m->ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, m->numIndices * sizeof(GLuint), indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
+	delete[] indices;
+	delete[] pts;
 
-	glBegin(GL_TRIANGLE_STRIP);
-	for (int ilng = 0; ilng < NumLngs; ilng++)
-	{
-		glTexCoord2f(bot.s, bot.t);
-		float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(NumLngs - 1);
-		top.s = (lng + M_PI) / (2. * M_PI);
-		DrawPoint(&top);
-		struct point* p = PtsPointer(NumLats - 2, ilng);	// ilat=NumLats-1 is the north pole
-		DrawPoint(p);
-	}
-	glEnd();
+	return m;
+}
 
-	// connect the south pole to the latitude 1:
+// point the vertex arrays at a buffer of points -- base is NULL when a vbo is bound:
 
-	glBegin(GL_TRIANGLE_STRIP);
-	for (int ilng = NumLngs - 1; ilng >= 0; ilng--)
-	{
-		glTexCoord2f(bot.s, bot.t);
-		float lng = -M_PI + 2. * M_PI * (float)ilng / (float)(NumLngs - 1);
-		bot.s = (lng + M_PI) / (2. * M_PI);
-		DrawPoint(&bot);
-		struct point* p = PtsPointer(1, ilng);					// ilat=0 is the south pole
-		DrawPoint(p);
-	}
-	glEnd();
+inline
+void
+SetPointPointers(char* base)
+{
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(struct point), base + offsetof(struct point, x));
+	glNormalPointer(GL_FLOAT, sizeof(struct point), base + offsetof(struct point, nx));
+	glTexCoordPointer(2, GL_FLOAT, sizeof(struct point), base + offsetof(struct point, s));
+}
 
-	// connect the horizontal strips:
+inline
+void
+UnsetPointPointers()
+{
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+}
 
-	for (int ilat = 2; ilat < NumLats - 1; ilat++)
-	{
-		struct point* p;
-		glBegin(GL_TRIANGLE_STRIP);
-		for (int ilng = 0; ilng < NumLngs; ilng++)
-		{
-			p = PtsPointer(ilat, ilng);
-			DrawPoint(p);
-			p = PtsPointer(ilat - 1, ilng);
-			DrawPoint(p);
-		}
-		glEnd();
-	}
-	// clean-up:
-	delete[] Pts;
-	Pts = NULL;
+void
+OsuSphere(float radius, int slices, int stacks)
+{
+	struct spheremesh* m = GetSphereMesh(slices, stacks);
+	if (m == NULL)
+		return;
+
+	glPushMatrix();
+	glScalef(radius, radius, radius);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
+	glBindBuffer(GL_ARRAY_BUFFER, m->vbo);
+	SetPointPointers(NULL);
+	glDrawElements(GL_TRIANGLES, m->numIndices, GL_UNSIGNED_INT, (void*)0);
+	UnsetPointPointers();
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glPopMatrix();
 }
 
 // Referenced from slide 35 of Lighting Material from lecture
@@ -463,6 +589,7 @@ Animate()
 	int ms = glutGet(GLUT_ELAPSED_TIME);			// milliseconds since the program started
 	ms %= MS_IN_THE_ANIMATION_CYCLE;				// milliseconds in the range 0 to MS_IN_THE_ANIMATION_CYCLE-1
 	Time = (float)ms / (float)MS_IN_THE_ANIMATION_CYCLE;        // [ 0., 1. )
+	CapFrameRate();
 
 	glutSetWindow(MainWindow);
 	glutPostRedisplay();
@@ -571,7 +698,7 @@ Display()
 
 	glEnable(GL_NORMALIZE);
 
-	Pattern->Use();
+	glUseProgram(PatternProgram);
 
 	// draw the current object:
 
@@ -580,19 +707,16 @@ Display()
 	{
 		TimeVert = 0.5 + 0.5 * sin(2. * M_PI * Time);
 	}
-	Pattern->SetUniformVariable("uTimeV", TimeVert);
 
 	if (FragShader == true)
 	{
 		TimeFrag = 0.5 + 0.5 * sin(2. * M_PI * Time);
 	}
-	Pattern->SetUniformVariable("uTimeF", TimeFrag);
 
 	GLfloat color[] = { 1., 0., 0. };
-	Pattern->SetUniformVariable("uColor", color);
-	Pattern->SetUniformVariable("uMode", mode);
+	SetPatternUniforms(TimeVert, TimeFrag, color, mode);
 	OsuSphere(5, 50, 50);
-	Pattern->Use(0);
+	glUseProgram(0);
 
 #ifdef DEMO_Z_FIGHTING
 	if (DepthFightingOn != 0)
@@ -976,16 +1100,515 @@ InitGraphics()
 	fprintf(stderr, "Status: Using GLEW %s\n", glewGetString(GLEW_VERSION));
 #endif
 
-	Pattern = new GLSLProgram();
-	bool valid = Pattern->Create("pattern.vert", "pattern.frag");
-	if (!valid) {
+	if (!CreatePattern()) {
 		fprintf(stderr, "Shader cannot be created.\n");
 		DoMainMenu(QUIT);
 	}
+	InitShaderWatch();
+}
+
+
+// true if this driver can give and take program binaries:
+
+bool
+CanCacheBinaries()
+{
+	GLint numFormats = 0;
+	if (strstr((char*)glGetString(GL_EXTENSIONS), "GL_ARB_get_program_binary") != NULL)
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+	return numFormats > 0;
+}
+
+
+// make the pattern shader program, from the binary cache if it is there and still matches:
+
+bool
+CreatePattern()
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	bool cacheable = CanCacheBinaries();
+	unsigned long long hash = HashProgramSources(PATTERNFILES[0], PATTERNFILES[1]);
+
+	GLuint program = 0;
+	if (cacheable && hash != 0)
+		program = LoadProgramBinary(PATTERNCACHE, hash);
+
+	if (program != 0)
+	{
+		Pattern = NULL;
+		fprintf(stderr, "Shader loaded from %s in %.2f ms.\n", PATTERNCACHE, MillisecondsSince(start));
+	}
+	else if (cacheable && hash != 0)
+	{
+		// GLSLProgram links before anything can ask for the binary to be kept, and some
+		// drivers then have none to give back, so this one is linked here instead:
+
+		Pattern = NULL;
+		program = StartProgramCompile(PATTERNFILES[0], PATTERNFILES[1]);
+		if (program == 0)
+			return false;
+		GLint linked;
+		glGetProgramiv(program, GL_LINK_STATUS, &linked);
+		if (!linked)
+		{
+			PrintProgramLog(program);
+			glDeleteProgram(program);
+			return false;
+		}
+		fprintf(stderr, "Shader created in %.2f ms.\n", MillisecondsSince(start));
+		SaveProgramBinary(PATTERNCACHE, hash, program);
+	}
+	else
+	{
+		Pattern = new GLSLProgram();
+		bool valid = Pattern->Create((char*)PATTERNFILES[0], (char*)PATTERNFILES[1]);
+		if (!valid)
+			return false;
+		Pattern->SetVerbose(false);
+
+		// GLSLProgram keeps its program handle to itself, so ask opengl which one Use( ) makes current:
+
+		Pattern->Use();
+		glGetIntegerv(GL_CURRENT_PROGRAM, (GLint*)&program);
+		Pattern->Use(0);
+		fprintf(stderr, "Shader created in %.2f ms.\n", MillisecondsSince(start));
+	}
+
+	PatternProgram = program;
+	InitPatternUniforms();
+	return true;
+}
+
+
+// find the pattern shader's uniforms, call this after it is linked:
+
+void
+InitPatternUniforms()
+{
+	PatternTimeVLoc = glGetUniformLocation(PatternProgram, "uTimeV");
+	PatternTimeFLoc = glGetUniformLocation(PatternProgram, "uTimeF");
+	PatternColorLoc = glGetUniformLocation(PatternProgram, "uColor");
+	PatternModeLoc = glGetUniformLocation(PatternProgram, "uMode");
+
+	GLuint blockIndex = GL_INVALID_INDEX;
+	if (strstr((char*)glGetString(GL_EXTENSIONS), "GL_ARB_uniform_buffer_object") != NULL)
+		blockIndex = glGetUniformBlockIndex(PatternProgram, "PatternBlock");
+	if (blockIndex == GL_INVALID_INDEX)
+	{
+		// a reloaded shader may have dropped the block, and then its buffer is not needed:
+
+		if (PatternUbo != 0)
+			glDeleteBuffers(1, &PatternUbo);
+		PatternUbo = 0;
+		return;
+	}
+
+	GLint blockSize;
+	glGetActiveUniformBlockiv(PatternProgram, blockIndex, GL_UNIFORM_BLOCK_DATA_SIZE, &blockSize);
+	if (blockSize != sizeof(struct patternblock))
+		fprintf(stderr, "PatternBlock is %d bytes, expected %d -- is it declared layout(std140)?\n",
+			blockSize, (int)sizeof(struct patternblock));
+
+	glUniformBlockBinding(PatternProgram, blockIndex, PATTERNBLOCKBINDING);
+	if (PatternUbo == 0)
+	{
+		glGenBuffers(1, &PatternUbo);
+		glBindBuffer(GL_UNIFORM_BUFFER, PatternUbo);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(struct patternblock), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+	glBindBufferBase(GL_UNIFORM_BUFFER, PATTERNBLOCKBINDING, PatternUbo);
+}
+
+
+// set the pattern shader's uniforms, PatternProgram must be in use:
+
+void
+SetPatternUniforms(float timeV, float timeF, float color[3], float mode)
+{
+	if (PatternUbo != 0)
+	{
+		struct patternblock block;
+		block.uTimeV = timeV;
+		block.uTimeF = timeF;
+		block.uColor[0] = color[0];
+		block.uColor[1] = color[1];
+		block.uColor[2] = color[2];
+		block.uMode = mode;
+
+		glBindBuffer(GL_UNIFORM_BUFFER, PatternUbo);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(struct patternblock), &block);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
 	else
-		fprintf(stderr, "Shader created.\n");
-	Pattern->SetVerbose(false);
+	{
+		glUniform1f(PatternTimeVLoc, timeV);
+		glUniform1f(PatternTimeFLoc, timeF);
+		glUniform3fv(PatternColorLoc, 1, color);
+		glUniform1f(PatternModeLoc, mode);
+	}
+}
+
+
+// 64-bit fnv-1a, continuing from hash:
+
+unsigned long long
+Fnv1a(unsigned long long hash, const unsigned char* p, long n)
+{
+	for (long i = 0; i < n; i++)
+	{
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+
+// hash a program's shader sources together with the driver that compiles them:
+// returns 0 if a source file cannot be read
+
+unsigned long long
+HashProgramSources(const char* vertFile, const char* fragFile)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+
+	const char* files[2] = { vertFile, fragFile };
+	for (int i = 0; i < 2; i++)
+	{
+		FILE* fp = fopen(files[i], "rb");
+		if (fp == NULL)
+			return 0;
+		fseek(fp, 0, SEEK_END);
+		long fileSize = ftell(fp);
+		rewind(fp);
+		unsigned char* file = new unsigned char[fileSize];
+		long numRead = (long)fread(file, 1, fileSize, fp);
+		fclose(fp);
+		hash = Fnv1a(hash, file, numRead);
+		delete[] file;
+	}
+
+	const GLenum driver[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	for (int i = 0; i < 3; i++)
+	{
+		const char* s = (const char*)glGetString(driver[i]);
+		hash = Fnv1a(hash, (const unsigned char*)s, (long)strlen(s));
+	}
+	return hash;
+}
+
+
+// make a program from a saved binary:
+// returns 0 if there is no cache, it is for other sources or another driver, or the driver rejects it
+
+GLuint
+LoadProgramBinary(const char* filename, unsigned long long hash)
+{
+	FILE* fp = fopen(filename, "rb");
+	if (fp == NULL)
+		return 0;
+
+	struct binaryheader header;
+	if (fread(&header, sizeof(struct binaryheader), 1, fp) != 1 || memcmp(header.magic, BINMAGIC, sizeof(BINMAGIC)) != 0
+		|| header.hash != hash || header.length <= 0)
+	{
+		fprintf(stderr, "Shader cache '%s' is out of date -- recompiling\n", filename);
+		fclose(fp);
+		return 0;
+	}
+
+	char* binary = new char[header.length];
+	size_t numRead = fread(binary, 1, header.length, fp);
+	fclose(fp);
+	if (numRead != (size_t)header.length)
+	{
+		fprintf(stderr, "Shader cache '%s' is truncated -- recompiling\n", filename);
+		delete[] binary;
+		return 0;
+	}
+
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, header.format, binary, header.length);
+	delete[] binary;
+
+	GLint linked;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked)
+	{
+		fprintf(stderr, "The driver rejected shader cache '%s' -- recompiling\n", filename);
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+
+// save a linked program's binary for LoadProgramBinary( ).
+// it is written to a temporary file that is then renamed over the cache, so a crash
+// part way through leaves the old cache (or none), never a truncated one:
+
+void
+SaveProgramBinary(const char* filename, unsigned long long hash, GLuint program)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+	{
+		fprintf(stderr, "The driver has no binary for '%s' -- it will not be cached\n", filename);
+		return;
+	}
+
+	struct binaryheader header;
+	memcpy(header.magic, BINMAGIC, sizeof(BINMAGIC));
+	header.hash = hash;
+	header.length = length;
+	char* binary = new char[length];
+	glGetProgramBinary(program, length, NULL, &header.format, binary);
+
+	char tempname[256];
+	snprintf(tempname, sizeof(tempname), "%s.tmp", filename);
+	FILE* fp = fopen(tempname, "wb");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Cannot create shader cache '%s'\n", tempname);
+		delete[] binary;
+		return;
+	}
+	bool written = fwrite(&header, sizeof(struct binaryheader), 1, fp) == 1
+		&& fwrite(binary, 1, length, fp) == (size_t)length;
+	written = (fclose(fp) == 0) && written;
+	delete[] binary;
+	if (!written)
+	{
+		fprintf(stderr, "Cannot write shader cache '%s'\n", tempname);
+		remove(tempname);
+		return;
+	}
+
+#ifdef WIN32
+	remove(filename);		// rename( ) will not replace a file that is there on windows
+#endif
+	if (rename(tempname, filename) != 0)
+	{
+		fprintf(stderr, "Cannot rename '%s' to '%s'\n", tempname, filename);
+		remove(tempname);
+	}
+}
+
+
+// start watching the pattern shader files, call this after CreatePattern( ):
+
+void
+InitShaderWatch()
+{
+	ParallelCompile = strstr((char*)glGetString(GL_EXTENSIONS), "GL_ARB_parallel_shader_compile") != NULL;
+	if (ParallelCompile)
+		glMaxShaderCompilerThreadsARB(0xffffffff);		// as many threads as the driver likes
+
+#ifdef __linux__
+	// editors often write a new file and rename it over the old one, so watch the directory:
+
+	WatchFd = inotify_init1(IN_NONBLOCK);
+	if (WatchFd < 0 || inotify_add_watch(WatchFd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		fprintf(stderr, "Cannot watch the shader files -- hot reload is off\n");
+		return;
+	}
+#else
+	PatternFilesChanged();			// remember the current modify times
+#endif
+
+	glutTimerFunc(WATCHMS, WatchShaders, 0);
+}
+
+
+// true if pattern.vert or pattern.frag was written since the last call:
+
+bool
+PatternFilesChanged()
+{
+	bool changed = false;
+
+#ifdef __linux__
+	// the buffer is aligned for inotify_event, read( ) never blocks:
+
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t numRead;
+	while ((numRead = read(WatchFd, events, sizeof(events))) > 0)
+	{
+		for (char* p = events; p < events + numRead; )
+		{
+			struct inotify_event* event = (struct inotify_event*)p;
+			if (event->len > 0 && (strcmp(event->name, PATTERNFILES[0]) == 0 || strcmp(event->name, PATTERNFILES[1]) == 0))
+				changed = true;
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+#else
+	for (int i = 0; i < 2; i++)
+	{
+		struct stat st;
+		if (stat(PATTERNFILES[i], &st) == 0 && st.st_mtime != PatternTimes[i])
+		{
+			PatternTimes[i] = st.st_mtime;
+			changed = true;
+		}
+	}
+#endif
+
+	return changed;
+}
+
+
+// glut timer callback: start a compile when the shader files change, and swap the
+// program in once it is done. this runs between frames, never in the middle of one
+
+void
+WatchShaders(int)
+{
+	glutTimerFunc(WATCHMS, WatchShaders, 0);
+
+	// another edit while compiling means that compile is already out of date:
+
+	if (PatternFilesChanged())
+	{
+		if (PendingProgram != 0)
+			glDeleteProgram(PendingProgram);
+		PendingProgram = StartProgramCompile(PATTERNFILES[0], PATTERNFILES[1]);
+	}
+
+	if (PendingProgram == 0)
+		return;
+
+	if (ParallelCompile)
+	{
+		GLint done;
+		glGetProgramiv(PendingProgram, GL_COMPLETION_STATUS_ARB, &done);
+		if (!done)
+			return;
+	}
+
+	GLint linked;
+	glGetProgramiv(PendingProgram, GL_LINK_STATUS, &linked);
+	if (!linked)
+	{
+		fprintf(stderr, "Shader reload failed -- keeping the old one:\n");
+		PrintProgramLog(PendingProgram);
+		glDeleteProgram(PendingProgram);
+		PendingProgram = 0;
+		return;
+	}
+
+	// the GLSLProgram that made the first program is not used anymore. it does not
+	// delete its opengl program itself, so that is deleted here as well:
+
+	delete Pattern;
+	Pattern = NULL;
+	glDeleteProgram(PatternProgram);
+	PatternProgram = PendingProgram;
+	PendingProgram = 0;
+	InitPatternUniforms();
+	fprintf(stderr, "Shader reloaded.\n");
+
+	if (CanCacheBinaries())
+	{
+		unsigned long long hash = HashProgramSources(PATTERNFILES[0], PATTERNFILES[1]);
+		if (hash != 0)
+			SaveProgramBinary(PATTERNCACHE, hash, PatternProgram);
+	}
+
+	glutSetWindow(MainWindow);
+	glutPostRedisplay();
+}
+
+
+// read a whole shader source file into a nul-terminated string, NULL if it cannot be read:
+
+char*
+ReadShaderFile(const char* filename)
+{
+	FILE* fp = fopen(filename, "rb");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Cannot open shader file '%s'\n", filename);
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	long fileSize = ftell(fp);
+	rewind(fp);
+	char* source = new char[fileSize + 1];
+	size_t numRead = fread(source, 1, fileSize, fp);
+	fclose(fp);
+	source[numRead] = '\0';
+	return source;
+}
+
+
+// compile and link a program without waiting for either:
+// returns 0 if a source file cannot be read
+
+GLuint
+StartProgramCompile(const char* vertFile, const char* fragFile)
+{
+	char* vertSource = ReadShaderFile(vertFile);
+	char* fragSource = ReadShaderFile(fragFile);
+	if (vertSource == NULL || fragSource == NULL)
+	{
+		delete[] vertSource;
+		delete[] fragSource;
+		return 0;
+	}
+
+	GLuint program = glCreateProgram();
+	GLuint vert = glCreateShader(GL_VERTEX_SHADER);
+	glShaderSource(vert, 1, (const GLchar**)&vertSource, NULL);
+	glCompileShader(vert);
+	GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
+	glShaderSource(frag, 1, (const GLchar**)&fragSource, NULL);
+	glCompileShader(frag);
+	glAttachShader(program, vert);
+	glAttachShader(program, frag);
+
+	// without this hint some drivers keep no binary for SaveProgramBinary( ) to save:
+
+	if (CanCacheBinaries())
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(program);
+
+	// the shaders go away with the program, and the logs are still there to read:
+
+	glDeleteShader(vert);
+	glDeleteShader(frag);
+	delete[] vertSource;
+	delete[] fragSource;
+	return program;
+}
+
+
+// print the compile logs of a program's shaders and then its link log:
+
+void
+PrintProgramLog(GLuint program)
+{
+	char log[4096];
+
+	GLuint shaders[2];
+	GLsizei numShaders;
+	glGetAttachedShaders(program, 2, &numShaders, shaders);
+	for (int i = 0; i < numShaders; i++)
+	{
+		GLint compiled;
+		glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &compiled);
+		if (!compiled)
+		{
+			glGetShaderInfoLog(shaders[i], sizeof(log), NULL, log);
+			fprintf(stderr, "%s\n", log);
+		}
+	}
 
+	glGetProgramInfoLog(program, sizeof(log), NULL, log);
+	fprintf(stderr, "%s\n", log);
 }
 
 
@@ -1053,6 +1676,7 @@ Keyboard(unsigned char c, int x, int y)
 
 	default:
 		fprintf(stderr, "Don't know what to do with keyboard hit: '%c' (0x%0x)\n", c, c);
+		return;			// nothing changed, so there is nothing to redraw
 	}
 
 	// force a call to Display( ):
@@ -1118,8 +1742,14 @@ MouseButton(int button, int state, int x, int y)
 		ActiveButton &= ~b;		// clear the proper bit
 	}
 
-	glutSetWindow(MainWindow);
-	glutPostRedisplay();
+	// pressing or letting go of a button only changes what the next moves do,
+	// but the wheel changes the scale right away:
+
+	if (button == SCROLL_WHEEL_UP || button == SCROLL_WHEEL_DOWN)
+	{
+		glutSetWindow(MainWindow);
+		glutPostRedisplay();
+	}
 
 }
 
@@ -1129,7 +1759,7 @@ MouseButton(int button, int state, int x, int y)
 void
 MouseMotion(int x, int y)
 {
-	if (true)
+	if (DebugOn != 0)
 		fprintf(stderr, "MouseMotion: %d, %d\n", x, y);
 
 
@@ -1156,8 +1786,16 @@ MouseMotion(int x, int y)
 	Xmouse = x;			// new current position
 	Ymouse = y;
 
-	glutSetWindow(MainWindow);
-	glutPostRedisplay();
+	// glut calls this for every move, with or without a button down, and most of
+	// them change nothing on the screen. only the ones that turned or scaled the
+	// scene ask for a redraw, and however many of those come in before the next
+	// Display( ), glut still draws just once for them:
+
+	if ((dx != 0 || dy != 0) && (ActiveButton & (LEFT | MIDDLE)) != 0)
+	{
+		glutSetWindow(MainWindow);
+		glutPostRedisplay();
+	}
 }
 
 
@@ -1357,7 +1995,9 @@ struct bmfh
 	short bfReserved1;
 	short bfReserved2;
 	int bfOffBytes;		// # bytes to get to the start of the per-pixel data
-} FileHeader;
+};
+
+#define BMFH_SIZE		14	// bytes the file header takes up in the file (sizeof(struct bmfh) is padded)
 
 // bmp info header:
 struct bmih
@@ -1373,9 +2013,39 @@ struct bmih
 	int biYPixelsPerMeter;
 	int biClrUsed;		// # colors in the palette
 	int biClrImportant;
-} InfoHeader;
+};
+
+
+// turn one row of bgr pixels into rgb.
+// with ssse3, 5 pixels at a time are swapped with a single byte shuffle:
+// 16 bytes are loaded and stored, but only the first 15 are kept, the 16th
+// gets overwritten by the next group. the shuffle is only compiled in when the
+// compiler targets ssse3 (-mssse3 or -mavx with g++, /arch:AVX with msvc) --
+// without that it is all the plain loop
+
+void
+BgrToRgb(const unsigned char* bgr, unsigned char* rgb, int numPixels)
+{
+	int s = 0;
+#if defined(__SSSE3__) || defined(__AVX__)
+	const __m128i swap = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+	for (; s + 6 <= numPixels; s += 5)
+	{
+		__m128i pixels = _mm_loadu_si128((const __m128i*)(bgr + 3 * s));
+		_mm_storeu_si128((__m128i*)(rgb + 3 * s), _mm_shuffle_epi8(pixels, swap));
+	}
+#endif
+	for (; s < numPixels; s++)
+	{
+		rgb[3 * s + 0] = bgr[3 * s + 2];		// r
+		rgb[3 * s + 1] = bgr[3 * s + 1];		// g
+		rgb[3 * s + 2] = bgr[3 * s + 0];		// b
+	}
+}
+
 
 // read a BMP file into a Texture:
+// the whole file is read with one fread( ) and then decoded from memory
 
 unsigned char*
 BmpToTexture(char* filename, int* width, int* height)
@@ -1389,7 +2059,7 @@ BmpToTexture(char* filename, int* width, int* height)
 		return NULL;
 	}
 #else
-	FILE* fp = fopen(filename, "rb");
+	fp = fopen(filename, "rb");
 	if (fp == NULL)
 	{
 		fprintf(stderr, "Cannot open Bmp file '%s'\n", filename);
@@ -1397,7 +2067,33 @@ BmpToTexture(char* filename, int* width, int* height)
 	}
 #endif
 
-	FileHeader.bfType = ReadShort(fp);
+	fseek(fp, 0, SEEK_END);
+	long fileSize = ftell(fp);
+	rewind(fp);
+	if (fileSize < BMFH_SIZE + 40)
+	{
+		fprintf(stderr, "Bmp file '%s' is too short to be a bmp\n", filename);
+		fclose(fp);
+		return NULL;
+	}
+
+	unsigned char* file = new unsigned char[fileSize];
+	size_t numRead = fread(file, 1, fileSize, fp);
+	fclose(fp);
+	if (numRead != (size_t)fileSize)
+	{
+		fprintf(stderr, "Cannot read Bmp file '%s'\n", filename);
+		delete[] file;
+		return NULL;
+	}
+
+	// the headers are local so that more than one file can be loaded at a time:
+
+	struct bmfh FileHeader;
+	struct bmih InfoHeader;
+
+	FileHeader.bfType = ReadShort(&file[0]);
+
 
 	// if bfType is not BMP_MAGIC_NUMBER, the file is not a bmp:
 
@@ -1406,150 +2102,127 @@ BmpToTexture(char* filename, int* width, int* height)
 	if (FileHeader.bfType != BMP_MAGIC_NUMBER)
 	{
 		fprintf(stderr, "Wrong type of file: 0x%0x\n", FileHeader.bfType);
-		fclose(fp);
+		delete[] file;
 		return NULL;
 	}
 
-	FileHeader.bfSize = ReadInt(fp);
+
+	FileHeader.bfSize = ReadInt(&file[2]);
 	if (VERBOSE)	fprintf(stderr, "FileHeader.bfSize = %d\n", FileHeader.bfSize);
 
-	FileHeader.bfReserved1 = ReadShort(fp);
-	FileHeader.bfReserved2 = ReadShort(fp);
+	FileHeader.bfReserved1 = ReadShort(&file[6]);
+	FileHeader.bfReserved2 = ReadShort(&file[8]);
 
-	FileHeader.bfOffBytes = ReadInt(fp);
+	FileHeader.bfOffBytes = ReadInt(&file[10]);
 	if (VERBOSE)	fprintf(stderr, "FileHeader.bfOffBytes = %d\n", FileHeader.bfOffBytes);
 
-	InfoHeader.biSize = ReadInt(fp);
+
+	InfoHeader.biSize = ReadInt(&file[14]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biSize = %d\n", InfoHeader.biSize);
-	InfoHeader.biWidth = ReadInt(fp);
+	InfoHeader.biWidth = ReadInt(&file[18]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biWidth = %d\n", InfoHeader.biWidth);
-	InfoHeader.biHeight = ReadInt(fp);
+	InfoHeader.biHeight = ReadInt(&file[22]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biHeight = %d\n", InfoHeader.biHeight);
 
 	const int nums = InfoHeader.biWidth;
 	const int numt = InfoHeader.biHeight;
 
-	InfoHeader.biPlanes = ReadShort(fp);
+	InfoHeader.biPlanes = ReadShort(&file[26]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biPlanes = %d\n", InfoHeader.biPlanes);
 
-	InfoHeader.biBitCount = ReadShort(fp);
+	InfoHeader.biBitCount = ReadShort(&file[28]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biBitCount = %d\n", InfoHeader.biBitCount);
 
-	InfoHeader.biCompression = ReadInt(fp);
+	InfoHeader.biCompression = ReadInt(&file[30]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biCompression = %d\n", InfoHeader.biCompression);
 
-	InfoHeader.biSizeImage = ReadInt(fp);
+	InfoHeader.biSizeImage = ReadInt(&file[34]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biSizeImage = %d\n", InfoHeader.biSizeImage);
 
-	InfoHeader.biXPixelsPerMeter = ReadInt(fp);
-	InfoHeader.biYPixelsPerMeter = ReadInt(fp);
+	InfoHeader.biXPixelsPerMeter = ReadInt(&file[38]);
+	InfoHeader.biYPixelsPerMeter = ReadInt(&file[42]);
 
-	InfoHeader.biClrUsed = ReadInt(fp);
+	InfoHeader.biClrUsed = ReadInt(&file[46]);
 	if (VERBOSE)	fprintf(stderr, "InfoHeader.biClrUsed = %d\n", InfoHeader.biClrUsed);
 
-	InfoHeader.biClrImportant = ReadInt(fp);
+	InfoHeader.biClrImportant = ReadInt(&file[50]);
+
 
 	// fprintf( stderr, "Image size found: %d x %d\n", ImageWidth, ImageHeight );
 
-	// pixels will be stored bottom-to-top, left-to-right:
-	unsigned char* texture = new unsigned char[3 * nums * numt];
-	if (texture == NULL)
+
+	// this function does not support compression:
+
+	if (InfoHeader.biCompression != 0)
 	{
-		fprintf(stderr, "Cannot allocate the texture array!\n");
+		fprintf(stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression);
+		delete[] file;
 		return NULL;
 	}
 
-	// extra padding bytes:
+
+	// each row is padded out to a multiple of 4 bytes:
 
 	int requiredRowSizeInBytes = 4 * ((InfoHeader.biBitCount * InfoHeader.biWidth + 31) / 32);
 	if (VERBOSE)	fprintf(stderr, "requiredRowSizeInBytes = %d\n", requiredRowSizeInBytes);
 
-	int myRowSizeInBytes = (InfoHeader.biBitCount * InfoHeader.biWidth + 7) / 8;
-	if (VERBOSE)	fprintf(stderr, "myRowSizeInBytes = %d\n", myRowSizeInBytes);
-
-	int oldNumExtra = 4 * (((3 * InfoHeader.biWidth) + 3) / 4) - 3 * InfoHeader.biWidth;
-	if (VERBOSE)	fprintf(stderr, "Old NumExtra padding = %d\n", oldNumExtra);
-
-	int numExtra = requiredRowSizeInBytes - myRowSizeInBytes;
-	if (VERBOSE)	fprintf(stderr, "New NumExtra padding = %d\n", numExtra);
+	if (nums <= 0 || numt <= 0 || FileHeader.bfOffBytes < 0 ||
+		(long)FileHeader.bfOffBytes + (long)requiredRowSizeInBytes * numt > fileSize)
+	{
+		fprintf(stderr, "Bmp file '%s' is too short for a %d x %d image\n", filename, nums, numt);
+		delete[] file;
+		return NULL;
+	}
 
-	// this function does not support compression:
 
-	if (InfoHeader.biCompression != 0)
+	// pixels will be stored bottom-to-top, left-to-right:
+	unsigned char* texture = new unsigned char[3 * nums * numt];
+	if (texture == NULL)
 	{
-		fprintf(stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression);
-		fclose(fp);
+		fprintf(stderr, "Cannot allocate the texture array!\n");
+		delete[] file;
 		return NULL;
 	}
 
+
 	// we can handle 24 bits of direct color:
 	if (InfoHeader.biBitCount == 24)
 	{
-		rewind(fp);
-		fseek(fp, FileHeader.bfOffBytes, SEEK_SET);
-		int t;
-		unsigned char* tp;
-		for (t = 0, tp = texture; t < numt; t++)
+		for (int t = 0; t < numt; t++)
 		{
-			for (int s = 0; s < nums; s++, tp += 3)
-			{
-				*(tp + 2) = fgetc(fp);		// b
-				*(tp + 1) = fgetc(fp);		// g
-				*(tp + 0) = fgetc(fp);		// r
-			}
-
-			for (int e = 0; e < numExtra; e++)
-			{
-				fgetc(fp);
-			}
+			const unsigned char* row = &file[FileHeader.bfOffBytes + requiredRowSizeInBytes * t];
+			BgrToRgb(row, &texture[3 * nums * t], nums);
 		}
 	}
 
 	// we can also handle 8 bits of indirect color:
+	// (the color table is stored as b, g, r, a)
 	if (InfoHeader.biBitCount == 8 && InfoHeader.biClrUsed == 256)
 	{
-		struct rgba32
+		const unsigned char* colorTable = &file[BMFH_SIZE + InfoHeader.biSize];
+		if (colorTable + 4 * InfoHeader.biClrUsed > file + fileSize)
 		{
-			unsigned char r, g, b, a;
-		};
-		struct rgba32* colorTable = new struct rgba32[InfoHeader.biClrUsed];
-
-		rewind(fp);
-		fseek(fp, sizeof(struct bmfh) + InfoHeader.biSize - 2, SEEK_SET);
-		for (int c = 0; c < InfoHeader.biClrUsed; c++)
-		{
-			colorTable[c].r = fgetc(fp);
-			colorTable[c].g = fgetc(fp);
-			colorTable[c].b = fgetc(fp);
-			colorTable[c].a = fgetc(fp);
-			if (VERBOSE)	fprintf(stderr, "%4d:\t0x%02x\t0x%02x\t0x%02x\t0x%02x\n",
-				c, colorTable[c].r, colorTable[c].g, colorTable[c].b, colorTable[c].a);
+			fprintf(stderr, "Bmp file '%s' is too short for its color table\n", filename);
+			delete[] texture;
+			delete[] file;
+			return NULL;
 		}
 
-		rewind(fp);
-		fseek(fp, FileHeader.bfOffBytes, SEEK_SET);
-		int t;
-		unsigned char* tp;
-		for (t = 0, tp = texture; t < numt; t++)
+		for (int t = 0; t < numt; t++)
 		{
+			const unsigned char* row = &file[FileHeader.bfOffBytes + requiredRowSizeInBytes * t];
+			unsigned char* tp = &texture[3 * nums * t];
 			for (int s = 0; s < nums; s++, tp += 3)
 			{
-				int index = fgetc(fp);
-				*(tp + 0) = colorTable[index].r;	// r
-				*(tp + 1) = colorTable[index].g;	// g
-				*(tp + 2) = colorTable[index].b;	// b
-			}
-
-			for (int e = 0; e < numExtra; e++)
-			{
-				fgetc(fp);
+				const unsigned char* color = &colorTable[4 * row[s]];
+				*(tp + 0) = color[2];	// r
+				*(tp + 1) = color[1];	// g
+				*(tp + 2) = color[0];	// b
 			}
 		}
-
-		delete[] colorTable;
 	}
 
-	fclose(fp);
+	delete[] file;
 
 	*width = nums;
 	*height = numt;
@@ -1557,21 +2230,22 @@ BmpToTexture(char* filename, int* width, int* height)
 }
 
 int
-ReadInt(FILE* fp)
+ReadInt(const unsigned char* p)
 {
-	const unsigned char b0 = fgetc(fp);
-	const unsigned char b1 = fgetc(fp);
-	const unsigned char b2 = fgetc(fp);
-	const unsigned char b3 = fgetc(fp);
-	return (b3 << 24) | (b2 << 16) | (b1 << 8) | b0;
+	return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
 }
 
 short
-ReadShort(FILE* fp)
+ReadShort(const unsigned char* p)
+{
+	return (p[1] << 8) | p[0];
+}
+
+
+double
+MillisecondsSince(std::chrono::steady_clock::time_point start)
 {
-	const unsigned char b0 = fgetc(fp);
-	const unsigned char b1 = fgetc(fp);
-	return (b1 << 8) | b0;
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
 
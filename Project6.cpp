@@ -1,10 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
 
+#if defined(__AVX__)
+#include <immintrin.h>		// 8 curves at a time in the curve engine
+#elif defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>		// 4 curves at a time in the curve engine
+#endif
+
 #ifdef WIN32
 #include <windows.h>
 #pragma warning(disable:4996)
@@ -14,6 +24,10 @@
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include "glut.h"
+#ifdef HEADLESS
+#include "headless.cpp"		// draw offscreen with egl instead of in a glut window (benchmarking)
+#endif
+#include "timestep.cpp"		// fixed-timestep animation and the frame cap
 
 
 //	This is a sample OpenGL / GLUT program
@@ -206,6 +220,411 @@ Curve leaf3;
 Curve leaf4;
 
 
+// the curve engine: every bezier curve that gets drawn goes through one batch of them.
+// the control points are kept structure-of-arrays, one array for each coordinate of each
+// control point, so CURVELANES curves at a time fill the lanes of an avx (8) or sse (4)
+// register. each curve is evaluated by forward differencing, which after the first point
+// is 3 adds per coordinate per point instead of the bernstein polynomials. the points go
+// straight into one dynamic vbo, sample by sample -- point it of curve i is vertex
+// it*capacity+i, so the curves in the lanes are that many vertices in a row -- and the
+// curves are line strips through that vbo, all of them in one glMultiDrawElements( )
+
+#if defined(__AVX__)
+
+#define CURVELANES		8
+
+typedef __m256			lanes;
+#define LOADLANES(p)	_mm256_loadu_ps(p)
+#define SETLANES(f)		_mm256_set1_ps(f)
+#define ADDLANES(a, b)	_mm256_add_ps(a, b)
+#define SUBLANES(a, b)	_mm256_sub_ps(a, b)
+#define MULLANES(a, b)	_mm256_mul_ps(a, b)
+
+#elif defined(__SSE__) || defined(_M_X64)
+
+#define CURVELANES		4
+
+typedef __m128			lanes;
+#define LOADLANES(p)	_mm_loadu_ps(p)
+#define SETLANES(f)		_mm_set1_ps(f)
+#define ADDLANES(a, b)	_mm_add_ps(a, b)
+#define SUBLANES(a, b)	_mm_sub_ps(a, b)
+#define MULLANES(a, b)	_mm_mul_ps(a, b)
+
+#else
+
+#define CURVELANES		1
+
+typedef float			lanes;
+#define LOADLANES(p)	(*(p))
+#define SETLANES(f)		(f)
+#define ADDLANES(a, b)	((a) + (b))
+#define SUBLANES(a, b)	((a) - (b))
+#define MULLANES(a, b)	((a) * (b))
+
+#endif
+
+#define CURVEROUNDUP		8			// capacities are a multiple of this, which is a multiple of any CURVELANES
+
+struct curves
+{
+	int				count, capacity;
+	float*			x[4];				// control point k of curve i is ( x[k][i], y[k][i], z[k][i] )
+	float*			y[4];
+	float*			z[4];
+	float*			r;					// the color of each curve
+	float*			g;
+	float*			b;
+	bool			colorsChanged;		// true means the color vbo has to be filled again
+	GLuint			vbo;				// capacity*(NUMPOINTS+1) points, filled every frame
+	GLuint			colorVbo;			// their colors
+	GLuint			ibo;				// the line strip of each curve, NUMPOINTS+1 indices apiece
+	GLsizei*		counts;				// what glMultiDrawElements( ) needs to draw each of them
+	const GLvoid**	offsets;
+};
+
+struct curves	Curves;
+bool			CurveEngineOn;			// false means the old way, bernstein polynomials in glBegin( )/glEnd( )
+bool			CurveEngineDefault = true;	// what Reset( ) sets CurveEngineOn to, -bernstein makes it false
+
+
+// the curves are made before there is any curve to draw, since the vbos
+// and the index buffer only depend on how many curves there can be:
+
+void
+InitCurves(struct curves* cv, int capacity)
+{
+	capacity = CURVEROUNDUP * ((capacity + CURVEROUNDUP - 1) / CURVEROUNDUP);
+	cv->count = 0;
+	cv->capacity = capacity;
+	for (int k = 0; k < 4; k++)
+	{
+		cv->x[k] = new float[capacity]();		// zeros, so the unused lanes at the end are harmless
+		cv->y[k] = new float[capacity]();
+		cv->z[k] = new float[capacity]();
+	}
+	cv->r = new float[capacity]();
+	cv->g = new float[capacity]();
+	cv->b = new float[capacity]();
+	cv->colorsChanged = true;
+
+	int numVertices = capacity * (NUMPOINTS + 1);
+	glGenBuffers(1, &cv->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, cv->vbo);
+	glBufferData(GL_ARRAY_BUFFER, numVertices * 3 * sizeof(float), NULL, GL_STREAM_DRAW);
+	glGenBuffers(1, &cv->colorVbo);
+	glBindBuffer(GL_ARRAY_BUFFER, cv->colorVbo);
+	glBufferData(GL_ARRAY_BUFFER, numVertices * 4 * sizeof(GLubyte), NULL, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	GLuint* indices = new GLuint[numVertices];
+	cv->counts = new GLsizei[capacity];
+	cv->offsets = new const GLvoid*[capacity];
+	for (int i = 0; i < capacity; i++)
+	{
+		for (int it = 0; it <= NUMPOINTS; it++)
+			indices[(NUMPOINTS + 1) * i + it] = capacity * it + i;
+		cv->counts[i] = NUMPOINTS + 1;
+		cv->offsets[i] = (const GLvoid*)((size_t)(NUMPOINTS + 1) * i * sizeof(GLuint));
+	}
+	glGenBuffers(1, &cv->ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cv->ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, numVertices * sizeof(GLuint), indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	delete[] indices;
+}
+
+
+// copy a curve's animated control points into the batch:
+
+void
+SetCurve(struct curves* cv, int i, Curve* curve)
+{
+	Point* p[4] = { &curve->p0, &curve->p1, &curve->p2, &curve->p3 };
+	for (int k = 0; k < 4; k++)
+	{
+		cv->x[k][i] = p[k]->x;
+		cv->y[k][i] = p[k]->y;
+		cv->z[k][i] = p[k]->z;
+	}
+}
+
+
+// returns its index, or -1 if there is no room:
+
+int
+AddCurve(struct curves* cv, Curve* curve)
+{
+	if (cv->count >= cv->capacity)
+		return -1;
+
+	int i = cv->count++;
+	SetCurve(cv, i, curve);
+	cv->r[i] = curve->r;
+	cv->g[i] = curve->g;
+	cv->b[i] = curve->b;
+	cv->colorsChanged = true;
+	return i;
+}
+
+
+// write the x, y, and z lanes out as that many points in a row:
+
+#if defined(__AVX__) || defined(__SSE__) || defined(_M_X64)
+
+inline
+void
+StorePoints4(float* out, __m128 x, __m128 y, __m128 z)
+{
+	__m128 xy01 = _mm_unpacklo_ps(x, y);								// x0 y0 x1 y1
+	__m128 xy23 = _mm_unpackhi_ps(x, y);								// x2 y2 x3 y3
+	__m128 z0x1 = _mm_shuffle_ps(z, x, _MM_SHUFFLE(1, 1, 0, 0));		// z0 z0 x1 x1
+	__m128 y1z1 = _mm_shuffle_ps(y, z, _MM_SHUFFLE(1, 1, 1, 1));		// y1 y1 z1 z1
+	__m128 z2xy3 = _mm_shuffle_ps(z, xy23, _MM_SHUFFLE(3, 2, 3, 2));	// z2 z3 x3 y3
+	__m128 y3z3 = _mm_shuffle_ps(xy23, z, _MM_SHUFFLE(3, 3, 3, 3));	// y3 y3 z3 z3
+	_mm_storeu_ps(out + 0, _mm_shuffle_ps(xy01, z0x1, _MM_SHUFFLE(2, 0, 1, 0)));	// x0 y0 z0 x1
+	_mm_storeu_ps(out + 4, _mm_shuffle_ps(y1z1, xy23, _MM_SHUFFLE(1, 0, 2, 0)));	// y1 z1 x2 y2
+	_mm_storeu_ps(out + 8, _mm_shuffle_ps(z2xy3, y3z3, _MM_SHUFFLE(2, 1, 2, 0)));	// z2 x3 y3 z3
+}
+
+#endif
+
+inline
+void
+StorePoints(float* out, lanes x, lanes y, lanes z)
+{
+#if defined(__AVX__)
+	StorePoints4(out, _mm256_castps256_ps128(x), _mm256_castps256_ps128(y), _mm256_castps256_ps128(z));
+	StorePoints4(out + 12, _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1), _mm256_extractf128_ps(z, 1));
+#elif defined(__SSE__) || defined(_M_X64)
+	StorePoints4(out, x, y, z);
+#else
+	out[0] = x;
+	out[1] = y;
+	out[2] = z;
+#endif
+}
+
+
+// evaluate all the curves at NUMPOINTS+1 evenly spaced t's into out, CURVELANES curves at a time.
+// for a cubic a*t^3 + b*t^2 + c*t + d, stepping t by h, the first difference starts out at
+// a*h^3 + b*h^2 + c*h, the second at 6*a*h^3 + 2*b*h^2, and the third is always 6*a*h^3:
+
+void
+EvalCurves(struct curves* cv, float* out)
+{
+	const float h = 1.f / (float)NUMPOINTS;
+	lanes three = SETLANES(3.f);
+	lanes six = SETLANES(6.f);
+	lanes h1 = SETLANES(h);
+	lanes h2 = SETLANES(h * h);
+	lanes h3 = SETLANES(h * h * h);
+
+	float** coords[3] = { cv->x, cv->y, cv->z };
+	for (int i = 0; i < cv->count; i += CURVELANES)
+	{
+		lanes f[3], d1[3], d2[3], d3[3];			// for x, y, and z
+		for (int k = 0; k < 3; k++)
+		{
+			lanes p0 = LOADLANES(&coords[k][0][i]);
+			lanes p1 = LOADLANES(&coords[k][1][i]);
+			lanes p2 = LOADLANES(&coords[k][2][i]);
+			lanes p3 = LOADLANES(&coords[k][3][i]);
+			lanes a = ADDLANES(SUBLANES(p3, p0), MULLANES(three, SUBLANES(p1, p2)));
+			lanes b = MULLANES(three, ADDLANES(SUBLANES(p0, ADDLANES(p1, p1)), p2));
+			lanes c = MULLANES(three, SUBLANES(p1, p0));
+			lanes ah3 = MULLANES(a, h3);
+			lanes bh2 = MULLANES(b, h2);
+			f[k] = p0;
+			d1[k] = ADDLANES(ADDLANES(ah3, bh2), MULLANES(c, h1));
+			d2[k] = ADDLANES(MULLANES(six, ah3), ADDLANES(bh2, bh2));
+			d3[k] = MULLANES(six, ah3);
+		}
+
+		float* o = out + 3 * i;
+		for (int it = 0; it <= NUMPOINTS; it++)
+		{
+			StorePoints(o, f[0], f[1], f[2]);
+			o += 3 * cv->capacity;
+			for (int k = 0; k < 3; k++)
+			{
+				f[k] = ADDLANES(f[k], d1[k]);
+				d1[k] = ADDLANES(d1[k], d2[k]);
+				d2[k] = ADDLANES(d2[k], d3[k]);
+			}
+		}
+	}
+}
+
+
+// evaluate the curves into the vbo and draw them all:
+
+void
+DrawCurves(struct curves* cv)
+{
+	if (cv->count == 0)
+		return;
+
+	int numVertices = cv->capacity * (NUMPOINTS + 1);
+	if (cv->colorsChanged)
+	{
+		GLubyte* colors = new GLubyte[4 * numVertices];
+		for (int it = 0; it <= NUMPOINTS; it++)
+		{
+			GLubyte* c = &colors[4 * cv->capacity * it];
+			for (int i = 0; i < cv->capacity; i++, c += 4)
+			{
+				c[0] = (GLubyte)(255.f * cv->r[i] + 0.5f);
+				c[1] = (GLubyte)(255.f * cv->g[i] + 0.5f);
+				c[2] = (GLubyte)(255.f * cv->b[i] + 0.5f);
+				c[3] = 255;
+			}
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, cv->colorVbo);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, 4 * numVertices * sizeof(GLubyte), colors);
+		delete[] colors;
+		cv->colorsChanged = false;
+	}
+
+	// orphan last frame's points, so this does not wait for them to be drawn:
+
+	glBindBuffer(GL_ARRAY_BUFFER, cv->vbo);
+	glBufferData(GL_ARRAY_BUFFER, numVertices * 3 * sizeof(float), NULL, GL_STREAM_DRAW);
+	float* points = (float*)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+	if (points == NULL)
+	{
+		fprintf(stderr, "Cannot map the curve vertex buffer\n");
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return;
+	}
+	EvalCurves(cv, points);
+	glUnmapBuffer(GL_ARRAY_BUFFER);
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, (void*)0);
+	glBindBuffer(GL_ARRAY_BUFFER, cv->colorVbo);
+	glColorPointer(4, GL_UNSIGNED_BYTE, 0, (void*)0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cv->ibo);
+	glMultiDrawElements(GL_LINE_STRIP, cv->counts, GL_UNSIGNED_INT, cv->offsets, cv->count);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+
+// the old way, one curve at a time, for comparing against:
+
+void
+DrawCurvesImmediate(struct curves* cv)
+{
+	for (int i = 0; i < cv->count; i++)
+	{
+		glColor3f(cv->r[i], cv->g[i], cv->b[i]);
+		glBegin(GL_LINE_STRIP);
+		for (int it = 0; it <= NUMPOINTS; it++)
+		{
+			float t = (float)it / (float)NUMPOINTS;
+			float omt = 1.f - t;
+			float b0 = omt * omt * omt;
+			float b1 = 3.f * t * omt * omt;
+			float b2 = 3.f * t * t * omt;
+			float b3 = t * t * t;
+			glVertex3f(b0 * cv->x[0][i] + b1 * cv->x[1][i] + b2 * cv->x[2][i] + b3 * cv->x[3][i],
+				b0 * cv->y[0][i] + b1 * cv->y[1][i] + b2 * cv->y[2][i] + b3 * cv->y[3][i],
+				b0 * cv->z[0][i] + b1 * cv->z[1][i] + b2 * cv->z[2][i] + b3 * cv->z[3][i]);
+		}
+		glEnd();
+	}
+}
+
+
+// the flower's curves come first in the batch, in the order they used to be drawn:
+
+#define STEMCURVE			0
+#define PETALCURVES			1			// NUMCURVES of them
+#define LEAFCURVES			( PETALCURVES + NUMCURVES )
+#define FLOWERCURVES		( LEAFCURVES + 4 )
+
+const float PETALCOLORS[NUMCURVES][3] =
+{
+	{ 0.5, 1., 0. },	{ 1., 1., 0. },		{ 1., 0.5, 0. },	{ 1., 0., 0. },
+	{ 1., 0., 0.5 },	{ 1., 0., 1. },		{ 0.5, 0., 1. },	{ 0., 0., 1. },
+	{ 0., 0.5, 1. },	{ 0., 1., 1. },		{ 0., 1., 0.5 },	{ 0., 1., 0. }
+};
+
+
+// the grass: -curves n adds a field of n blades of grass around the flower, each one a
+// curve swaying at its own phase, for benchmarking the curve engine with a lot of curves.
+// the sway is the cosine of the time plus each blade's phase, which is the cos and sin of
+// the time combined with the cos and sin of the phase, so the loop has no calls in it and
+// the compiler can vectorize it like the curves:
+
+const float GRASSSIZE = { 80.f };			// the field is GRASSSIZE x GRASSSIZE, centered under the flower
+const float GRASSGROUND = { -28.f };		// where the stem ends
+const float GRASSHEIGHT = { 3.f };
+const float GRASSSWAY = { 0.4f };			// how far the middle control point moves each way
+const int GRASSWAVES = { 5 };				// sways in one animation cycle
+
+int		NumGrass;
+float*	GrassCos;							// cos and sin of each blade's phase
+float*	GrassSin;
+
+
+void
+InitGrass(struct curves* cv, int numGrass)
+{
+	GrassCos = new float[numGrass];
+	GrassSin = new float[numGrass];
+	int side = (int)ceilf(sqrtf((float)numGrass));
+	NumGrass = 0;
+	for (int n = 0; n < numGrass; n++)
+	{
+		float x = GRASSSIZE * (((float)(n % side) + (float)rand() / (float)RAND_MAX) / (float)side - 0.5f);
+		float z = GRASSSIZE * (((float)(n / side) + (float)rand() / (float)RAND_MAX) / (float)side - 0.5f);
+		float height = GRASSHEIGHT * (0.5f + (float)rand() / (float)RAND_MAX);
+
+		Curve blade;
+		blade.r = 0.1f;
+		blade.g = 0.4f + 0.4f * (float)rand() / (float)RAND_MAX;
+		blade.b = 0.1f;
+		blade.p0.x = blade.p1.x = blade.p2.x = blade.p3.x = x;
+		blade.p0.z = blade.p1.z = blade.p2.z = blade.p3.z = z;
+		blade.p0.y = GRASSGROUND;
+		blade.p1.y = GRASSGROUND + height / 3.f;
+		blade.p2.y = GRASSGROUND + 2.f * height / 3.f;
+		blade.p3.y = GRASSGROUND + height;
+		if (AddCurve(cv, &blade) < 0)
+			break;
+
+		float phase = 0.2f * (x + z);				// a wave going across the field
+		GrassCos[NumGrass] = cosf(phase);
+		GrassSin[NumGrass] = sinf(phase);
+		NumGrass++;
+	}
+}
+
+
+// bend blades first to last-1 by time in [0.,1.) -- the base and the first control point stay
+// put, the middle one moves by the sway and the tip by twice that:
+
+void
+SwayGrass(int first, int last, float time, float* __restrict x1, float* __restrict x2, float* __restrict x3,
+	const float* __restrict x0, const float* __restrict phaseCos, const float* __restrict phaseSin)
+{
+	float c = GRASSSWAY * cosf(2.f * (float)M_PI * (float)GRASSWAVES * time);
+	float s = GRASSSWAY * sinf(2.f * (float)M_PI * (float)GRASSWAVES * time);
+	for (int i = first; i < last; i++)
+	{
+		float sway = c * phaseCos[i - first] - s * phaseSin[i - first];
+		x1[i] = x0[i];
+		x2[i] = x0[i] + sway;
+		x3[i] = x0[i] + 2.f * sway;
+	}
+}
+
+
 // main program:
 
 int
@@ -257,19 +676,47 @@ main(int argc, char* argv[])
 	leaf4.p2.x = -23.5; leaf4.p2.y = -30;	leaf4.p2.z = 0;
 	leaf4.p3.x = 1.5;	leaf4.p3.y = -28;	leaf4.p3.z = 0;
 
-	// setup all the graphics stuff:
 
-	InitGraphics();
+	// Initialize petal points (each petal is this one turned by another -30 degrees)
 
-	// create the display structures that will not change:
+	petals.p0.x = -0.773;	petals.p0.y = 2.899;	petals.p0.z = 0;
+	petals.p1.x = -3.092;	petals.p1.y = 11.595;	petals.p1.z = 0;
+	petals.p2.x = 3.092;	petals.p2.y = 11.595;	petals.p2.z = 0;
+	petals.p3.x = 0.773;	petals.p3.y = 2.899;	petals.p3.z = 0;
 
-	InitLists();
+
+	// the stem and the leaves are green:
+
+	stem.r = leaf1.r = leaf2.r = leaf3.r = leaf4.r = 0.;
+	stem.g = leaf1.g = leaf2.g = leaf3.g = leaf4.g = 1.;
+	stem.b = leaf1.b = leaf2.b = leaf3.b = leaf4.b = 0.;
+
+	// setup all the graphics stuff:
+
+	InitGraphics();
 
 	// init all the global variables used by Display( ):
 	// this will also post a redisplay
 
 	Reset();
 
+	// -curves n adds n blades of grass to draw with the flower, and -bernstein draws
+	// the curves the old way (for benchmarking the two against each other):
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-curves") == 0 && i + 1 < argc)
+			NumGrass = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-bernstein") == 0)
+			CurveEngineOn = CurveEngineDefault = false;
+		else
+			fprintf(stderr, "Unknown argument: '%s'\n", argv[i]);
+	}
+
+	// create the display structures that will not change:
+
+	InitLists();
+
 	// setup all the user interface stuff:
 
 	InitMenus();
@@ -288,76 +735,92 @@ main(int argc, char* argv[])
 }
 
 
-// this is where one would put code that is to be called
-// everytime the glut main loop has nothing to do
-//
-// this is typically where animation parameters are set
-//
-// do not call Display( ) from here -- let glutMainLoop( ) do it
+// one step of the flower swaying, time in [0.,1.) like Time:
 
 void
-Animate()
+StepFlower(float time)
 {
-	const int MS_IN_THE_ANIMATION_CYCLE = 10000;	// milliseconds in the animation loop
-	int ms = glutGet(GLUT_ELAPSED_TIME);			// milliseconds since the program started
-	ms %= MS_IN_THE_ANIMATION_CYCLE;				// milliseconds in the range 0 to MS_IN_THE_ANIMATION_CYCLE-1
-	Time = (float)ms / (float)MS_IN_THE_ANIMATION_CYCLE;        // [ 0., 1. )
-
-
 	// Stem animation
 
-	stem.p1.x = stem.p1.x + cos(Time * 2 * (2 * M_PI))/100;
-	stem.p1.y = stem.p1.y + cos(Time * 2 * (2 * M_PI))/50;
-	stem.p1.z = stem.p1.z + cos(Time * 2 * (2 * M_PI))/100;
+	stem.p1.x = stem.p1.x + cos(time * 2 * (2 * M_PI))/100;
+	stem.p1.y = stem.p1.y + cos(time * 2 * (2 * M_PI))/50;
+	stem.p1.z = stem.p1.z + cos(time * 2 * (2 * M_PI))/100;
 
-	stem.p2.x =  stem.p2.x + cos(Time * 2 * (2 * M_PI))/50;
-	stem.p2.y =  stem.p2.y + cos(Time * 2 * (2 * M_PI))/100;
-	stem.p2.z = stem.p2.z + cos(Time * 2 * (2 * M_PI))/50;
+	stem.p2.x =  stem.p2.x + cos(time * 2 * (2 * M_PI))/50;
+	stem.p2.y =  stem.p2.y + cos(time * 2 * (2 * M_PI))/100;
+	stem.p2.z = stem.p2.z + cos(time * 2 * (2 * M_PI))/50;
 
 
 	// leaf1 animation
 
-	leaf1.p1.x = leaf1.p1.x - cos(Time * M_PI) / 50;
-	leaf1.p1.y = leaf1.p1.y - cos(Time * M_PI) / 100;
-	leaf1.p1.z = leaf1.p1.z - cos(Time * M_PI) / 50;
+	leaf1.p1.x = leaf1.p1.x - cos(time * M_PI) / 50;
+	leaf1.p1.y = leaf1.p1.y - cos(time * M_PI) / 100;
+	leaf1.p1.z = leaf1.p1.z - cos(time * M_PI) / 50;
 
-	leaf1.p2.x = leaf1.p2.x - cos(Time * M_PI) / 100;
-	leaf1.p2.y = leaf1.p2.y - cos(Time * M_PI) / 50;
-	leaf1.p2.z = leaf1.p2.z - cos(Time * M_PI) / 100;
+	leaf1.p2.x = leaf1.p2.x - cos(time * M_PI) / 100;
+	leaf1.p2.y = leaf1.p2.y - cos(time * M_PI) / 50;
+	leaf1.p2.z = leaf1.p2.z - cos(time * M_PI) / 100;
 
 
 	// leaf2 animation
 
-	leaf2.p1.x = leaf2.p1.x + cos(Time * M_PI) / 50;
-	leaf2.p1.y = leaf2.p1.y + cos(Time * M_PI) / 100;
-	leaf2.p1.z = leaf2.p1.z + cos(Time * M_PI) / 50;
+	leaf2.p1.x = leaf2.p1.x + cos(time * M_PI) / 50;
+	leaf2.p1.y = leaf2.p1.y + cos(time * M_PI) / 100;
+	leaf2.p1.z = leaf2.p1.z + cos(time * M_PI) / 50;
 
-	leaf2.p2.x = leaf2.p2.x + cos(Time * M_PI) / 100;
-	leaf2.p2.y = leaf2.p2.y + cos(Time * M_PI) / 50;
-	leaf2.p2.z = leaf2.p2.z + cos(Time * M_PI) / 100;
+	leaf2.p2.x = leaf2.p2.x + cos(time * M_PI) / 100;
+	leaf2.p2.y = leaf2.p2.y + cos(time * M_PI) / 50;
+	leaf2.p2.z = leaf2.p2.z + cos(time * M_PI) / 100;
 	
 
 	// leaf3 animation
 
-	leaf3.p1.x = leaf3.p1.x - cos(Time * M_PI) / 50;
-	leaf3.p1.y = leaf3.p1.y - cos(Time * M_PI) / 100;
-	leaf3.p1.z = leaf3.p1.z - cos(Time * M_PI) / 50;
+	leaf3.p1.x = leaf3.p1.x - cos(time * M_PI) / 50;
+	leaf3.p1.y = leaf3.p1.y - cos(time * M_PI) / 100;
+	leaf3.p1.z = leaf3.p1.z - cos(time * M_PI) / 50;
 
-	leaf3.p2.x = leaf3.p2.x - cos(Time * M_PI) / 100;
-	leaf3.p2.y = leaf3.p2.y - cos(Time * M_PI) / 50;
-	leaf3.p2.z = leaf3.p2.z - cos(Time * M_PI) / 100;
+	leaf3.p2.x = leaf3.p2.x - cos(time * M_PI) / 100;
+	leaf3.p2.y = leaf3.p2.y - cos(time * M_PI) / 50;
+	leaf3.p2.z = leaf3.p2.z - cos(time * M_PI) / 100;
 
 
 	// leaf4 animation
 
-	leaf4.p1.x = leaf4.p1.x + cos(Time * M_PI) / 50;
-	leaf4.p1.y = leaf4.p1.y + cos(Time * M_PI) / 100;
-	leaf4.p1.z = leaf4.p1.z + cos(Time * M_PI) / 50;
+	leaf4.p1.x = leaf4.p1.x + cos(time * M_PI) / 50;
+	leaf4.p1.y = leaf4.p1.y + cos(time * M_PI) / 100;
+	leaf4.p1.z = leaf4.p1.z + cos(time * M_PI) / 50;
+
+	leaf4.p2.x = leaf4.p2.x + cos(time * M_PI) / 100;
+	leaf4.p2.y = leaf4.p2.y + cos(time * M_PI) / 50;
+	leaf4.p2.z = leaf4.p2.z + cos(time * M_PI) / 100;
+}
 
-	leaf4.p2.x = leaf4.p2.x + cos(Time * M_PI) / 100;
-	leaf4.p2.y = leaf4.p2.y + cos(Time * M_PI) / 50;
-	leaf4.p2.z = leaf4.p2.z + cos(Time * M_PI) / 100;
 
+// this is where one would put code that is to be called
+// everytime the glut main loop has nothing to do
+//
+// this is typically where animation parameters are set
+//
+// do not call Display( ) from here -- let glutMainLoop( ) do it
+
+void
+Animate()
+{
+	const int MS_IN_THE_ANIMATION_CYCLE = 10000;	// milliseconds in the animation loop
+	int ms = glutGet(GLUT_ELAPSED_TIME);			// milliseconds since the program started
+	ms %= MS_IN_THE_ANIMATION_CYCLE;				// milliseconds in the range 0 to MS_IN_THE_ANIMATION_CYCLE-1
+	Time = (float)ms / (float)MS_IN_THE_ANIMATION_CYCLE;        // [ 0., 1. )
+
+	// the stem and leaves sway a little every step, by where the step is in the animation cycle:
+
+	int steps = CountSteps();
+	for (int i = 0; i < steps; i++)
+	{
+		float time = fmodf(SteppedMs, (float)MS_IN_THE_ANIMATION_CYCLE) / (float)MS_IN_THE_ANIMATION_CYCLE;
+		StepFlower(time);
+		SteppedMs += STEPMS;
+	}
+	CapFrameRate();
 
 	glFlush();
 	glutSetWindow(MainWindow);
@@ -476,42 +939,11 @@ Display()
 		glEnd();
 	}
 
-	// Draw Bezier Curve (referenced from project information page)
-	glColor3f(0., 1., 0.);
-	glLineWidth(3.);
-	glBegin(GL_LINE_STRIP);
-	for (int it = 0; it <= NUMPOINTS; it++)
-	{
-		float t = (float)it / (float)NUMPOINTS;
-		float omt = 1.f - t;
-		float x = omt * omt * omt * stem.p0.x + 3.f * t * omt * omt * stem.p1.x + 3.f * t * t * omt * stem.p2.x + t * t * t * stem.p3.x;
-		float y = omt * omt * omt * stem.p0.y + 3.f * t * omt * omt * stem.p1.y + 3.f * t * t * omt * stem.p2.y + t * t * t * stem.p3.y;
-		float z = omt * omt * omt * stem.p0.z + 3.f * t * omt * omt * stem.p1.z + 3.f * t * t * omt * stem.p2.z + t * t * t * stem.p3.z;
-		glVertex3f(x, y, z);
-	}
-	glEnd();
-	glLineWidth(1.);
-
 
 	// Drawing Flower Petals
 
+	glPushMatrix();
 	for (int i = 0; i < NUMCURVES; i++) {
-		petals.p0.x = -0.773;
-		petals.p0.y = 2.899;
-		petals.p0.z = 0;
-
-		petals.p1.x = -3.092;
-		petals.p1.y = 11.595;
-		petals.p1.z = 0;
-
-		petals.p2.x = 3.092;
-		petals.p2.y = 11.595;
-		petals.p2.z = 0;
-
-		petals.p3.x = 0.773;
-		petals.p3.y = 2.899;
-		petals.p3.z = 0;
-
 		if (PointsCheck)
 		{
 			glBegin(GL_POINTS);
@@ -533,47 +965,9 @@ Display()
 			glVertex3f(petals.p3.x, petals.p3.y, petals.p3.z);
 			glEnd();
 		}
-
-		// Draw Bezier Curve (referenced from project information page)
-		glLineWidth(3.);
-		if (i == 0)
-			glColor3f(0.5, 1., 0.);
-		else if (i == 1)
-			glColor3f(1., 1., 0.);
-		else if (i == 2)
-			glColor3f(1., 0.5, 0.);
-		else if (i == 3)
-			glColor3f(1., 0., 0.);
-		else if (i == 4)
-			glColor3f(1., 0., 0.5);
-		else if (i == 5)
-			glColor3f(1., 0., 1.);
-		else if (i == 6)
-			glColor3f(0.5, 0., 1.);
-		else if (i == 7)
-			glColor3f(0., 0., 1.);
-		else if (i == 8)
-			glColor3f(0., 0.5, 1.);
-		else if (i == 9)
-			glColor3f(0., 1., 1.);
-		else if (i == 10)
-			glColor3f(0., 1., 0.5);
-		else if (i == 11)
-			glColor3f(0., 1., .0);
-		glBegin(GL_LINE_STRIP);
-		for (int it = 0; it <= NUMPOINTS; it++)
-		{
-			float t = (float)it / (float)NUMPOINTS;
-			float omt = 1.f - t;
-			float x = omt * omt * omt * petals.p0.x + 3.f * t * omt * omt * petals.p1.x + 3.f * t * t * omt * petals.p2.x + t * t * t * petals.p3.x;
-			float y = omt * omt * omt * petals.p0.y + 3.f * t * omt * omt * petals.p1.y + 3.f * t * t * omt * petals.p2.y + t * t * t * petals.p3.y;
-			float z = omt * omt * omt * petals.p0.z + 3.f * t * omt * omt * petals.p1.z + 3.f * t * t * omt * petals.p2.z + t * t * t * petals.p3.z;
-			glVertex3f(x, y, z);
-		}
-		glEnd();
-		glLineWidth(1.);
 		glRotatef(-30, 0, 0, 1);
 	}
+	glPopMatrix();
 
 	
 	// Drawing Leafs
@@ -637,57 +1031,23 @@ Display()
 		glEnd();
 	}
 
-	// Draw Bezier Curve (referenced from project information page)
-	glColor3f(0., 1., 0.);
-	glLineWidth(3.);
-	glBegin(GL_LINE_STRIP);
-	for (int it = 0; it <= NUMPOINTS; it++)
-	{
-		float t = (float)it / (float)NUMPOINTS;
-		float omt = 1.f - t;
-		float x = omt * omt * omt * leaf1.p0.x + 3.f * t * omt * omt * leaf1.p1.x + 3.f * t * t * omt * leaf1.p2.x + t * t * t * leaf1.p3.x;
-		float y = omt * omt * omt * leaf1.p0.y + 3.f * t * omt * omt * leaf1.p1.y + 3.f * t * t * omt * leaf1.p2.y + t * t * t * leaf1.p3.y;
-		float z = omt * omt * omt * leaf1.p0.z + 3.f * t * omt * omt * leaf1.p1.z + 3.f * t * t * omt * leaf1.p2.z + t * t * t * leaf1.p3.z;
-		glVertex3f(x, y, z);
-	}
-	glEnd();
-
-	glBegin(GL_LINE_STRIP);
-	for (int it = 0; it <= NUMPOINTS; it++)
-	{
-		float t = (float)it / (float)NUMPOINTS;
-		float omt = 1.f - t;
-		float x = omt * omt * omt * leaf2.p0.x + 3.f * t * omt * omt * leaf2.p1.x + 3.f * t * t * omt * leaf2.p2.x + t * t * t * leaf2.p3.x;
-		float y = omt * omt * omt * leaf2.p0.y + 3.f * t * omt * omt * leaf2.p1.y + 3.f * t * t * omt * leaf2.p2.y + t * t * t * leaf2.p3.y;
-		float z = omt * omt * omt * leaf2.p0.z + 3.f * t * omt * omt * leaf2.p1.z + 3.f * t * t * omt * leaf2.p2.z + t * t * t * leaf2.p3.z;
-		glVertex3f(x, y, z);
-	}
-	glEnd();
-
-	glBegin(GL_LINE_STRIP);
-	for (int it = 0; it <= NUMPOINTS; it++)
-	{
-		float t = (float)it / (float)NUMPOINTS;
-		float omt = 1.f - t;
-		float x = omt * omt * omt * leaf3.p0.x + 3.f * t * omt * omt * leaf3.p1.x + 3.f * t * t * omt * leaf3.p2.x + t * t * t * leaf3.p3.x;
-		float y = omt * omt * omt * leaf3.p0.y + 3.f * t * omt * omt * leaf3.p1.y + 3.f * t * t * omt * leaf3.p2.y + t * t * t * leaf3.p3.y;
-		float z = omt * omt * omt * leaf3.p0.z + 3.f * t * omt * omt * leaf3.p1.z + 3.f * t * t * omt * leaf3.p2.z + t * t * t * leaf3.p3.z;
-		glVertex3f(x, y, z);
-	}
-	glEnd();
+	// Draw Bezier Curves: the stem, the petals, the leaves, and any grass, all in one draw
+	// (the petals do not move, so they went into the batch once in InitLists( )):
 
-	glBegin(GL_LINE_STRIP);
-	for (int it = 0; it <= NUMPOINTS; it++)
-	{
-		float t = (float)it / (float)NUMPOINTS;
-		float omt = 1.f - t;
-		float x = omt * omt * omt * leaf4.p0.x + 3.f * t * omt * omt * leaf4.p1.x + 3.f * t * t * omt * leaf4.p2.x + t * t * t * leaf4.p3.x;
-		float y = omt * omt * omt * leaf4.p0.y + 3.f * t * omt * omt * leaf4.p1.y + 3.f * t * t * omt * leaf4.p2.y + t * t * t * leaf4.p3.y;
-		float z = omt * omt * omt * leaf4.p0.z + 3.f * t * omt * omt * leaf4.p1.z + 3.f * t * t * omt * leaf4.p2.z + t * t * t * leaf4.p3.z;
-		glVertex3f(x, y, z);
-	}
-	glEnd();
+	SetCurve(&Curves, STEMCURVE, &stem);
+	SetCurve(&Curves, LEAFCURVES + 0, &leaf1);
+	SetCurve(&Curves, LEAFCURVES + 1, &leaf2);
+	SetCurve(&Curves, LEAFCURVES + 2, &leaf3);
+	SetCurve(&Curves, LEAFCURVES + 3, &leaf4);
+	if (NumGrass > 0)
+		SwayGrass(FLOWERCURVES, FLOWERCURVES + NumGrass, Time, Curves.x[1], Curves.x[2], Curves.x[3],
+			Curves.x[0], GrassCos, GrassSin);
 
+	glLineWidth(3.);
+	if (CurveEngineOn)
+		DrawCurves(&Curves);
+	else
+		DrawCurvesImmediate(&Curves);
 	glLineWidth(1.);
 
 
@@ -719,6 +1079,7 @@ Display()
 	DoRasterString(2., 95., 0., (char*)"Geometric Modeling - Rainbow Flower");
 
 	glColor3f(1., 1., 1.);
+	DoRasterString(2., 17., 0., (char*)(CurveEngineOn ? "(E) Curve Engine On" : "(E) Curve Engine Off"));
 	DoRasterString(2., 12., 0., (char*)"(F) Freeze Animation");
 	DoRasterString(2., 7., 0., (char*)"(R) Reset");
 	DoRasterString(2., 2., 0., (char*)"(Q) Quit");
@@ -1013,6 +1374,35 @@ InitLists()
 
 	glEndList();
 
+	// the curve batch, with the flower's curves in it and then the grass:
+
+	InitCurves(&Curves, FLOWERCURVES + NumGrass);
+	AddCurve(&Curves, &stem);
+	for (int i = 0; i < NUMCURVES; i++)
+	{
+		float a = -30.f * (float)i * (float)M_PI / 180.f;
+		float c = cosf(a);
+		float s = sinf(a);
+		Curve petal = petals;
+		Point* p[4] = { &petal.p0, &petal.p1, &petal.p2, &petal.p3 };
+		Point* p0[4] = { &petals.p0, &petals.p1, &petals.p2, &petals.p3 };
+		for (int k = 0; k < 4; k++)
+		{
+			p[k]->x = c * p0[k]->x - s * p0[k]->y;
+			p[k]->y = s * p0[k]->x + c * p0[k]->y;
+		}
+		petal.r = PETALCOLORS[i][0];
+		petal.g = PETALCOLORS[i][1];
+		petal.b = PETALCOLORS[i][2];
+		AddCurve(&Curves, &petal);
+	}
+	AddCurve(&Curves, &leaf1);
+	AddCurve(&Curves, &leaf2);
+	AddCurve(&Curves, &leaf3);
+	AddCurve(&Curves, &leaf4);
+	if (NumGrass > 0)
+		InitGrass(&Curves, NumGrass);
+
 }
 
 
@@ -1042,7 +1432,15 @@ Keyboard(unsigned char c, int x, int y)
 		if (Frozen)
 			glutIdleFunc(NULL);
 		else
+		{
+			LastStepMs = -1;
 			glutIdleFunc(Animate);
+		}
+		break;
+
+	case 'e':
+	case 'E':
+		CurveEngineOn = !CurveEngineOn;
 		break;
 
 	case 'r':
@@ -1058,6 +1456,7 @@ Keyboard(unsigned char c, int x, int y)
 
 	default:
 		fprintf(stderr, "Don't know what to do with keyboard hit: '%c' (0x%0x)\n", c, c);
+		return;			// nothing changed, so there is nothing to redraw
 	}
 
 	// force a call to Display( ):
@@ -1123,8 +1522,14 @@ MouseButton(int button, int state, int x, int y)
 		ActiveButton &= ~b;		// clear the proper bit
 	}
 
-	glutSetWindow(MainWindow);
-	glutPostRedisplay();
+	// pressing or letting go of a button only changes what the next moves do,
+	// but the wheel changes the scale right away:
+
+	if (button == SCROLL_WHEEL_UP || button == SCROLL_WHEEL_DOWN)
+	{
+		glutSetWindow(MainWindow);
+		glutPostRedisplay();
+	}
 
 }
 
@@ -1134,7 +1539,7 @@ MouseButton(int button, int state, int x, int y)
 void
 MouseMotion(int x, int y)
 {
-	if (true)
+	if (DebugOn != 0)
 		fprintf(stderr, "MouseMotion: %d, %d\n", x, y);
 
 
@@ -1161,8 +1566,16 @@ MouseMotion(int x, int y)
 	Xmouse = x;			// new current position
 	Ymouse = y;
 
-	glutSetWindow(MainWindow);
-	glutPostRedisplay();
+	// glut calls this for every move, with or without a button down, and most of
+	// them change nothing on the screen. only the ones that turned or scaled the
+	// scene ask for a redraw, and however many of those come in before the next
+	// Display( ), glut still draws just once for them:
+
+	if ((dx != 0 || dy != 0) && (ActiveButton & (LEFT | MIDDLE)) != 0)
+	{
+		glutSetWindow(MainWindow);
+		glutPostRedisplay();
+	}
 }
 
 
@@ -1186,6 +1599,7 @@ Reset()
 	glutIdleFunc(Animate);
 	PointsCheck = true;
 	LinesCheck = true;
+	CurveEngineOn = CurveEngineDefault;
 	glFlush();
 }
 
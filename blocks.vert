@@ -0,0 +1,58 @@
+#version 120
+
+// per-vertex lighting for the block chunks, done the same way the fixed-function
+// pipeline does it for the two torch lights, so the blocks look just like they
+// did when they were drawn with glEnable( GL_LIGHTING ). with clustered lighting
+// the lights are done per fragment instead, so this just passes the eye-space
+// position and normal along
+
+uniform bool	uLight0On;
+uniform bool	uLight1On;
+
+varying vec3	vST;			// s, t, and the texture array layer
+varying vec4	vColor;			// lit color
+varying vec3	vEyePos;
+varying vec3	vNormal;
+
+
+vec4
+PointLight( int i, vec3 eyePos, vec3 normal )
+{
+	vec3 toLight = gl_LightSource[i].position.xyz - eyePos;
+	float d = length( toLight );
+	toLight = normalize( toLight );
+	float atten = 1. / ( gl_LightSource[i].constantAttenuation +
+				gl_LightSource[i].linearAttenuation * d +
+				gl_LightSource[i].quadraticAttenuation * d * d );
+
+	vec4 color = gl_FrontLightProduct[i].ambient;
+	float nDotL = dot( normal, toLight );
+	if( nDotL > 0. )
+	{
+		color += nDotL * gl_FrontLightProduct[i].diffuse;
+		vec3 halfway = normalize( toLight + vec3( 0., 0., 1. ) );
+		float nDotH = max( dot( normal, halfway ), 0. );
+		color += pow( nDotH, gl_FrontMaterial.shininess ) * gl_FrontLightProduct[i].specular;
+	}
+	return atten * color;
+}
+
+
+void
+main( )
+{
+	vec3 eyePos = ( gl_ModelViewMatrix * gl_Vertex ).xyz;
+	vec3 normal = normalize( gl_NormalMatrix * gl_Normal );
+
+	vColor = gl_FrontLightModelProduct.sceneColor;
+	if( uLight0On )
+		vColor += PointLight( 0, eyePos, normal );
+	if( uLight1On )
+		vColor += PointLight( 1, eyePos, normal );
+	vColor = clamp( vColor, 0., 1. );
+
+	vEyePos = eyePos;
+	vNormal = normal;
+	vST = gl_MultiTexCoord0.stp;
+	gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+}
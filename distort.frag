@@ -0,0 +1,14 @@
+#version 120
+
+// the texture replaces the color, the same as GL_REPLACE did before
+
+uniform sampler2D	uTexUnit;
+
+varying vec2	vST;
+
+
+void
+main( )
+{
+	gl_FragColor = texture2D( uTexUnit, vST );
+}
@@ -0,0 +1,28 @@
+#version 120
+
+// jitters each vertex's texture coordinates by up to 1/100 in s and t, the same
+// amount the old cpu loop did with cos( rand( ) ) / 100. the jitter comes from a
+// hash of the original coordinates and uTime, so it changes every frame but
+// the sphere itself never has to leave its vertex buffer
+
+uniform float	uTime;
+
+varying vec2	vST;
+
+
+float
+Hash( vec2 v )
+{
+	return fract( sin( dot( v, vec2( 12.9898, 78.233 ) ) ) * 43758.5453 );
+}
+
+
+void
+main( )
+{
+	vec2 st = gl_MultiTexCoord0.st;
+	float ds = cos( 6.2831853 * Hash( st + vec2( uTime, 0. ) ) ) / 100.;
+	float dt = cos( 6.2831853 * Hash( st + vec2( 0., uTime + 0.5 ) ) ) / 100.;
+	vST = st + vec2( ds, dt );
+	gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+}
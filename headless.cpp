@@ -0,0 +1,439 @@
+//	headless.cpp -- a stand-in for glut that renders offscreen, for benchmarking
+//
+//	Compiling one of the projects with -DHEADLESS pulls this file in after "glut.h"
+//	and it supplies the glut routines the projects use, so they can run on a
+//	linux box that has no display or gpu (egl surfaceless + mesa llvmpipe):
+//
+//		g++ -O2 -DHEADLESS Project4.cpp -o Project4 -lEGL -lGL -lGLU -lpthread
+//		./Project4 -frames 600 -warmup 30 -step 16.667 -json Project4.json
+//
+//	"glutCreateWindow( )" makes an egl context that draws into a framebuffer object
+//	of the initial window size, and "glutMainLoop( )" calls the idle and display
+//	callbacks for a fixed number of frames and then exits
+//
+//	GLUT_ELAPSED_TIME is a deterministic clock that advances by -step milliseconds
+//	every frame, so the animation is the same on every run no matter how slow the
+//	machine is
+//
+//	Every frame ends with a glFinish( ) and is timed from the start of the idle callback,
+//	the frame times after the warmup are written as json (to stdout without -json):
+//		min, median, p99, mean, and max, all in milliseconds
+//
+//	An OpenGL error in any frame is printed and the run exits with status 1
+//
+//	Menus, the mouse and the keyboard do nothing here, and text is not drawn
+
+#include <string.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <chrono>
+#include <algorithm>
+
+
+// benchmark settings (from the command line):
+
+int			BenchFrames = 600;			// frames that get timed
+int			BenchWarmup = 30;			// frames drawn first and not timed
+double		BenchStepMs = 1000. / 60.;	// deterministic clock step per frame
+const char*	BenchJson = NULL;			// where to write the results (NULL = stdout)
+const char*	BenchProgram = "";			// argv[0] without its directory
+
+
+// the offscreen "window":
+
+int			HeadlessWidth = 600;
+int			HeadlessHeight = 600;
+const char*	HeadlessTitle = "";
+int			HeadlessFrame;				// frame number, drives the clock
+GLuint		HeadlessFramebuffer;
+
+
+// the callbacks that get used:
+
+void		(*HeadlessDisplay)() = NULL;
+void		(*HeadlessIdle)() = NULL;
+void		(*HeadlessReshape)(int, int) = NULL;
+void		(*HeadlessVisibility)(int) = NULL;
+
+
+// the glut fonts are addresses of these on linux:
+
+void* glutStrokeRoman;
+void* glutBitmapTimesRoman24;
+
+
+// pull the benchmark options out of the command line, like glut does with its own:
+
+void
+glutInit(int* pargc, char** argv)
+{
+	BenchProgram = argv[0];
+	const char* slash = strrchr(argv[0], '/');
+	if (slash != NULL)
+		BenchProgram = slash + 1;
+
+	int n = 1;
+	for (int i = 1; i < *pargc; i++)
+	{
+		if (i + 1 < *pargc && strcmp(argv[i], "-frames") == 0)
+			BenchFrames = atoi(argv[++i]);
+		else if (i + 1 < *pargc && strcmp(argv[i], "-warmup") == 0)
+			BenchWarmup = atoi(argv[++i]);
+		else if (i + 1 < *pargc && strcmp(argv[i], "-step") == 0)
+			BenchStepMs = atof(argv[++i]);
+		else if (i + 1 < *pargc && strcmp(argv[i], "-json") == 0)
+			BenchJson = argv[++i];
+		else
+			argv[n++] = argv[i];
+	}
+	*pargc = n;
+
+	if (BenchFrames < 1)
+		BenchFrames = 1;
+	if (BenchWarmup < 0)
+		BenchWarmup = 0;
+}
+
+
+void
+glutInitWindowSize(int width, int height)
+{
+	HeadlessWidth = width;
+	HeadlessHeight = height;
+}
+
+
+// make an egl context with no window and give it a framebuffer object to draw into:
+
+int
+glutCreateWindow(const char* title)
+{
+	HeadlessTitle = title;
+
+	// prefer mesa's surfaceless platform, it needs no x server:
+
+	EGLDisplay display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay != NULL)
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (display == EGL_NO_DISPLAY)
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+	{
+		fprintf(stderr, "Headless: cannot open an EGL display\n");
+		exit(1);
+	}
+
+	EGLint configAttribs[] =
+	{
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint numConfigs;
+	if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs < 1)
+	{
+		fprintf(stderr, "Headless: no EGL config can render desktop OpenGL\n");
+		exit(1);
+	}
+
+	// a compatibility context, the projects use the fixed-function pipeline:
+
+	eglBindAPI(EGL_OPENGL_API);
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+	if (context == EGL_NO_CONTEXT)
+	{
+		fprintf(stderr, "Headless: cannot create an OpenGL context\n");
+		exit(1);
+	}
+
+	// without surfaceless contexts, make current on a small pbuffer (the fbo is still what gets drawn into):
+
+	EGLSurface surface = EGL_NO_SURFACE;
+	const char* extensions = eglQueryString(display, EGL_EXTENSIONS);
+	if (extensions == NULL || strstr(extensions, "EGL_KHR_surfaceless_context") == NULL)
+	{
+		EGLint pbufferAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+		surface = eglCreatePbufferSurface(display, config, pbufferAttribs);
+	}
+	if (!eglMakeCurrent(display, surface, surface, context))
+	{
+		fprintf(stderr, "Headless: cannot make the OpenGL context current\n");
+		exit(1);
+	}
+
+#ifdef __glew_h__
+	// this loads the gl entry points -- glew may also complain that there
+	// is no glx display, which does not matter here:
+
+	glewInit();
+#endif
+
+	GLuint renderbuffers[2];
+	glGenFramebuffers(1, &HeadlessFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, HeadlessFramebuffer);
+	glGenRenderbuffers(2, renderbuffers);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, HeadlessWidth, HeadlessHeight);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, HeadlessWidth, HeadlessHeight);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		fprintf(stderr, "Headless: the offscreen framebuffer is not complete\n");
+		exit(1);
+	}
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+
+	fprintf(stderr, "Headless: %d x %d offscreen on %s\n", HeadlessWidth, HeadlessHeight, glGetString(GL_RENDERER));
+	return 1;
+}
+
+
+// Display( ) asks for GL_BACK, which a framebuffer object does not have (that is
+// GL_INVALID_OPERATION) -- here the back buffer is the offscreen color attachment:
+
+void
+HeadlessDrawBuffer(GLenum buffer)
+{
+	if (buffer == GL_BACK || buffer == GL_FRONT)
+		buffer = GL_COLOR_ATTACHMENT0;
+	glDrawBuffer(buffer);
+}
+
+#define glDrawBuffer	HeadlessDrawBuffer
+
+
+void glutDisplayFunc(void (*callback)())			{ HeadlessDisplay = callback; }
+void glutIdleFunc(void (*callback)())				{ HeadlessIdle = callback; }
+void glutReshapeFunc(void (*callback)(int, int))	{ HeadlessReshape = callback; }
+void glutVisibilityFunc(void (*callback)(int))		{ HeadlessVisibility = callback; }
+
+
+// everything else about windows, input, and menus does nothing:
+
+void glutInitDisplayMode(unsigned int)								{ }
+void glutInitWindowPosition(int, int)								{ }
+void glutSetWindowTitle(const char*)								{ }
+void glutSetWindow(int)												{ }
+void glutDestroyWindow(int)											{ }
+void glutPostRedisplay()											{ }
+void glutSwapBuffers()												{ }
+void glutKeyboardFunc(void (*)(unsigned char, int, int))			{ }
+void glutMouseFunc(void (*)(int, int, int, int))					{ }
+void glutMotionFunc(void (*)(int, int))								{ }
+void glutPassiveMotionFunc(void (*)(int, int))						{ }
+void glutEntryFunc(void (*)(int))									{ }
+void glutSpecialFunc(void (*)(int, int, int))						{ }
+void glutSpaceballMotionFunc(void (*)(int, int, int))				{ }
+void glutSpaceballRotateFunc(void (*)(int, int, int))				{ }
+void glutSpaceballButtonFunc(void (*)(int, int))					{ }
+void glutButtonBoxFunc(void (*)(int, int))							{ }
+void glutDialsFunc(void (*)(int, int))								{ }
+void glutTabletMotionFunc(void (*)(int, int))						{ }
+void glutTabletButtonFunc(void (*)(int, int, int, int))				{ }
+void glutMenuStateFunc(void (*)(int))								{ }
+void glutTimerFunc(unsigned int, void (*)(int), int)				{ }
+int  glutCreateMenu(void (*)(int))									{ return 1; }
+void glutAddMenuEntry(const char*, int)								{ }
+void glutAddSubMenu(const char*, int)								{ }
+void glutAttachMenu(int)											{ }
+void glutBitmapCharacter(void*, int)								{ }
+void glutStrokeCharacter(void*, int)								{ }
+
+
+int
+glutGet(GLenum query)
+{
+	switch (query)
+	{
+		case GLUT_WINDOW_WIDTH:
+			return HeadlessWidth;
+
+		case GLUT_WINDOW_HEIGHT:
+			return HeadlessHeight;
+
+		case GLUT_ELAPSED_TIME:
+			return (int)(HeadlessFrame * BenchStepMs + 0.5);
+
+		default:
+			return 0;
+	}
+}
+
+
+// the glut solids, drawn with the same orientation and normals as glut draws them:
+
+void
+glutSolidSphere(double radius, GLint slices, GLint stacks)
+{
+	GLUquadric* quadric = gluNewQuadric();
+	gluSphere(quadric, radius, slices, stacks);
+	gluDeleteQuadric(quadric);
+}
+
+
+void
+glutSolidTorus(double innerRadius, double outerRadius, GLint sides, GLint rings)
+{
+	for (int i = 0; i < rings; i++)
+	{
+		glBegin(GL_QUAD_STRIP);
+		for (int j = 0; j <= sides; j++)
+		{
+			for (int k = 1; k >= 0; k--)
+			{
+				float theta = 2. * M_PI * (float)(i + k) / (float)rings;
+				float phi = 2. * M_PI * (float)j / (float)sides;
+				float nx = cos(theta) * cos(phi);
+				float ny = sin(theta) * cos(phi);
+				float nz = sin(phi);
+				glNormal3f(nx, ny, nz);
+				glVertex3f(outerRadius * cos(theta) + innerRadius * nx, outerRadius * sin(theta) + innerRadius * ny, innerRadius * nz);
+			}
+		}
+		glEnd();
+	}
+}
+
+
+void
+glutSolidCube(double size)
+{
+	static float faces[6][4][3] =
+	{
+		{ { 1.,-1.,-1. }, { 1., 1.,-1. }, { 1., 1., 1. }, { 1.,-1., 1. } },
+		{ {-1.,-1., 1. }, {-1., 1., 1. }, {-1., 1.,-1. }, {-1.,-1.,-1. } },
+		{ {-1., 1.,-1. }, {-1., 1., 1. }, { 1., 1., 1. }, { 1., 1.,-1. } },
+		{ {-1.,-1., 1. }, {-1.,-1.,-1. }, { 1.,-1.,-1. }, { 1.,-1., 1. } },
+		{ {-1.,-1., 1. }, { 1.,-1., 1. }, { 1., 1., 1. }, {-1., 1., 1. } },
+		{ { 1.,-1.,-1. }, {-1.,-1.,-1. }, {-1., 1.,-1. }, { 1., 1.,-1. } },
+	};
+	static float normals[6][3] =
+	{
+		{ 1., 0., 0. }, {-1., 0., 0. }, { 0., 1., 0. }, { 0.,-1., 0. }, { 0., 0., 1. }, { 0., 0.,-1. },
+	};
+
+	float h = size / 2.;
+	glBegin(GL_QUADS);
+	for (int f = 0; f < 6; f++)
+	{
+		glNormal3fv(normals[f]);
+		for (int v = 0; v < 4; v++)
+			glVertex3f(h * faces[f][v][0], h * faces[f][v][1], h * faces[f][v][2]);
+	}
+	glEnd();
+}
+
+
+// write a string as a json string:
+
+void
+WriteJsonString(FILE* fp, const char* s)
+{
+	fputc('"', fp);
+	for (; *s != '\0'; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			fputc('\\', fp);
+		fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+
+// draw the warmup and benchmark frames, write out the statistics, and quit:
+
+void
+glutMainLoop()
+{
+	// glut tells a new window its size and that it is visible:
+
+	if (HeadlessReshape != NULL)
+		(*HeadlessReshape)(HeadlessWidth, HeadlessHeight);
+	if (HeadlessVisibility != NULL)
+		(*HeadlessVisibility)(GLUT_VISIBLE);
+
+	// every frame gets drawn, not just the ones that asked for a redisplay:
+
+	double* frameMs = new double[BenchFrames];
+	for (HeadlessFrame = 0; HeadlessFrame < BenchWarmup + BenchFrames; HeadlessFrame++)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		if (HeadlessIdle != NULL)
+			(*HeadlessIdle)();
+		if (HeadlessDisplay != NULL)
+			(*HeadlessDisplay)();
+		glFinish();
+
+		std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+		if (HeadlessFrame >= BenchWarmup)
+			frameMs[HeadlessFrame - BenchWarmup] = ms.count();
+
+		// a frame with gl errors in it is not a frame worth timing -- report all of
+		// them (gl keeps one per kind until they are read) and fail:
+
+		bool failed = false;
+		for (GLenum err = glGetError(); err != GL_NO_ERROR; err = glGetError())
+		{
+			fprintf(stderr, "Headless: OpenGL error 0x%x in frame %d\n", err, HeadlessFrame);
+			failed = true;
+		}
+		if (failed)
+			exit(1);
+	}
+
+	// median averages the two middle frames of an even count, p99 is the nearest-rank percentile:
+
+	double mean = 0.;
+	for (int i = 0; i < BenchFrames; i++)
+		mean += frameMs[i];
+	mean /= (double)BenchFrames;
+
+	std::sort(frameMs, frameMs + BenchFrames);
+	double median = (frameMs[(BenchFrames - 1) / 2] + frameMs[BenchFrames / 2]) / 2.;
+	int p99 = (int)ceil(0.99 * (double)BenchFrames) - 1;
+
+	FILE* fp = stdout;
+	if (BenchJson != NULL)
+	{
+		fp = fopen(BenchJson, "w");
+		if (fp == NULL)
+		{
+			fprintf(stderr, "Cannot create benchmark file '%s'\n", BenchJson);
+			exit(1);
+		}
+	}
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "\t\"program\": ");		WriteJsonString(fp, BenchProgram);		fprintf(fp, ",\n");
+	fprintf(fp, "\t\"title\": ");		WriteJsonString(fp, HeadlessTitle);		fprintf(fp, ",\n");
+	fprintf(fp, "\t\"renderer\": ");	WriteJsonString(fp, (const char*)glGetString(GL_RENDERER));	fprintf(fp, ",\n");
+	fprintf(fp, "\t\"width\": %d,\n", HeadlessWidth);
+	fprintf(fp, "\t\"height\": %d,\n", HeadlessHeight);
+	fprintf(fp, "\t\"frames\": %d,\n", BenchFrames);
+	fprintf(fp, "\t\"warmup\": %d,\n", BenchWarmup);
+	fprintf(fp, "\t\"step_ms\": %.3f,\n", BenchStepMs);
+	fprintf(fp, "\t\"frame_ms\": {\n");
+	fprintf(fp, "\t\t\"min\": %.4f,\n", frameMs[0]);
+	fprintf(fp, "\t\t\"median\": %.4f,\n", median);
+	fprintf(fp, "\t\t\"p99\": %.4f,\n", frameMs[p99]);
+	fprintf(fp, "\t\t\"mean\": %.4f,\n", mean);
+	fprintf(fp, "\t\t\"max\": %.4f\n", frameMs[BenchFrames - 1]);
+	fprintf(fp, "\t}\n");
+	fprintf(fp, "}\n");
+
+	if (fp != stdout)
+		fclose(fp);
+	delete[] frameMs;
+	exit(0);
+}
@@ -0,0 +1,146 @@
+#version 120
+
+// lights the fragment with the lights in its cluster, using the material from
+// SetMaterial( ). uTextured modulates it by the texture, like GL_MODULATE does.
+// uShadowsOn takes the lights with shadow cube maps out of the light where
+// something is in their way
+
+uniform bool		uTextured;
+uniform sampler2D	uTexUnit;
+
+varying vec2	vST;
+varying vec3	vEyePos;
+varying vec3	vNormal;
+
+
+// the clustered lights -- these numbers have to match the #defines in Project4.cpp:
+
+const float	CLUSTERSX = 16.;
+const float	CLUSTERSY = 16.;
+const float	CLUSTERSZ = 24.;
+const float	MAXLIGHTS = 1024.;
+const float	LIGHTINDEXWIDTH = 1024.;
+const float	LIGHTINDEXHEIGHT = 256.;
+
+uniform sampler2D	uLights;			// one light per column: position+radius, color+spot cos, spot direction+exponent, attenuation+group+shadow cube
+uniform sampler2D	uClusters;			// one cluster per texel: offset into uLightIndices, # of lights
+uniform sampler2D	uLightIndices;
+uniform vec3		uViewport;			// x, y, and size of the square viewport
+uniform float		uClusterNear;
+uniform float		uClusterLogRatio;	// log( far / near )
+uniform float		uSkipGroup;			// lights in this group do not light this object, 0 means use them all
+
+
+// the shadows -- SHADOWFAR has to match Project4.cpp too.
+// gl_TextureMatrix[7] takes eye coordinates to world coordinates:
+
+const float	SHADOWFAR = 100.;
+
+uniform bool		uShadowsOn;
+uniform samplerCube	uShadowCube0;
+uniform samplerCube	uShadowCube1;
+uniform vec3		uCubeLight0;		// where the cube maps' lights are, in world coordinates
+uniform vec3		uCubeLight1;
+uniform float		uCubeTexel0;		// the size of a cube map texel 1. away from its light
+uniform float		uCubeTexel1;
+
+
+// how much of a cube-mapped light gets to a point, 1. is all of it.
+// toPoint is from the light to the point, in world coordinates. the bias grows
+// as the light gets more edge-on to the surface (nDotL), since a texel then
+// covers more depth:
+
+float
+CubeShadow( samplerCube cube, vec3 toPoint, float texel, float nDotL )
+{
+	float d = length( toPoint );
+	vec3 dir = toPoint / d;
+	vec3 u = normalize( cross( dir, abs( dir.y ) < 0.9 ? vec3( 0., 1., 0. ) : vec3( 1., 0., 0. ) ) );
+	vec3 v = cross( dir, u );
+	float slope = min( sqrt( 1. - nDotL * nDotL ) / nDotL, 8. );
+	float bias = 0.02 + texel * d * ( 1. + slope );
+	float lit = 0.;
+	for( int i = -1; i <= 1; i++ )
+	{
+		for( int j = -1; j <= 1; j++ )
+		{
+			float caster = SHADOWFAR * textureCube( cube, dir + texel * ( float( i ) * u + float( j ) * v ) ).r;
+			if( d - bias <= caster )
+				lit += 1.;
+		}
+	}
+	return lit / 9.;
+}
+
+
+// the same lighting the fixed-function pipeline does, but only for the
+// lights in the cluster this fragment is in. there is no per-light ambient
+// term: SetPointLight( ) and SetSpotLight( ) give every GL_LIGHT a black
+// GL_AMBIENT, so all the ambient comes from the light model's sceneColor:
+
+vec4
+ClusteredLights( vec3 eyePos, vec3 normal )
+{
+	vec2 tile = floor( ( gl_FragCoord.xy - uViewport.xy ) / uViewport.z * vec2( CLUSTERSX, CLUSTERSY ) );
+	tile = clamp( tile, vec2( 0., 0. ), vec2( CLUSTERSX - 1., CLUSTERSY - 1. ) );
+	float slice = floor( log( max( -eyePos.z, uClusterNear ) / uClusterNear ) / uClusterLogRatio * CLUSTERSZ );
+	slice = clamp( slice, 0., CLUSTERSZ - 1. );
+	vec2 cluster = texture2D( uClusters, vec2( ( tile.x + CLUSTERSX * tile.y + 0.5 ) / ( CLUSTERSX * CLUSTERSY ), ( slice + 0.5 ) / CLUSTERSZ ) ).ra;
+
+	vec3 worldPos = ( gl_TextureMatrix[7] * vec4( eyePos, 1. ) ).xyz;
+	vec4 color = gl_FrontLightModelProduct.sceneColor;
+	int count = int( cluster.y );
+	for( int i = 0; i < count; i++ )
+	{
+		float j = cluster.x + float( i );
+		float index = texture2D( uLightIndices, vec2( ( mod( j, LIGHTINDEXWIDTH ) + 0.5 ) / LIGHTINDEXWIDTH, ( floor( j / LIGHTINDEXWIDTH ) + 0.5 ) / LIGHTINDEXHEIGHT ) ).r;
+		float s = ( index + 0.5 ) / MAXLIGHTS;
+		vec4 posRadius = texture2D( uLights, vec2( s, 0.125 ) );
+		vec4 colorSpot = texture2D( uLights, vec2( s, 0.375 ) );
+
+		vec4 atten = texture2D( uLights, vec2( s, 0.875 ) );
+		if( atten.z > 0. && atten.z == uSkipGroup )
+			continue;
+
+		vec3 toLight = posRadius.xyz - eyePos;
+		float d = length( toLight );
+		if( d > posRadius.w )
+			continue;
+		toLight /= d;
+		float a = 1. / ( atten.x + atten.y * d * d );
+		if( colorSpot.w > -1. )
+		{
+			vec4 dirExponent = texture2D( uLights, vec2( s, 0.625 ) );
+			float spotDot = dot( -toLight, dirExponent.xyz );
+			if( spotDot < colorSpot.w )
+				continue;
+			a *= pow( spotDot, dirExponent.w );
+		}
+
+		float nDotL = dot( normal, toLight );
+		if( nDotL > 0. )
+		{
+			if( uShadowsOn && atten.w == 1. )
+				a *= CubeShadow( uShadowCube0, worldPos - uCubeLight0, uCubeTexel0, nDotL );
+			else if( uShadowsOn && atten.w == 2. )
+				a *= CubeShadow( uShadowCube1, worldPos - uCubeLight1, uCubeTexel1, nDotL );
+
+			vec3 halfway = normalize( toLight + vec3( 0., 0., 1. ) );
+			float nDotH = max( dot( normal, halfway ), 0. );
+			color.rgb += a * colorSpot.rgb * ( nDotL * gl_FrontMaterial.diffuse.rgb +
+						pow( nDotH, gl_FrontMaterial.shininess ) * gl_FrontMaterial.specular.rgb );
+		}
+	}
+	color.a = gl_FrontMaterial.diffuse.a;
+	return clamp( color, 0., 1. );
+}
+
+
+void
+main( )
+{
+	vec4 color = ClusteredLights( vEyePos, normalize( vNormal ) );
+	if( uTextured )
+		color *= texture2D( uTexUnit, vST );
+	gl_FragColor = color;
+}
@@ -0,0 +1,18 @@
+#version 120
+
+// the lit objects with clustered lighting -- the lights are done per fragment
+// in lights.frag, so this just passes the eye-space position and normal along
+
+varying vec2	vST;
+varying vec3	vEyePos;
+varying vec3	vNormal;
+
+
+void
+main( )
+{
+	vEyePos = ( gl_ModelViewMatrix * gl_Vertex ).xyz;
+	vNormal = normalize( gl_NormalMatrix * gl_Normal );
+	vST = gl_MultiTexCoord0.st;
+	gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+}
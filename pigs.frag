@@ -0,0 +1,68 @@
+#version 120
+#extension GL_EXT_texture_array : require
+
+// GL_REPLACE texturing out of the pigs' texture array, the way the pig was drawn
+// one box at a time, with the sun's shadows on it when uShadowsOn is set.
+// uDistance is for the shadow cube maps, which want the distance from the light
+// (the eye in those passes) instead of a color, the same as shadowcube.frag
+
+uniform sampler2DArray	uTexUnit;
+uniform bool			uDistance;
+uniform bool			uShadowsOn;
+uniform sampler2DShadow	uSunShadow0;
+uniform sampler2DShadow	uSunShadow1;
+uniform sampler2DShadow	uSunShadow2;
+uniform vec3			uCascadeEnds;		// eye depth each cascade reaches out to
+uniform float			uSunTexel;			// 1. / the cascades' size
+uniform float			uShadowDim;			// what the shadows multiply the color by
+
+varying vec3	vST;
+varying vec3	vEyePos;
+
+// this has to match the .cpp file:
+
+const float	SHADOWFAR = 100.;
+
+
+// 4 lookups around the point, each one a 2x2 compare-and-blend from GL_LINEAR:
+
+float
+SunShadowPcf( sampler2DShadow map, vec4 coord )
+{
+	float h = 0.5 * uSunTexel;
+	return 0.25 * ( shadow2D( map, coord.xyz + vec3( -h, -h, 0. ) ).r + shadow2D( map, coord.xyz + vec3( h, -h, 0. ) ).r +
+			shadow2D( map, coord.xyz + vec3( -h, h, 0. ) ).r + shadow2D( map, coord.xyz + vec3( h, h, 0. ) ).r );
+}
+
+
+// how much of the sun gets to a point, 1. is all of it:
+
+float
+SunShadow( vec3 eyePos )
+{
+	vec4 p = vec4( eyePos, 1. );
+	float depth = -eyePos.z;
+	if( depth < uCascadeEnds.x )
+		return SunShadowPcf( uSunShadow0, gl_TextureMatrix[4] * p );
+	if( depth < uCascadeEnds.y )
+		return SunShadowPcf( uSunShadow1, gl_TextureMatrix[5] * p );
+	if( depth < uCascadeEnds.z )
+		return SunShadowPcf( uSunShadow2, gl_TextureMatrix[6] * p );
+	return 1.;
+}
+
+
+void
+main( )
+{
+	if( uDistance )
+	{
+		gl_FragColor = vec4( length( vEyePos ) / SHADOWFAR );
+		return;
+	}
+
+	vec4 color = texture2DArray( uTexUnit, vST );
+	if( uShadowsOn )
+		color.rgb *= mix( uShadowDim, 1., SunShadow( vEyePos ) );
+	gl_FragColor = color;
+}
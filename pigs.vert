@@ -0,0 +1,23 @@
+#version 120
+
+// the instanced pigs: every box of every pig is an instance, and its
+// transformation comes in as 3 rows of per-instance attributes, so the box's
+// model matrix is applied here and then the usual modelview and projection
+
+attribute vec4	aRow0;			// the top 3 rows of the box's transformation
+attribute vec4	aRow1;
+attribute vec4	aRow2;
+attribute float	aLayer;			// which of pigbody, pigface, and pignose
+
+varying vec3	vST;			// s, t, and the texture array layer
+varying vec3	vEyePos;
+
+
+void
+main( )
+{
+	vec4 world = vec4( dot( aRow0, gl_Vertex ), dot( aRow1, gl_Vertex ), dot( aRow2, gl_Vertex ), 1. );
+	vEyePos = ( gl_ModelViewMatrix * world ).xyz;
+	vST = vec3( gl_MultiTexCoord0.st, aLayer );
+	gl_Position = gl_ModelViewProjectionMatrix * world;
+}
@@ -0,0 +1,15 @@
+#version 120
+
+// the distance from the light, as a fraction of SHADOWFAR so that 1. (what the
+// cube map is cleared to) means nothing is in the way -- this has to match the .cpp file
+
+const float	SHADOWFAR = 100.;
+
+varying vec3	vFromLight;
+
+
+void
+main( )
+{
+	gl_FragColor = vec4( length( vFromLight ) / SHADOWFAR );
+}
@@ -0,0 +1,14 @@
+#version 120
+
+// the casters for a point light's shadow cube map. the modelview matrix puts
+// the light at the eye, so the eye-space position is the vector from the light
+
+varying vec3	vFromLight;
+
+
+void
+main( )
+{
+	vFromLight = ( gl_ModelViewMatrix * gl_Vertex ).xyz;
+	gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+}
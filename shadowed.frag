@@ -0,0 +1,52 @@
+#version 120
+
+// the texture color, darkened where the sun's cascades say it is in shadow.
+// gl_TextureMatrix[4..6] take eye coordinates to the cascades
+
+uniform sampler2D		uTexUnit;
+uniform sampler2DShadow	uSunShadow0;
+uniform sampler2DShadow	uSunShadow1;
+uniform sampler2DShadow	uSunShadow2;
+uniform vec3			uCascadeEnds;		// eye depth each cascade reaches out to
+uniform float			uSunTexel;			// 1. / the cascades' size
+uniform float			uShadowDim;			// what the shadows multiply the color by
+
+varying vec2	vST;
+varying vec3	vEyePos;
+
+
+// 4 lookups around the point, each one a 2x2 compare-and-blend from GL_LINEAR:
+
+float
+SunShadowPcf( sampler2DShadow map, vec4 coord )
+{
+	float h = 0.5 * uSunTexel;
+	return 0.25 * ( shadow2D( map, coord.xyz + vec3( -h, -h, 0. ) ).r + shadow2D( map, coord.xyz + vec3( h, -h, 0. ) ).r +
+			shadow2D( map, coord.xyz + vec3( -h, h, 0. ) ).r + shadow2D( map, coord.xyz + vec3( h, h, 0. ) ).r );
+}
+
+
+// how much of the sun gets to a point, 1. is all of it:
+
+float
+SunShadow( vec3 eyePos )
+{
+	vec4 p = vec4( eyePos, 1. );
+	float depth = -eyePos.z;
+	if( depth < uCascadeEnds.x )
+		return SunShadowPcf( uSunShadow0, gl_TextureMatrix[4] * p );
+	if( depth < uCascadeEnds.y )
+		return SunShadowPcf( uSunShadow1, gl_TextureMatrix[5] * p );
+	if( depth < uCascadeEnds.z )
+		return SunShadowPcf( uSunShadow2, gl_TextureMatrix[6] * p );
+	return 1.;
+}
+
+
+void
+main( )
+{
+	vec4 color = texture2D( uTexUnit, vST );
+	color.rgb *= mix( uShadowDim, 1., SunShadow( vEyePos ) );
+	gl_FragColor = color;
+}
@@ -0,0 +1,16 @@
+#version 120
+
+// GL_REPLACE texturing for the ground, the door, and the pig, the way they are
+// drawn without shadows, so this just passes the eye-space position along
+
+varying vec2	vST;
+varying vec3	vEyePos;
+
+
+void
+main( )
+{
+	vEyePos = ( gl_ModelViewMatrix * gl_Vertex ).xyz;
+	vST = gl_MultiTexCoord0.st;
+	gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+}
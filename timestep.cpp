@@ -0,0 +1,79 @@
+//	timestep.cpp -- fixed-timestep animation and the frame cap, shared by the projects
+//
+//	Each project includes this after "glut.h" (and headless.cpp) and calls
+//	CountSteps( ) and CapFrameRate( ) from its Animate( ):
+//
+//		int steps = CountSteps();
+//		for (int i = 0; i < steps; i++)
+//			... one step of STEPMS milliseconds ...
+//		CapFrameRate();
+//
+//	A project that needs the animation time of each step adds STEPMS to SteppedMs
+//	after it, and one whose keyboard unfreezes the animation sets LastStepMs to -1
+
+#include <chrono>
+#include <thread>
+
+
+// fixed-timestep animation: Animate( ) moves things along in steps of exactly STEPMS
+// milliseconds, however often glut gets around to calling it, so the motion is the same
+// speed on a fast machine and a slow one. Display( ) draws StepAlpha of the way from the
+// next-to-last step to the last one, so it is smooth when the frame rate and the step
+// rate do not line up. the time comes from the glut clock, so a headless run takes the
+// same steps every time:
+
+const float STEPMS = { 1000.f / 60.f };
+const int MAXSTEPS = { 5 };			// a frame longer than this many steps drops the rest, rather than falling further behind
+
+float	StepAccumulator;			// milliseconds that have not been stepped yet
+int		LastStepMs = -1;			// -1 means start counting from now, as after unfreezing
+float	SteppedMs;					// milliseconds of animation all the steps so far add up to
+float	StepAlpha;					// [0.,1.)
+
+
+// how many steps Animate( ) takes this time:
+
+int
+CountSteps()
+{
+	int ms = glutGet(GLUT_ELAPSED_TIME);
+	if (LastStepMs < 0)
+		LastStepMs = ms;
+	StepAccumulator += (float)(ms - LastStepMs);
+	LastStepMs = ms;
+
+	int steps = (int)(StepAccumulator / STEPMS);
+	StepAccumulator -= (float)steps * STEPMS;
+	if (steps > MAXSTEPS)
+		steps = MAXSTEPS;
+	StepAlpha = StepAccumulator / STEPMS;
+	return steps;
+}
+
+
+// the frame cap: glut calls Animate( ) again the moment it is done drawing, so without
+// this the idle function spins a core drawing frames faster than the screen shows them.
+// it sleeps away whatever is left of MINFRAMEMS (vsync, where the driver has it on,
+// does the same thing in SwapBuffers( ), and then this never has to sleep):
+
+const float MINFRAMEMS = { 1000.f / 60.f };
+
+#ifdef HEADLESS
+bool	FrameCapOn = false;			// the benchmarks want every frame as fast as it can go
+#else
+bool	FrameCapOn = true;
+#endif
+
+
+void
+CapFrameRate()
+{
+	static std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+	if (FrameCapOn)
+	{
+		std::chrono::duration<float, std::milli> spent = std::chrono::steady_clock::now() - last;
+		if (spent.count() < MINFRAMEMS)
+			std::this_thread::sleep_for(std::chrono::duration<float, std::milli>(MINFRAMEMS - spent.count()));
+	}
+	last = std::chrono::steady_clock::now();
+}